@@ -28,6 +28,7 @@ JOB_STATUS_STR = {
     214: _('mounting instance disk file'),
     215: _('configuring instance'),
     216: _('unmounting instance disk file'),
+    217: _('resources acquired on node server'),
     221: _('starting instance virtual machine'),
     250: _('stopping instance virtual machine'),
     259: _('virtual machine stopped'),
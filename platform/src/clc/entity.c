@@ -40,60 +40,205 @@
 #include "node.h"
 #include "entity.h"
 
-#define LY_ENTITY_MAX            1024
+/*
+** entities are allocated in chunks, the chunk table grows on demand,
+** so the entity address never changes once allocated
+*/
+#define LY_ENTITY_CHUNK_SHIFT    8
+#define LY_ENTITY_CHUNK_SIZE     (1 << LY_ENTITY_CHUNK_SHIFT)
+#define LY_ENTITY_CHUNK_MASK     (LY_ENTITY_CHUNK_SIZE - 1)
+
+/* initial number of hash buckets, must be power of 2 */
+#define LY_ENTITY_HASH_SIZE      1024
 
 static int g_entity_clc = 0;
-static LYEntity *g_entity_store = NULL;
+static LYEntity **g_entity_store = NULL;
+static int g_entity_store_chunks = 0;
+static LIST_HEAD(g_entity_free_list);
 static LIST_HEAD(g_node_list);
 static LIST_HEAD(g_instance_list);
+static LIST_HEAD(g_entity_send_list);
+
+/* hash indexes */
+static struct list_head *g_entity_db_hash = NULL;
+static struct list_head *g_entity_ip_hash = NULL;
+static unsigned int g_entity_hash_size = 0;
+
+/* worker event loop of the calling thread, -1 for main loop */
+static __thread int t_entity_worker = -1;
+/* tell the owner worker to release an entity */
+static void (*g_entity_release_notify)(int worker, int id) = NULL;
 
 /*
 ** entity storage handlers
 ** 
-** NOT thread safe
+** NOT thread safe, callers must hold clc lock(see worker.h)
 */
 
-/* init entity store */
-int ly_entity_store_init(void)
+static inline LYEntity *__entity_get(int id)
 {
-    if (g_entity_store != NULL)
-        return -255;
+    if (g_entity_store == NULL || id < 0 ||
+        (id >> LY_ENTITY_CHUNK_SHIFT) >= g_entity_store_chunks)
+        return NULL;
+    return g_entity_store[id >> LY_ENTITY_CHUNK_SHIFT] +
+           (id & LY_ENTITY_CHUNK_MASK);
+}
+
+static inline unsigned int __hash_db(int type, int db_id)
+{
+    unsigned int h = (unsigned int)db_id * 2654435761U;
+    return (h ^ (unsigned int)type) & (g_entity_hash_size - 1);
+}
+
+static inline unsigned int __hash_ip(const char * ip)
+{
+    unsigned int h = 2166136261U;
+    while (*ip) {
+        h ^= (unsigned char)*ip++;
+        h *= 16777619U;
+    }
+    return h & (g_entity_hash_size - 1);
+}
 
-    int size = LY_ENTITY_MAX;
+/* (re)index entity by type and db_id */
+static void __entity_db_hash(LYEntity * ent)
+{
+    list_del_init(&ent->db_hash);
+    if (ent->db_id > 0 &&
+        (ent->type == LY_ENTITY_NODE || ent->type == LY_ENTITY_OSM))
+        list_add(&ent->db_hash,
+                 &g_entity_db_hash[__hash_db(ent->type, ent->db_id)]);
+}
+
+/* (re)index node entity by ip */
+static void __entity_ip_hash(LYEntity * ent)
+{
+    list_del_init(&ent->ip_hash);
+    if (ent->type != LY_ENTITY_NODE || ent->entity == NULL)
+        return;
+    NodeInfo * nf = &((LYNodeData *)ent->entity)->node;
+    if (nf->host_ip)
+        list_add(&ent->ip_hash, &g_entity_ip_hash[__hash_ip(nf->host_ip)]);
+}
+
+static struct list_head * __hash_alloc(unsigned int size)
+{
+    struct list_head * h = malloc(size * sizeof(struct list_head));
+    if (h == NULL)
+        return NULL;
+    unsigned int i;
+    for (i = 0; i < size; i++)
+        INIT_LIST_HEAD(h + i);
+    return h;
+}
 
-    g_entity_store = malloc(size * sizeof(LYEntity));
-    if (g_entity_store == NULL)
+/* double the hash buckets and re-index all the entities */
+static int __entity_hash_grow(void)
+{
+    unsigned int size = g_entity_hash_size << 1;
+    struct list_head * db_hash = __hash_alloc(size);
+    struct list_head * ip_hash = __hash_alloc(size);
+    if (db_hash == NULL || ip_hash == NULL) {
+        free(db_hash);
+        free(ip_hash);
         return -1;
-    bzero(g_entity_store, size * sizeof(LYEntity));
+    }
+
+    free(g_entity_db_hash);
+    free(g_entity_ip_hash);
+    g_entity_db_hash = db_hash;
+    g_entity_ip_hash = ip_hash;
+    g_entity_hash_size = size;
 
     int i;
-    for (i = 0; i < size; i++) {
-        (g_entity_store + i)->id = -1;
-        (g_entity_store + i)->fd = -1;
-        (g_entity_store + i)->db_id = -1;
+    for (i = 0; i < g_entity_store_chunks << LY_ENTITY_CHUNK_SHIFT; i++) {
+        LYEntity * ent = __entity_get(i);
+        int db_hashed = !list_empty(&ent->db_hash);
+        int ip_hashed = !list_empty(&ent->ip_hash);
+        INIT_LIST_HEAD(&ent->db_hash);
+        INIT_LIST_HEAD(&ent->ip_hash);
+        if (db_hashed)
+            __entity_db_hash(ent);
+        if (ip_hashed)
+            __entity_ip_hash(ent);
     }
+    return 0;
+}
+
+/* add one more chunk of free entities to the store */
+static int __entity_store_grow(void)
+{
+    int n = g_entity_store_chunks;
+    LYEntity ** store = realloc(g_entity_store, (n + 1) * sizeof(LYEntity *));
+    if (store == NULL)
+        return -1;
+    g_entity_store = store;
 
+    LYEntity * chunk = malloc(LY_ENTITY_CHUNK_SIZE * sizeof(LYEntity));
+    if (chunk == NULL)
+        return -1;
+    bzero(chunk, LY_ENTITY_CHUNK_SIZE * sizeof(LYEntity));
+
+    int i;
+    for (i = 0; i < LY_ENTITY_CHUNK_SIZE; i++) {
+        LYEntity * ent = chunk + i;
+        ent->id = -1;
+        ent->slot = (n << LY_ENTITY_CHUNK_SHIFT) + i;
+        ent->fd = -1;
+        ent->db_id = -1;
+        ent->worker = -1;
+        INIT_LIST_HEAD(&ent->db_hash);
+        INIT_LIST_HEAD(&ent->ip_hash);
+        INIT_LIST_HEAD(&ent->send_list);
+        list_add_tail(&ent->list, &g_entity_free_list);
+    }
+    g_entity_store[n] = chunk;
+    g_entity_store_chunks = n + 1;
+
+    /* keep hash load factor under 1 */
+    if ((g_entity_store_chunks << LY_ENTITY_CHUNK_SHIFT) > g_entity_hash_size &&
+        __entity_hash_grow() < 0)
+        logwarn(_("failed growing entity hash, size %d\n"),
+                  g_entity_hash_size);
+
+    return 0;
+}
+
+/* init entity store */
+int ly_entity_store_init(void)
+{
+    if (g_entity_store != NULL)
+        return -255;
+
+    INIT_LIST_HEAD(&g_entity_free_list);
     INIT_LIST_HEAD(&g_node_list);
     INIT_LIST_HEAD(&g_instance_list);
+    INIT_LIST_HEAD(&g_entity_send_list);
+
+    g_entity_hash_size = LY_ENTITY_HASH_SIZE;
+    g_entity_db_hash = __hash_alloc(g_entity_hash_size);
+    g_entity_ip_hash = __hash_alloc(g_entity_hash_size);
+    if (g_entity_db_hash == NULL || g_entity_ip_hash == NULL ||
+        __entity_store_grow() < 0) {
+        ly_entity_store_destroy();
+        return -1;
+    }
+
     return 0;
 }
 
 /* get a new entity object */
 int ly_entity_new(int fd)
 {
-    LYEntity *ent = g_entity_store;
-    if (ent == NULL || fd < 0)
+    if (g_entity_store == NULL || fd < 0)
         return -255;
 
-    int i;
-    for (i = 0; i < LY_ENTITY_MAX; i++, ent++) {
-        if (ent->id == -1)
-            break;
-    }
-
-    if (i == LY_ENTITY_MAX)
+    if (list_empty(&g_entity_free_list) && __entity_store_grow() < 0)
         return -1;
 
+    /* slots are reused in FIFO order */
+    LYEntity *ent = list_first_entry(&g_entity_free_list, LYEntity, list);
+
     /* entity must be cleaned and freed already*/
     if (ent->entity || ent->auth.challenge || ent->auth.secret)
         return -1;
@@ -112,21 +257,21 @@ int ly_entity_new(int fd)
     else 
         ly_packet_reinit(ent->pkt);
 
-
-    INIT_LIST_HEAD(&ent->list);
+    list_del_init(&ent->list);
     ent->db_id = -1;
     ent->type = LY_ENTITY_UNKNOWN;
     ent->flag = 0;
+    ent->worker = -1;
     ent->fd = fd;
-    ent->id = (unsigned short)i;
-    return i;
+    ent->id = ent->slot;
+    return ent->id;
 }
 
 int ly_entity_init(int id, unsigned char type)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0)
         return -1;
-    LYEntity *ent = g_entity_store + id;
 
     if (ent->type != LY_ENTITY_UNKNOWN)
         return 0; /* do nothing if set already */
@@ -149,49 +294,56 @@ int ly_entity_init(int id, unsigned char type)
     else if (type == LY_ENTITY_CLC)
         g_entity_clc = id;
 
+    __entity_db_hash(ent);
     return 0;
 }
 
 int ly_entity_fd(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
-    return (g_entity_store + id)->fd;
+    return ent->fd;
 }
 
 int ly_entity_type(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
-    return (g_entity_store + id)->type;
+    return ent->type;
 }
 
 int ly_entity_db_id(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
-    return (g_entity_store + id)->db_id;
+    return ent->db_id;
 }
 
 LYPacketRecv *ly_entity_pkt(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return NULL;
-    return (g_entity_store + id)->pkt;
+    return ent->pkt;
 }
 
 void *ly_entity_data(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return NULL;
-    return (g_entity_store + id)->entity;
+    return ent->entity;
 }
 
 AuthConfig *ly_entity_auth(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return NULL;
-    return &(g_entity_store + id)->auth;
+    return &ent->auth;
 }
 
 void *ly_entity_data_next(unsigned char ent_type, int * id)
@@ -208,10 +360,9 @@ void *ly_entity_data_next(unsigned char ent_type, int * id)
         return NULL;
 
     LYEntity * ent;
-    if (id == NULL || *id <= 0 || *id >= LY_ENTITY_MAX)
+    if (id == NULL || *id <= 0 || (ent = __entity_get(*id)) == NULL)
         ent = list_entry(head->next, LYEntity, list);
     else {
-        ent = g_entity_store + *id;
         if (list_is_last(&ent->list, head))
             return NULL;
         ent = list_entry(ent->list.next, LYEntity, list);       
@@ -221,113 +372,104 @@ void *ly_entity_data_next(unsigned char ent_type, int * id)
     return ent->entity;
 }
 
+static inline int __entity_status(int id)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
+        return LY_ENTITY_FLAG_STATUS_OFFLINE;
+    return ent->flag & LY_ENTITY_FLAG_STATUS_MASK;
+}
+
 int ly_entity_is_online(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
-        return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_STATUS_MASK) >=
-            LY_ENTITY_FLAG_STATUS_ONLINE ? 1 : 0;
+    return __entity_status(id) >= LY_ENTITY_FLAG_STATUS_ONLINE ? 1 : 0;
 }
 
 int ly_entity_is_authenticated(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
-        return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_STATUS_MASK) >=
-            LY_ENTITY_FLAG_STATUS_AUTHENTICATED ? 1 : 0;
+    return __entity_status(id) >= LY_ENTITY_FLAG_STATUS_AUTHENTICATED ? 1 : 0;
 }
 
 int ly_entity_is_registered(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
-        return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_STATUS_MASK) >=
-            LY_ENTITY_FLAG_STATUS_REGISTERED ? 1 : 0;
+    return __entity_status(id) >= LY_ENTITY_FLAG_STATUS_REGISTERED ? 1 : 0;
 }
 
 int ly_entity_is_running(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
-        return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_STATUS_MASK) >=
-            LY_ENTITY_FLAG_STATUS_RUNNING ? 1 : 0;
+    return __entity_status(id) >= LY_ENTITY_FLAG_STATUS_RUNNING ? 1 : 0;
 }
 
 int ly_entity_is_serving(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
-        return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_STATUS_MASK) >=
-            LY_ENTITY_FLAG_STATUS_SERVING ? 1 : 0;
+    return __entity_status(id) >= LY_ENTITY_FLAG_STATUS_SERVING ? 1 : 0;
 }
 
 int ly_entity_is_enabled(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return 0;
-    return ((g_entity_store + id)->flag & LY_ENTITY_FLAG_NODE_ENABLED) ? 1 : 0;
+    return (ent->flag & LY_ENTITY_FLAG_NODE_ENABLED) ? 1 : 0;
+}
+
+/* set db_id, make sure each entity maps to a unique db_id */
+static void __entity_set_db_id(LYEntity * ent, int db_id)
+{
+    int old_id = ly_entity_find_by_db(ent->type, db_id);
+    if (old_id >= 0 && old_id != ent->id) {
+        loginfo(_("Entity(%d) with same db_id(%d) found, release it\n"),
+                  old_id, db_id);
+        ly_entity_release(old_id);
+    }
+    ent->db_id = db_id;
+    __entity_db_hash(ent);
 }
 
 int ly_entity_update(int id, int db_id, int status)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
     if (status >= 0) {
-        (g_entity_store + id)->flag &= ~LY_ENTITY_FLAG_STATUS_MASK;
-        (g_entity_store + id)->flag |= status & LY_ENTITY_FLAG_STATUS_MASK;
-    }
-    if (db_id >= 0) {
-        /* make sure each entity maps to a unique db_id */
-        int old_id = ly_entity_find_by_db(ly_entity_type(id), db_id);
-        if (old_id >= 0 && old_id != id) {
-            loginfo(_("Entity(%d) with same db_id(%d) found, release it\n"),
-                      old_id, db_id);
-            ly_entity_release(old_id);
-        }
-        (g_entity_store + id)->db_id = db_id;
+        ent->flag &= ~LY_ENTITY_FLAG_STATUS_MASK;
+        ent->flag |= status & LY_ENTITY_FLAG_STATUS_MASK;
     }
+    if (db_id >= 0)
+        __entity_set_db_id(ent, db_id);
+    __entity_ip_hash(ent);
     return 0;
 }
 
 int ly_entity_enable(int id, int db_id, int enble)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
 
     if (enble)
-        (g_entity_store + id)->flag |= LY_ENTITY_FLAG_NODE_ENABLED;
+        ent->flag |= LY_ENTITY_FLAG_NODE_ENABLED;
     else 
-        (g_entity_store + id)->flag &= ~LY_ENTITY_FLAG_NODE_ENABLED;
-
-    if (db_id >= 0) {
-        /* make sure each entity maps to a unique db_id */
-        int old_id = ly_entity_find_by_db(ly_entity_type(id), db_id);
-        if (old_id >= 0 && old_id != id) {
-            loginfo(_("Entity(%d) with same db_id(%d) found, release it\n"),
-                      old_id, db_id);
-            ly_entity_release(old_id);
-        }
-        (g_entity_store + id)->db_id = db_id;
-    }
+        ent->flag &= ~LY_ENTITY_FLAG_NODE_ENABLED;
+
+    if (db_id >= 0)
+        __entity_set_db_id(ent, db_id);
+    __entity_ip_hash(ent);
     return 0;
 }
 
 int ly_entity_find_by_db(int ent_type, int db_id)
 {
-    if (db_id <= 0)
+    if (db_id <= 0 || g_entity_db_hash == NULL)
         return -1;
 
-    struct list_head * head;
-    if (ent_type == LY_ENTITY_NODE)
-        head = &g_node_list;
-    else if (ent_type == LY_ENTITY_OSM)
-        head = &g_instance_list;
-    else 
+    if (ent_type != LY_ENTITY_NODE && ent_type != LY_ENTITY_OSM)
         return -1;
 
     LYEntity * curr;
-    list_for_each_entry(curr, head, list) {
-        if (curr->db_id == db_id)
+    list_for_each_entry(curr, &g_entity_db_hash[__hash_db(ent_type, db_id)],
+                        db_hash) {
+        if (curr->db_id == db_id && curr->type == ent_type)
             return curr->id;
     }
     return -1;
@@ -353,8 +495,11 @@ int ly_entity_head(int ent_type)
 
 int ly_entity_node_active(char * ip)
 {
+    if (ip == NULL || g_entity_ip_hash == NULL)
+        return 0;
+
     LYEntity * curr;
-    list_for_each_entry(curr, &g_node_list, list) {
+    list_for_each_entry(curr, &g_entity_ip_hash[__hash_ip(ip)], ip_hash) {
         LYNodeData * nd = curr->entity;
         NodeInfo * nf = &nd->node;
         if (ly_entity_is_registered(curr->id) &&
@@ -371,19 +516,46 @@ int ly_entity_clc(void)
 
 int ly_entity_release(int id)
 {
-    if (g_entity_store == NULL || id < 0 || id >= LY_ENTITY_MAX)
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
         return -1;
 
-    LYEntity *ent = g_entity_store + id;
     if (ent->id < 0)
         /* deleted already */
         return 0;
 
-    list_del(&ent->list);
+    if (ent->worker >= 0 && ent->worker != t_entity_worker) {
+        /*
+        ** the socket is being read by the owner worker outside of
+        ** clc lock, hide the entity and let the owner release it
+        */
+        if (ent->flag & LY_ENTITY_FLAG_RELEASING)
+            return 0;
+        ent->flag = LY_ENTITY_FLAG_RELEASING;
+        list_del_init(&ent->db_hash);
+        list_del_init(&ent->ip_hash);
+        list_del_init(&ent->send_list);
+        if (ent->type == LY_ENTITY_NODE && ent->entity)
+            node_remove(ent->entity);
+        if (g_entity_release_notify)
+            g_entity_release_notify(ent->worker, id);
+        return 0;
+    }
 
-    if (ent->fd >= 0)
+    list_del(&ent->list);
+    list_del_init(&ent->db_hash);
+    list_del_init(&ent->ip_hash);
+    list_del_init(&ent->send_list);
+
+    if (ent->fd >= 0) {
+        /* last try, replies might be still in queue */
+        if (ent->sendq.head && !ent->send_wait)
+            ly_packet_queue_flush(&ent->sendq, ent->fd);
         close(ent->fd);
+    }
     ent->fd = -1;
+    ly_packet_queue_cleanup(&ent->sendq);
+    ent->send_wait = 0;
 
     /* don't free packet buffer
     if (ent->pkt) {
@@ -393,8 +565,10 @@ int ly_entity_release(int id)
     }
     */
     if (ent->entity) {
-        if (ent->type == LY_ENTITY_NODE)
+        if (ent->type == LY_ENTITY_NODE) {
+            node_remove(ent->entity);
             luoyun_node_info_cleanup(ent->entity);
+        }
         else if (ent->type == LY_ENTITY_OSM)
             luoyun_osm_info_cleanup(ent->entity);
         free(ent->entity);
@@ -405,24 +579,122 @@ int ly_entity_release(int id)
     ent->db_id = -1;
     ent->type = LY_ENTITY_UNKNOWN;
     ent->flag = 0;
+    ent->worker = -1;
     lyauth_free(&ent->auth);
 
+    /* put it at the tail, so the id is not reused too soon */
+    list_add_tail(&ent->list, &g_entity_free_list);
+    return 0;
+}
+
+int ly_entity_is_releasing(int id)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0)
+        return 0;
+    return (ent->flag & LY_ENTITY_FLAG_RELEASING) ? 1 : 0;
+}
+
+int ly_entity_worker(int id)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL)
+        return -1;
+    return ent->worker;
+}
+
+int ly_entity_set_worker(int id, int worker)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0)
+        return -1;
+    ent->worker = worker;
     return 0;
 }
 
+/* set the worker event loop the calling thread runs */
+void ly_entity_thread_worker(int worker)
+{
+    t_entity_worker = worker;
+}
+
+void ly_entity_release_notify(void (*func)(int worker, int id))
+{
+    g_entity_release_notify = func;
+}
+
+int ly_entity_send(int id, int32_t type, void * data, int32_t size)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0 || ent->fd < 0 ||
+        (ent->flag & LY_ENTITY_FLAG_RELEASING))
+        return -255;
+
+    if (ent->sendq.bytes + size > CLC_ENTITY_SENDQ_MAX) {
+        logwarn(_("entity %d has %d bytes not sent, packet dropped\n"),
+                  id, ent->sendq.bytes);
+        return -1;
+    }
+
+    if (ly_packet_queue(&ent->sendq, type, data, size) < 0)
+        return -1;
+
+    /* entity waiting for writable is sent to by its event loop */
+    if (!ent->send_wait && list_empty(&ent->send_list))
+        list_add_tail(&ent->send_list, &g_entity_send_list);
+    return 0;
+}
+
+int ly_entity_send_pending(int id)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0)
+        return 0;
+    return ent->sendq.bytes;
+}
+
+int ly_entity_send_next(void)
+{
+    if (list_empty(&g_entity_send_list))
+        return -1;
+    LYEntity *ent = list_first_entry(&g_entity_send_list, LYEntity, send_list);
+    list_del_init(&ent->send_list);
+    return ent->id;
+}
+
+int ly_entity_send_flush(int id)
+{
+    LYEntity *ent = __entity_get(id);
+    if (ent == NULL || ent->id < 0 || ent->fd < 0)
+        return -255;
+
+    list_del_init(&ent->send_list);
+    int ret = ly_packet_queue_flush(&ent->sendq, ent->fd);
+    if (ret < 0) {
+        /* socket is broken, it's closed once the event loop sees it */
+        logwarn(_("entity %d send error, %d packets dropped\n"),
+                  id, ent->sendq.num);
+        ly_packet_queue_cleanup(&ent->sendq);
+    }
+    ent->send_wait = ret == 1 ? 1 : 0;
+    return ret;
+}
+
 void ly_entity_store_destroy(void)
 {
-    if (g_entity_store == NULL)
-        return;
-    LYEntity *ent = g_entity_store;
+    /* node data is freed below */
+    node_cleanup();
+
     int i;
-    for (i = 0; i < LY_ENTITY_MAX; i++, ent++) {
+    for (i = 0; i < g_entity_store_chunks << LY_ENTITY_CHUNK_SHIFT; i++) {
+        LYEntity *ent = __entity_get(i);
         if (ent->fd >= 0)
             close(ent->fd);
         if (ent->pkt){
             ly_packet_cleanup(ent->pkt);
             free(ent->pkt);
         }
+        ly_packet_queue_cleanup(&ent->sendq);
         if (ent->entity) {
             if (ent->type == LY_ENTITY_NODE)
                 luoyun_node_info_cleanup(ent->entity);
@@ -432,8 +704,22 @@ void ly_entity_store_destroy(void)
         }
         lyauth_free(&ent->auth);
     }
+    for (i = 0; i < g_entity_store_chunks; i++)
+        free(g_entity_store[i]);
     free(g_entity_store);
     g_entity_store = NULL;
+    g_entity_store_chunks = 0;
+
+    free(g_entity_db_hash);
+    free(g_entity_ip_hash);
+    g_entity_db_hash = NULL;
+    g_entity_ip_hash = NULL;
+    g_entity_hash_size = 0;
+
+    INIT_LIST_HEAD(&g_entity_free_list);
+    INIT_LIST_HEAD(&g_node_list);
+    INIT_LIST_HEAD(&g_instance_list);
+    INIT_LIST_HEAD(&g_entity_send_list);
     return;
 }
 
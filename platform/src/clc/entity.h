@@ -12,16 +12,31 @@ typedef struct LYEntity_t {
     AuthConfig auth;
     /* packet receive struct */
     LYPacketRecv *pkt;
-    /* entity id */
-    short id;
+    /* packets waiting to be sent */
+    LYPacketSendQueue sendq;
+    /* linked in entity send list when there are packets to send */
+    struct list_head send_list;
+    /* socket is full, waiting for it to be writable */
+    int send_wait;
+    /* entity id, -1 if the slot is free */
+    int id;
+    /* slot index in entity store, never changes */
+    int slot;
     /* entity type */
     unsigned char type;
     /* entity flag, interpretion depends on entity type */
     unsigned char flag;
     /* entity specific id in DB */
     int db_id;
+    /* worker event loop owning the entity, -1 for main loop */
+    int worker;
     /* entity active list, doubly linked circular list */
+    /* free slots are linked in entity free list */
     struct list_head list;
+    /* hash index by (type, db_id) */
+    struct list_head db_hash;
+    /* hash index by node ip, node entity only */
+    struct list_head ip_hash;
     /* entity specific data */
     void *entity;
 } LYEntity;
@@ -34,6 +49,7 @@ typedef struct LYEntity_t {
 #define LY_ENTITY_FLAG_STATUS_RUNNING		0x04
 #define LY_ENTITY_FLAG_STATUS_SERVING		0x05
 #define LY_ENTITY_FLAG_NODE_ENABLED	 	0x08
+#define LY_ENTITY_FLAG_RELEASING		0x10
 
 int ly_entity_store_init(void);
 int ly_entity_new(int fd);
@@ -58,7 +74,25 @@ int ly_entity_enable(int id, int db_id, int enable);
 int ly_entity_node_active(char * ip);
 int ly_entity_clc(void);
 int ly_entity_release(int id);
+int ly_entity_is_releasing(int id);
+int ly_entity_worker(int id);
+int ly_entity_set_worker(int id, int worker);
+void ly_entity_thread_worker(int worker);
+void ly_entity_release_notify(void (*func)(int worker, int id));
 void ly_entity_store_destroy(void);
+
+/*
+** packets to entities are queued, then sent in batch by the event
+** loops without blocking. ly_entity_send fails if too much data is
+** queued, so a slow entity can not hold up the clc.
+*/
+int ly_entity_send(int id, int32_t type, void * data, int32_t size);
+/* bytes queued for entity */
+int ly_entity_send_pending(int id);
+/* next entity having packets to send, -1 if none */
+int ly_entity_send_next(void);
+/* send queued packets, return 1 if entity has to wait for writable */
+int ly_entity_send_flush(int id);
 void ly_entity_print_node(void);
 void ly_entity_print_osm(void);
 
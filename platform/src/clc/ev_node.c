@@ -38,11 +38,18 @@
 #include "entity.h"
 #include "node.h"
 #include "postgres.h"
+#include "worker.h"
 
 #define NODE_SCHEDULE_CPU_LIMIT(n) (n*g_c->node_cpu_factor)
 #define NODE_SCHEDULE_MEM_LIMIT(m) (m*g_c->node_mem_factor)
 
-/* node register and authtication */
+/*
+** node register and authtication
+**
+** register functions are called with clc lock held, it's released
+** while db is accessed. node data is changed only by the event loop
+** owning the entity, others just read it with the lock held.
+*/
 static int __node_register_auth(NodeInfo * nf, int ent_id)
 {
     if (nf->host_tag <= 0) {
@@ -54,7 +61,9 @@ static int __node_register_auth(NodeInfo * nf, int ent_id)
     DBNodeRegInfo db_nf;
     bzero(&db_nf, sizeof(DBNodeRegInfo));
 
+    ly_clc_unlock();
     int found = db_node_find(DB_NODE_FIND_BY_ID, &nf->host_tag, &db_nf);
+    ly_clc_lock();
     if (found == 1) {
         logdebug(_("tagged node found in db(%d %s %d %d)\n"),
                     db_nf.id, db_nf.ip, db_nf.status, db_nf.enabled);
@@ -88,8 +97,81 @@ out:
     return ret;
 }
 
+/* node register request, host strings are copied by __node_xml_str */
+static const LYXmlField g_register_fields[] = {
+    LYXML_INT("request/parameters/status", NodeInfo, status, 1),
+    LYXML_INT("request/parameters/hypervisor", NodeInfo, hypervisor, 1),
+    LYXML_INT("request/parameters/cpu/arch", NodeInfo, cpu_arch, 1),
+    LYXML_INT("request/parameters/cpu/mhz", NodeInfo, cpu_mhz, 1),
+    LYXML_INT("request/parameters/cpu/max", NodeInfo, cpu_max, 1),
+    LYXML_INT("request/parameters/cpu/commit", NodeInfo, cpu_commit, 1),
+    LYXML_INT("request/parameters/memory/total", NodeInfo, mem_max, 1),
+    LYXML_INT("request/parameters/memory/free", NodeInfo, mem_free, 1),
+    LYXML_INT("request/parameters/memory/commit", NodeInfo, mem_commit, 1),
+    LYXML_INT("request/parameters/storage/total", NodeInfo, storage_total, 1),
+    LYXML_INT("request/parameters/storage/free", NodeInfo, storage_free, 1),
+    LYXML_INT("request/parameters/load/average", NodeInfo, load_average, 1),
+    /* numa topology, not sent by older nodes */
+    LYXML_INT("request/parameters/numa/cells", NodeInfo, numa_cells, 0),
+    LYXML_INT("request/parameters/numa/cpus", NodeInfo, numa_cell_cpus, 0),
+    LYXML_INT("request/parameters/numa/free", NodeInfo, numa_mem_free, 0),
+};
+
+/* node info query reply */
+static const LYXmlField g_node_info_fields[] = {
+    LYXML_INT("response/data/status", NodeInfo, status, 1),
+    LYXML_INT("response/data/cpu/commit", NodeInfo, cpu_commit, 1),
+    LYXML_INT("response/data/memory/free", NodeInfo, mem_free, 1),
+    LYXML_INT("response/data/storage/free", NodeInfo, storage_free, 1),
+    LYXML_INT("response/data/memory/commit", NodeInfo, mem_commit, 1),
+    LYXML_INT("response/data/load/average", NodeInfo, load_average, 1),
+    /* appliance cache counters, not sent by older nodes */
+    LYXML_INT("response/data/appcache/hit", NodeInfo, app_cache_hit, 0),
+    LYXML_INT("response/data/appcache/miss", NodeInfo, app_cache_miss, 0),
+    LYXML_INT("response/data/numa/free", NodeInfo, numa_mem_free, 0),
+};
+
+/* node resource report */
+static const LYXmlField g_resource_fields[] = {
+    LYXML_INT("report/resource/cpu/commit", NodeInfo, cpu_commit, 1),
+    LYXML_INT("report/resource/memory/free", NodeInfo, mem_free, 1),
+    LYXML_INT("report/resource/memory/commit", NodeInfo, mem_commit, 1),
+    LYXML_INT("report/resource/storage/free", NodeInfo, storage_free, 1),
+    LYXML_INT("report/resource/load/average", NodeInfo, load_average, 1),
+    /* appliance cache counters, not sent by older nodes */
+    LYXML_INT("report/resource/appcache/hit", NodeInfo, app_cache_hit, 0),
+    LYXML_INT("report/resource/appcache/miss", NodeInfo, app_cache_miss, 0),
+    LYXML_INT("report/resource/numa/free", NodeInfo, numa_mem_free, 0),
+};
+
+/* instance info query reply, netstat0 is scanned separately */
+static const LYXmlField g_instance_info_fields[] = {
+    LYXML_INT("response/data/id", InstanceInfo, id, 1),
+    LYXML_INT("response/data/status", InstanceInfo, status, 1),
+    LYXML_STR("response/data/ip", InstanceInfo, ip, 0),
+    LYXML_INT("response/data/gport", InstanceInfo, gport, 1),
+};
+
+/* instance state report */
+static const LYXmlField g_instance_report_fields[] = {
+    LYXML_INT("report/instance/id", InstanceInfo, id, 1),
+    LYXML_INT("report/instance/status", InstanceInfo, status, 1),
+};
+
+/* string in node info lives longer than msg */
+static int __node_xml_str(LYXmlMsg * msg, const char * path, char ** s)
+{
+    char * str = lyxml_msg_text(msg, path);
+    if (str == NULL || (str = strdup(str)) == NULL)
+        return -1;
+    if (*s)
+        free(*s);
+    *s = str;
+    return 0;
+}
+
 /* process node register request */
-static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
+static int __node_xml_register(LYXmlMsg * msg, int ent_id)
 {
     if (ly_entity_is_registered(ent_id)) {
         logwarn(_("received node register request again, ignored\n"));
@@ -103,112 +185,23 @@ static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
     }
     NodeInfo * nf = &nd->node;
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if (xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                 __func__, __LINE__);
-        return -1;
-    }
     int ret = -1;
 
-    char *str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/status");
-    if (str == NULL)
+    if (lyxml_msg_decode(msg, g_register_fields,
+                         LYXML_FIELD_NUM(g_register_fields), nf) < 0 ||
+        __node_xml_str(msg, "request/parameters/host/name",
+                       &nf->host_name) < 0 ||
+        __node_xml_str(msg, "request/parameters/host/ip",
+                       &nf->host_ip) < 0 ||
+        __node_xml_str(msg, "request/parameters/cpu/model",
+                       &nf->cpu_model) < 0)
         goto xml_err;
-    nf->status = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/hypervisor");
-    if (str == NULL)
-        goto xml_err;
-    nf->hypervisor = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/host/tag");
-    int tag = -1;
-    if (str) {
-        tag = atoi(str); /* NULL str is allowed for new node */
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/host/name");
-    if (str == NULL)
-        goto xml_err;
-    nf->host_name = str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/host/ip");
-    if (str == NULL)
-        goto xml_err;
-    nf->host_ip = str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/cpu/arch");
-    if (str == NULL)
-        goto xml_err;
-    nf->cpu_arch = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/cpu/model");
-    if (str == NULL)
-        goto xml_err;
-    nf->cpu_model = str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/cpu/mhz");
-    if (str == NULL)
-        goto xml_err;
-    nf->cpu_mhz = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/cpu/max");
-    if (str == NULL)
-        goto xml_err;
-    nf->cpu_max = atoi(str);
     nf->cpu_vlimit = NODE_SCHEDULE_CPU_LIMIT(nf->cpu_max);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/cpu/commit");
-    if (str == NULL)
-        goto xml_err;
-    nf->cpu_commit = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/memory/total");
-    if (str == NULL)
-        goto xml_err;
-    nf->mem_max = atoi(str);
     nf->mem_vlimit = NODE_SCHEDULE_MEM_LIMIT(nf->mem_max);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/memory/free");
-    if (str == NULL)
-        goto xml_err;
-    nf->mem_free = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/memory/commit");
-    if (str == NULL)
-        goto xml_err;
-    nf->mem_commit = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/storage/total");
-    if (str == NULL)
-        goto xml_err;
-    nf->storage_total = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/storage/free");
-    if (str == NULL)
-        goto xml_err;
-    nf->storage_free = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                          "/" LYXML_ROOT "/request/parameters/load/average");
-    if (str == NULL)
-        goto xml_err;
-    nf->load_average = atoi(str);
-    free(str);
+
+    /* NULL str is allowed for new node */
+    char * str = lyxml_msg_text(msg, "request/parameters/host/tag");
+    int tag = str ? atoi(str) : -1;
 
     if (nf->status >= NODE_STATUS_REGISTERED) {
         logwarn(_("node(%d, %s) tries to register from wrong status(%d)\n"),
@@ -236,12 +229,15 @@ static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
         ret = __node_register_auth(nf, ent_id);
         if (ret == LY_S_REGISTERING_DONE_SUCCESS) {
             AuthConfig * ac = ly_entity_auth(ent_id);
+            ly_clc_unlock();
             if (db_node_update_secret(DB_NODE_FIND_BY_ID, &tag,
                                       ac->secret) < 0 ||
                 db_node_update_status(DB_NODE_FIND_BY_ID, &tag,
-                                      NODE_STATUS_REGISTERED) < 0) {
-                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+                                      NODE_STATUS_REGISTERED) < 0)
                 ret = -1;
+            ly_clc_lock();
+            if (ret < 0) {
+                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
                 goto done;
             }
             loginfo(_("node(tag:%d) registered\n"), tag);
@@ -253,7 +249,9 @@ static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
     /* new node */
     DBNodeRegInfo db_nf;
     bzero(&db_nf, sizeof(DBNodeRegInfo));
+    ly_clc_unlock();
     ret = db_node_find(DB_NODE_FIND_BY_IP, nf->host_ip, &db_nf);
+    ly_clc_lock();
     if (ret < 0 || ret > 1) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         ret = -1;
@@ -274,23 +272,22 @@ static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
             bzero(&db_nf, sizeof(DBNodeRegInfo));
         }
             
+        ly_clc_unlock();
         ret = db_node_insert(nf);
+        if (ret >= 0) {
+            db_nf.id = ret;
+            loginfo(_("new node %s added in db(%d)\n"), nf->host_ip, ret);
+            /* enable node if node is control server */
+            if (ly_is_clc_ip(nf->host_ip) &&
+                (db_node_enable(ret, 1) != 0 ||
+                 db_node_find(DB_NODE_FIND_BY_ID, &ret, &db_nf) != 1))
+                ret = -1;
+        }
+        ly_clc_lock();
         if (ret < 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             goto new_done;
         }
-        db_nf.id = ret;
-        loginfo(_("new node %s added in db(%d)\n"), nf->host_ip, ret);
-
-        /* enable node if node is control server */
-        if (ly_is_clc_ip(nf->host_ip)) {
-            if (db_node_enable(ret, 1) != 0 ||
-                db_node_find(DB_NODE_FIND_BY_ID, &ret, &db_nf) != 1) {
-                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-                ret = -1;
-                goto new_done;
-            }
-        }
     }
     else
         logdebug(_("untagged node for ip(%s) found in db\n"), nf->host_ip);
@@ -316,10 +313,12 @@ static int __node_xml_register(xmlDoc * doc, xmlNode * node, int ent_id)
         ret = LY_S_REGISTERING_INIT;
     }
     nf->status = NODE_STATUS_ONLINE;
+    ly_clc_unlock();
     if (db_node_update(DB_NODE_FIND_BY_ID, &db_nf.id, nf) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         ret = -1;
     }
+    ly_clc_lock();
 
 new_done:
     db_node_reginfo_free(&db_nf);
@@ -327,28 +326,25 @@ new_done:
 xml_err:
     logerror(_("invalid node xml register request\n"));
 done:
-    xmlXPathFreeContext(xpathCtx);
+    node_update(ent_id);
     logdebug(_("end of %s, node status %d\n"), __func__, nf->status);
     return ret;
 }
 
-/* process xml request */
-static int __process_node_xml_request(xmlDoc * doc, xmlNode * node, int ent_id)
+/* process xml request, called with clc lock held */
+static int __node_xml_request(LYXmlMsg * msg, int ent_id)
 {
     loginfo(_("node request for entity %d\n"), ent_id);
 
-    char *str = (char *) xmlGetProp(node, (const xmlChar *) "action");
-    int action = atoi(str);
-    if (action != LY_A_CLC_REGISTER_NODE) {
+    char *str = lyxml_msg_text(msg, "request@action");
+    if (str == NULL || atoi(str) != LY_A_CLC_REGISTER_NODE) {
         logerror(_("clc received non-register node request.\n"));
-        free(str);
         return -1;
     }
-    free(str);
 
     loginfo(_("node register request\n"));
 
-    str = (char *) xmlGetProp(node, (const xmlChar *) "id");
+    str = lyxml_msg_text(msg, "request@id");
     if (str)
         logdebug("id = %s\n", str);
     else {
@@ -356,9 +352,8 @@ static int __process_node_xml_request(xmlDoc * doc, xmlNode * node, int ent_id)
         return -1;
     }
     int id = atoi(str);
-    free(str);
 
-    int ret = __node_xml_register(doc, node, ent_id);
+    int ret = __node_xml_register(msg, ent_id);
     if (ret < 0)
         logerror(_("node registeration failed.\n"));
     else if (ret == 0) {
@@ -387,103 +382,77 @@ static int __process_node_xml_request(xmlDoc * doc, xmlNode * node, int ent_id)
     else
         ai.data[0] = '\0';
 
-    int fd = ly_entity_fd(ent_id);
     LYReply r;
     r.req_id = id;
     r.from = LY_ENTITY_CLC;
     r.to = LY_ENTITY_NODE;
     r.status = ret;
     r.data = &ai;
-    char *response = lyxml_data_reply_auth_info(&r, NULL, 0);
-    ret = ly_packet_send(fd, PKT_TYPE_NODE_REGISTER_REPLY,
-                         response, strlen(response));
+    int len;
+    char *response = lyxml_msg_reply_auth_info(nd->proto, &r, &len);
+    if (response == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    ret = ly_entity_send(ent_id, PKT_TYPE_NODE_REGISTER_REPLY,
+                         response, len);
     free(response);
 
     return ret;
 }
 
+static int __process_node_xml_request(LYXmlMsg * msg, int ent_id)
+{
+    ly_clc_lock();
+    int ret = __node_xml_request(msg, ent_id);
+    ly_clc_unlock();
+    return ret;
+}
+
 /*
 ** process instance info data,
 ** either from internal query or from xml response
 **
 */
-static int __instance_info_update(xmlDoc * doc, xmlNode * node)
+static int __instance_info_update(LYXmlMsg * msg)
 {
-    int ret;
     logdebug(_("%s called\n"), __func__);
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if (xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                 __func__, __LINE__);
-        return -1;
-    }
-
     InstanceInfo ii;
     bzero(&ii, sizeof(InstanceInfo));
-    char *str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/id");
-    if (str == NULL)
-        goto failed;
-    ii.id = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/status");
-    if (str == NULL)
-        goto failed;
-    ii.status = atoi(str);
-    free(str);
-    ii.ip = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/ip");
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/gport");
+    if (lyxml_msg_decode(msg, g_instance_info_fields,
+                         LYXML_FIELD_NUM(g_instance_info_fields), &ii) < 0)
+        return -1;
+    char * str = lyxml_msg_text(msg, "response/data/netstat0");
     if (str == NULL)
-        goto failed;
-    ii.gport = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/netstat0");
-    if (str)
-        sscanf(str, "%ld %ld %ld %ld", &ii.netstat[0].rx_bytes, &ii.netstat[0].rx_pkts,
-                                       &ii.netstat[0].tx_bytes, &ii.netstat[0].tx_pkts);
-    else
-        goto failed;
-    free(str);
+        return -1;
+    sscanf(str, "%ld %ld %ld %ld", &ii.netstat[0].rx_bytes, &ii.netstat[0].rx_pkts,
+                                   &ii.netstat[0].tx_bytes, &ii.netstat[0].tx_pkts);
 
     logdebug(_("update info for instance %d:"), ii.id);
     luoyun_instance_info_print(&ii);
 
+    ly_clc_lock();
     int ent_id = ly_entity_find_by_db(LY_ENTITY_OSM, ii.id);
     if (ly_entity_is_registered(ent_id))
         ii.status = DOMAIN_S_UNKNOWN; /* don't update status */
+    ly_clc_unlock();
     if (db_instance_update_status(ii.id, &ii, -1) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        if (ii.ip)
-            free(ii.ip);
-        goto failed;
+        return -1;
     }
 
-    if (ii.ip)
-        free(ii.ip);
-    ret = 0;
-    goto done;
-
-failed:
-    ret = -1;
-done:
-    xmlXPathFreeContext(xpathCtx);
-    return ret;
+    return 0;
 }
 
 /* process node info query reply */
-static int __node_info_update(xmlDoc * doc, xmlNode * node,
-                              int ent_id, int * j_status)
+static int __node_info_update(LYXmlMsg * msg, int ent_id, int * j_status)
 {
     logdebug(_("%s called\n"), __func__);
 
+    ly_clc_lock();
     if (!ly_entity_is_online(ent_id)) {
+        ly_clc_unlock();
         /* shouldn't come here */
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         *j_status = LY_S_FINISHED_FAILURE_NODE_NOT_AVAIL;
@@ -492,69 +461,30 @@ static int __node_info_update(xmlDoc * doc, xmlNode * node,
 
     LYNodeData * nd = ly_entity_data(ent_id);
     if (nd == NULL) {
+        ly_clc_unlock();
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         *j_status = LY_S_FINISHED_FAILURE;
         return 0;
     }
     NodeInfo * nf = &nd->node;
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if (xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                 __func__, __LINE__);
-        *j_status = LY_S_FINISHED_FAILURE;
-        return 0;
-    }
-
-    char *str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/status");
-    if (str == NULL)
-        goto failed;
-    nf->status = atoi(str);
-    free(str);
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/cpu/commit");
-    if (str == NULL)
+    if (lyxml_msg_decode(msg, g_node_info_fields,
+                         LYXML_FIELD_NUM(g_node_info_fields), nf) < 0) {
+        ly_clc_unlock();
         goto failed;
-    nf->cpu_commit = atoi(str);
-    free(str);
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/memory/free");
-    if (str == NULL)
-        goto failed;
-    nf->mem_free = atoi(str);
-    free(str);
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/storage/free");
-    if (str == NULL)
-        goto failed;
-    nf->storage_free = atoi(str);
-    free(str);
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/memory/commit");
-    if (str == NULL)
-        goto failed;
-    nf->mem_commit = atoi(str);
-    free(str);
+    }
+    if (lyxml_msg_exist(msg, "response/data/appcache/hit"))
+        nd->appcache = 1;
 
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                          "/" LYXML_ROOT "/response/data/load/average");
-    if (str == NULL)
-        goto failed;
-    nf->load_average = atoi(str);
-    free(str);
+    node_update(ent_id);
 
     int node_id = ly_entity_db_id(ent_id);
+    ly_clc_unlock();
     logdebug(_("update info for node %d: %d %d %d %d %d\n"), node_id,
                 nf->status, nf->cpu_commit, 
                 nf->mem_free, nf->mem_commit, nf->load_average);
 
+    /* node data is changed only by the event loop owning the entity */
     if (db_node_update(DB_NODE_FIND_BY_ID, &node_id, nf) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
@@ -566,16 +496,14 @@ static int __node_info_update(xmlDoc * doc, xmlNode * node,
 failed:
     *j_status = LY_S_FINISHED_FAILURE;
 done:
-    xmlXPathFreeContext(xpathCtx);
     return 0;
 }
 
 /* process xml response */
-static int __process_node_xml_response(xmlDoc * doc, xmlNode * node,
-                                       int ent_id)
+static int __process_node_xml_response(LYXmlMsg * msg, int ent_id)
 {
     logdebug(_("node response for entity %d\n"), ent_id);
-    char * str = (char *) xmlGetProp(node, (const xmlChar *) "id");
+    char * str = lyxml_msg_text(msg, "response@id");
     if (str)
         logdebug("node response id(job id) = %s\n", str);
     else {
@@ -583,9 +511,8 @@ static int __process_node_xml_response(xmlDoc * doc, xmlNode * node,
         return -1;
     }
     int id = atoi(str);
-    free(str);
 
-    str = (char *) xmlGetProp(node, (const xmlChar *) "status");
+    str = lyxml_msg_text(msg, "response@status");
     if (str)
         logdebug("node response status = %s\n", str);
     else {
@@ -593,39 +520,41 @@ static int __process_node_xml_response(xmlDoc * doc, xmlNode * node,
         return -1;
     }
     int status = atoi(str);
-    free(str);
+
+    /* older nodes don't time their responses */
+    str = lyxml_msg_text(msg, "response@elapsed");
+    int elapsed = str ? atoi(str) : -1;
+
+    if (lyxml_msg_exist(msg, "response/result")) {
+        str = lyxml_msg_text(msg, "response/result");
+        if (str)
+            loginfo(_("response result: %s\n"), str);
+        else
+            loginfo(_("response no result message\n"));
+    }
 
     int data_type = -1;
-    node = node->children;
-    for (; node; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            if (strcmp((char *)node->name, "result") == 0) {
-                xmlNode * n = node->children;
-                if (n && n->type == XML_TEXT_NODE && n->content)
-                    loginfo(_("response result: %s\n"), n->content);
-                else
-                    loginfo(_("response no result message\n"));
-            }
-            else if (strcmp((char *)node->name, "data") == 0) {
-                str = (char *) xmlGetProp(node, (const xmlChar *) "type");
-                if (str) {
-                    logdebug("node response data type = %s\n", str);
-                    data_type = atoi(str);
-                    free(str);
-                }
-                else
-                    logwarn(_("response data no type\n"));
-            }
+    if (lyxml_msg_exist(msg, "response/data")) {
+        str = lyxml_msg_text(msg, "response/data@type");
+        if (str) {
+            logdebug("node response data type = %s\n", str);
+            data_type = atoi(str);
         }
+        else
+            logwarn(_("response data no type\n"));
     }
 
+    ly_clc_lock();
     if (id != 0) {
         LYJobInfo * job = job_find(id);
         if (job == NULL) {
+            ly_clc_unlock();
             logwarn(_("job(%d) not found waiting for node reply\n"), id);
             return 0;
         }
+        job_trace(job, status, elapsed);
         if (job_update_status(job, status)) {
+            ly_clc_unlock();
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
         }
@@ -642,15 +571,16 @@ static int __process_node_xml_response(xmlDoc * doc, xmlNode * node,
     }
 
     int ent_type = ly_entity_type(ent_id);
+    ly_clc_unlock();
     if (ent_type == LY_ENTITY_NODE && data_type == DATA_INSTANCE_INFO) { 
-        if ( __instance_info_update(doc, node)) {
+        if ( __instance_info_update(msg)) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
         }
     }
    
     if (ent_type == LY_ENTITY_NODE && data_type == DATA_NODE_INFO) { 
-        if ( __node_info_update(doc, node, ent_id, &status)) {
+        if ( __node_info_update(msg, ent_id, &status)) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
         }
@@ -660,170 +590,165 @@ static int __process_node_xml_response(xmlDoc * doc, xmlNode * node,
 }
 
 /* process node resource report */
-static int __node_resource_update(xmlDoc * doc, xmlNode * node, int ent_id)
+static int __node_resource_update(LYXmlMsg * msg, int ent_id)
 {
     logdebug(_("%s called\n"), __func__);
 
+    ly_clc_lock();
     LYNodeData * nd = ly_entity_data(ent_id);
     if (nd == NULL) {
+        ly_clc_unlock();
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;;
     }
 
     NodeInfo * nf = &nd->node;
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if (xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                 __func__, __LINE__);
-        goto failed;
+    if (lyxml_msg_decode(msg, g_resource_fields,
+                         LYXML_FIELD_NUM(g_resource_fields), nf) < 0) {
+        ly_clc_unlock();
+        return -1;
     }
+    /* older nodes don't report appcache, nor take prefetch requests */
+    if (lyxml_msg_exist(msg, "report/resource/appcache/hit"))
+        nd->appcache = 1;
 
-    char *str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/report/resource/cpu/commit");
-    if (str == NULL)
-        goto failed;
-    nf->cpu_commit = atoi(str);
-    free(str);
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/report/resource/memory/free");
-    if (str == NULL)
-        goto failed;
-    nf->mem_free = atoi(str);
-    free(str);
+    logdebug(_("report info for node %d: %d %d %d %d %d, appcache %u/%u\n"),
+                ly_entity_db_id(ent_id), nf->status,
+                nf->cpu_commit, nf->mem_free, nf->mem_commit,
+                nf->load_average, nf->app_cache_hit, nf->app_cache_miss);
 
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/report/resource/memory/commit");
-    if (str == NULL)
-        goto failed;
-    nf->mem_commit = atoi(str);
-    free(str);
+    node_update(ent_id);
+    ly_clc_unlock();
+    return 0;
+}
 
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/report/resource/storage/free");
-    if (str == NULL)
-        goto failed;
-    nf->storage_free = atoi(str);
-    free(str);
+/*
+** process instance state report, sent by node on domain events.
+** status is kept for instances with osm connected, as in
+** __instance_info_update, unless the instance is stopped.
+*/
+static int __instance_status_report(LYXmlMsg * msg, int ent_id)
+{
+    logdebug(_("%s called\n"), __func__);
 
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                          "/" LYXML_ROOT "/report/resource/load/average");
-    if (str == NULL)
-        goto failed;
-    nf->load_average = atoi(str);
-    free(str);
+    InstanceInfo ii;
+    bzero(&ii, sizeof(InstanceInfo));
+    if (lyxml_msg_decode(msg, g_instance_report_fields,
+                         LYXML_FIELD_NUM(g_instance_report_fields), &ii) < 0)
+        return -1;
 
-    logdebug(_("report info for node %d: %d %d %d %d %d\n"),
-                ly_entity_db_id(ent_id), nf->status,
-                nf->cpu_commit, nf->mem_free, nf->mem_commit,
-                nf->load_average);
+    ly_clc_lock();
+    int node_id = ly_entity_db_id(ent_id);
+    ly_clc_unlock();
+    if (db_instance_get_node(ii.id) != node_id) {
+        logwarn(_("instance %d is not on node %d, report ignored\n"),
+                   ii.id, node_id);
+        return 0;
+    }
+    loginfo(_("instance %d status %d reported by node %d\n"),
+               ii.id, ii.status, node_id);
 
-    xmlXPathFreeContext(xpathCtx);
+    ly_clc_lock();
+    int registered = 0;
+    int osm_id = ly_entity_find_by_db(LY_ENTITY_OSM, ii.id);
+    if (ii.status == DOMAIN_S_STOP) {
+        if (osm_id > 0) {
+            loginfo(_("release entity %d\n"), osm_id);
+            ly_entity_release(osm_id);
+        }
+    }
+    else
+        registered = ly_entity_is_registered(osm_id);
+    ly_clc_unlock();
+    if (registered)
+        return 0;
+    ii.ip = "0.0.0.0";
+    ii.gport = 0;
+    if (db_instance_update_status(ii.id, &ii, -1) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
     return 0;
-
-failed:
-    xmlXPathFreeContext(xpathCtx);
-    return -1;
 }
 
 /* process xml report */
-static int __process_node_xml_report(xmlDoc * doc, xmlNode * node, int ent_id)
+static int __process_node_xml_report(LYXmlMsg * msg, int ent_id)
 {
     loginfo(_("node report for entity %d\n"), ent_id);
 
+    ly_clc_lock();
     int node_id = ly_entity_db_id(ent_id);
+    ly_clc_unlock();
     int status = -1;
-    node = node->children;
-    for (; node; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            if (strcmp((char *)node->name, "status") == 0) {
-                if (node->children != NULL &&
-                    node->children->type == XML_TEXT_NODE) {
-                    status = atoi((char *)node->children->content);
-                    logwarn(_("node %d report status %d\n"),
-                               node_id, status);
-                }
-                else {
-                    logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-                    return -1;
-                }
-            }
-            else if (strcmp((char *)node->name, "message") == 0) {
-                if (node->children != NULL && 
-                    node->children->type == XML_TEXT_NODE) {
-                    logwarn(_("node %d report message %s\n"),
-                               node_id, node->children->content);
-                }
-            }
-            else if (strcmp((char *)node->name, "resource") == 0) {
-                 logdebug(_("node %d report resource\n"), node_id);
-                 __node_resource_update(doc, node, ent_id);
-            }
+    char * str;
+    if (lyxml_msg_exist(msg, "report/status")) {
+        str = lyxml_msg_text(msg, "report/status");
+        if (str == NULL) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
         }
+        status = atoi(str);
+        logwarn(_("node %d report status %d\n"), node_id, status);
+    }
+    str = lyxml_msg_text(msg, "report/message");
+    if (str)
+        logwarn(_("node %d report message %s\n"), node_id, str);
+    if (lyxml_msg_exist(msg, "report/resource")) {
+         logdebug(_("node %d report resource\n"), node_id);
+         __node_resource_update(msg, ent_id);
+    }
+    if (lyxml_msg_exist(msg, "report/instance")) {
+         logdebug(_("node %d report instance\n"), node_id);
+         __instance_status_report(msg, ent_id);
     }
 
+    ly_clc_lock();
     LYNodeData * nd = ly_entity_data(ent_id);
     if (nd != NULL && status != -1) {
         loginfo(_("update node status to %d from report\n"), nd->node.status);
     }
+    ly_clc_unlock();
 
     return 0;
 }
 
-/* process xml packet from node */
-int eh_process_node_xml(char * xml, int ent_id)
+/* process xml packet from node, parsed without clc lock held */
+int eh_process_node_xml(char * xml, int len, int ent_id)
 {
     logdebug(_("%s called\n"), __func__);
     /* logdebug("%s\n", xml); */
 
     int ret = 0;
-    xmlDoc *doc = xml_doc_from_str(xml);
-    if (doc == NULL) {
-        /* error: could not parse xml string */
-        logerror(_("unrecognized node packet data\n%s\n"), xml);
-        return -1;
-    }
-    xmlNode * node = xmlDocGetRootElement(doc);
-    if (node == NULL || strcmp((char *)node->name, LYXML_ROOT) != 0) {
-        /* error: xml string not for "LYXML_ROOT" */
+    LYXmlMsg * msg = lyxml_msg_parse(xml, len);
+    if (msg == NULL) {
+        /* error: could not parse xml string, or not for "LYXML_ROOT" */
         logerror(_("unrecognized node packet data\n%s\n"), xml);
         return -1;
     }
 
-    node = node->children;
+    if (lyxml_msg_exist(msg, "response"))
+        ret = __process_node_xml_response(msg, ent_id);
+    if (ret >= 0 && lyxml_msg_exist(msg, "request"))
+        ret = __process_node_xml_request(msg, ent_id);
+    if (ret >= 0 && lyxml_msg_exist(msg, "report"))
+        ret = __process_node_xml_report(msg, ent_id);
+    /* other nodes ignored */
 
-    for (; node; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            if (strcmp((char *)node->name, "response") == 0 ) {
-                ret = __process_node_xml_response(doc, node, ent_id);
-                if (ret  < 0)
-                    break;
-            }
-            else if (strcmp((char *)node->name, "request") == 0 ) {
-                ret = __process_node_xml_request(doc, node, ent_id);
-                if (ret  < 0)
-                    break;
-            }
-            else if (strcmp((char *)node->name, "report") == 0 ) {
-                ret = __process_node_xml_report(doc, node, ent_id);
-                if (ret  < 0)
-                    break;
-            }
-            /* other nodes ignored */
-        }
-    }
-    xmlFreeDoc(doc);
+    lyxml_msg_free(msg);
     return ret;
 }
 
-/* process raw auth request from node */
-int eh_process_node_auth(int is_reply, void * data, int ent_id)
+/* called with clc lock held, it's released while db is accessed */
+static int __node_auth(int is_reply, void * data, int len, int ent_id)
 {
     logdebug(_("%s called\n"), __func__);
 
+    if (len != sizeof(AuthInfo) && len != sizeof(AuthProto)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+
     int ret;
     AuthInfo * ai = data;
     AuthConfig * ac = ly_entity_auth(ent_id);
@@ -860,9 +785,12 @@ int eh_process_node_auth(int is_reply, void * data, int ent_id)
     /* get secret */
     if (ac->secret == NULL) {
         logdebug(_("retrieve auth key for node %d(tag)\n"), ai->tag);
+        /* auth config is used only by the event loop owning entity */
+        ly_clc_unlock();
         ret = db_node_find_secret(DB_NODE_FIND_BY_ID,
                                   &ai->tag,
                                   &ac->secret);
+        ly_clc_lock();
         if (ret < 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
@@ -876,8 +804,10 @@ int eh_process_node_auth(int is_reply, void * data, int ent_id)
 
     /* update node status */
     logdebug(_("update node status to %d\n"), NODE_STATUS_AUTHENTICATING);
+    ly_clc_unlock();
     ret = db_node_update_status(DB_NODE_FIND_BY_ID, &ai->tag,
                                 NODE_STATUS_AUTHENTICATING);
+    ly_clc_lock();
     if (ret < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
@@ -891,10 +821,17 @@ int eh_process_node_auth(int is_reply, void * data, int ent_id)
         return -1;
     }
 
+    /* wire format, only node asking for it gets it in reply */
+    if (len == sizeof(AuthProto)) {
+        AuthProto * ap = data;
+        ap->proto &= LUOYUN_PROTO_BIN;
+        nd->proto = ap->proto;
+        loginfo(_("node %d(tag) packet data in %s\n"), ai->tag,
+                   nd->proto & LUOYUN_PROTO_BIN ? "binary" : "xml");
+    }
+
     /* send answer back */
-    int fd = ly_entity_fd(ent_id);
-    if (ly_packet_send(fd, PKT_TYPE_NODE_AUTH_REPLY,
-                       ai, sizeof(AuthInfo)) < 0) {
+    if (ly_entity_send(ent_id, PKT_TYPE_NODE_AUTH_REPLY, ai, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
@@ -908,7 +845,7 @@ int eh_process_node_auth(int is_reply, void * data, int ent_id)
 
     bzero(ai->data, LUOYUN_AUTH_DATA_LEN);
     strncpy((char *)ai->data, ac->challenge, LUOYUN_AUTH_DATA_LEN);
-    if (ly_packet_send(fd, PKT_TYPE_NODE_AUTH_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_NODE_AUTH_REQUEST,
                        ai, sizeof(AuthInfo)) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
@@ -919,3 +856,12 @@ int eh_process_node_auth(int is_reply, void * data, int ent_id)
 
     return 0;
 }
+
+/* process raw auth request from node */
+int eh_process_node_auth(int is_reply, void * data, int len, int ent_id)
+{
+    ly_clc_lock();
+    int ret = __node_auth(is_reply, data, len, ent_id);
+    ly_clc_unlock();
+    return ret;
+}
@@ -37,6 +37,7 @@
 #include "lyjob.h"
 #include "postgres.h"
 #include "lyclc.h"
+#include "worker.h"
 
 /* process osm query */
 int eh_process_osm_query(char *buf)
@@ -51,26 +52,29 @@ int eh_process_osm_query(char *buf)
         return 1;
     }
 
-    LYJobInfo * job = job_find(job_id);
-    if (job == NULL) {
-        logwarn(_("job(%d) not found in %s\n"), job_id, __func__);
-        return 0;
-    }
-
     loginfo(_("osm(tag:%d ip:%s) status %d\n"), osm_tag, ip, osm_status);
 
-    if (job_update_status(job, LY_S_FINISHED_SUCCESS)) {
+    ly_clc_lock();
+    int ret = 0;
+    LYJobInfo * job = job_find(job_id);
+    if (job == NULL)
+        logwarn(_("job(%d) not found in %s\n"), job_id, __func__);
+    else if (job_update_status(job, LY_S_FINISHED_SUCCESS)) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
+        ret = -1;
     }
-
-    return 0;
+    ly_clc_unlock();
+    return ret;
 }
 
 /* process osm report */
 int eh_process_osm_report(char * buf, int size, int ent_id)
 {
+    ly_clc_lock();
     int db_id = ly_entity_db_id(ent_id);
+    int serving = ly_entity_is_serving(ent_id);
+    int running = ly_entity_is_running(ent_id);
+    ly_clc_unlock();
 
     if (size != sizeof(int32_t)) {
         logerror(_("instance %d, unexpected osm report data size\n"), db_id);
@@ -78,44 +82,40 @@ int eh_process_osm_report(char * buf, int size, int ent_id)
     }
 
     int status = *(int32_t *)buf;
+    int flag;
+    InstanceInfo ii;
+    bzero(&ii, sizeof(InstanceInfo));
+    ii.ip = NULL;
+    ii.gport = -1;
     logdebug(_("instance %d, osm report: <%d>\n"), db_id, status);
     if (status == LY_S_APP_RUNNING) {
         loginfo(_("osm report: %d, %s\n"), status, "application running");
-        if (!ly_entity_is_serving(ent_id)) {
-            InstanceInfo ii;
-            bzero(&ii, sizeof(InstanceInfo));
-            ii.status = DOMAIN_S_SERVING;
-            ii.ip = NULL;
-            ii.gport = -1;
-            if (db_instance_update_status(db_id, &ii, -1) < 0) {
-                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-                return -1;
-            }
-
-            ly_entity_update(ent_id, -1, LY_ENTITY_FLAG_STATUS_SERVING);
-            loginfo(_("instance (tag:%d) is servicing\n"), db_id);
-        }
+        if (serving)
+            return 0;
+        ii.status = DOMAIN_S_SERVING;
+        flag = LY_ENTITY_FLAG_STATUS_SERVING;
     }
     else if (status > LY_S_APP_RUNNING && status <= LY_S_APP_FAILED) {
         loginfo(_("osm report: %d, %s\n"), status, "application status unknown");
-        if (!ly_entity_is_running(ent_id) || ly_entity_is_serving(ent_id)) {
-            InstanceInfo ii;
-            bzero(&ii, sizeof(InstanceInfo));
-            ii.status = DOMAIN_S_RUNNING;
-            ii.ip = NULL;
-            ii.gport = -1;
-            if (db_instance_update_status(db_id, &ii, -1) < 0) {
-                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-                return -1;
-            }
-
-            ly_entity_update(ent_id, -1, LY_ENTITY_FLAG_STATUS_RUNNING);
-            loginfo(_("instance (tag:%d) is running\n"), db_id);
-        }
+        if (running && !serving)
+            return 0;
+        ii.status = DOMAIN_S_RUNNING;
+        flag = LY_ENTITY_FLAG_STATUS_RUNNING;
     }
     else {
         logwarn(_("osm report: %d, %s\n"), status, "undefined osm report, ignore");
+        return 0;
+    }
+
+    if (db_instance_update_status(db_id, &ii, -1) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
     }
+    ly_clc_lock();
+    ly_entity_update(ent_id, -1, flag);
+    ly_clc_unlock();
+    loginfo(_("instance (tag:%d) is %s\n"), db_id,
+               flag == LY_ENTITY_FLAG_STATUS_SERVING ? "servicing" : "running");
     return 0;
 }
 
@@ -125,39 +125,47 @@ int eh_process_osm_register(char * buf, int size, int ent_id)
     logdebug(_("%s called\n"), __func__);
     logdebug(_("osm register request, <%s>\n"), buf);
 
+    int tag, status;
+    char ip[MAX_IP_LEN];
+    if (sscanf(buf, "%d %d %s", &tag, &status, ip) != 3) {
+        logerror(_("osm register with unexpected data\n"));
+        return 1;
+    }
+
+    ly_clc_lock();
     if (ly_entity_is_registered(ent_id)) {
+        ly_clc_unlock();
         logwarn(_("received osm register request again, ignored\n"));
         return -1;
     }
 
     OSMInfo * oi = ly_entity_data(ent_id);
     if (oi == NULL) {
+        ly_clc_unlock();
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
-
-    char ip[MAX_IP_LEN];
-    if (sscanf(buf, "%d %d %s", &oi->tag, &oi->status, ip) != 3) {
-        logerror(_("osm register with unexpected data\n"));
-        return 1;
-    }
+    oi->tag = tag;
+    oi->status = status;
+    if (oi->ip)
+        free(oi->ip);
     oi->ip = strdup(ip);
 
     int result = LY_S_REGISTERING_DONE_SUCCESS;
     if (ly_entity_is_authenticated(ent_id) == 0) {
-        logwarn(_("OSM(%d %d %s) not authenticated\n"),
-                  oi->tag, oi->status, ip);
+        logwarn(_("OSM(%d %d %s) not authenticated\n"), tag, status, ip);
         result = LY_S_REGISTERING_DONE_FAIL;
     }
-    else if (oi->status != OSM_STATUS_UNREGISTERED) {
+    else if (status != OSM_STATUS_UNREGISTERED) {
         logwarn(_("OSM(%d %d %s) register with unexpected status\n"),
-                  oi->tag, oi->status, ip);
+                  tag, status, ip);
         result = LY_S_REGISTERING_DONE_FAIL;
     }
 
-    int fd = ly_entity_fd(ent_id);
-    if (ly_packet_send(fd, PKT_TYPE_OSM_REGISTER_REPLY,
-                       &result, sizeof(result)) < 0) {
+    int ret = ly_entity_send(ent_id, PKT_TYPE_OSM_REGISTER_REPLY,
+                             &result, sizeof(result));
+    ly_clc_unlock();
+    if (ret < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
@@ -170,14 +178,16 @@ int eh_process_osm_register(char * buf, int size, int ent_id)
     ii.status = DOMAIN_S_RUNNING;
     ii.ip = ip;
     ii.gport = -1;
-    if (db_instance_update_status(oi->tag, &ii, -1) < 0) {
+    if (db_instance_update_status(tag, &ii, -1) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    ly_entity_update(ent_id, oi->tag, LY_ENTITY_FLAG_STATUS_REGISTERED);
+    ly_clc_lock();
+    ly_entity_update(ent_id, tag, LY_ENTITY_FLAG_STATUS_REGISTERED);
+    ly_clc_unlock();
     loginfo(_("instance (tag:%d, ip:%s) registered successfully\n"),
-              oi->tag, ip);
+              tag, ip);
 
 #if 0
     /* prepare storage for the instance */
@@ -192,8 +202,8 @@ int eh_process_osm_register(char * buf, int size, int ent_id)
     return 0;
 }
 
-/* process raw auth request from osmanager */
-int eh_process_osm_auth(int is_reply, void * data, int ent_id)
+/* called with clc lock held, it's released while db is accessed */
+static int __osm_auth(int is_reply, void * data, int ent_id)
 {
     logdebug(_("%s called\n"), __func__);
 
@@ -232,7 +242,10 @@ int eh_process_osm_auth(int is_reply, void * data, int ent_id)
     /* get secret */
     if (ac->secret == NULL) {
         logdebug(_("retrieve auth key for instance %d(tag)\n"), ai->tag);
+        /* auth config is used only by the event loop owning entity */
+        ly_clc_unlock();
         ret = db_instance_find_secret(ai->tag, &ac->secret);
+        ly_clc_lock();
         if (ret < 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
@@ -253,8 +266,7 @@ int eh_process_osm_auth(int is_reply, void * data, int ent_id)
     }
 
     /* send answer back */
-    int fd = ly_entity_fd(ent_id);
-    if (ly_packet_send(fd, PKT_TYPE_OSM_AUTH_REPLY,
+    if (ly_entity_send(ent_id, PKT_TYPE_OSM_AUTH_REPLY,
                        ai, sizeof(AuthInfo)) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
@@ -271,7 +283,7 @@ int eh_process_osm_auth(int is_reply, void * data, int ent_id)
     bzero(ai->data, LUOYUN_AUTH_DATA_LEN);
     strncpy((char *)ai->data, ac->challenge, LUOYUN_AUTH_DATA_LEN);
     logdebug(_("clc sends out auth request\n"));
-    if (ly_packet_send(fd, PKT_TYPE_OSM_AUTH_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_OSM_AUTH_REQUEST,
                        ai, sizeof(AuthInfo)) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
@@ -283,3 +295,12 @@ int eh_process_osm_auth(int is_reply, void * data, int ent_id)
     return 0;
 }
 
+
+/* process raw auth request from osmanager */
+int eh_process_osm_auth(int is_reply, void * data, int ent_id)
+{
+    ly_clc_lock();
+    int ret = __osm_auth(is_reply, data, ent_id);
+    ly_clc_unlock();
+    return ret;
+}
@@ -45,15 +45,23 @@
 #include "../util/lypacket.h"
 #include "../util/lyxml.h"
 #include "../util/lyutil.h"
+#include "../util/lymetric.h"
 #include "lyclc.h"
 #include "entity.h"
 #include "lyjob.h"
 #include "events.h"
 #include "postgres.h"
+#include "worker.h"
 
 
 int g_efd = -1;
 
+/* metrics of packets from entities, see ly_epoll_init */
+static LYMetric * g_m_recv_bytes;
+static LYMetric * g_m_packets;
+static LYMetric * g_m_packet_errors;
+static LYMetric * g_m_packet_time;
+
 /* for debugging, print recv buf */
 static void __print_recv_buf(char *buf, int size)
 {
@@ -121,17 +129,25 @@ static int __epoll_work_recv(int ent_id)
         close(infd);
         return -1;
     }
+    /* spread entities across worker event loops */
+    int efd = g_efd;
+    int worker = ly_worker_next();
+    if (worker >= 0)
+        efd = ly_worker_efd(worker);
+
     struct epoll_event ev;
     ev.data.fd = id;
     ev.events = EPOLLIN;
-    ret = epoll_ctl(g_efd, EPOLL_CTL_ADD, infd, &ev);
+    ret = epoll_ctl(efd, EPOLL_CTL_ADD, infd, &ev);
     if (ret == -1) {
         logerror(_("add socket to epoll error in %s.\n"), __func__);
         ly_entity_release(id);
         /* close(infd); closed in ly_entity_release */
         return -1;
     }
-    loginfo(_("entity %d registered in epoll.\n"), id);
+    /* clc lock is held, worker can not see the entity before this */
+    ly_entity_set_worker(id, worker);
+    loginfo(_("entity %d registered in epoll(worker %d).\n"), id, worker);
 
     return 0;
 }
@@ -155,6 +171,7 @@ static int __process_web_job(char * buf, int size, int ent_id)
         return -1;
     }
     bzero(job, sizeof(LYJobInfo));
+    job_trace(job, LY_S_INITIATED, -1);
 
     job->j_id = job_id;
     if (db_job_get(job) != 0) {
@@ -163,37 +180,38 @@ static int __process_web_job(char * buf, int size, int ent_id)
         return -1;
     }
 
+    ly_clc_lock();
     if (job_exist(job)){
+        ly_clc_unlock();
         logwarn(_("job %d exists already\n"), job_id);
         free(job);
         return 0;
     }
 
     int ret = job_check(job);
-    if (ret){
-        logwarn(_("job check for job %d returns %d\n"), job_id, ret);
-        if (!JOB_IS_CANCELLED(ret))
-            ret = LY_S_CANCEL_INTERNAL_ERROR;
-        /* can not use job_remove */
-        time(&job->j_started);
-        time(&job->j_ended);
-        job->j_status = ret;
-        db_job_update_status(job);
-        free(job);
+    if (ret == 0 && job_insert(job) == 0) {
+        ly_clc_unlock();
         return 0;
     }
+    ly_clc_unlock();
 
-    if (job_insert(job) != 0) {
+    /* job is not queued, can not use job_remove */
+    int failed = ret == 0;
+    if (failed) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        time(&job->j_started);
-        time(&job->j_ended);
-        job->j_status = LY_S_CANCEL_INTERNAL_ERROR;
-        db_job_update_status(job);
-        free(job);
-        return -1;
+        ret = LY_S_CANCEL_INTERNAL_ERROR;
     }
-
-    return 0;
+    else {
+        logwarn(_("job check for job %d returns %d\n"), job_id, ret);
+        if (!JOB_IS_CANCELLED(ret))
+            ret = LY_S_CANCEL_INTERNAL_ERROR;
+    }
+    time(&job->j_started);
+    time(&job->j_ended);
+    job->j_status = ret;
+    db_job_update_status(job);
+    free(job);
+    return failed ? -1 : 0;
 }
 
 /* process echo request */
@@ -201,53 +219,52 @@ static int __process_test_echo(char * buf, int size, int ent_id)
 {
     logdebug(_("sending echo reply ...\n"));
     logdebug(_("%s\n"), buf);
-    int fd = ly_entity_fd(ent_id);
-    return ly_packet_send(fd, PKT_TYPE_TEST_ECHO_REPLY, buf, size);
+    ly_clc_lock();
+    int ret = ly_entity_send(ent_id, PKT_TYPE_TEST_ECHO_REPLY, buf, size);
+    ly_clc_unlock();
+    return ret;
 }
 
-int ly_epoll_entity_recv(int ent_id)
+static void __entity_init(int ent_id, int type)
 {
-    if (ly_entity_type(ent_id) == LY_ENTITY_CLC)
-        return __epoll_work_recv(ent_id);
-
-    int fd = ly_entity_fd(ent_id);
-    if (fd < 0) {
-        logerror(_("fd for entity %d was closed. ignore event.\n"), ent_id);
-        return 1;
-    }
-
-    LYPacketRecv *pkt = ly_entity_pkt(ent_id);
-    if (pkt == NULL)
-        return -255;
+    ly_clc_lock();
+    ly_entity_init(ent_id, type);
+    ly_clc_unlock();
+}
 
+/*
+** process received data, in the event loop owning the entity.
+** called without clc lock held, the handlers take it only around
+** entity and job state, packets are parsed and db is accessed
+** without it.
+**
+** return 1 if the entity should be released
+*/
+static int __epoll_entity_process(int ent_id, int fd, LYPacketRecv * pkt,
+                                  int len)
+{
     int size;
-    void * buf = ly_packet_buf(pkt, &size);
-    if (buf == NULL) {
-        logerror(_("ly_packet_buf returns NULL buffer. close socket\n"));
-        return 1;
-    }
-    if (size == 0) {
-        logerror(_("ly_packet_buf returns 0 size buffer. close socket\n"));
-        return 1;
-    }
+    void * buf;
 
-    int len = recv(fd, buf, size, 0);
     if (len <= 0) {
         loginfo(_("socket %d recv returns %d. close socket\n"), fd, len);
-        if (len < 0)
-            loginfo(_("socket %d recv, errno %d\n"), fd, errno);
 
+        ly_clc_lock();
         int type = ly_entity_type(ent_id);
         int db_id = ly_entity_db_id(ent_id);
         if (type == LY_ENTITY_NODE) {
             loginfo(_("remove job on node %d\n"), db_id);
             job_clean_on_entity(ent_id, LY_S_FINISHED_FAILURE_NODE_NOT_ONLINE);
+        }
+        ly_clc_unlock();
+
+        if (type == LY_ENTITY_NODE) {
             loginfo(_("update node %d status in db to offline\n"), db_id);
             db_node_update_status(DB_NODE_FIND_BY_ID, &db_id, NODE_STATUS_OFFLINE);
             return 1;
         }
 
-        if (ly_entity_type(ent_id) != LY_ENTITY_OSM)
+        if (type != LY_ENTITY_OSM)
             return 1;
 
         logdebug(_("update instance %d status in db\n"), db_id);
@@ -257,10 +274,13 @@ int ly_epoll_entity_recv(int ent_id)
         ii.gport = 0;
         ii.status = DOMAIN_S_NEED_QUERY;
         db_instance_update_status(db_id, &ii, -1);
+        ly_clc_lock();
         job_internal_query_instance(db_id);
+        ly_clc_unlock();
         return 1;
     }
     logdebug(_("socket %d recv %d bytes\n"), fd, len);
+    buf = ly_packet_buf(pkt, &size);
 
     while(1) {
         int ret = ly_packet_recv(pkt, len);
@@ -282,6 +302,7 @@ int ly_epoll_entity_recv(int ent_id)
 
         int type = ly_packet_type(pkt);
         logdebug(_("socket %d recv packet, type %d\n"), fd, type);
+        unsigned long long t = lymetric_now_us();
         /*
         if (type == PKT_TYPE_UNKNOW)
             break;
@@ -289,28 +310,28 @@ int ly_epoll_entity_recv(int ent_id)
 
         buf = ly_packet_data(pkt, &size);
         if (type == PKT_TYPE_WEB_NEW_JOB_REQUEST) {
-            ly_entity_init(ent_id, LY_ENTITY_WEB);
+            __entity_init(ent_id, LY_ENTITY_WEB);
             ret = __process_web_job(buf, size, ent_id);
             if (ret < 0)
                 logerror(_("web packet process error in %s.\n"), __func__);
         }
 	else if (type == PKT_TYPE_NODE_REGISTER_REQUEST) {
-            ly_entity_init(ent_id, LY_ENTITY_NODE);
-            ret = eh_process_node_xml(buf, ent_id);
+            __entity_init(ent_id, LY_ENTITY_NODE);
+            ret = eh_process_node_xml(buf, size, ent_id);
             if (ret < 0)
                 logerror(_("node packet process error in %s.\n"), __func__);
         }
         else if (type == PKT_TYPE_NODE_AUTH_REQUEST ||
                  type == PKT_TYPE_NODE_AUTH_REPLY) {
-            ly_entity_init(ent_id, LY_ENTITY_NODE);
+            __entity_init(ent_id, LY_ENTITY_NODE);
             ret = eh_process_node_auth(type == PKT_TYPE_NODE_AUTH_REPLY ?
-                                       1 : 0, buf, ent_id);
+                                       1 : 0, buf, size, ent_id);
             if (ret < 0)
                 logerror(_("node auth packet process error in %s.\n"), __func__);
         }
         else if (type == PKT_TYPE_OSM_AUTH_REQUEST ||
                  type == PKT_TYPE_OSM_AUTH_REPLY) {
-            ly_entity_init(ent_id, LY_ENTITY_OSM);
+            __entity_init(ent_id, LY_ENTITY_OSM);
             ret = eh_process_osm_auth(type == PKT_TYPE_OSM_AUTH_REPLY ?
                                        1 : 0, buf, ent_id);
             if (ret < 0)
@@ -323,12 +344,12 @@ int ly_epoll_entity_recv(int ent_id)
         }
 	else if (PKT_TYPE_ENTITY_GROUP_CLC(type) ||
                  PKT_TYPE_ENTITY_GROUP_NODE(type)) {
-            ret = eh_process_node_xml(buf, ent_id);
+            ret = eh_process_node_xml(buf, size, ent_id);
             if (ret < 0)
                 logerror(_("node packet process error in %s.\n"), __func__);
         }
         else if (type == PKT_TYPE_OSM_REGISTER_REQUEST) {
-            ly_entity_init(ent_id, LY_ENTITY_OSM);
+            __entity_init(ent_id, LY_ENTITY_OSM);
             ret = eh_process_osm_register(buf, size, ent_id);
             if (ret < 0)
                 logerror(_("osm packet process error in %s.\n"), __func__);
@@ -346,8 +367,11 @@ int ly_epoll_entity_recv(int ent_id)
         else {
             logerror(_("unrecognized packet type.\n"));
         }
+        lymetric_inc(g_m_packets);
+        lymetric_observe(g_m_packet_time, lymetric_now_us() - t);
 
         if (ly_packet_recv_done(pkt) < 0 || ret < 0) {
+            lymetric_inc(g_m_packet_errors);
             logerror(_("%s return error\n"), __func__);
             return -1;
         }
@@ -361,6 +385,128 @@ int ly_epoll_entity_recv(int ent_id)
     return 0;
 }
 
+int ly_epoll_entity_recv(int ent_id)
+{
+    int ret;
+
+    ly_clc_lock();
+    if (ly_entity_type(ent_id) == LY_ENTITY_CLC) {
+        ret = __epoll_work_recv(ent_id);
+        ly_clc_unlock();
+        return ret;
+    }
+
+    int fd = ly_entity_fd(ent_id);
+    LYPacketRecv *pkt = ly_entity_pkt(ent_id);
+    ly_clc_unlock();
+
+    if (fd < 0) {
+        logerror(_("fd for entity %d was closed. ignore event.\n"), ent_id);
+        return 1;
+    }
+    if (pkt == NULL)
+        return -255;
+
+    /*
+    ** only the event loop owning the entity reads the socket and
+    ** the packet buffer, no need to hold clc lock
+    */
+    int size;
+    void * buf = ly_packet_buf(pkt, &size);
+    if (buf == NULL) {
+        logerror(_("ly_packet_buf returns NULL buffer. close socket\n"));
+        return 1;
+    }
+    if (size == 0) {
+        logerror(_("ly_packet_buf returns 0 size buffer. close socket\n"));
+        return 1;
+    }
+
+    int len = recv(fd, buf, size, 0);
+    if (len < 0)
+        loginfo(_("socket %d recv, errno %d\n"), fd, errno);
+    else
+        lymetric_add(g_m_recv_bytes, len);
+
+    ret = __epoll_entity_process(ent_id, fd, pkt, len);
+    ly_clc_lock();
+    ly_epoll_send_flush();
+    ly_clc_unlock();
+    return ret;
+}
+
+/* watch entity socket for writable or not */
+static int __epoll_entity_pollout(int ent_id, int on)
+{
+    int efd = g_efd;
+    int worker = ly_entity_worker(ent_id);
+    if (worker >= 0)
+        efd = ly_worker_efd(worker);
+
+    struct epoll_event ev;
+    ev.data.fd = ent_id;
+    ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, ly_entity_fd(ent_id), &ev) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+/* send packets queued for entities, called with clc lock held */
+void ly_epoll_send_flush(void)
+{
+    int ent_id;
+    while ((ent_id = ly_entity_send_next()) >= 0) {
+        if (ly_entity_send_flush(ent_id) == 1) {
+            logdebug(_("entity %d socket full, %d bytes queued\n"),
+                       ent_id, ly_entity_send_pending(ent_id));
+            __epoll_entity_pollout(ent_id, 1);
+        }
+    }
+}
+
+/* handle epoll event of an entity, called without clc lock held */
+int ly_epoll_entity_event(int ent_id, uint32_t events)
+{
+    int ret = 0;
+    if (events & EPOLLOUT) {
+        /* socket writable again, send the rest of queue */
+        ly_clc_lock();
+        ret = ly_entity_send_flush(ent_id);
+        if (ret == 0 || ret == -1)
+            __epoll_entity_pollout(ent_id, 0);
+        ly_clc_unlock();
+        ret = 0;
+        events &= ~EPOLLOUT;
+        if (events == 0)
+            return 0;
+    }
+    if (events & EPOLLIN) {
+        ret = ly_epoll_entity_recv(ent_id);
+        if (ret < 0) {
+            logerror(_("epoll_data_recv error\n"));
+            return ret;
+        }
+        else if (ret == 0)
+            return 0;
+        loginfo(_("release entity %d\n"), ent_id);
+    }
+    else if (events & EPOLLRDHUP)
+        loginfo(_("epoll entity(%d) got rdhup. close.\n"), ent_id);
+    else if (events & EPOLLHUP)
+        loginfo(_("epoll entity(%d) got hup. close.\n"), ent_id);
+    else {
+        logerror(_("unexpected event(%d, %d). ignore.\n"), events, ent_id);
+        return 0;
+    }
+
+    ly_clc_lock();
+    ly_entity_release(ent_id);
+    ly_clc_unlock();
+    return ret;
+}
+
 /* start clc main work socket */
 int ly_epoll_work_start(int port)
 {
@@ -422,6 +568,14 @@ int ly_epoll_init(unsigned int max_events)
     if (g_efd == -1)
         return -1;
 
+    g_m_recv_bytes = lymetric_counter("ly_clc_recv_bytes_total",
+                                      "bytes received from entities");
+    g_m_packets = lymetric_counter("ly_clc_packets_total",
+                                   "packets received from entities");
+    g_m_packet_errors = lymetric_counter("ly_clc_packet_errors_total",
+                                         "packets failed processing");
+    g_m_packet_time = lymetric_histogram("ly_clc_packet_process_seconds",
+                                         "time spent processing a packet");
     return 0;
 }
 
@@ -1,6 +1,8 @@
 #ifndef __LY_INCLUDE_CLC_EVENTS_H
 #define __LY_INCLUDE_CLC_EVENTS_H
 
+#include <stdint.h>
+
 #define EPOLL_EVENTS_MAX 64
 
 extern int g_efd;
@@ -8,6 +10,12 @@ extern int g_efd;
 /* clc work socket receives connection */
 int ly_epoll_entity_recv(int ent_id);
 
+/* handle epoll event of an entity, called without clc lock held */
+int ly_epoll_entity_event(int ent_id, uint32_t events);
+
+/* send packets queued for entities, called with clc lock held */
+void ly_epoll_send_flush(void);
+
 /* start clc main work socket */
 int ly_epoll_work_start(int port);
 
@@ -22,8 +30,8 @@ int ly_epoll_close(void);
 **
 ** defined in ev_node.c
 */
-int eh_process_node_xml(char * xml, int ent_id);
-int eh_process_node_auth(int is_reply, void * data, int ent_id);
+int eh_process_node_xml(char * xml, int len, int ent_id);
+int eh_process_node_auth(int is_reply, void * data, int len, int ent_id);
 
 /*
 ** osmanager packet handler 
@@ -40,17 +40,33 @@
 #include "../util/lypacket.h"
 #include "../util/lyxml.h"
 #include "../util/lyutil.h"
+#include "../util/lymetric.h"
 #include "options.h"
 #include "entity.h"
 #include "events.h"
 #include "postgres.h"
 #include "lyjob.h"
+#include "worker.h"
+#include "timer.h"
 #include "lyclc.h"
 
 
 /* Global value */
 CLCConfig *g_c = NULL;
 
+/* set by signal handler, main loop exits */
+static volatile sig_atomic_t g_exit = 0;
+
+/* periodic mcast join request */
+static LYTimer g_mcast_timer;
+
+static void __mcast_join_timer(void * data)
+{
+    if (ly_mcast_send_join() < 0)
+        logerror(_("failed sending mcast request.\n"));
+    ly_timer_add(&g_mcast_timer, CLC_MCAST_JOIN_INTERVAL);
+}
+
 static int __print_config(CLCConfig * c)
 {
     logdebug("CLCConfig :\n"
@@ -61,7 +77,11 @@ static int __print_config(CLCConfig * c)
              "  DB info = %s,%s,%s\n"
              "  factor = %d,%d\n"
              "  vm_name_prefix = %s\n"
+             "  node select = %d, placement = %d, prefetch = %d\n"
              "  timeout = %d,%d,%d\n"
+             "  event workers = %d\n"
+             "  db pool size = %d\n"
+             "  db flush interval = %d\n"
              "  verbose = %d\n" "  debug = %d\n" "  daemon = %d\n",
              c->clc_ip, c->clc_port,
              c->clc_mcast_ip, c->clc_mcast_port,
@@ -69,7 +89,9 @@ static int __print_config(CLCConfig * c)
              c->db_name, c->db_user, c->db_pass,
              c->node_cpu_factor, c->node_mem_factor,
              c->vm_name_prefix,
+             c->node_select, c->node_placement, c->node_prefetch,
              c->job_timeout_instance, c->job_timeout_node, c->job_timeout_other,
+             c->event_workers, c->db_pool_size, c->db_flush_interval,
              c->verbose, c->debug, c->daemon);
 
     return 0;
@@ -80,7 +102,12 @@ static void __main_clean(int keeppid)
     if (g_c == NULL)
         return;
 
+    lymetric_stop();
+    ly_worker_stop();
     job_cleanup();
+    ly_timer_cleanup();
+    ly_db_cache_close();
+    ly_db_async_close();
     ly_db_close();
     ly_clc_ip_clean();
     ly_entity_store_destroy();
@@ -109,6 +136,10 @@ static void __main_clean(int keeppid)
         free(g_c->vm_name_prefix);
     if (g_c->pid_path)
         free(g_c->pid_path);
+    if (g_c->metrics_path)
+        free(g_c->metrics_path);
+    if (g_c->trace_path)
+        free(g_c->trace_path);
     lyxml_cleanup();
     logclose();
     free(g_c);
@@ -118,6 +149,11 @@ static void __main_clean(int keeppid)
 static void __sig_handler(int sig, siginfo_t * si, void *unused)
 {
     loginfo("%s was signaled to exit...\n", PROGRAM_NAME);
+    /* worker event loops must be stopped outside of signal handler */
+    if (ly_worker_num() > 0) {
+        g_exit = 1;
+        return;
+    }
     __main_clean(0);
     exit(0);
 }
@@ -209,6 +245,8 @@ int main(int argc, char *argv[])
             printf(_("Run as daemon, log to %s.\n"), c->log_path);
         lyutil_daemonize(__main_clean, keeppidfile);
         logfile(c->log_path, c->debug ? LYDEBUG : c->verbose ? LYINFO : LYWARN);
+        if (c->log_async && logasync() < 0)
+            logwarn(_("failed starting async logging\n"));
     }
     else
         logfile(NULL, c->debug ? LYDEBUG : c->verbose ? LYINFO : LYWARN);
@@ -233,6 +271,13 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* init instance status cache */
+    if (ly_db_cache_init(c->db_flush_interval) < 0) {
+        logsimple(_("ly_db_cache_init failed.\n"));
+        ret = -255;
+        goto out;
+    }
+
     /* initialize entity store */
     if (ly_entity_store_init() < 0) {
         logsimple(_("ly_entity_init failed.\n"));
@@ -270,18 +315,37 @@ int main(int argc, char *argv[])
         goto out;
     }
 
+    /* async db connections are registered in epoll */
+    if (ly_db_async_init(c->db_pool_size) != 0) {
+        logsimple(_("ly_db_async_init failed.\n"));
+        ret = -255;
+        goto out;
+    }
+
     if (ly_epoll_work_start(g_c->clc_port) != 0) {
         ret = -1;
         logsimple(_("ly_epoll_init failed.\n"));
         goto out;
     }
 
-    /* init timeout values */
-    time_t mcast_join_time, job_dispatch_time, job_internal_time;
-    mcast_join_time = 0;
-    time(&job_dispatch_time);
-    job_internal_time = job_dispatch_time + (CLC_MCAST_JOIN_INTERVAL<<1);
-    job_dispatch_time = job_dispatch_time + (CLC_MCAST_JOIN_INTERVAL<<2);
+    /* start worker event loops */
+    if (ly_worker_start(c->event_workers) != 0) {
+        ret = -1;
+        logsimple(_("ly_worker_start failed.\n"));
+        goto out;
+    }
+
+    /* clc runs without metrics if they can't be served */
+    if (lymetric_serve(c->metrics_path) < 0)
+        logwarn(_("metrics are not served on %s\n"), c->metrics_path);
+
+    /* send mcast request right now */
+    ly_timer_init(&g_mcast_timer, __mcast_join_timer, NULL);
+    if (ly_timer_add(&g_mcast_timer, 0) != 0) {
+        ret = -1;
+        logsimple(_("ly_timer_add failed.\n"));
+        goto out;
+    }
 
     /* start main event driven loop */
     if (c->clc_ip)
@@ -289,69 +353,41 @@ int main(int argc, char *argv[])
     else
         loginfo(_("clc uses IP automatically detected\n"));
     loginfo(_("start event loop, waiting for events ...\n"));
-    int i, n = 0;
+    int i, n = 0, timeout;
     struct epoll_event events[EPOLL_EVENTS_MAX];
-    while (1) {
+    while (!g_exit) {
         time_t time_now;
         time(&time_now);
 
-        /* send mcast request */
-        if (time_now - mcast_join_time > CLC_MCAST_JOIN_INTERVAL) {
-            if (ly_mcast_send_join() < 0)
-                logerror(_("failed sending mcast request.\n"));
-            mcast_join_time = time_now;
-        }
-        else if (time_now < mcast_join_time)
-            mcast_join_time = time_now;
-
-        /* job dispatch */
-        if (time_now - job_dispatch_time > CLC_JOB_DISPATCH_INTERVAL) {
-            if (job_dispatch() < 0)
-                logerror(_("job_dispatch failed.\n"));
-            job_dispatch_time = time_now;
-        }
-        else if (time_now < job_dispatch_time)
-            job_dispatch_time = time_now;
-
-        /* internal job dispatch */
-        if (time_now - job_internal_time > CLC_JOB_INTERNAL_INTERVAL) {
-            if (job_internal_dispatch() < 0)
-                logerror(_("job_internal failed.\n"));
-            job_internal_time = time_now;
-        }
-        else if (time_now < job_internal_time)
-            job_internal_time = time_now;
+        /* write instance status cached, guarded by db lock */
+        if (ly_db_cache_timer(time_now) < 0)
+            logerror(_("ly_db_cache_timer failed.\n"));
+
+        ly_clc_lock();
+
+        /* mcast request, jobs and internal jobs that are due */
+        ly_timer_run();
+
+        /* packets queued by timers and event handlers */
+        ly_epoll_send_flush();
+
+        /* sleep until the next timer */
+        timeout = ly_timer_wait(CLC_EPOLL_TIMEOUT);
+
+        ly_clc_unlock();
 
-        n = epoll_wait(g_efd, events, EPOLL_EVENTS_MAX,
-                       CLC_EPOLL_TIMEOUT);
+        n = epoll_wait(g_efd, events, EPOLL_EVENTS_MAX, timeout);
         if (n != 0)
             logdebug(_("waiting ... got %d events\n"), n);
         for (i = 0; i < n; i++) {
             int id = events[i].data.fd;
-            if (events[i].events & EPOLLIN) {
-                ret = ly_epoll_entity_recv(id);
-                if (ret < 0) {
-                    logerror(_("epoll_data_recv error\n"));
-                }
-                else if (ret > 0) {
-                    loginfo(_("release entity %d\n"), id);
-                    ly_entity_release(id);
-                }
-            }
-            else if (events[i].events & EPOLLRDHUP) {
-                loginfo(_("epoll entity(%d) got rdhup. close.\n"), id);
-                ly_entity_release(id);
-            }
-            else if (events[i].events & EPOLLHUP) {
-                loginfo(_("epoll entity(%d) got hup. close.\n"), id);
-                ly_entity_release(id);
-            }
-            else {
-                logerror(_("unexpected event(%d, %d). ignore.\n"),
-                         events[i].events, id);
-            }
+            if (DB_IS_EPOLL_ID(id))
+                ly_db_async_event(id, events[i].events);
+            else
+                ly_epoll_entity_event(id, events[i].events);
         }
     }
+    ret = 0;
 
 out:
     __main_clean(keeppidfile);
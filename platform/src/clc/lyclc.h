@@ -8,9 +8,19 @@
 #define CLC_JOB_DISPATCH_INTERVAL 2
 #define CLC_JOB_INTERNAL_INTERVAL 60
 
+/* jobs wait for nodes to join after clc starts */
+#define CLC_JOB_DISPATCH_DELAY ((CLC_MCAST_JOIN_INTERVAL<<2) + \
+                                CLC_JOB_DISPATCH_INTERVAL)
+#define CLC_JOB_INTERNAL_DELAY ((CLC_MCAST_JOIN_INTERVAL<<1) + \
+                                CLC_JOB_INTERNAL_INTERVAL)
+
 #define CLC_SOCKET_KEEPALIVE_INTVL  10
 #define CLC_SOCKET_KEEPALIVE_PROBES 3
 
+/* data queued for sending to an entity, in bytes */
+#define CLC_ENTITY_SENDQ_BUSY	(64 << 10) /* periodic queries skipped */
+#define CLC_ENTITY_SENDQ_MAX	(4 << 20)  /* new packets refused */
+
 /* functions defined in mcast.c */
 int ly_mcast_send_join(void);
 int ly_clc_ip_get(void);
@@ -38,15 +38,147 @@
 #include "../util/logging.h"
 #include "../util/lyxml.h"
 #include "../util/list.h"
+#include "../util/lymetric.h"
 #include "postgres.h"
 #include "entity.h"
 #include "node.h"
 #include "lyclc.h"
 #include "lyjob.h"
+#include "worker.h"
+
+/* initial number of hash buckets, must be power of 2 */
+#define LY_JOB_HASH_SIZE 1024
 
 static LIST_HEAD(g_job_list);
 static unsigned int g_job_count = 0;
 static unsigned int g_job_ins_pending_nr = 0;
+static time_t g_job_pending_time = 0;
+static time_t g_job_dispatch_time = 0; /* no job runs before it */
+
+/* metrics of jobs, see job_init */
+#define JOB_STATE_NUM 7
+static const char * g_job_state_name[JOB_STATE_NUM] = {
+    "pending", "running", "waiting", "finished", "timeout", "cancelled",
+    "other"
+};
+static LYMetric * g_m_job_state[JOB_STATE_NUM];
+static LYMetric * g_m_jobs;
+static LYMetric * g_m_job_time;
+
+/* phases of job trace, named by the status starting them */
+static const struct {
+    int status;
+    const char * name;
+} g_job_phase[] = {
+    { LY_S_INITIATED, "received" },
+    { LY_S_RUNNING, "dispatching" },
+    { LY_S_RUNNING_SEARCHING_NODE, "searching_node" },
+    { LY_S_RUNNING_SENT_TO_NODE, "sent_to_node" },
+    { LY_S_RUNNING_WAITING, "waiting" },
+    { LY_S_RUNNING_DOWNLOADING_APP, "downloading_app" },
+    { LY_S_RUNNING_CHECKING_APP, "checking_app" },
+    { LY_S_RUNNING_EXTRACTING_APP, "extracting_app" },
+    { LY_S_RUNNING_MOUNTING_IMAGE, "mounting_image" },
+    { LY_S_RUNNING_PREPARING_IMAGE, "preparing_image" },
+    { LY_S_RUNNING_UNMOUNTING_IMAGE, "unmounting_image" },
+    { LY_S_RUNNING_PROCESSING, "processing" },
+    { LY_S_RUNNING_STARTING_INSTANCE, "starting_instance" },
+    { LY_S_RUNNING_STOPPING, "stopping" },
+    { LY_S_RUNNING_STOPPED, "stopped" },
+    { LY_S_WAITING_STARTING_OSM, "starting_osm" },
+    { LY_S_WAITING_SYCING_OSM, "syncing_osm" },
+    { LY_S_WAITING_STARTING_SERVICE, "starting_service" },
+    { LY_S_PENDING_NODE_STROKE, "node_stroke" },
+};
+#define JOB_PHASE_NUM (sizeof(g_job_phase) / sizeof(g_job_phase[0]))
+static LYMetric * g_m_job_phase[JOB_PHASE_NUM];
+
+/* hash indexes of g_job_list */
+static struct list_head *g_job_id_hash = NULL;
+static struct list_head *g_job_target_hash = NULL;
+static struct list_head *g_job_ent_hash = NULL;
+static unsigned int g_job_hash_size = 0;
+
+static inline unsigned int __hash_int(int v)
+{
+    return ((unsigned int)v * 2654435761U) & (g_job_hash_size - 1);
+}
+
+static inline unsigned int __hash_target(int type, int id)
+{
+    unsigned int h = (unsigned int)id * 2654435761U;
+    return (h ^ (unsigned int)type) & (g_job_hash_size - 1);
+}
+
+/* jobs on the same target as job are in the returned list */
+static inline struct list_head * __job_target_head(LYJobInfo * job)
+{
+    return &g_job_target_hash[__hash_target(job->j_target_type,
+                                            job->j_target_id)];
+}
+
+static void __job_hash_add(LYJobInfo * job)
+{
+    list_add_tail(&job->j_id_hash, &g_job_id_hash[__hash_int(job->j_id)]);
+    list_add_tail(&job->j_target_hash, __job_target_head(job));
+    list_add_tail(&job->j_ent_hash,
+                  &g_job_ent_hash[__hash_int(job->j_ent_id)]);
+}
+
+static void __job_hash_del(LYJobInfo * job)
+{
+    list_del(&job->j_id_hash);
+    list_del(&job->j_target_hash);
+    list_del(&job->j_ent_hash);
+}
+
+static struct list_head * __hash_alloc(unsigned int size)
+{
+    struct list_head * h = malloc(size * sizeof(struct list_head));
+    if (h == NULL)
+        return NULL;
+    unsigned int i;
+    for (i = 0; i < size; i++)
+        INIT_LIST_HEAD(h + i);
+    return h;
+}
+
+static void __job_hash_free(void)
+{
+    free(g_job_id_hash);
+    free(g_job_target_hash);
+    free(g_job_ent_hash);
+    g_job_id_hash = NULL;
+    g_job_target_hash = NULL;
+    g_job_ent_hash = NULL;
+    g_job_hash_size = 0;
+}
+
+/* allocate hash buckets and index all the jobs in queue */
+static int __job_hash_init(unsigned int size)
+{
+    struct list_head * id_hash = __hash_alloc(size);
+    struct list_head * target_hash = __hash_alloc(size);
+    struct list_head * ent_hash = __hash_alloc(size);
+    if (id_hash == NULL || target_hash == NULL || ent_hash == NULL) {
+        free(id_hash);
+        free(target_hash);
+        free(ent_hash);
+        return -1;
+    }
+
+    __job_hash_free();
+    g_job_id_hash = id_hash;
+    g_job_target_hash = target_hash;
+    g_job_ent_hash = ent_hash;
+    g_job_hash_size = size;
+
+    /* jobs are indexed in queue order, so hash lists keep the order */
+    LYJobInfo *curr;
+    list_for_each_entry(curr, &(g_job_list), j_list)
+        __job_hash_add(curr);
+    return 0;
+}
 
 void job_print_queue()
 {
@@ -69,8 +201,12 @@ int job_exist(LYJobInfo * job)
     if (job == NULL)
         return 0;
 
+    if (g_job_hash_size == 0)
+        return 0;
+
     LYJobInfo *curr;
-    list_for_each_entry(curr, &(g_job_list), j_list) {
+    list_for_each_entry(curr, &g_job_id_hash[__hash_int(job->j_id)],
+                        j_id_hash) {
         if (job->j_id == curr->j_id)
             return 1;
     }
@@ -87,10 +223,15 @@ int job_check(LYJobInfo * job)
         job->j_action == LY_A_OSM_QUERY)
         return 0;
 
+    if (g_job_hash_size == 0)
+        return 0;
+
     LYJobInfo *curr;
     LYJobInfo *safe;
+    /* only jobs on the same target are checked */
+    struct list_head * head = __job_target_head(job);
     /* if instance is being destroyed, don't do anything */
-    list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+    list_for_each_entry_safe(curr, safe, head, j_target_hash) {
     if (curr->j_target_type == job->j_target_type &&
         curr->j_target_id == job->j_target_id &&
         curr->j_action == LY_A_NODE_DESTROY_INSTANCE)
@@ -99,7 +240,7 @@ int job_check(LYJobInfo * job)
 
     if (job->j_action == LY_A_CLC_ENABLE_NODE ||
         job->j_action == LY_A_CLC_DISABLE_NODE) {
-        list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+        list_for_each_entry_safe(curr, safe, head, j_target_hash) {
             if (curr->j_target_type == job->j_target_type &&
                 curr->j_target_id == job->j_target_id &&
                 (curr->j_action == LY_A_CLC_ENABLE_NODE ||
@@ -110,7 +251,7 @@ int job_check(LYJobInfo * job)
         }
     }
     else if (job->j_action == LY_A_NODE_RUN_INSTANCE) {
-        list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+        list_for_each_entry_safe(curr, safe, head, j_target_hash) {
             if (curr->j_target_type == job->j_target_type && 
                 curr->j_target_id == job->j_target_id && 
                 curr->j_action != LY_A_NODE_QUERY_INSTANCE)
@@ -119,7 +260,7 @@ int job_check(LYJobInfo * job)
         }
     }
     else if (job->j_action == LY_A_NODE_FULLREBOOT_INSTANCE) {
-        list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+        list_for_each_entry_safe(curr, safe, head, j_target_hash) {
             if (curr->j_target_type == job->j_target_type &&
                 curr->j_target_id == job->j_target_id &&
                 curr->j_action == job->j_action)
@@ -128,7 +269,7 @@ int job_check(LYJobInfo * job)
         }
     }
     else if (job->j_action == LY_A_NODE_DESTROY_INSTANCE) {
-        list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+        list_for_each_entry_safe(curr, safe, head, j_target_hash) {
             if (curr->j_target_type == job->j_target_type &&
                 curr->j_target_id == job->j_target_id) {
                 if (curr->j_action == job->j_action)
@@ -142,7 +283,7 @@ int job_check(LYJobInfo * job)
     }
     else if (job->j_target_type == JOB_TARGET_INSTANCE) {
         /* for all other control action agaist instance */
-        list_for_each_entry_safe(curr, safe, &(g_job_list), j_list) {
+        list_for_each_entry_safe(curr, safe, head, j_target_hash) {
             if (curr->j_target_type == job->j_target_type &&
                 curr->j_target_id == job->j_target_id) {
                 if (curr->j_action == LY_A_NODE_QUERY_INSTANCE)
@@ -164,25 +305,105 @@ int job_check(LYJobInfo * job)
 
 LYJobInfo * job_find(int id)
 {
+    if (g_job_hash_size == 0)
+        return NULL;
+
     LYJobInfo *curr;
-    list_for_each_entry(curr, &(g_job_list), j_list) {
+    list_for_each_entry(curr, &g_job_id_hash[__hash_int(id)], j_id_hash) {
         if (curr->j_id == id)
             return curr;
     }
     return NULL;
 }
 
+static void __job_wakeup(void * data);
+
+static void __job_timer_add(LYJobInfo * job, time_t now, int delay)
+{
+    if (now + delay < g_job_dispatch_time)
+        delay = g_job_dispatch_time - now;
+    if (ly_timer_add(&job->j_timer, delay) < 0)
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+}
+
+static int __job_timeout(LYJobInfo * job)
+{
+    if (job->j_target_type == JOB_TARGET_INSTANCE)
+        return g_c->job_timeout_instance;
+    else if (job->j_target_type == JOB_TARGET_NODE)
+        return g_c->job_timeout_node;
+    else
+        return g_c->job_timeout_other;
+}
+
+/* 
+** schedule the next wake-up of job according to its status,
+** running jobs wake up at timeout, pending jobs are retried after
+** two dispatch intervals, others are checked each dispatch interval
+*/
+static void __job_schedule(LYJobInfo * job, time_t now)
+{
+    int delay = CLC_JOB_DISPATCH_INTERVAL, max;
+    if (JOB_IS_PENDING(job->j_status)) {
+        max = (CLC_JOB_DISPATCH_INTERVAL<<1) + 1;
+        delay = job->j_last_run + max - now;
+    }
+    else if (JOB_IS_RUNNING(job->j_status)) {
+        max = __job_timeout(job) + 1;
+        delay = job->j_started + max - now;
+    }
+    else
+        max = delay;
+
+    /* in case system time goes back */
+    if (delay > max)
+        delay = max;
+    __job_timer_add(job, now, delay);
+}
+
 int job_insert(LYJobInfo * job)
 {
     if (job == NULL)
         return -1;
 
+    /* run as soon as possible */
+    ly_timer_init(&job->j_timer, __job_wakeup, job);
+    time_t now;
+    time(&now);
+    __job_timer_add(job, now, 0);
+    if (!ly_timer_pending(&job->j_timer))
+        return -1;
+
     list_add_tail(&(job->j_list), &(g_job_list));
     job->j_pending_nr = -1;
     g_job_count++;
+    lymetric_set(g_m_jobs, g_job_count);
+
+    /* keep hash load factor under 1 */
+    if (g_job_count > g_job_hash_size) {
+        if (__job_hash_init(g_job_hash_size ? g_job_hash_size << 1 :
+                                              LY_JOB_HASH_SIZE) < 0) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            ly_timer_del(&job->j_timer);
+            list_del(&job->j_list);
+            g_job_count--;
+            lymetric_set(g_m_jobs, g_job_count);
+            return -1;
+        }
+    }
+    else
+        __job_hash_add(job);
     return 0;
 }
 
+/* job must be in the queue */
+void job_set_entity(LYJobInfo * job, int ent_id)
+{
+    job->j_ent_id = ent_id;
+    list_del(&job->j_ent_hash);
+    list_add_tail(&job->j_ent_hash, &g_job_ent_hash[__hash_int(ent_id)]);
+}
+
 static int job_busy_remove(LYJobInfo * job)
 {
     if (job == NULL)
@@ -205,17 +426,187 @@ int job_remove(LYJobInfo * job)
         return -1;
 
     job_busy_remove(job);
+    ly_timer_del(&job->j_timer);
+    __job_hash_del(job);
     list_del(&job->j_list);
     g_job_count--;
+    lymetric_set(g_m_jobs, g_job_count);
     free(job);
     return 0;
 }
 
+static int __job_state(int status)
+{
+    if (JOB_IS_PENDING(status))
+        return 0;
+    if (JOB_IS_RUNNING(status))
+        return 1;
+    if (JOB_IS_WAITING(status))
+        return 2;
+    if (JOB_IS_FINISHED(status))
+        return 3;
+    if (JOB_IS_TIMEOUT(status))
+        return 4;
+    if (JOB_IS_CANCELLED(status))
+        return 5;
+    return 6;
+}
+
+static int __job_phase(int status)
+{
+    int i;
+    for (i = 0; i < JOB_PHASE_NUM; i++) {
+        if (g_job_phase[i].status == status)
+            return i;
+    }
+    return -1;
+}
+
+/*
+** start a span of job trace. node_ms is from response of node, -1 if
+** status is not reported by node. status reported again is not a new
+** span. when trace is full, the last span is replaced.
+*/
+void job_trace(LYJobInfo * job, int status, int node_ms)
+{
+    unsigned long long now = lymetric_now_us();
+    if (job->j_received == 0)
+        job->j_received = now;
+
+    LYJobTrace * t;
+    if (job->j_trace_nr > 0) {
+        t = &job->j_trace[job->j_trace_nr - 1];
+        if (t->status == status) {
+            if (t->node_ms < 0)
+                t->node_ms = node_ms;
+            return;
+        }
+        if (job->j_trace_nr == LY_JOB_TRACE_MAX)
+            job->j_trace_nr--;
+    }
+    t = &job->j_trace[job->j_trace_nr++];
+    t->status = status;
+    t->clc_ms = (now - job->j_received) / 1000;
+    t->node_ms = node_ms;
+}
+
+/*
+** trace file is kept open and flushed by timer, so ending a job doesn't
+** touch the disk. it's rotated by size the same way log file is.
+*/
+static FILE * g_trace_fp = NULL;
+static long long g_trace_size = 0;
+static LYTimer g_trace_timer;
+
+static void __job_trace_flush(void * data)
+{
+    if (g_trace_fp)
+        fflush(g_trace_fp);
+}
+
+static void __job_trace_rotate(void)
+{
+    char old[PATH_MAX], new[PATH_MAX];
+    int i;
+    for (i = 4; i >= 0; i--) {
+        if (snprintf(old, PATH_MAX, "%s.%d", g_c->trace_path, i) >= PATH_MAX ||
+            snprintf(new, PATH_MAX, "%s.%d", g_c->trace_path, i + 1) >= PATH_MAX) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return;
+        }
+        rename(old, new);
+    }
+    snprintf(new, PATH_MAX, "%s.0", g_c->trace_path);
+    rename(g_c->trace_path, new);
+}
+
+static FILE * __job_trace_open(void)
+{
+    if (g_trace_fp && g_trace_size <= MAXLOGFILESIZE)
+        return g_trace_fp;
+
+    if (g_trace_fp) {
+        fclose(g_trace_fp);
+        g_trace_fp = NULL;
+        __job_trace_rotate();
+    }
+    else
+        ly_timer_init(&g_trace_timer, __job_trace_flush, NULL);
+
+    g_trace_fp = fopen(g_c->trace_path, "a");
+    if (g_trace_fp == NULL) {
+        logerror(_("can not open %s\n"), g_c->trace_path);
+        return NULL;
+    }
+    struct stat st;
+    g_trace_size = fstat(fileno(g_trace_fp), &st) ? 0 : st.st_size;
+    return g_trace_fp;
+}
+
+static void __job_trace_close(void)
+{
+    if (g_trace_fp == NULL)
+        return;
+    ly_timer_del(&g_trace_timer);
+    fclose(g_trace_fp);
+    g_trace_fp = NULL;
+}
+
+/*
+** time spent in each phase of ended job, appended to trace file.
+** phases between two node responses are timed by node, so network
+** delay and clock of node don't count.
+*/
+static void __job_trace_done(LYJobInfo * job)
+{
+    LYJobTrace * t = job->j_trace;
+    int i, n = job->j_trace_nr;
+    if (n == 0)
+        return;
+
+    char buf[LY_JOB_TRACE_MAX * 32 + 128];
+    int len = snprintf(buf, sizeof(buf),
+                       "job %d action %d target %d node %d status %d "
+                       "total %.3f", job->j_id, job->j_action,
+                       job->j_target_id, ly_entity_db_id(job->j_ent_id),
+                       job->j_status, t[n - 1].clc_ms / 1000.0);
+    for (i = 0; i < n - 1 && len < sizeof(buf); i++) {
+        unsigned int ms = t[i + 1].clc_ms - t[i].clc_ms;
+        if (t[i].node_ms >= 0 && t[i + 1].node_ms >= t[i].node_ms)
+            ms = t[i + 1].node_ms - t[i].node_ms;
+        int p = __job_phase(t[i].status);
+        if (p < 0) {
+            len += snprintf(buf + len, sizeof(buf) - len, " s%d %.3f",
+                            t[i].status, ms / 1000.0);
+            continue;
+        }
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %.3f",
+                        g_job_phase[p].name, ms / 1000.0);
+        if (job->j_action == LY_A_NODE_RUN_INSTANCE)
+            lymetric_observe(g_m_job_phase[p], ms * 1000ULL);
+    }
+    logdebug(_("trace: %s\n"), buf);
+
+    if (g_c->trace_path == NULL)
+        return;
+    FILE * fp = __job_trace_open();
+    if (fp == NULL)
+        return;
+    len = fprintf(fp, "%s\n", buf);
+    if (len > 0)
+        g_trace_size += len;
+    if (!ly_timer_pending(&g_trace_timer))
+        ly_timer_add(&g_trace_timer, 1);
+}
+
 int job_update_status(LYJobInfo * job, int status)
 {
     if (JOB_IS_INITIATED(status))
         return 0;
 
+    lymetric_inc(g_m_job_state[__job_state(status)]);
+    job_trace(job, status, -1);
+
     job->j_status = status;
 
     if (JOB_IS_STARTED(status))
@@ -223,8 +614,16 @@ int job_update_status(LYJobInfo * job, int status)
 
     if (JOB_IS_FINISHED(status) ||
         JOB_IS_TIMEOUT(status) ||
-        JOB_IS_CANCELLED(status))
+        JOB_IS_CANCELLED(status)) {
         time(&job->j_ended);
+        if (job->j_started > 0 && job->j_ended >= job->j_started)
+            lymetric_observe(g_m_job_time,
+                             (job->j_ended - job->j_started) * 1000000ULL);
+        __job_trace_done(job);
+    }
+
+    /* finished jobs are removed from the queue with their timer */
+    __job_schedule(job, time(NULL));
 
     if (db_job_update_status(job) < 0) {
         logerror(_("db error %s(%d)\n"), __func__, __LINE__);
@@ -380,7 +779,15 @@ static int __job_start_instance(LYJobInfo * job)
     bzero(&ci, sizeof(NodeCtrlInstance));
     ci.req_id = job->j_id;
     ci.ins_id = job->j_target_id;
-    if (db_node_instance_control_get(&ci, &node_id) < 0) {
+    /*
+    ** run by timer with clc lock held, workers are not stalled while
+    ** the instance is read from db. the job is not sent to any entity
+    ** yet, it is not updated by others meanwhile.
+    */
+    ly_clc_unlock();
+    int ret = db_node_instance_control_get(&ci, &node_id);
+    ly_clc_lock();
+    if (ret < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
@@ -388,7 +795,8 @@ static int __job_start_instance(LYJobInfo * job)
     ci.req_action = job->j_action;
     ci.reply = LUOYUN_REQUEST_REPLY_RESULT | LUOYUN_REQUEST_REPLY_STATUS;
 
-    int ent_id = node_schedule(node_id);
+    job_trace(job, LY_S_RUNNING_SEARCHING_NODE, -1);
+    int ent_id = node_schedule(node_id, &ci);
     if (ent_id == NODE_SCHEDULE_NODE_BUSY) {
         if (node_id)
             logwarn(_("failed to run instance %d. node %d busy!\n"), ci.ins_id, node_id);
@@ -434,7 +842,7 @@ static int __job_start_instance(LYJobInfo * job)
         goto failed;
     }
 
-    job->j_ent_id = ent_id;
+    job_set_entity(job, ent_id);
     node_id = ly_entity_db_id(ent_id);
     loginfo(_("run instance %d on node %d entity %d\n"),
                ci.ins_id, node_id, ent_id);
@@ -446,7 +854,6 @@ static int __job_start_instance(LYJobInfo * job)
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
-    NodeInfo * nf = &nd->node;
 
     if (ci.ins_status == DOMAIN_S_NEW || ci.osm_secret == NULL) {
         if (ci.osm_secret)
@@ -467,28 +874,30 @@ static int __job_start_instance(LYJobInfo * job)
         goto failed;
     }
 
-    char *xml = lyxml_data_instance_run(&ci, NULL, 0);
+    int len;
+    char *xml = lyxml_msg_instance_run(node_proto(ent_id), &ci, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
 
     logdebug(_("sending instance control request ...\n"));
-    int len = strlen(xml);
-    if (ly_packet_send(ly_entity_fd(ent_id),
-                       PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST,
                        xml, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         free(xml);
         goto failed;
     }
+    job_trace(job, LY_S_RUNNING_SENT_TO_NODE, -1);
 
     /* update the number of instance start jobs */
     nd->ins_job_busy_nr++;
  
     /* temprarily hold the resource, recovered automatically in case of failure */
-    nf->cpu_commit += ci.ins_vcpu;
-    nf->mem_commit += ci.ins_mem;
+    node_commit(ent_id, &ci);
+
+    /* other nodes get popular appliance ready in advance */
+    node_prefetch(&ci);
 
     free(xml);
     luoyun_node_ctrl_instance_cleanup(&ci);
@@ -519,7 +928,15 @@ static int __job_control_instance_simple(LYJobInfo * job)
     bzero(&ci, sizeof(NodeCtrlInstance));
     ci.req_id = job->j_id;
     ci.ins_id = job->j_target_id;
-    if (db_node_instance_control_get(&ci, &node_id) < 0) {
+    /*
+    ** run by timer with clc lock held, workers are not stalled while
+    ** the instance is read from db. the job is not sent to any entity
+    ** yet, it is not updated by others meanwhile.
+    */
+    ly_clc_unlock();
+    int ret = db_node_instance_control_get(&ci, &node_id);
+    ly_clc_lock();
+    if (ret < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
@@ -572,17 +989,16 @@ static int __job_control_instance_simple(LYJobInfo * job)
                    ci.ins_id, node_id);
         goto failed;
     }
-    job->j_ent_id = ent_id;
+    job_set_entity(job, ent_id);
 
-    char *xml = lyxml_data_instance_other(&ci, NULL, 0);
+    int len;
+    char *xml = lyxml_msg_instance_other(node_proto(ent_id), &ci, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
     logdebug(_("sending instance control request ...\n"));
-    int len = strlen(xml);
-    if (ly_packet_send(ly_entity_fd(ent_id),
-                       PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST,
                        xml, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         free(xml);
@@ -624,18 +1040,17 @@ static int __job_query_node(LYJobInfo * job)
         job_update_status(job, JOB_S_FINISHED);
         return 0;
     }
-    job->j_ent_id = ent_id;
+    job_set_entity(job, ent_id);
 
-    char *xml = lyxml_data_node_info(job->j_id, NULL, 0);
+    int len;
+    char *xml = lyxml_msg_node_info(node_proto(ent_id), job->j_id, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         goto failed;
     }
 
     logdebug(_("sending node query request ...\n"));
-    int len = strlen(xml);
-    if (ly_packet_send(ly_entity_fd(ent_id),
-                       PKT_TYPE_CLC_NODE_CONTROL_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_NODE_CONTROL_REQUEST,
                        xml, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         free(xml);
@@ -670,8 +1085,7 @@ int __job_node_enable(LYJobInfo * job)
         return -1;
     }
 
-    int fd = ly_entity_fd(ent_id);
-    if (ly_packet_send(fd, PKT_TYPE_JOIN_REQUEST, "join", 4) < 0) {
+    if (ly_entity_send(ent_id, PKT_TYPE_JOIN_REQUEST, "join", 4) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         job_update_status(job, JOB_S_FAILED);
         return -1;
@@ -735,6 +1149,7 @@ int __job_node_config(LYJobInfo * job)
         nf->cpu_vlimit = db_nf.cpu_vlimit;
         nf->mem_vlimit = db_nf.mem_vlimit;
         loginfo(_("node config: %d %d\n"), nf->cpu_vlimit, nf->mem_vlimit);
+        node_update(ent_id);
         goto done;
     }
     else {
@@ -777,10 +1192,9 @@ static int __job_query_osm(LYJobInfo * job)
         job_update_status(job, JOB_S_FINISHED);
         return 0;
     }
-    job->j_ent_id = ent_id;
+    job_set_entity(job, ent_id);
 
-    int fd = ly_entity_fd(ent_id);
-    if (ly_packet_send(fd, PKT_TYPE_CLC_OSM_QUERY_REQUEST,
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_OSM_QUERY_REQUEST,
                        &job->j_id, sizeof(job->j_id)) < 0) {
         printf("error in %s(%d)\n", __func__, __LINE__);
         job_update_status(job, JOB_S_FAILED);
@@ -855,56 +1269,76 @@ static int __job_run(LYJobInfo * job)
     return 0;
 }
 
-int job_dispatch(void)
+/* job timer callback, run the job or check whether it's timed out */
+static void __job_wakeup(void * data)
 {
-    int timeout;
+    LYJobInfo * job = data;
     time_t now;
-    now = time(&now);
-    g_job_ins_pending_nr = 0;
+    time(&now);
 
-    LYJobInfo *job;
-    LYJobInfo *safe;
-    list_for_each_entry_safe(job, safe, &(g_job_list), j_list) {
-        if (JOB_IS_INITIATED(job->j_status)) {
-            time(&job->j_last_run);
-            __job_run(job);
-        }
-        else if (JOB_IS_RUNNING(job->j_status) ||
-                 JOB_IS_WAITING(job->j_status) ||
-                 JOB_IS_PENDING(job->j_status)) {
-            if (job->j_target_type == JOB_TARGET_INSTANCE)
-                timeout = g_c->job_timeout_instance;
-            else if (job->j_target_type == JOB_TARGET_NODE)
-                timeout = g_c->job_timeout_node;
-            else
-                timeout = g_c->job_timeout_other;
-            if (JOB_IS_PENDING(job->j_status)) {
-                if ((now - job->j_last_run) > (CLC_JOB_DISPATCH_INTERVAL)<<1) {
-                    /* interval of checking pending jobs needs further research */
-                    time(&job->j_last_run);
-                    __job_run(job);
-                }
-            }
-            else if ((now - job->j_started) > timeout) {
-                logwarn(_("job %d timed out\n"), job->j_id);
-                job_update_status(job, JOB_S_TIMEOUT);
-            }
-            else if (JOB_IS_WAITING(job->j_status))
+    /* pending jobs are numbered in each dispatch interval */
+    if (now - g_job_pending_time >= CLC_JOB_DISPATCH_INTERVAL ||
+        now < g_job_pending_time) {
+        g_job_ins_pending_nr = 0;
+        g_job_pending_time = now;
+    }
+
+    /* job may be removed by __job_run, schedule the next wake-up first */
+    __job_schedule(job, now);
+
+    if (JOB_IS_INITIATED(job->j_status)) {
+        time(&job->j_last_run);
+        __job_run(job);
+    }
+    else if (JOB_IS_RUNNING(job->j_status) ||
+             JOB_IS_WAITING(job->j_status) ||
+             JOB_IS_PENDING(job->j_status)) {
+        if (JOB_IS_PENDING(job->j_status)) {
+            if ((now - job->j_last_run) > (CLC_JOB_DISPATCH_INTERVAL)<<1) {
+                /* interval of checking pending jobs needs further research */
+                time(&job->j_last_run);
                 __job_run(job);
+            }
         }
-        else {
-            logerror(_("in %s, job %d in unexpected status(%d)\n"),
-                        __func__, job->j_id, job->j_status);
-            /* user intervention is required */
-            job_update_status(job, JOB_S_UNKNOWN);
+        else if ((now - job->j_started) > __job_timeout(job)) {
+            logwarn(_("job %d timed out\n"), job->j_id);
+            job_update_status(job, JOB_S_TIMEOUT);
         }
+        else if (JOB_IS_WAITING(job->j_status))
+            __job_run(job);
+    }
+    else {
+        logerror(_("in %s, job %d in unexpected status(%d)\n"),
+                    __func__, job->j_id, job->j_status);
+        /* user intervention is required */
+        job_update_status(job, JOB_S_UNKNOWN);
     }
-    return 0;
 }
 
 int job_init(void)
 {
+    int i;
+    char name[LYMETRIC_NAME_MAX];
+    for (i = 0; i < JOB_STATE_NUM; i++) {
+        snprintf(name, sizeof(name), "ly_clc_job_status_total{state=\"%s\"}",
+                 g_job_state_name[i]);
+        g_m_job_state[i] = lymetric_counter(name, "job status changes");
+    }
+    g_m_jobs = lymetric_gauge("ly_clc_jobs", "jobs in queue");
+    g_m_job_time = lymetric_histogram("ly_clc_job_seconds",
+                                      "time from job start to its end");
+    for (i = 0; i < JOB_PHASE_NUM; i++) {
+        snprintf(name, sizeof(name),
+                 "ly_clc_job_phase_seconds{phase=\"%s\"}",
+                 g_job_phase[i].name);
+        g_m_job_phase[i] = lymetric_histogram(name,
+                                   "time spent in each phase of instance start");
+    }
+
     INIT_LIST_HEAD(&g_job_list);
+    g_job_dispatch_time = time(NULL) + CLC_JOB_DISPATCH_DELAY;
+    if (__job_hash_init(LY_JOB_HASH_SIZE) < 0)
+        return -1;
 
     int ret = db_job_get_all();
     if (ret < 0) {
@@ -913,6 +1347,7 @@ int job_init(void)
     }
 
     g_job_count = (unsigned int) ret;
+    lymetric_set(g_m_jobs, g_job_count);
 
     /* init instance status in db */
     db_instance_init_status();
@@ -925,7 +1360,10 @@ void job_clean_on_entity(int ent_id, int job_status)
 {
     LYJobInfo *job;
     LYJobInfo *tmp;
-    list_for_each_entry_safe(job, tmp, &(g_job_list), j_list) {
+    if (g_job_hash_size == 0)
+        return;
+    list_for_each_entry_safe(job, tmp, &g_job_ent_hash[__hash_int(ent_id)],
+                             j_ent_hash) {
         if (job->j_ent_id == ent_id) {
             loginfo(_("removing job %d\n"), job->j_id);
             job_update_status(job, job_status);
@@ -940,8 +1378,12 @@ void job_cleanup(void)
     LYJobInfo *tmp;
     list_for_each_entry_safe(job, tmp, &(g_job_list), j_list) {
         loginfo(_("deleting job %d\n"), job->j_id);
+        ly_timer_del(&job->j_timer);
         list_del(&(job->j_list));
         free(job);
     }
+    g_job_count = 0;
+    __job_hash_free();
+    __job_trace_close();
     return;
 }
@@ -2,9 +2,25 @@
 #define __LY_INCLUDE_CLC_JOB_H
 
 #include "../util/list.h"
+#include "timer.h"
+
+/*
+** trace of a job, one span per status it goes through, see job_trace.
+** phases on node are timed by node from the request with the job id.
+*/
+#define LY_JOB_TRACE_MAX 24
+
+typedef struct LYJobTrace_t {
+    int status;
+    unsigned int clc_ms;      /* ms since job received by clc */
+    int node_ms;              /* ms since request received by node, or -1 */
+} LYJobTrace;
 
 typedef struct LYJobInfo_t {
     struct list_head j_list;
+    struct list_head j_id_hash;     /* indexed by j_id */
+    struct list_head j_target_hash; /* by j_target_type and j_target_id */
+    struct list_head j_ent_hash;    /* by j_ent_id */
 
      int j_id;                 /* id in database */
      int j_status;       /* status of this job */
@@ -21,6 +37,12 @@ typedef struct LYJobInfo_t {
 
      int j_ent_id;             /* job process entity */
      int j_pending_nr;         /* > 0: the job pending number, 0: being processed, -1: not busy */
+
+     LYTimer j_timer;          /* next run or timeout check of the job */
+
+     unsigned long long j_received; /* in us, see lymetric_now_us */
+     int j_trace_nr;
+     LYJobTrace j_trace[LY_JOB_TRACE_MAX];
 } LYJobInfo;
 
 void job_print_queue();
@@ -29,8 +51,9 @@ int job_check(LYJobInfo * job);
 LYJobInfo * job_find(int id);
 int job_insert(LYJobInfo * job);
 int job_remove(LYJobInfo * job);
+void job_set_entity(LYJobInfo * job, int ent_id);
 int job_update_status(LYJobInfo * job, int status);
-int job_dispatch(void);
+void job_trace(LYJobInfo * job, int status, int node_ms);
 int job_init(void);
 void job_clean_on_entity(int ent_id, int job_status);
 void job_cleanup(void);
@@ -42,7 +65,6 @@ void job_cleanup(void);
 #define CLC_JOB_CLEANUP_NODE_INTERVAL     86400
 #define CLC_JOB_QUERY_INSTANCE_INTERVAL   120
 int job_internal_query_instance(int id);
-int job_internal_dispatch(void);
 int job_internal_init(void);
 
 #endif
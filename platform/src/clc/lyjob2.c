@@ -38,9 +38,9 @@
 #include "lyclc.h"
 #include "lyjob.h"
 
-static time_t g_job_time_query_node = 0;
-static time_t g_job_time_cleanup_node = 0;
-static time_t g_job_time_query_instance = 0;
+static LYTimer g_job_timer_query_node;
+static LYTimer g_job_timer_cleanup_node;
+static LYTimer g_job_timer_query_instance;
 
 int job_internal_query_instance(int id)
 {
@@ -55,9 +55,9 @@ int job_internal_query_instance(int id)
     if (ent_id < 0 || !ly_entity_is_registered(ent_id))
         return -1;
 
-    int fd = ly_entity_fd(ent_id);
-    if (fd < 0)
-        return -1;
+    /* previous queries are not sent yet */
+    if (ly_entity_send_pending(ent_id) > CLC_ENTITY_SENDQ_BUSY)
+        return 0;
 
     char ins_domain[21];
     if (g_c->vm_name_prefix == NULL)
@@ -70,15 +70,15 @@ int job_internal_query_instance(int id)
     ii.req_action = LY_A_NODE_QUERY_INSTANCE;
     ii.ins_id = id;
     ii.ins_domain = ins_domain;
-    char * xml = lyxml_data_instance_other(&ii, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_instance_other(node_proto(ent_id), &ii, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
     logdebug(_("sending query request to instance %d\n"), id);
-    int len = strlen(xml);
-    if (ly_packet_send(fd, PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST, xml, len) < 0) {
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST, xml, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         free(xml);
         return -1;
@@ -108,19 +108,18 @@ static int __query_node(int ent_id)
     if (ent_id < 0 || !ly_entity_is_registered(ent_id))
         return -1;
 
-    int fd = ly_entity_fd(ent_id);
-    if (fd < 0)
-        return -1;
+    if (ly_entity_send_pending(ent_id) > CLC_ENTITY_SENDQ_BUSY)
+        return 0;
 
-    char * xml = lyxml_data_node_info(0, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_node_info(node_proto(ent_id), 0, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
     logdebug(_("sending node query to entity %d...\n"), ent_id);
-    int len = strlen(xml);
-    if (ly_packet_send(fd, PKT_TYPE_CLC_NODE_CONTROL_REQUEST, xml, len) < 0) {
+    if (ly_entity_send(ent_id, PKT_TYPE_CLC_NODE_CONTROL_REQUEST, xml, len) < 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         free(xml);
         return -1;
@@ -167,42 +166,38 @@ static void __cleanup_node_all(void)
     return;
 }
 
-int job_internal_dispatch(void)
+static void __query_node_timer(void * data)
 {
-    time_t now;
-    time(&now);
-
-    if (now - g_job_time_query_node > CLC_JOB_QUERY_NODE_INTERVAL) {
-        __query_node_all();
-        g_job_time_query_node = now;
-    }
-    else if (now < g_job_time_query_node)
-        g_job_time_query_node = now;
-
-    if (now - g_job_time_cleanup_node > CLC_JOB_CLEANUP_NODE_INTERVAL) {
-        __cleanup_node_all();
-        g_job_time_cleanup_node = now;
-    }
-    else if (now < g_job_time_cleanup_node)
-        g_job_time_cleanup_node = now;
+    __query_node_all();
+    ly_timer_add(&g_job_timer_query_node, CLC_JOB_QUERY_NODE_INTERVAL);
+}
 
-    if (now - g_job_time_query_instance > CLC_JOB_QUERY_INSTANCE_INTERVAL) {
-        __query_instance_all();
-        g_job_time_query_instance = now;
-    }
-    else if (now < g_job_time_query_instance)
-        g_job_time_query_instance = now;
+static void __cleanup_node_timer(void * data)
+{
+    __cleanup_node_all();
+    ly_timer_add(&g_job_timer_cleanup_node, CLC_JOB_CLEANUP_NODE_INTERVAL);
+}
 
-    return 0;
+static void __query_instance_timer(void * data)
+{
+    __query_instance_all();
+    ly_timer_add(&g_job_timer_query_instance,
+                 CLC_JOB_QUERY_INSTANCE_INTERVAL);
 }
 
 int job_internal_init(void)
 {
-    time(&g_job_time_cleanup_node);
-    g_job_time_query_node = g_job_time_cleanup_node -
-                            CLC_JOB_QUERY_NODE_INTERVAL;
-    g_job_time_query_instance = g_job_time_cleanup_node -
-                                CLC_JOB_QUERY_INSTANCE_INTERVAL;
+    ly_timer_init(&g_job_timer_query_node, __query_node_timer, NULL);
+    ly_timer_init(&g_job_timer_cleanup_node, __cleanup_node_timer, NULL);
+    ly_timer_init(&g_job_timer_query_instance, __query_instance_timer, NULL);
+
+    /* nodes and instances are queried once nodes have joined */
+    if (ly_timer_add(&g_job_timer_query_node, CLC_JOB_INTERNAL_DELAY) < 0 ||
+        ly_timer_add(&g_job_timer_cleanup_node,
+                     CLC_JOB_CLEANUP_NODE_INTERVAL) < 0 ||
+        ly_timer_add(&g_job_timer_query_instance,
+                     CLC_JOB_INTERNAL_DELAY) < 0)
+        return -1;
 
     return 0;
 }
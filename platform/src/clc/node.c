@@ -27,14 +27,297 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "../luoyun/luoyun.h"
 #include "../util/logging.h"
+#include "../util/lyxml.h"
 #include "lyclc.h"
 #include "entity.h"
 #include "node.h"
 
-int node_schedule(int node_id)
+/* number of hash buckets for appliance locality, must be power of 2 */
+#define NODE_APP_HASH_SIZE	256
+
+/* appliance runs counted before it's prefetched, counts halved regularly */
+#define NODE_APP_POPULAR	3
+#define NODE_APP_DECAY		256
+
+/* nodes the instance doesn't fit in are the last choice */
+#define NODE_SCORE_NOFIT	(1LL << 40)
+
+/* on numa nodes, instance not fitting in one cell is placed elsewhere first */
+#define NODE_SCORE_NOCELL	(1LL << 32)
+
+/*
+** placement indexes, ordered by key then entity id. by free memory for
+** fitting the instance, by headroom for spreading instances out, by
+** utilization for packing them.
+*/
+static LYNodeData ** g_node_index[NODE_INDEX_NUM];
+static int g_node_index_size = 0;
+static int g_node_num = 0;
+/* limits of nodes indexed, not reverted when nodes are removed */
+static int g_node_mem_max = 0;
+static int g_node_cpu_max = 0;
+static int g_node_mem_min = 0;
+static int g_node_cpu_min = 0;
+
+/* appliance cache slots of all nodes, indexed by app_id */
+static struct list_head * g_node_app_hash = NULL;
+
+/* appliance run counts, one slot per bucket, popular ones stay */
+typedef struct LYNodeAppHot_t {
+    int app_id;
+    int runs;
+} LYNodeAppHot;
+static LYNodeAppHot g_node_app_hot[NODE_APP_HASH_SIZE];
+static int g_node_app_runs = 0;
+
+/* placement in progress */
+typedef struct LYNodePlace_t {
+    NodeCtrlInstance * ci;
+    int strategy;
+    int ret;                    /* NODE_SCHEDULE_NODE_* if none found */
+    LYNodeData * best;
+    long long score;
+    int bound;                  /* index walked down with score bound */
+    long long slack;            /* score is at most key of bound + slack */
+} LYNodePlace;
+
+static inline long long __node_mem_avail(LYNodeData * nd)
+{
+    return (long long)nd->node.mem_vlimit - nd->node.mem_commit;
+}
+
+static inline unsigned int __hash_app(int app_id)
+{
+    return ((unsigned int)app_id * 2654435761U) & (NODE_APP_HASH_SIZE - 1);
+}
+
+/* instance fits in a numa cell of node, as placed by node */
+static inline int __node_cell_fit(NodeInfo * nf, NodeCtrlInstance * ci)
+{
+    return ci->ins_vcpu <= nf->numa_cell_cpus &&
+           ci->ins_mem <= nf->numa_mem_free;
+}
+
+/*
+** higher score is better. memory/cpu/storage headroom after placement
+** and load per cpu are in per mille.
+*/
+static long long __node_score(LYNodeData * nd, NodeCtrlInstance * ci,
+                              int strategy)
+{
+    NodeInfo * nf = &nd->node;
+    long long mem = __node_mem_avail(nd) - ci->ins_mem;
+    long long cpu = (long long)nf->cpu_vlimit - nf->cpu_commit - ci->ins_vcpu;
+    long long mem_room = nf->mem_vlimit ? mem * 1000 / nf->mem_vlimit : 0;
+    long long cpu_room = nf->cpu_vlimit ? cpu * 1000 / nf->cpu_vlimit : 0;
+    long long disk_room = nf->storage_total ?
+                          (long long)nf->storage_free * 1000 /
+                          nf->storage_total : 0;
+    /* load average is reported multiplied by 100 */
+    long long load = nf->cpu_max ?
+                     (long long)nf->load_average * 10 / nf->cpu_max : 0;
+
+    long long score;
+    if (strategy == NODE_PLACEMENT_BESTFIT)
+        /* least memory left */
+        score = -mem;
+    else if (strategy == NODE_PLACEMENT_BINPACK)
+        /* most utilized */
+        score = -(mem_room + cpu_room);
+    else
+        /* most headroom, least loaded */
+        score = mem_room + cpu_room + disk_room / 2 - load;
+
+    if (mem < 0 || cpu < 0)
+        score -= NODE_SCORE_NOFIT;
+    else if (nf->numa_cells > 1 && !__node_cell_fit(nf, ci))
+        score -= NODE_SCORE_NOCELL;
+    return score;
+}
+
+/* first position of node not ordered before (key, ent_id) in index i */
+static int __node_index_lower(int i, long long key, int ent_id)
+{
+    LYNodeData ** index = g_node_index[i];
+    int lo = 0, hi = g_node_num;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        LYNodeData * nd = index[mid];
+        if (nd->index_key[i] < key ||
+            (nd->index_key[i] == key && nd->ent_id < ent_id))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void __node_index_del(LYNodeData * nd)
+{
+    int i;
+    for (i = 0; i < NODE_INDEX_NUM; i++) {
+        LYNodeData ** index = g_node_index[i];
+        int pos = __node_index_lower(i, nd->index_key[i], nd->ent_id);
+        memmove(index + pos, index + pos + 1,
+                (g_node_num - pos - 1) * sizeof(LYNodeData *));
+    }
+    g_node_num--;
+    nd->indexed = 0;
+}
+
+static void __node_index_key(LYNodeData * nd, long long key[])
+{
+    static NodeCtrlInstance empty;
+    key[NODE_INDEX_MEM] = __node_mem_avail(nd);
+    key[NODE_INDEX_ROOM] = __node_score(nd, &empty, NODE_PLACEMENT_SPREAD);
+    key[NODE_INDEX_PACK] = __node_score(nd, &empty, NODE_PLACEMENT_BINPACK);
+}
+
+/* index must have room for the node */
+static void __node_index_add(LYNodeData * nd)
+{
+    __node_index_key(nd, nd->index_key);
+    int i;
+    for (i = 0; i < NODE_INDEX_NUM; i++) {
+        LYNodeData ** index = g_node_index[i];
+        int pos = __node_index_lower(i, nd->index_key[i], nd->ent_id);
+        memmove(index + pos + 1, index + pos,
+                (g_node_num - pos) * sizeof(LYNodeData *));
+        index[pos] = nd;
+    }
+    g_node_num++;
+    nd->indexed = 1;
+}
+
+/* move node to its positions after its resource changes */
+static void __node_index_fix(LYNodeData * nd)
+{
+    long long key[NODE_INDEX_NUM];
+    __node_index_key(nd, key);
+    if (!memcmp(key, nd->index_key, sizeof(key)))
+        return;
+    __node_index_del(nd);
+    __node_index_add(nd);
+}
+
+static int __node_app_cached(LYNodeData * nd, int app_id)
+{
+    int i;
+    for (i = 0; i < NODE_APP_CACHE_NR; i++) {
+        if (nd->app_cache[i].app_id == app_id)
+            return 1;
+    }
+    return 0;
+}
+
+/* remember appliance on node, replacing the oldest one */
+static void __node_app_add(LYNodeData * nd, int app_id)
+{
+    if (g_node_app_hash == NULL || __node_app_cached(nd, app_id))
+        return;
+
+    LYNodeApp * app = &nd->app_cache[nd->app_cache_next];
+    nd->app_cache_next = (nd->app_cache_next + 1) % NODE_APP_CACHE_NR;
+    if (app->app_id)
+        list_del(&app->hash);
+    app->app_id = app_id;
+    app->nd = nd;
+    list_add(&app->hash, &g_node_app_hash[__hash_app(app_id)]);
+}
+
+/*
+** consider node for the placement, p->ret is updated with the reason
+** if it can't be used. return 1 if the node is eligible.
+*/
+static int __node_try(LYNodePlace * p, LYNodeData * nd)
+{
+    int ent_id = nd->ent_id;
+    if (!ly_entity_is_registered(ent_id) || !ly_entity_is_enabled(ent_id))
+        return 0;
+
+    if (p->ret == NODE_SCHEDULE_NODE_UNAVAIL)
+        p->ret = NODE_SCHEDULE_NODE_BUSY;
+
+    NodeInfo * nf = &nd->node;
+    /* no logging here, thousands of nodes may be walked through */
+    if (nf->storage_free <= g_c->node_storage_low)
+        return 0;
+
+    if (nf->status == NODE_STATUS_BUSY || nf->status == NODE_STATUS_ERROR ||
+        nf->cpu_commit >= nf->cpu_vlimit || nf->mem_commit >= nf->mem_vlimit)
+        return 0;
+
+    if (nd->ins_job_busy_nr >= g_c->node_ins_job_busy_limit) {
+        if (p->ret == NODE_SCHEDULE_NODE_BUSY)
+            p->ret = NODE_SCHEDULE_NODE_STROKE;
+        return 0;
+    }
+
+    /* least free memory first for binpack, whatever order of walk */
+    long long score = __node_score(nd, p->ci, p->strategy);
+    if (p->best == NULL || score > p->score ||
+        (score == p->score && p->strategy == NODE_PLACEMENT_BINPACK &&
+         __node_mem_avail(nd) < __node_mem_avail(p->best))) {
+        p->best = nd;
+        p->score = score;
+    }
+    return 1;
+}
+
+/*
+** score of instance on a node differs from the key of node in index
+** p->bound, the score of an empty instance, by its share of the node.
+** the share is bounded by that of the largest or smallest node, 2 is
+** added for rounding of each part.
+*/
+static void __node_bound(LYNodePlace * p)
+{
+    NodeCtrlInstance * ci = p->ci;
+    p->bound = -1;
+    if (g_node_mem_min <= 0 || g_node_cpu_min <= 0)
+        return;
+    if (p->strategy == NODE_PLACEMENT_BINPACK) {
+        /* share of node is taken off headroom, adding to utilization */
+        p->bound = NODE_INDEX_PACK;
+        p->slack = (long long)ci->ins_mem * 1000 / g_node_mem_min +
+                   (long long)ci->ins_vcpu * 1000 / g_node_cpu_min + 4;
+    }
+    else if (p->strategy != NODE_PLACEMENT_BESTFIT) {
+        p->bound = NODE_INDEX_ROOM;
+        p->slack = 4 - (long long)ci->ins_mem * 1000 / g_node_mem_max -
+                   (long long)ci->ins_vcpu * 1000 / g_node_cpu_max;
+        if (p->slack > 0)
+            p->slack = 0;
+    }
+}
+
+/*
+** walk placement index i from pos in direction dir, eligible nodes are
+** scored. for bestfit walking up, score only drops with free memory,
+** so the first node the instance fits in without penalty is the best.
+** walking down the index with score bound, the walk stops once no node
+** left can beat the best.
+*/
+static void __node_walk(LYNodePlace * p, int i, int pos, int dir)
+{
+    LYNodeData ** index = g_node_index[i];
+    int first = p->strategy == NODE_PLACEMENT_BESTFIT && dir > 0;
+    int bound = i == p->bound && dir < 0;
+    for (; pos >= 0 && pos < g_node_num; pos += dir) {
+        if (bound && p->best &&
+            index[pos]->index_key[i] + p->slack < p->score)
+            break;
+        if (__node_try(p, index[pos]) && first &&
+            p->score > -(NODE_SCORE_NOCELL >> 1))
+            break;
+    }
+}
+
+int node_schedule(int node_id, NodeCtrlInstance * ci)
 {
     if (g_c->node_select == NODE_SELECT_LAST_ONLY && node_id > 0) {
         int ent_id = ly_entity_find_by_db(LY_ENTITY_NODE, node_id);
@@ -66,48 +349,230 @@ int node_schedule(int node_id)
         return ent_id;
     }
 
-    int ent_curr = -1;
-    int ent_id = NODE_SCHEDULE_NODE_UNAVAIL;
-    int mem_avail_max = 0;
-    while(1) {
-        LYNodeData * nd = ly_entity_data_next(LY_ENTITY_NODE, &ent_curr);
-        if (nd == NULL)
-            break;
-        if (!ly_entity_is_registered(ent_curr) ||
-            !ly_entity_is_enabled(ent_curr))
-            continue;
+    LYNodePlace p;
+    p.ci = ci;
+    p.strategy = g_c->node_placement;
+    p.ret = NODE_SCHEDULE_NODE_UNAVAIL;
+    p.best = NULL;
+    p.score = 0;
+    __node_bound(&p);
 
-        if (ent_id == NODE_SCHEDULE_NODE_UNAVAIL)
-            ent_id = NODE_SCHEDULE_NODE_BUSY;
+    /* nodes that ran the appliance recently */
+    if (p.strategy == NODE_PLACEMENT_LOCALITY && ci->app_id > 0 &&
+        g_node_app_hash) {
+        LYNodeApp * app;
+        list_for_each_entry(app, &g_node_app_hash[__hash_app(ci->app_id)],
+                            hash) {
+            if (app->app_id == ci->app_id)
+                __node_try(&p, app->nd);
+        }
+        /* don't overcommit for locality */
+        if (p.best && p.score < -(NODE_SCORE_NOFIT >> 1))
+            p.best = NULL;
+    }
 
-        NodeInfo * nf = &nd->node;
-        if (nf->storage_free <= g_c->node_storage_low) {
-            logwarn(_("node %d storage is low.\n"), ly_entity_db_id(ent_curr));
-            continue;
+    if (p.best == NULL) {
+        if (p.strategy == NODE_PLACEMENT_BESTFIT) {
+            /* least free memory the instance fits in first */
+            int lower = __node_index_lower(NODE_INDEX_MEM, ci->ins_mem, -1);
+            __node_walk(&p, NODE_INDEX_MEM, lower, 1);
+            if (p.best == NULL)
+                __node_walk(&p, NODE_INDEX_MEM, lower - 1, -1);
         }
+        else if (p.strategy == NODE_PLACEMENT_BINPACK)
+            /* most utilized first */
+            __node_walk(&p, NODE_INDEX_PACK, g_node_num - 1, -1);
+        else
+            /* most headroom first */
+            __node_walk(&p, NODE_INDEX_ROOM, g_node_num - 1, -1);
+    }
+
+    if (p.best)
+        return p.best->ent_id;
+    return p.ret;
+}
 
-        logdebug("%s:%d %d %d %d\n", __func__,
-                  nf->cpu_commit, nf->cpu_vlimit,
-                  nf->mem_commit, nf->mem_vlimit);
+int node_update(int ent_id)
+{
+    if (ly_entity_type(ent_id) != LY_ENTITY_NODE)
+        return -1;
+    LYNodeData * nd = ly_entity_data(ent_id);
+    if (nd == NULL)
+        return -1;
 
-        if (nf->cpu_commit >= nf->cpu_vlimit || nf->mem_commit >= nf->mem_vlimit) {
-            logwarn(_("node %d is busy.\n"), ly_entity_db_id(ent_curr));
-            continue;
+    if (g_node_app_hash == NULL) {
+        g_node_app_hash = malloc(NODE_APP_HASH_SIZE * sizeof(struct list_head));
+        if (g_node_app_hash == NULL) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
         }
+        int i;
+        for (i = 0; i < NODE_APP_HASH_SIZE; i++)
+            INIT_LIST_HEAD(g_node_app_hash + i);
+    }
 
-        if (nd->ins_job_busy_nr >= g_c->node_ins_job_busy_limit) {
-            if (ent_id == NODE_SCHEDULE_NODE_BUSY)
-                ent_id = NODE_SCHEDULE_NODE_STROKE;
-            logwarn(_("node %d is stroking.\n"), ly_entity_db_id(ent_curr));
-            continue;
+    if (nd->node.mem_vlimit > g_node_mem_max)
+        g_node_mem_max = nd->node.mem_vlimit;
+    if (nd->node.cpu_vlimit > g_node_cpu_max)
+        g_node_cpu_max = nd->node.cpu_vlimit;
+    if (nd->node.mem_vlimit > 0 &&
+        (g_node_mem_min == 0 || nd->node.mem_vlimit < g_node_mem_min))
+        g_node_mem_min = nd->node.mem_vlimit;
+    if (nd->node.cpu_vlimit > 0 &&
+        (g_node_cpu_min == 0 || nd->node.cpu_vlimit < g_node_cpu_min))
+        g_node_cpu_min = nd->node.cpu_vlimit;
+
+    if (!nd->indexed) {
+        if (g_node_num >= g_node_index_size) {
+            int i, size = g_node_index_size ? g_node_index_size << 1 : 64;
+            for (i = 0; i < NODE_INDEX_NUM; i++) {
+                LYNodeData ** index = realloc(g_node_index[i],
+                                              size * sizeof(LYNodeData *));
+                if (index == NULL) {
+                    logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+                    return -1;
+                }
+                g_node_index[i] = index;
+            }
+            g_node_index_size = size;
         }
+        nd->ent_id = ent_id;
+        __node_index_add(nd);
+    }
+    else
+        __node_index_fix(nd);
+    return 0;
+}
 
-        int mem_avail = nf->mem_vlimit - nf->mem_commit;
-        if (mem_avail > mem_avail_max) {
-            mem_avail_max = mem_avail;
-            ent_id = ent_curr;
+void node_remove(LYNodeData * nd)
+{
+    int i;
+    for (i = 0; i < NODE_APP_CACHE_NR; i++) {
+        if (nd->app_cache[i].app_id) {
+            list_del(&nd->app_cache[i].hash);
+            nd->app_cache[i].app_id = 0;
         }
     }
-    return ent_id;
+
+    if (nd->indexed)
+        __node_index_del(nd);
+}
+
+int node_proto(int ent_id)
+{
+    if (ly_entity_type(ent_id) != LY_ENTITY_NODE)
+        return LUOYUN_PROTO_XML;
+    LYNodeData * nd = ly_entity_data(ent_id);
+    if (nd == NULL)
+        return LUOYUN_PROTO_XML;
+    return nd->proto;
+}
+
+void node_commit(int ent_id, NodeCtrlInstance * ci)
+{
+    LYNodeData * nd = ly_entity_data(ent_id);
+    if (nd == NULL)
+        return;
+
+    NodeInfo * nf = &nd->node;
+    nf->cpu_commit += ci->ins_vcpu;
+    nf->mem_commit += ci->ins_mem;
+    /* most likely in the most free cell, until node reports again */
+    if (nf->numa_cells > 1 && __node_cell_fit(nf, ci))
+        nf->numa_mem_free -= ci->ins_mem;
+    if (nd->indexed)
+        __node_index_fix(nd);
+
+    if (ci->app_id > 0)
+        __node_app_add(nd, ci->app_id);
 }
 
+/* count appliance run, return number of recent runs */
+static int __node_app_hot(int app_id)
+{
+    int i;
+    if (++g_node_app_runs >= NODE_APP_DECAY) {
+        for (i = 0; i < NODE_APP_HASH_SIZE; i++)
+            g_node_app_hot[i].runs >>= 1;
+        g_node_app_runs = 0;
+    }
+
+    LYNodeAppHot * h = &g_node_app_hot[__hash_app(app_id)];
+    if (h->app_id != app_id) {
+        /* slot taken by another appliance, replaced when it cools down */
+        if (h->runs > 0) {
+            h->runs--;
+            return 0;
+        }
+        h->app_id = app_id;
+    }
+    return ++h->runs;
+}
+
+int node_prefetch(NodeCtrlInstance * ci)
+{
+    if (g_c->node_prefetch <= 0 || ci->app_id <= 0 ||
+        ci->app_checksum == NULL || g_node_app_hash == NULL)
+        return 0;
+
+    int runs = __node_app_hot(ci->app_id);
+    if (runs == 0 || runs % NODE_APP_POPULAR)
+        return 0;
+
+    /* nodes with most free memory are likely chosen next */
+    char * xml[2] = { NULL, NULL };    /* xml and binary */
+    int len[2];
+    int i, num = 0;
+    for (i = g_node_num - 1; i >= 0 && num < g_c->node_prefetch; i--) {
+        LYNodeData * nd = g_node_index[NODE_INDEX_MEM][i];
+        NodeInfo * nf = &nd->node;
+        int ent_id = nd->ent_id;
+        if (!nd->appcache ||
+            !ly_entity_is_registered(ent_id) ||
+            !ly_entity_is_enabled(ent_id) ||
+            nf->status == NODE_STATUS_BUSY ||
+            nf->status == NODE_STATUS_ERROR ||
+            nf->storage_free <= g_c->node_storage_low ||
+            nf->mem_commit >= nf->mem_vlimit ||
+            __node_app_cached(nd, ci->app_id))
+            continue;
+        int bin = nd->proto & LUOYUN_PROTO_BIN ? 1 : 0;
+        if (xml[bin] == NULL) {
+            xml[bin] = lyxml_msg_appliance_prefetch(nd->proto, ci, &len[bin]);
+            if (xml[bin] == NULL) {
+                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+                num = -1;
+                break;
+            }
+        }
+        if (ly_entity_send(ent_id, PKT_TYPE_CLC_INSTANCE_CONTROL_REQUEST,
+                           xml[bin], len[bin]) < 0)
+            continue;
+        __node_app_add(nd, ci->app_id);
+        num++;
+    }
+    free(xml[0]);
+    free(xml[1]);
+    if (num > 0)
+        loginfo(_("appliance %d prefetched to %d nodes\n"), ci->app_id, num);
+    return num;
+}
+
+void node_cleanup(void)
+{
+    int i;
+    for (i = 0; i < NODE_INDEX_NUM; i++) {
+        free(g_node_index[i]);
+        g_node_index[i] = NULL;
+    }
+    g_node_index_size = 0;
+    g_node_num = 0;
+    g_node_mem_max = 0;
+    g_node_cpu_max = 0;
+    g_node_mem_min = 0;
+    g_node_cpu_min = 0;
+    free(g_node_app_hash);
+    g_node_app_hash = NULL;
+    bzero(g_node_app_hot, sizeof(g_node_app_hot));
+    g_node_app_runs = 0;
+}
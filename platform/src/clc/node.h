@@ -1,16 +1,62 @@
 #ifndef __LY_INCLUDE_CLC_NODE_H
 #define __LY_INCLUDE_CLC_NODE_H
 
+#include "../util/list.h"
 #include "lyclc.h"
 
+/* appliances recently run on the node, likely cached there */
+#define NODE_APP_CACHE_NR	8
+
+typedef struct LYNodeApp_t {
+    struct list_head hash;      /* indexed by app_id */
+    int app_id;                 /* 0: slot not used */
+    struct LYNodeData_t * nd;   /* node owning the slot */
+} LYNodeApp;
+
+/* placement indexes */
+#define NODE_INDEX_MEM		0	/* free memory */
+#define NODE_INDEX_ROOM		1	/* headroom, empty instance spread score */
+#define NODE_INDEX_PACK		2	/* utilization, binpack score of it */
+#define NODE_INDEX_NUM		3
+
 typedef struct LYNodeData_t {
     int ins_job_busy_nr;
     NodeInfo node;
+    int ent_id;                 /* entity of the node */
+    int indexed;                /* in placement indexes */
+    long long index_key[NODE_INDEX_NUM];    /* keys when indexed */
+    LYNodeApp app_cache[NODE_APP_CACHE_NR];
+    int app_cache_next;
+    int proto;                  /* wire format agreed, LUOYUN_PROTO_* */
+    int appcache;               /* appcache reported, prefetch supported */
 } LYNodeData;
 
 #define NODE_SCHEDULE_NODE_STROKE       -3
 #define NODE_SCHEDULE_NODE_BUSY         -2
 #define NODE_SCHEDULE_NODE_UNAVAIL      -1
-int node_schedule(int node_id);
+int node_schedule(int node_id, NodeCtrlInstance * ci);
+
+/*
+** placement indexes, nodes ordered by free memory, headroom and
+** utilization.
+** node_update must be called whenever node resource info changes,
+** node_remove before node data is freed.
+*/
+int node_update(int ent_id);
+void node_remove(LYNodeData * nd);
+
+/* wire format of packet data sent to node */
+int node_proto(int ent_id);
+
+/* hold resource for instance placed on node, remember its appliance */
+void node_commit(int ent_id, NodeCtrlInstance * ci);
+
+/*
+** count appliance run, when it's getting popular, send it to a few
+** nodes not having it, return number of nodes it's sent to
+*/
+int node_prefetch(NodeCtrlInstance * ci);
+
+void node_cleanup(void);
 
 #endif
@@ -261,6 +261,10 @@ static int __parse_config(CLCConfig * c)
                             0, ini_config) ||
         __parse_oneitem_str("LYCLC_PID_PATH", &c->pid_path,
                             0, ini_config) ||
+        __parse_oneitem_str("LYCLC_METRICS_PATH", &c->metrics_path,
+                            0, ini_config) ||
+        __parse_oneitem_str("LYCLC_TRACE_PATH", &c->trace_path,
+                            0, ini_config) ||
         __parse_oneitem_int("LYCLC_NODE_CPU_FACTOR", &c->node_cpu_factor,
                             ini_config) ||
         __parse_oneitem_int("LYCLC_NODE_MEM_FACTOR", &c->node_mem_factor,
@@ -271,11 +275,21 @@ static int __parse_config(CLCConfig * c)
                             ini_config) ||
         __parse_oneitem_int("LYCLC_NODE_SELECT", &c->node_select,
                             ini_config) ||
+        __parse_oneitem_int("LYCLC_NODE_PLACEMENT", &c->node_placement,
+                            ini_config) ||
+        __parse_oneitem_int("LYCLC_NODE_PREFETCH", &c->node_prefetch,
+                            ini_config) ||
         __parse_oneitem_int("LYCLC_JOB_TIMEOUT_INSTANCE", &c->job_timeout_instance,
                             ini_config) ||
         __parse_oneitem_int("LYCLC_JOB_TIMEOUT_NODE", &c->job_timeout_node,
                             ini_config) ||
         __parse_oneitem_int("LYCLC_JOB_INSTANCE_BUSY_LIMIT", &c->node_ins_job_busy_limit,
+                            ini_config) ||
+        __parse_oneitem_int("LYCLC_EVENT_WORKERS", &c->event_workers,
+                            ini_config) ||
+        __parse_oneitem_int("LYCLC_DB_POOL_SIZE", &c->db_pool_size,
+                            ini_config) ||
+        __parse_oneitem_int("LYCLC_DB_FLUSH_INTERVAL", &c->db_flush_interval,
                             ini_config))
         return CLC_CONFIG_RET_ERR_CONF;
 
@@ -294,6 +308,16 @@ static int __parse_config(CLCConfig * c)
         if (__parse_oneitem_int("LYCLC_DEBUG", &c->debug, ini_config))
             return CLC_CONFIG_RET_ERR_CONF;
     }
+    if (c->log_async == UNDEFINED_CFG_INT) {
+        if (__parse_oneitem_int("LYCLC_LOG_ASYNC", &c->log_async, ini_config))
+            return CLC_CONFIG_RET_ERR_CONF;
+        if (c->log_async != UNDEFINED_CFG_INT &&
+            c->log_async != 0 && c->log_async != 1) {
+            logsimple(_("invalid value for LYCLC_LOG_ASYNC %d\n"),
+                        c->log_async);
+            return CLC_CONFIG_RET_ERR_CONF;
+        }
+    }
     if (c->log_path == NULL) {
         if (__parse_oneitem_str
             ("LYCLC_LOG_PATH", &c->log_path, 0, ini_config))
@@ -408,11 +432,14 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
     bzero(c, sizeof(CLCConfig));
     c->verbose = UNDEFINED_CFG_INT;
     c->daemon = UNDEFINED_CFG_INT;
+    c->log_async = UNDEFINED_CFG_INT;
     c->debug = UNDEFINED_CFG_INT;
     c->conf_path = NULL;
     c->web_conf_path = NULL;
     c->log_path = NULL;
     c->pid_path = NULL;
+    c->metrics_path = NULL;
+    c->trace_path = NULL;
     c->db_name = NULL;
     c->db_user = NULL;
     c->db_pass = NULL;
@@ -454,6 +481,8 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
         c->verbose = 0;
     if (c->daemon == UNDEFINED_CFG_INT)
         c->daemon = 1;
+    if (c->log_async == UNDEFINED_CFG_INT)
+        c->log_async = 1;
     if (c->debug == UNDEFINED_CFG_INT)
         c->debug = 0;
     if (c->clc_port == 0)
@@ -480,6 +509,16 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
         if (c->pid_path == NULL)
             return CLC_CONFIG_RET_ERR_NOMEM;
     }
+    if (c->metrics_path == NULL) {
+        c->metrics_path = strdup(DEFAULT_LYCLC_METRICS_PATH);
+        if (c->metrics_path == NULL)
+            return CLC_CONFIG_RET_ERR_NOMEM;
+    }
+    if (c->trace_path == NULL) {
+        c->trace_path = strdup(DEFAULT_LYCLC_TRACE_PATH);
+        if (c->trace_path == NULL)
+            return CLC_CONFIG_RET_ERR_NOMEM;
+    }
     if (c->db_name == NULL) {
         c->db_name = strdup(DEFAULT_LYCLC_DB_NAME);
         if (c->db_name == NULL)
@@ -500,6 +539,10 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
     if (c->node_select < NODE_SELECT_ANY || 
         c->node_select > NODE_SELECT_LAST_ONLY)
         c->node_select = NODE_SELECT_LAST_ONLY;
+    if (c->node_placement == 0)
+        c->node_placement = DEFAULT_NODE_PLACEMENT;
+    if (c->node_prefetch == 0)
+        c->node_prefetch = DEFAULT_NODE_PREFETCH;
     if (c->job_timeout_instance  == 0)
         c->job_timeout_instance = DEFAULT_JOB_TIMOUT_INSTANCE;
     if (c->job_timeout_node == 0)
@@ -512,6 +555,10 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
         c->node_mem_factor = DEFAULT_NODE_MEM_FACTOR;
     if (c->node_ins_job_busy_limit == 0)
         c->node_ins_job_busy_limit = DEFAULT_NODE_INS_JOB_BUSY_LIMIT;
+    if (c->db_pool_size == 0)
+        c->db_pool_size = DEFAULT_DB_POOL_SIZE;
+    if (c->db_flush_interval == 0)
+        c->db_flush_interval = DEFAULT_DB_FLUSH_INTERVAL;
  
     /* simple configuration validity checking */
     if (c->vm_name_prefix && strlen(c->vm_name_prefix) > 10) {
@@ -519,6 +566,36 @@ int clc_config(int argc, char *argv[], CLCConfig * c)
         return CLC_CONFIG_RET_ERR_CONF;
     }
         
+    if (c->event_workers < 0 || c->event_workers > EVENT_WORKERS_MAX) {
+        logsimple(_("number of event workers must be 0 - %d\n"),
+                    EVENT_WORKERS_MAX);
+        return CLC_CONFIG_RET_ERR_CONF;
+    }
+
+    if (c->db_pool_size > DB_POOL_SIZE_MAX) {
+        logsimple(_("db pool size must not be > %d\n"), DB_POOL_SIZE_MAX);
+        return CLC_CONFIG_RET_ERR_CONF;
+    }
+
+    if (c->node_placement < NODE_PLACEMENT_SPREAD ||
+        c->node_placement > NODE_PLACEMENT_LOCALITY) {
+        logsimple(_("node placement must be between %d and %d\n"),
+                    NODE_PLACEMENT_SPREAD, NODE_PLACEMENT_LOCALITY);
+        return CLC_CONFIG_RET_ERR_CONF;
+    }
+
+    if (c->node_prefetch > NODE_PREFETCH_MAX) {
+        logsimple(_("number of prefetch nodes must not be > %d\n"),
+                    NODE_PREFETCH_MAX);
+        return CLC_CONFIG_RET_ERR_CONF;
+    }
+
+    if (c->db_flush_interval > DB_FLUSH_INTERVAL_MAX) {
+        logsimple(_("db flush interval must not be > %d\n"),
+                    DB_FLUSH_INTERVAL_MAX);
+        return CLC_CONFIG_RET_ERR_CONF;
+    }
+
     if (__is_IP_valid(c->clc_mcast_ip, 1) == 0) {
         logsimple(_("cloud controller mcast ip is invalid\n"));
         return CLC_CONFIG_RET_ERR_CONF;
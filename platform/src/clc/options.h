@@ -23,15 +23,25 @@ typedef struct CLCConfig_t {
     char *web_conf_path;     /* LYWeb config file path */
     char *log_path;          /* log file path */
     char *pid_path;          /* pid file path */
+    char *metrics_path;      /* unix socket metrics are served on */
+    char *trace_path;        /* job phase breakdowns are appended to */
     char *vm_name_prefix;    /* VM name prefix */
     int   node_select;
+    int   node_placement;    /* how nodes are selected, NODE_PLACEMENT_* */
+    int   node_prefetch;     /* nodes popular appliances are prefetched to,
+                                -1 for none */
     int   node_storage_low;
     int   verbose;
     int   debug;
     int   daemon;
+    int   log_async;         /* 1: log written by a thread, 0: inline */
     int   node_cpu_factor, node_mem_factor;
     int   job_timeout_instance, job_timeout_node, job_timeout_other;
     int   node_ins_job_busy_limit;
+    int   event_workers;     /* number of worker event loops, 0 for none */
+    int   db_pool_size;      /* async db connections, -1 for none */
+    int   db_flush_interval; /* instance status write behind, in seconds,
+                                -1 to write immediately */
 } CLCConfig;
 
 #define DEFAULT_NODE_CPU_FACTOR 4
@@ -39,9 +49,29 @@ typedef struct CLCConfig_t {
 
 #define DEFAULT_NODE_INS_JOB_BUSY_LIMIT 4
 
+#define EVENT_WORKERS_MAX 64
+
+#define DEFAULT_DB_POOL_SIZE 2
+#define DB_POOL_SIZE_MAX 8
+
+#define DEFAULT_DB_FLUSH_INTERVAL 30
+#define DB_FLUSH_INTERVAL_MAX 3600
+
 #define NODE_SELECT_ANY		1
 #define NODE_SELECT_LAST_ONLY	2
 
+#define NODE_PLACEMENT_SPREAD	1	/* most free resource */
+#define NODE_PLACEMENT_BESTFIT	2	/* least memory left */
+#define NODE_PLACEMENT_BINPACK	3	/* most utilized */
+#define NODE_PLACEMENT_LOCALITY	4	/* appliance likely cached */
+#define DEFAULT_NODE_PLACEMENT	NODE_PLACEMENT_SPREAD
+
+#define DEFAULT_LYCLC_METRICS_PATH "/var/run/lyclc.metrics"
+#define DEFAULT_LYCLC_TRACE_PATH "/var/log/lyclc.trace"
+
+#define DEFAULT_NODE_PREFETCH	2
+#define NODE_PREFETCH_MAX	16
+
 #define CLC_CONFIG_RET_HELP		1
 #define CLC_CONFIG_RET_VER		2
 #define CLC_CONFIG_RET_ERR_CMD		-1
@@ -0,0 +1,740 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <libpq-fe.h>
+
+#include "../util/logging.h"
+#include "../util/list.h"
+#include "../util/lymetric.h"
+#include "lyclc.h"
+#include "events.h"
+#include "postgres.h"
+
+
+/*
+** async db access
+**
+** statements are queued, then sent on a small pool of non-blocking
+** connections registered in clc epoll set. with libpq pipeline mode,
+** several statements are in flight on each connection.
+**
+** statements of the same key are sent on the same connection, so they
+** are executed in the order they are queued, see DB_KEY_xxx. broken
+** connections are reconnected in clc event loop, statements waiting
+** are sent once connected again.
+**
+** statements are queued by worker event loops too, the pool is guarded
+** by db lock, not clc lock. callbacks are called with db lock held, they
+** must not take clc lock.
+*/
+
+#ifdef LIBPQ_HAS_PIPELINING
+#define DB_PIPELINE_DEPTH	32
+#else
+#define DB_PIPELINE_DEPTH	1
+#endif
+
+typedef struct LYDBQuery_t {
+    struct list_head list;
+    LYDBCallback cb;
+    void * data;
+    int key;                    /* see DB_KEY_xxx */
+    char * sql;                 /* NULL for prepared statement */
+    int stmt;
+    int nparams;
+    const char * values[DB_PARAMS_MAX];
+    int lengths[DB_PARAMS_MAX];
+    int formats[DB_PARAMS_MAX];
+    char * buf;                 /* copy of parameter values */
+    unsigned long long queued;  /* lymetric_now_us when queued */
+} LYDBQuery;
+
+typedef struct LYDBConn_t {
+    PGconn * conn;
+    int fd;                     /* -1 if connection is not usable */
+    int events;                 /* events registered in epoll */
+    int resetting;              /* reconnecting, see __db_conn_reset */
+    int sent;                   /* number of statements in flight */
+    struct list_head queries;   /* statements in flight, in order */
+    int queued;                 /* number of statements waiting */
+    struct list_head waiting;   /* statements to be sent, in order */
+    PGresult * res;             /* result of the first statement */
+} LYDBConn;
+
+/* recursive, pgcache holds it while queuing statements */
+static pthread_mutex_t g_db_async_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static LYDBConn * g_db_pool = NULL;
+static int g_db_pool_size = 0;
+static int g_db_pending = 0;
+
+/* metrics of async statements, see ly_db_async_init */
+static LYMetric * g_m_db_pending;
+static LYMetric * g_m_db_time;
+static LYMetric * g_m_db_errors;
+
+static void __db_query_free(LYDBQuery * q)
+{
+    if (q->sql)
+        free(q->sql);
+    if (q->buf)
+        free(q->buf);
+    free(q);
+}
+
+static void __db_query_done(LYDBQuery * q, PGresult * res)
+{
+    list_del(&q->list);
+    g_db_pending--;
+    lymetric_set(g_m_db_pending, g_db_pending);
+    lymetric_observe(g_m_db_time, lymetric_now_us() - q->queued);
+    ExecStatusType status = PQresultStatus(res);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+        lymetric_inc(g_m_db_errors);
+    if (q->cb)
+        q->cb(res, q->data);
+    if (res)
+        PQclear(res);
+    __db_query_free(q);
+}
+
+static int __db_conn_events(LYDBConn * c, int events)
+{
+    if (c->events == events)
+        return 0;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = DB_EPOLL_ID(c - g_db_pool);
+    if (epoll_ctl(g_efd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+static void __db_conn_unwatch(LYDBConn * c)
+{
+    if (c->fd >= 0)
+        epoll_ctl(g_efd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->fd = -1;
+    c->events = 0;
+}
+
+/* watch socket of connection, which may be changed while connecting */
+static int __db_conn_watch(LYDBConn * c, int events)
+{
+    int fd = PQsocket(c->conn);
+    if (fd >= 0 && fd == c->fd)
+        return __db_conn_events(c, events);
+
+    __db_conn_unwatch(c);
+    if (fd < 0)
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = DB_EPOLL_ID(c - g_db_pool);
+    if (epoll_ctl(g_efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    c->fd = fd;
+    c->events = events;
+    return 0;
+}
+
+static int __db_conn_setup(LYDBConn * c)
+{
+    if (PQstatus(c->conn) != CONNECTION_OK) {
+        logerror(_("unable to connect to the database: %s\n"),
+                    PQerrorMessage(c->conn));
+        return -1;
+    }
+    /* statements are prepared on each new session */
+    if (PQsetnonblocking(c->conn, 0) != 0 || ly_db_prepare(c->conn) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    if (PQsetnonblocking(c->conn, 1) != 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+#ifdef LIBPQ_HAS_PIPELINING
+    if (PQenterPipelineMode(c->conn) != 1) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+#endif
+
+    return __db_conn_watch(c, EPOLLIN);
+}
+
+/* fail the statements waiting, connection is not usable */
+static void __db_conn_drop(LYDBConn * c)
+{
+    logerror(_("async db connection %d is not usable: %s\n"),
+               (int)(c - g_db_pool), PQerrorMessage(c->conn));
+    c->resetting = 0;
+    __db_conn_unwatch(c);
+    while (!list_empty(&c->waiting))
+        __db_query_done(list_first_entry(&c->waiting, LYDBQuery, list),
+                        NULL);
+    c->queued = 0;
+}
+
+/*
+** start reconnecting without blocking, __db_conn_reset_poll is called
+** on events of the connection till it's done
+*/
+static int __db_conn_reset(LYDBConn * c)
+{
+    if (PQresetStart(c->conn) != 1 || __db_conn_watch(c, EPOLLOUT) < 0) {
+        __db_conn_drop(c);
+        return -1;
+    }
+    c->resetting = 1;
+    return 0;
+}
+
+static void __db_conn_reset_poll(LYDBConn * c)
+{
+    switch (PQresetPoll(c->conn)) {
+    case PGRES_POLLING_READING:
+        if (__db_conn_watch(c, EPOLLIN) == 0)
+            return;
+        break;
+    case PGRES_POLLING_WRITING:
+        if (__db_conn_watch(c, EPOLLOUT) == 0)
+            return;
+        break;
+    case PGRES_POLLING_OK:
+        c->resetting = 0;
+        if (__db_conn_setup(c) == 0) {
+            loginfo(_("async db connection %d is reconnected\n"),
+                      (int)(c - g_db_pool));
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    __db_conn_drop(c);
+}
+
+/* fail all the statements in flight, and start reconnecting */
+static void __db_conn_fail(LYDBConn * c)
+{
+    logerror(_("async db connection %d error: %s\n"),
+               (int)(c - g_db_pool), PQerrorMessage(c->conn));
+
+    if (c->res) {
+        PQclear(c->res);
+        c->res = NULL;
+    }
+    while (!list_empty(&c->queries))
+        __db_query_done(list_first_entry(&c->queries, LYDBQuery, list), NULL);
+    c->sent = 0;
+
+    __db_conn_unwatch(c);
+    __db_conn_reset(c);
+}
+
+static int __db_conn_send(LYDBConn * c, LYDBQuery * q)
+{
+    int ret;
+    if (q->sql)
+        ret = PQsendQueryParams(c->conn, q->sql, 0, NULL, NULL, NULL, NULL, 0);
+    else
+        ret = PQsendQueryPrepared(c->conn, ly_db_stmt_name(q->stmt),
+                                  q->nparams, q->values, q->lengths,
+                                  q->formats, 1);
+    if (ret != 1)
+        return -1;
+#ifdef LIBPQ_HAS_PIPELINING
+    /* sync after each statement, so errors do not abort the others */
+    if (PQpipelineSync(c->conn) != 1)
+        return -1;
+#endif
+    list_add_tail(&q->list, &c->queries);
+    c->sent++;
+    return 0;
+}
+
+static int __db_conn_flush(LYDBConn * c)
+{
+    int ret = PQflush(c->conn);
+    if (ret < 0)
+        return -1;
+    return __db_conn_events(c, ret ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/* process the results available */
+static int __db_conn_read(LYDBConn * c)
+{
+    if (PQconsumeInput(c->conn) != 1)
+        return -1;
+
+    while (!PQisBusy(c->conn)) {
+        PGresult * res = PQgetResult(c->conn);
+        if (res == NULL) {
+            /* end of results of the first statement */
+            if (list_empty(&c->queries))
+                break;
+            __db_query_done(list_first_entry(&c->queries, LYDBQuery, list),
+                            c->res);
+            c->res = NULL;
+            c->sent--;
+            continue;
+        }
+#ifdef LIBPQ_HAS_PIPELINING
+        if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+            PQclear(res);
+            continue;
+        }
+#endif
+        /* only the first result is kept */
+        if (c->res == NULL)
+            c->res = res;
+        else
+            PQclear(res);
+    }
+
+    return 0;
+}
+
+static void __db_conn_event(LYDBConn * c, uint32_t events)
+{
+    if (c->resetting) {
+        __db_conn_reset_poll(c);
+        return;
+    }
+
+    int ret = 0;
+    if (events & (EPOLLERR | EPOLLHUP))
+        ret = -1;
+    if (ret == 0 && (events & EPOLLOUT))
+        ret = __db_conn_flush(c);
+    if (ret == 0 && (events & EPOLLIN))
+        ret = __db_conn_read(c);
+    if (ret < 0)
+        __db_conn_fail(c);
+}
+
+/*
+** connection statements of key are sent on, the least loaded one for
+** DB_KEY_NONE. NULL if it's not usable.
+*/
+static LYDBConn * __db_conn_get(int key)
+{
+    LYDBConn * c = NULL;
+    if (key >= 0) {
+        c = &g_db_pool[key % g_db_pool_size];
+        /* reconnect on demand if it failed before */
+        if (c->fd < 0 && __db_conn_reset(c) < 0)
+            return NULL;
+        return c;
+    }
+
+    int i;
+    for (i = 0; i < g_db_pool_size; i++) {
+        LYDBConn * t = &g_db_pool[i];
+        if (t->fd < 0 || t->resetting)
+            continue;
+        if (c == NULL || t->sent + t->queued < c->sent + c->queued)
+            c = t;
+    }
+    return c;
+}
+
+/* send statements waiting on each connection, in order */
+static void __db_dispatch(void)
+{
+    int i;
+    for (i = 0; i < g_db_pool_size; i++) {
+        LYDBConn * c = &g_db_pool[i];
+        if (c->fd < 0 || c->resetting)
+            continue;
+
+        while (c->queued > 0 && c->sent < DB_PIPELINE_DEPTH) {
+            LYDBQuery * q = list_first_entry(&c->waiting, LYDBQuery, list);
+            list_del(&q->list);
+            c->queued--;
+            if (__db_conn_send(c, q) < 0) {
+                list_add_tail(&q->list, &c->queries);
+                __db_conn_fail(c);
+                break;
+            }
+        }
+
+        if (c->fd >= 0 && !c->resetting && c->sent > 0 &&
+            __db_conn_flush(c) < 0)
+            __db_conn_fail(c);
+    }
+}
+
+static int __db_queue(LYDBQuery * q)
+{
+    LYDBConn * c = __db_conn_get(q->key);
+    if (c == NULL)
+        return -1;
+
+    q->queued = lymetric_now_us();
+    list_add_tail(&q->list, &c->waiting);
+    c->queued++;
+    g_db_pending++;
+    lymetric_set(g_m_db_pending, g_db_pending);
+    __db_dispatch();
+    return 0;
+}
+
+/* whether statement of qkey is to be completed before those of key */
+static int __db_key_before(int key, int qkey)
+{
+    if (key == DB_KEY_ALL)
+        return 1;
+    if (key < 0 || qkey < 0 || DB_KEY_TABLE(key) != DB_KEY_TABLE(qkey))
+        return 0;
+    return qkey == key || DB_KEY_ID(key) == 0 || DB_KEY_ID(qkey) == 0;
+}
+
+/* whether connection i may have statements to be completed before key */
+static int __db_key_conn(int key, int i)
+{
+    if (key == DB_KEY_ALL)
+        return 1;
+    if (key < 0)
+        return 0;
+    if (DB_KEY_ID(key) == 0)
+        return 1;
+    int table = DB_KEY_ROW(DB_KEY_TABLE(key), 0);
+    return i == key % g_db_pool_size || i == table % g_db_pool_size;
+}
+
+/* number of statements to be completed before those of key */
+static int __db_key_pending(int key)
+{
+    if (key == DB_KEY_ALL)
+        return g_db_pending;
+    if (key < 0)
+        return 0;
+
+    int i, n = 0;
+    for (i = 0; i < g_db_pool_size; i++) {
+        if (!__db_key_conn(key, i))
+            continue;
+        LYDBConn * c = &g_db_pool[i];
+        LYDBQuery * q;
+        list_for_each_entry(q, &c->queries, list)
+            if (__db_key_before(key, q->key))
+                n++;
+        list_for_each_entry(q, &c->waiting, list)
+            if (__db_key_before(key, q->key))
+                n++;
+    }
+    return n;
+}
+
+static int __db_async_event(int id, uint32_t events)
+{
+    int i = DB_EPOLL_ID_BASE - id;
+    if (g_db_pool == NULL || i < 0 || i >= g_db_pool_size)
+        return -255;
+
+    LYDBConn * c = &g_db_pool[i];
+    if (c->fd < 0)
+        return -1;
+
+    __db_conn_event(c, events);
+    __db_dispatch();
+    return c->fd < 0 ? -1 : 0;
+}
+
+static int __db_async_query(const char * sql, int key, LYDBCallback cb,
+                            void * data)
+{
+    if (g_db_pool == NULL || sql == NULL)
+        return -1;
+
+    LYDBQuery * q = malloc(sizeof(LYDBQuery));
+    if (q == NULL)
+        return -1;
+    bzero(q, sizeof(LYDBQuery));
+    q->cb = cb;
+    q->data = data;
+    q->key = key;
+    q->sql = strdup(sql);
+    if (q->sql == NULL || __db_queue(q) < 0) {
+        __db_query_free(q);
+        return -1;
+    }
+    return 0;
+}
+
+static int __db_async_prepared(int stmt, int key, LYDBParams * p,
+                               LYDBCallback cb, void * data)
+{
+    if (g_db_pool == NULL || ly_db_stmt_name(stmt) == NULL || p == NULL)
+        return -1;
+
+    LYDBQuery * q = malloc(sizeof(LYDBQuery));
+    if (q == NULL)
+        return -1;
+    bzero(q, sizeof(LYDBQuery));
+    q->cb = cb;
+    q->data = data;
+    q->key = key;
+    q->stmt = stmt;
+    q->nparams = p->n;
+
+    int i, size = 0;
+    for (i = 0; i < p->n; i++) {
+        q->lengths[i] = p->lengths[i];
+        q->formats[i] = p->formats[i];
+        if (p->values[i] == NULL)
+            continue;
+        if (p->formats[i] == 0)
+            q->lengths[i] = strlen(p->values[i]) + 1;
+        size += q->lengths[i];
+    }
+    if (size) {
+        q->buf = malloc(size);
+        if (q->buf == NULL) {
+            free(q);
+            return -1;
+        }
+    }
+    char * b = q->buf;
+    for (i = 0; i < p->n; i++) {
+        if (p->values[i] == NULL)
+            continue;
+        memcpy(b, p->values[i], q->lengths[i]);
+        q->values[i] = b;
+        b += q->lengths[i];
+    }
+
+    if (__db_queue(q) < 0) {
+        __db_query_free(q);
+        return -1;
+    }
+    return 0;
+}
+
+/* number of statements not completed yet */
+int ly_db_async_pending(void)
+{
+    return g_db_pending;
+}
+
+static int __db_async_wait(int key)
+{
+    if (g_db_pool == NULL)
+        return 0;
+
+    struct pollfd pfd[DB_POOL_SIZE_MAX];
+    LYDBConn * conn[DB_POOL_SIZE_MAX];
+    while (__db_key_pending(key) > 0) {
+        __db_dispatch();
+
+        int i, n = 0;
+        for (i = 0; i < g_db_pool_size; i++) {
+            LYDBConn * c = &g_db_pool[i];
+            if (c->fd < 0 || (c->sent == 0 && !c->resetting))
+                continue;
+            if (!__db_key_conn(key, i))
+                continue;
+            pfd[n].fd = c->fd;
+            pfd[n].events = (c->events & EPOLLIN ? POLLIN : 0) |
+                            (c->events & EPOLLOUT ? POLLOUT : 0);
+            pfd[n].revents = 0;
+            conn[n] = c;
+            n++;
+        }
+
+        if (n == 0)
+            /* no usable connection, statements are failed already */
+            break;
+
+        if (poll(pfd, n, CLC_EPOLL_TIMEOUT) < 0 && errno != EINTR) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (pfd[i].revents == 0 || conn[i]->fd != pfd[i].fd)
+                continue;
+            uint32_t events = 0;
+            if (pfd[i].revents & POLLIN)
+                events |= EPOLLIN;
+            if (pfd[i].revents & POLLOUT)
+                events |= EPOLLOUT;
+            if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                events |= EPOLLERR;
+            __db_conn_event(conn[i], events);
+        }
+    }
+
+    return 0;
+}
+
+void ly_db_async_lock(void)
+{
+    pthread_mutex_lock(&g_db_async_lock);
+}
+
+void ly_db_async_unlock(void)
+{
+    pthread_mutex_unlock(&g_db_async_lock);
+}
+
+/* handle epoll event of async db connection */
+int ly_db_async_event(int id, uint32_t events)
+{
+    ly_db_async_lock();
+    int ret = __db_async_event(id, events);
+    ly_db_async_unlock();
+    return ret;
+}
+
+/*
+** queue a statement, cb is called with the result, or NULL on error
+**
+** return -1 if async db access is not available
+*/
+int ly_db_async_query(const char * sql, int key, LYDBCallback cb,
+                      void * data)
+{
+    ly_db_async_lock();
+    int ret = __db_async_query(sql, key, cb, data);
+    ly_db_async_unlock();
+    return ret;
+}
+
+/* same as ly_db_async_query, parameters are copied */
+int ly_db_async_prepared(int stmt, int key, LYDBParams * p,
+                         LYDBCallback cb, void * data)
+{
+    ly_db_async_lock();
+    int ret = __db_async_prepared(stmt, key, p, cb, data);
+    ly_db_async_unlock();
+    return ret;
+}
+
+/*
+** wait till the statements to be completed before key are done,
+** DB_KEY_ALL for all of them. for a row, only the connections of the
+** row and its table are waited on.
+*/
+int ly_db_async_wait(int key)
+{
+    ly_db_async_lock();
+    int ret = __db_async_wait(key);
+    ly_db_async_unlock();
+    return ret;
+}
+
+/* open the connection pool, must be called after ly_epoll_init */
+int ly_db_async_init(int size)
+{
+    if (g_db_pool != NULL)
+        return -255;
+    if (size <= 0)
+        return 0;
+    if (size > DB_POOL_SIZE_MAX)
+        size = DB_POOL_SIZE_MAX;
+
+    g_m_db_pending = lymetric_gauge("ly_clc_db_async_pending",
+                                    "async db statements not completed");
+    g_m_db_time = lymetric_histogram("ly_clc_db_async_seconds",
+                                     "time of async db statements, queued to done");
+    g_m_db_errors = lymetric_counter("ly_clc_db_errors_total",
+                                     "db statements failed");
+
+    char conninfo[LINE_MAX];
+    snprintf(conninfo, LINE_MAX, "dbname=%s user=%s password=%s",
+             g_c->db_name, g_c->db_user, g_c->db_pass);
+
+    g_db_pool = malloc(size * sizeof(LYDBConn));
+    if (g_db_pool == NULL)
+        return -1;
+    bzero(g_db_pool, size * sizeof(LYDBConn));
+
+    int i;
+    for (i = 0; i < size; i++) {
+        LYDBConn * c = &g_db_pool[i];
+        c->fd = -1;
+        INIT_LIST_HEAD(&c->queries);
+        INIT_LIST_HEAD(&c->waiting);
+        g_db_pool_size++;
+        c->conn = PQconnectdb(conninfo);
+        if (c->conn == NULL || __db_conn_setup(c) < 0) {
+            ly_db_async_close();
+            return -1;
+        }
+    }
+
+    loginfo(_("async db access uses %d connections, pipeline depth %d\n"),
+              size, DB_PIPELINE_DEPTH);
+    return 0;
+}
+
+/* complete all the statements and close the connection pool */
+void ly_db_async_close(void)
+{
+    ly_db_async_lock();
+    if (g_db_pool == NULL) {
+        ly_db_async_unlock();
+        return;
+    }
+
+    __db_async_wait(DB_KEY_ALL);
+
+    int i;
+    for (i = 0; i < g_db_pool_size; i++) {
+        LYDBConn * c = &g_db_pool[i];
+        while (!list_empty(&c->waiting))
+            __db_query_done(list_first_entry(&c->waiting, LYDBQuery, list),
+                            NULL);
+        __db_conn_unwatch(c);
+        if (c->conn)
+            PQfinish(c->conn);
+    }
+    free(g_db_pool);
+    g_db_pool = NULL;
+    g_db_pool_size = 0;
+    g_db_pending = 0;
+    ly_db_async_unlock();
+    return;
+}
@@ -0,0 +1,595 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <libpq-fe.h>
+
+#include "../util/logging.h"
+#include "../util/list.h"
+#include "../luoyun/luoyun.h"
+#include "postgres.h"
+
+/*
+** instance status cache, write behind
+**
+** instance state is read from db once, then kept in memory. traffic
+** counters and vdi port reported by osm only change the cache, the
+** instances changed are written to db in one statement every flush
+** interval. changes of ip, status and node_id are read by others, so
+** they are written immediately, together with other pending changes.
+**
+** instances failed to be written are marked dirty again. clean state
+** is read from db again after DB_CACHE_EXPIRE seconds, in case it's
+** changed by others, and no more than DB_CACHE_MAX instances are kept,
+** least recently used clean ones are dropped first.
+**
+** guarded by db lock, see pgasync.c, the same as the statements
+** flushing it, so the cache is updated without clc lock held.
+*/
+
+#define DB_CACHE_HASH_SIZE	4096	/* must be power of 2 */
+#define DB_CACHE_BATCH		256	/* max instances in one statement */
+#define DB_CACHE_MAX		16384	/* max instances cached */
+#define DB_CACHE_EXPIRE		300	/* seconds before reading db again */
+
+/* pending changes */
+#define DB_CACHE_SET_KEY	0x1	/* key, vdi_port, rx and tx */
+#define DB_CACHE_SET_IP		0x2
+#define DB_CACHE_SET_STATUS	0x4
+#define DB_CACHE_SET_NODE	0x8
+#define DB_CACHE_SET_ALL	0xf
+
+typedef struct LYDBInsCache_t {
+    struct list_head hash;
+    struct list_head dirty;     /* in g_cache_dirty if changes are pending */
+    struct list_head lru;       /* in g_cache_lru, last used at tail */
+    int id;
+    int set;                    /* DB_CACHE_SET_xxx */
+    int flushing;               /* statements sent, not completed yet */
+    time_t loaded;              /* read from db */
+    char * secret;
+    int vdi_port;
+    unsigned long rx, tx;       /* accumulated traffic */
+    unsigned long rx_last;      /* counters last reported by osm */
+    unsigned long tx_last;
+    char * ip;
+    int node_id;                /* 0 for NULL */
+    int status;
+} LYDBInsCache;
+
+/* instances written in one statement */
+typedef struct LYDBCacheBatch_t {
+    int n;
+    int ids[DB_CACHE_BATCH];
+} LYDBCacheBatch;
+
+/* growable string for array literals */
+typedef struct LYDBCacheBuf_t {
+    char * s;
+    int len;
+    int size;
+} LYDBCacheBuf;
+
+static struct list_head * g_cache_hash = NULL;
+static LIST_HEAD(g_cache_dirty);
+static LIST_HEAD(g_cache_lru);
+static int g_cache_num = 0;
+static int g_cache_interval = 0;
+static time_t g_cache_flush_time = 0;
+
+static inline unsigned int __cache_hash(int id)
+{
+    return ((unsigned int)id * 2654435761U) & (DB_CACHE_HASH_SIZE - 1);
+}
+
+static LYDBInsCache * __cache_find(int id)
+{
+    LYDBInsCache * e;
+    list_for_each_entry(e, &g_cache_hash[__cache_hash(id)], hash)
+        if (e->id == id)
+            return e;
+    return NULL;
+}
+
+static void __cache_free(LYDBInsCache * e)
+{
+    list_del(&e->hash);
+    list_del(&e->dirty);
+    list_del(&e->lru);
+    g_cache_num--;
+    if (e->secret)
+        free(e->secret);
+    if (e->ip)
+        free(e->ip);
+    free(e);
+}
+
+static void __cache_set(LYDBInsCache * e, int set)
+{
+    e->set |= set;
+    if (list_empty(&e->dirty))
+        list_add_tail(&e->dirty, &g_cache_dirty);
+}
+
+/* parse colon-packed key column, secret:port:rx:rx_last:tx:tx_last */
+static void __cache_parse_key(LYDBInsCache * e, const char * key)
+{
+    char * str = NULL, * savestr = NULL, * ptr[6];
+    int i;
+    if (key && strlen(key)) {
+        str = strdup(key);
+        savestr = str;
+    }
+    for (i = 0; i < 6; i++) {
+        ptr[i] = NULL;
+        if (str && strlen(str)) {
+            ptr[i] = str;
+            str = index(str, ':');
+            if (str) {
+                *str = '\0';
+                str++;
+            }
+        }
+    }
+    e->secret = ptr[0] ? strdup(ptr[0]) : NULL;
+    e->vdi_port = ptr[1] ? atoi(ptr[1]) : 0;
+    e->rx = ptr[2] ? atol(ptr[2]) : 0;
+    e->rx_last = ptr[3] ? atol(ptr[3]) : 0;
+    e->tx = ptr[4] ? atol(ptr[4]) : 0;
+    e->tx_last = ptr[5] ? atol(ptr[5]) : 0;
+    if (savestr)
+        free(savestr);
+}
+
+/* state in db is the same, it can be dropped */
+static inline int __cache_clean(LYDBInsCache * e)
+{
+    return list_empty(&e->dirty) && e->flushing == 0;
+}
+
+/* drop least recently used clean instances to make room for one */
+static void __cache_shrink(void)
+{
+    LYDBInsCache * e, * n;
+    list_for_each_entry_safe(e, n, &g_cache_lru, lru) {
+        if (g_cache_num < DB_CACHE_MAX)
+            break;
+        if (__cache_clean(e))
+            __cache_free(e);
+    }
+}
+
+/* read instance state from db, NULL if instance is not found */
+static LYDBInsCache * __cache_load(int id, time_t now)
+{
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, id);
+    PGresult * res = ly_db_select(DB_STMT_INS_STATUS_GET, DB_KEY_INSTANCE(id),
+                                   &p);
+    if (res == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return NULL;
+    }
+
+    LYDBInsCache * e = NULL;
+    int ret = PQntuples(res);
+    if (ret > 1)
+        logerror(_("DB have multi instance(%d) with same tag\n"), id);
+    if (ret != 1)
+        goto out;
+
+    e = malloc(sizeof(LYDBInsCache));
+    if (e == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        goto out;
+    }
+    bzero(e, sizeof(LYDBInsCache));
+    e->id = id;
+    e->loaded = now;
+    INIT_LIST_HEAD(&e->dirty);
+    __cache_parse_key(e, ly_db_get_str(res, 0, 0));
+    char * s = ly_db_get_str(res, 0, 1);
+    if (s && strlen(s))
+        e->ip = strdup(s);
+    e->node_id = ly_db_get_int(res, 0, 2);
+    e->status = PQgetisnull(res, 0, 3) ? -1 : ly_db_get_int(res, 0, 3);
+    __cache_shrink();
+    list_add(&e->hash, &g_cache_hash[__cache_hash(id)]);
+    list_add_tail(&e->lru, &g_cache_lru);
+    g_cache_num++;
+
+out:
+    PQclear(res);
+    return e;
+}
+
+/* cached state, read from db again if it may be changed by others */
+static LYDBInsCache * __cache_get(int id)
+{
+    time_t now = time(NULL);
+    LYDBInsCache * e = __cache_find(id);
+    if (e && __cache_clean(e) &&
+        (now - e->loaded >= DB_CACHE_EXPIRE || now < e->loaded)) {
+        __cache_free(e);
+        e = NULL;
+    }
+    if (e == NULL)
+        return __cache_load(id, now);
+    list_move_tail(&e->lru, &g_cache_lru);
+    return e;
+}
+
+static int __buf_printf(LYDBCacheBuf * b, const char * fmt, ...)
+{
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int ret = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if (ret < 0)
+            return -1;
+        if (ret < b->size - b->len) {
+            b->len += ret;
+            return 0;
+        }
+        int size = b->size ? b->size << 1 : 1024;
+        while (size - b->len <= ret)
+            size <<= 1;
+        char * s = realloc(b->s, size);
+        if (s == NULL)
+            return -1;
+        b->s = s;
+        b->size = size;
+    }
+}
+
+/* array element, NULL or double quoted string */
+static int __buf_quote(LYDBCacheBuf * b, const char * v)
+{
+    if (v == NULL)
+        return __buf_printf(b, "NULL");
+    if (__buf_printf(b, "\"") < 0)
+        return -1;
+    for (; *v; v++) {
+        if ((*v == '"' || *v == '\\') && __buf_printf(b, "\\") < 0)
+            return -1;
+        if (__buf_printf(b, "%c", *v) < 0)
+            return -1;
+    }
+    return __buf_printf(b, "\"");
+}
+
+static void __cache_flush_done(PGresult * res, void * data)
+{
+    LYDBCacheBatch * b = data;
+    int i, failed = res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK;
+    if (failed)
+        logerror(_("instance status flush failed: %s\n"),
+                   res ? PQresultErrorMessage(res) : "no connection");
+    for (i = 0; g_cache_hash && i < b->n; i++) {
+        LYDBInsCache * e = __cache_find(b->ids[i]);
+        if (e == NULL)
+            continue;
+        if (e->flushing > 0)
+            e->flushing--;
+        /* try again in next flush, with all the known state */
+        if (failed)
+            __cache_set(e, DB_CACHE_SET_ALL);
+    }
+    free(b);
+}
+
+#define DB_CACHE_COLS	9
+
+/* write up to DB_CACHE_BATCH instances in todo list */
+static int __cache_flush_batch(struct list_head * todo)
+{
+    LYDBCacheBatch * b = malloc(sizeof(LYDBCacheBatch));
+    if (b == NULL)
+        return -1;
+    b->n = 0;
+
+    int i, ret = -1;
+    LYDBCacheBuf col[DB_CACHE_COLS];
+    bzero(col, sizeof(col));
+    for (i = 0; i < DB_CACHE_COLS; i++)
+        if (__buf_printf(&col[i], "{") < 0)
+            goto out;
+
+    while (!list_empty(todo) && b->n < DB_CACHE_BATCH) {
+        LYDBInsCache * e = list_first_entry(todo, LYDBInsCache, dirty);
+        const char * sep = b->n ? "," : "";
+        char key[256];
+        snprintf(key, 256, "%s:%d:%lu:%lu:%lu:%lu",
+                 e->secret ? e->secret : "", e->vdi_port,
+                 e->rx, e->rx_last, e->tx, e->tx_last);
+        int set_ip = (e->set & DB_CACHE_SET_IP) && e->ip;
+        int set_status = (e->set & DB_CACHE_SET_STATUS) && e->status >= 0;
+        int set_node = e->set & DB_CACHE_SET_NODE;
+        int set_key = e->set & DB_CACHE_SET_KEY;
+        if (__buf_printf(&col[0], "%s%d", sep, e->id) < 0 ||
+            __buf_printf(&col[1], "%s", sep) < 0 ||
+            __buf_quote(&col[1], set_ip ? e->ip : NULL) < 0 ||
+            (set_status ?
+             __buf_printf(&col[2], "%s%d", sep, e->status) :
+             __buf_printf(&col[2], "%sNULL", sep)) < 0 ||
+            __buf_printf(&col[3], "%s%s", sep, set_node ? "t" : "f") < 0 ||
+            (set_node && e->node_id > 0 ?
+             __buf_printf(&col[4], "%s%d", sep, e->node_id) :
+             __buf_printf(&col[4], "%sNULL", sep)) < 0 ||
+            __buf_printf(&col[5], "%s", sep) < 0 ||
+            __buf_quote(&col[5], set_key ? key : NULL) < 0)
+            goto out;
+        if (set_key) {
+            if (__buf_printf(&col[6], "%s%d", sep, e->vdi_port) < 0 ||
+                __buf_printf(&col[7], "%s%lu", sep, e->rx) < 0 ||
+                __buf_printf(&col[8], "%s%lu", sep, e->tx) < 0)
+                goto out;
+        }
+        else {
+            if (__buf_printf(&col[6], "%sNULL", sep) < 0 ||
+                __buf_printf(&col[7], "%sNULL", sep) < 0 ||
+                __buf_printf(&col[8], "%sNULL", sep) < 0)
+                goto out;
+        }
+
+        b->ids[b->n++] = e->id;
+        e->set = 0;
+        e->flushing++;
+        list_del_init(&e->dirty);
+    }
+
+    LYDBParams p;
+    ly_db_params_init(&p);
+    for (i = 0; i < DB_CACHE_COLS; i++) {
+        if (__buf_printf(&col[i], "}") < 0)
+            goto out;
+        ly_db_param_str(&p, col[i].s);
+    }
+    ly_db_param_int(&p, DOMAIN_S_DELETE);
+
+    logdebug(_("flush status of %d instances\n"), b->n);
+    ret = ly_db_exec_async(DB_STMT_INS_STATUS_FLUSH, DB_KEY_INSTANCES, &p,
+                           __cache_flush_done, b);
+    b = NULL;
+
+out:
+    if (b) {
+        /* instances taken from dirty list are written next time */
+        for (i = 0; i < b->n; i++) {
+            LYDBInsCache * e = __cache_find(b->ids[i]);
+            if (e == NULL)
+                continue;
+            e->flushing--;
+            __cache_set(e, DB_CACHE_SET_ALL);
+        }
+        free(b);
+    }
+    for (i = 0; i < DB_CACHE_COLS; i++)
+        if (col[i].s)
+            free(col[i].s);
+    return ret;
+}
+
+static int __cache_flush(void)
+{
+    if (g_cache_hash == NULL)
+        return 0;
+
+    /* instances failed to be written are added back to dirty list */
+    LIST_HEAD(todo);
+    list_splice_init(&g_cache_dirty, &todo);
+    while (!list_empty(&todo)) {
+        if (__cache_flush_batch(&todo) < 0) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            list_splice_tail(&todo, &g_cache_dirty);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* write all the pending changes to db */
+int ly_db_cache_flush(void)
+{
+    ly_db_async_lock();
+    int ret = __cache_flush();
+    ly_db_async_unlock();
+    return ret;
+}
+
+/* called in clc main loop */
+int ly_db_cache_timer(time_t now)
+{
+    ly_db_async_lock();
+    int ret = 0;
+    if (now < g_cache_flush_time)
+        g_cache_flush_time = now;
+    if (now - g_cache_flush_time >= g_cache_interval) {
+        g_cache_flush_time = now;
+        ret = __cache_flush();
+    }
+    ly_db_async_unlock();
+    return ret;
+}
+
+static int __cache_update(int instance_id, InstanceInfo * ii, int node_id)
+{
+    if (g_cache_hash == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+
+    LYDBInsCache * e = __cache_get(instance_id);
+    if (e == NULL)
+        return 0;
+
+    int set = 0;
+    if (ii) {
+        unsigned long rx = e->rx, tx = e->tx;
+        if (ii->netstat[0].rx_bytes >= e->rx_last) {
+            rx += ii->netstat[0].rx_bytes - e->rx_last;
+            tx += ii->netstat[0].tx_bytes - e->tx_last;
+        }
+        else {
+            /* just started or rebooted */
+            rx += ii->netstat[0].rx_bytes;
+            tx += ii->netstat[0].tx_bytes;
+        }
+        int vdi_port = ii->gport == -1 ? e->vdi_port : ii->gport;
+        if (rx != e->rx || tx != e->tx || vdi_port != e->vdi_port ||
+            ii->netstat[0].rx_bytes != e->rx_last ||
+            ii->netstat[0].tx_bytes != e->tx_last) {
+            e->rx = rx;
+            e->tx = tx;
+            e->rx_last = ii->netstat[0].rx_bytes;
+            e->tx_last = ii->netstat[0].tx_bytes;
+            e->vdi_port = vdi_port;
+            set |= DB_CACHE_SET_KEY;
+        }
+    }
+    if (ii && ii->ip && ii->ip[0] != '\0' && ii->ip[0] != ' ') {
+        if (e->ip == NULL || strcmp(ii->ip, e->ip)) {
+            if (e->ip)
+                free(e->ip);
+            e->ip = strdup(ii->ip);
+            set |= DB_CACHE_SET_IP;
+        }
+    }
+    if (node_id >= 0) {
+        if (node_id != e->node_id) {
+            e->node_id = node_id;
+            set |= DB_CACHE_SET_NODE;
+        }
+    }
+    if (ii && ii->status != DOMAIN_S_UNKNOWN) {
+        if (ii->status != e->status) {
+            e->status = ii->status;
+            set |= DB_CACHE_SET_STATUS;
+        }
+    }
+
+    if (set == 0)
+        return 0;
+    __cache_set(e, set);
+
+    /* other changes are read by others, write them now */
+    if ((set & ~DB_CACHE_SET_KEY) || g_cache_interval < 0)
+        return __cache_flush();
+    return 0;
+}
+
+int db_instance_update_status(int instance_id, InstanceInfo * ii, int node_id)
+{
+    ly_db_async_lock();
+    int ret = __cache_update(instance_id, ii, node_id);
+    ly_db_async_unlock();
+    return ret;
+}
+
+/* instance secret is changed in db */
+void ly_db_cache_secret(int instance_id, const char * secret)
+{
+    ly_db_async_lock();
+    LYDBInsCache * e = g_cache_hash ? __cache_find(instance_id) : NULL;
+    if (e) {
+        if (e->secret)
+            free(e->secret);
+        e->secret = secret ? strdup(secret) : NULL;
+    }
+    ly_db_async_unlock();
+}
+
+/* instances changed in db by others, -1 for all */
+void ly_db_cache_reload(int instance_id)
+{
+    ly_db_async_lock();
+    LYDBInsCache * e;
+    list_for_each_entry(e, &g_cache_lru, lru)
+        if (instance_id < 0 || e->id == instance_id)
+            e->loaded = 0;
+    ly_db_async_unlock();
+}
+
+/* instance is deleted from db */
+void ly_db_cache_remove(int instance_id)
+{
+    ly_db_async_lock();
+    LYDBInsCache * e = g_cache_hash ? __cache_find(instance_id) : NULL;
+    if (e)
+        __cache_free(e);
+    ly_db_async_unlock();
+}
+
+/* interval in seconds, -1 to write changes immediately */
+int ly_db_cache_init(int interval)
+{
+    if (g_cache_hash != NULL)
+        return -255;
+
+    g_cache_hash = malloc(DB_CACHE_HASH_SIZE * sizeof(struct list_head));
+    if (g_cache_hash == NULL)
+        return -1;
+    int i;
+    for (i = 0; i < DB_CACHE_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&g_cache_hash[i]);
+
+    g_cache_interval = interval;
+    time(&g_cache_flush_time);
+    return 0;
+}
+
+/* flush pending changes and free the cache */
+void ly_db_cache_close(void)
+{
+    ly_db_async_lock();
+    if (g_cache_hash == NULL) {
+        ly_db_async_unlock();
+        return;
+    }
+
+    if (__cache_flush() < 0)
+        logerror(_("instance status is not fully written to db\n"));
+    /* the statements sent are completed before freeing the cache */
+    ly_db_async_wait(DB_KEY_INSTANCES);
+
+    int i;
+    for (i = 0; i < DB_CACHE_HASH_SIZE; i++) {
+        while (!list_empty(&g_cache_hash[i]))
+            __cache_free(list_first_entry(&g_cache_hash[i],
+                                          LYDBInsCache, hash));
+    }
+    free(g_cache_hash);
+    g_cache_hash = NULL;
+    ly_db_async_unlock();
+    return;
+}
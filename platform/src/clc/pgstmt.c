@@ -0,0 +1,352 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+
+#include "../util/logging.h"
+#include "postgres.h"
+
+/*
+** prepared statements
+**
+** all the statements are prepared once on each db connection, then
+** executed with binary integer parameters and binary results.
+** 'now' literal is not used, it would be fixed at prepare time.
+*/
+
+/* type oids, from server catalog/pg_type.h */
+#define DB_BOOL		16
+#define DB_INT8		20
+#define DB_INT4		23
+#define DB_TEXT		25
+
+typedef struct LYDBStmt_t {
+    const char * name;
+    const char * sql;
+    int nparams;
+    Oid types[DB_PARAMS_MAX];
+} LYDBStmt;
+
+static const LYDBStmt g_db_stmts[DB_STMT_MAX] = {
+    [DB_STMT_NODE_EXIST_BY_IP] = {
+        "node_exist_by_ip",
+        "SELECT id FROM node WHERE ip = $1;",
+        1, { DB_TEXT } },
+    [DB_STMT_NODE_EXIST_BY_ID] = {
+        "node_exist_by_id",
+        "SELECT id FROM node WHERE id = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_NODE_SECRET_BY_IP] = {
+        "node_secret_by_ip",
+        "SELECT id, key FROM node WHERE ip = $1;",
+        1, { DB_TEXT } },
+    [DB_STMT_NODE_SECRET_BY_ID] = {
+        "node_secret_by_id",
+        "SELECT id, key FROM node WHERE id = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_NODE_FIND_BY_IP] = {
+        "node_find_by_ip",
+        "SELECT id, status, ip, key, vcpus, vmemory, isenable FROM node "
+        "WHERE ip = $1 ORDER BY key DESC;",
+        1, { DB_TEXT } },
+    [DB_STMT_NODE_FIND_BY_ID] = {
+        "node_find_by_id",
+        "SELECT id, status, ip, key, vcpus, vmemory, isenable FROM node "
+        "WHERE id = $1 ORDER BY key DESC;",
+        1, { DB_INT4 } },
+    [DB_STMT_NODE_UPDATE_SECRET] = {
+        "node_update_secret",
+        "UPDATE node SET key = $1, updated = now() WHERE id = $2;",
+        2, { DB_TEXT, DB_INT4 } },
+    [DB_STMT_NODE_UPDATE_BY_IP] = {
+        "node_update_by_ip",
+        "UPDATE node SET memory = $1, hostname = $2, arch = $3, cpus = $4, "
+        "cpu_model = $5, cpu_mhz = $6, status = $7, "
+        "updated = now() WHERE ip = $8;",
+        8, { DB_INT4, DB_TEXT, DB_INT4, DB_INT4,
+             DB_TEXT, DB_INT4, DB_INT4, DB_TEXT } },
+    [DB_STMT_NODE_UPDATE_BY_ID] = {
+        "node_update_by_id",
+        "UPDATE node SET memory = $1, hostname = $2, arch = $3, cpus = $4, "
+        "cpu_model = $5, cpu_mhz = $6, status = $7, "
+        "ip = $8, updated = now() WHERE id = $9;",
+        9, { DB_INT4, DB_TEXT, DB_INT4, DB_INT4,
+             DB_TEXT, DB_INT4, DB_INT4, DB_TEXT, DB_INT4 } },
+    [DB_STMT_NODE_ENABLE] = {
+        "node_enable",
+        "UPDATE node SET isenable = $1, updated = now() WHERE id = $2;",
+        2, { DB_BOOL, DB_INT4 } },
+    [DB_STMT_NODE_INSERT] = {
+        "node_insert",
+        "INSERT INTO node (id, hostname, ip, arch, memory, "
+        "status, cpus, cpu_model, vcpus, vmemory, cpu_mhz, created, updated) "
+        "VALUES (nextval('node_id_seq'), $1, $2, $3, $4, "
+        "$5, $6, $7, $8, $9, $10, now(), now()) RETURNING id;",
+        10, { DB_TEXT, DB_TEXT, DB_INT4, DB_INT4,
+              DB_INT4, DB_INT4, DB_TEXT, DB_INT4, DB_INT4, DB_INT4 } },
+    [DB_STMT_NODE_UPDATE_STATUS] = {
+        "node_update_status",
+        "UPDATE node SET status = $1, updated = now() WHERE id = $2;",
+        2, { DB_INT4, DB_INT4 } },
+    [DB_STMT_NODE_INIT_STATUS] = {
+        "node_init_status",
+        "UPDATE node SET status = $1 WHERE status >= $2 AND status <= $3;",
+        3, { DB_INT4, DB_INT4, DB_INT4 } },
+    [DB_STMT_JOB_GET] = {
+        "job_get",
+        "SELECT status, "
+        "floor(extract(epoch FROM created))::int8, "
+        "floor(extract(epoch FROM started))::int8, "
+        "floor(extract(epoch FROM ended))::int8, "
+        "target_type, target_id, action FROM job WHERE id = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_JOB_GET_ALL] = {
+        "job_get_all",
+        "SELECT id, status, "
+        "floor(extract(epoch FROM created))::int8, "
+        "floor(extract(epoch FROM started))::int8, "
+        "target_type, target_id, action FROM job "
+        "WHERE status >= $1 AND status < $2;",
+        2, { DB_INT4, DB_INT4 } },
+    [DB_STMT_JOB_UPDATE_STATUS] = {
+        "job_update_status",
+        "UPDATE job SET status = $1, "
+        "started = to_timestamp($2)::timestamp, "
+        "ended = to_timestamp($3)::timestamp "
+        "WHERE status != $1 AND id = $4;",
+        4, { DB_INT4, DB_INT8, DB_INT8, DB_INT4 } },
+    [DB_STMT_INS_KEY] = {
+        "ins_key",
+        "SELECT key FROM instance WHERE id = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_INS_UPDATE_KEY] = {
+        "ins_update_key",
+        "UPDATE instance SET key = $1, updated = now() WHERE id = $2;",
+        2, { DB_TEXT, DB_INT4 } },
+    [DB_STMT_INS_STATUS_GET] = {
+        "ins_status_get",
+        "SELECT key, ip, node_id, status FROM instance WHERE id = $1;",
+        1, { DB_INT4 } },
+    /*
+    ** one row for each instance in the arrays, NULL means the column
+    ** is not changed, set_node tells whether to set node_id
+    */
+    [DB_STMT_INS_STATUS_FLUSH] = {
+        "ins_status_flush",
+        "UPDATE instance SET ip = COALESCE(v.ip, instance.ip), "
+        "status = COALESCE(v.status, instance.status), "
+        "node_id = CASE WHEN v.set_node THEN v.node_id "
+        "ELSE instance.node_id END, "
+        "key = COALESCE(v.key, instance.key), "
+        "vdi_port = COALESCE(v.vdi_port, instance.vdi_port), "
+        "rx = COALESCE(v.rx, instance.rx), tx = COALESCE(v.tx, instance.tx), "
+        "updated = CASE WHEN v.ip IS NOT NULL OR v.status IS NOT NULL "
+        "OR v.set_node THEN now() ELSE instance.updated END "
+        "FROM unnest($1::int4[], $2::text[], $3::int4[], $4::bool[], "
+        "$5::int4[], $6::text[], $7::int4[], $8::int8[], $9::int8[]) "
+        "AS v(id, ip, status, set_node, node_id, key, vdi_port, rx, tx) "
+        "WHERE instance.id = v.id AND instance.status != $10;",
+        10, { 0, 0, 0, 0, 0, 0, 0, 0, 0, DB_INT4 } },
+    [DB_STMT_INS_DELETE] = {
+        "ins_delete",
+        "DELETE FROM instance WHERE id = $1 AND status = $2;",
+        2, { DB_INT4, DB_INT4 } },
+    [DB_STMT_INS_CONTROL] = {
+        "ins_control",
+        "SELECT instance.name, instance.cpus, instance.memory, "
+        "instance.ip, instance.node_id, "
+        "instance.appliance_id, appliance.name, "
+        "appliance.checksum, instance.status, instance.key, "
+        "instance.extendsize, "
+        "instance.secret_config, instance.config "
+        "FROM instance, appliance "
+        "WHERE instance.id = $1 AND appliance.id = instance.appliance_id;",
+        1, { DB_INT4 } },
+    [DB_STMT_INS_IP_BY_STATUS] = {
+        "ins_ip_by_status",
+        "SELECT ip FROM instance WHERE status = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_INS_NODE] = {
+        "ins_node",
+        "SELECT node_id FROM instance WHERE id = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_INS_ALL] = {
+        "ins_all",
+        "SELECT id FROM instance;",
+        0, { 0 } },
+    [DB_STMT_INS_ALL_BY_STATUS] = {
+        "ins_all_by_status",
+        "SELECT id FROM instance WHERE status = $1;",
+        1, { DB_INT4 } },
+    [DB_STMT_INS_ALL_BY_RANGE] = {
+        "ins_all_by_range",
+        "SELECT id FROM instance WHERE status >= $1 AND status <= $2;",
+        2, { DB_INT4, DB_INT4 } },
+    [DB_STMT_INS_INIT_STATUS] = {
+        "ins_init_status",
+        "UPDATE instance SET status = $1 WHERE status >= $2 AND status <= $3;",
+        3, { DB_INT4, DB_INT4, DB_INT4 } },
+};
+
+/* prepare all the statements on a blocking connection */
+int ly_db_prepare(PGconn * conn)
+{
+    int i;
+    for (i = 0; i < DB_STMT_MAX; i++) {
+        const LYDBStmt * s = &g_db_stmts[i];
+        PGresult * res = PQprepare(conn, s->name, s->sql,
+                                   s->nparams, s->types);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            logerror(_("db prepare %s failed: %s\n"), s->name,
+                       PQerrorMessage(conn));
+            PQclear(res);
+            return -1;
+        }
+        PQclear(res);
+    }
+    return 0;
+}
+
+const char * ly_db_stmt_name(int stmt)
+{
+    if (stmt < 0 || stmt >= DB_STMT_MAX)
+        return NULL;
+    return g_db_stmts[stmt].name;
+}
+
+void ly_db_params_init(LYDBParams * p)
+{
+    p->n = 0;
+}
+
+static int __db_param_bin(LYDBParams * p, uint64_t v, int len)
+{
+    if (p->n >= DB_PARAMS_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+
+    /* network byte order */
+    int i;
+    char * b = p->buf[p->n];
+    for (i = len - 1; i >= 0; i--) {
+        b[i] = v & 0xff;
+        v >>= 8;
+    }
+    p->values[p->n] = b;
+    p->lengths[p->n] = len;
+    p->formats[p->n] = 1;
+    p->n++;
+    return 0;
+}
+
+int ly_db_param_int(LYDBParams * p, int v)
+{
+    return __db_param_bin(p, (uint32_t)v, 4);
+}
+
+int ly_db_param_long(LYDBParams * p, int64_t v)
+{
+    return __db_param_bin(p, (uint64_t)v, 8);
+}
+
+int ly_db_param_bool(LYDBParams * p, int v)
+{
+    return __db_param_bin(p, v ? 1 : 0, 1);
+}
+
+/* strings are sent in text format, NULL is sent as SQL NULL */
+int ly_db_param_str(LYDBParams * p, const char * v)
+{
+    if (p->n >= DB_PARAMS_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    p->values[p->n] = v;
+    p->lengths[p->n] = 0;
+    p->formats[p->n] = 0;
+    p->n++;
+    return 0;
+}
+
+int ly_db_param_null(LYDBParams * p)
+{
+    return ly_db_param_str(p, NULL);
+}
+
+static int64_t __db_get_bin(const char * s, int len)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 0; i < len; i++)
+        v = (v << 8) | (unsigned char)s[i];
+    /* sign extension */
+    if (len < 8 && (v & ((uint64_t)1 << (len * 8 - 1))))
+        v |= ~(uint64_t)0 << (len * 8);
+    return (int64_t)v;
+}
+
+int64_t ly_db_get_long(const PGresult * res, int row, int col)
+{
+    if (PQgetisnull(res, row, col))
+        return 0;
+
+    char * s = PQgetvalue(res, row, col);
+    if (PQfformat(res, col) == 0)
+        return atoll(s);
+
+    int len = PQgetlength(res, row, col);
+    if (len == 1 || len == 2 || len == 4 || len == 8)
+        return __db_get_bin(s, len);
+
+    logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+    return 0;
+}
+
+int ly_db_get_int(const PGresult * res, int row, int col)
+{
+    return (int)ly_db_get_long(res, row, col);
+}
+
+int ly_db_get_bool(const PGresult * res, int row, int col)
+{
+    if (PQgetisnull(res, row, col))
+        return 0;
+
+    char * s = PQgetvalue(res, row, col);
+    if (PQfformat(res, col) == 0)
+        return s[0] == 't' ? 1 : 0;
+    return s[0] ? 1 : 0;
+}
+
+/* binary format of text types is the string itself */
+char * ly_db_get_str(const PGresult * res, int row, int col)
+{
+    return PQgetvalue(res, row, col);
+}
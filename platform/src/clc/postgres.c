@@ -32,6 +32,7 @@
 #include <libpq-fe.h>
 
 #include "../util/logging.h"
+#include "../util/lymetric.h"
 #include "../luoyun/luoyun.h"
 #include "lyclc.h"
 #include "lyjob.h"
@@ -40,16 +41,40 @@
 PGconn * _db_conn = NULL;
 pthread_mutex_t _db_lock;
 
-static PGresult * __db_select(char *sql)
-{
-    PGresult *res;
+/* metrics of statements executed synchronously, see ly_db_init */
+static LYMetric * g_m_db_time[DB_STMT_MAX];
+static LYMetric * g_m_db_errors;
 
+/* time spent includes waiting for db lock */
+static PGresult * __db_exec_prepared(int stmt, LYDBParams * p)
+{
+    unsigned long long t = lymetric_now_us();
     pthread_mutex_lock(&_db_lock);
-    res = PQexec(_db_conn, sql);
+    PGresult * res = PQexecPrepared(_db_conn, ly_db_stmt_name(stmt),
+                                    p->n, p->values, p->lengths,
+                                    p->formats, 1);
     pthread_mutex_unlock(&_db_lock);
 
+    if (stmt >= 0 && stmt < DB_STMT_MAX)
+        lymetric_observe(g_m_db_time[stmt], lymetric_now_us() - t);
+    ExecStatusType status = PQresultStatus(res);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK)
+        lymetric_inc(g_m_db_errors);
+    return res;
+}
+
+static PGresult * __db_select(int stmt, int key, LYDBParams * p)
+{
+    PGresult *res;
+
+    /* statements of the key sent earlier must be completed first */
+    ly_db_async_wait(key);
+
+    res = __db_exec_prepared(stmt, p);
+
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        logerror(_("db exec failed: %s\n"), PQerrorMessage(_db_conn));
+        logerror(_("db exec %s failed: %s\n"), ly_db_stmt_name(stmt),
+                   PQresultErrorMessage(res));
         PQclear(res);
         return NULL;
     }
@@ -57,16 +82,18 @@ static PGresult * __db_select(char *sql)
     return res;
 }
 
-static int __db_exec(char *sql)
+static int __db_exec(int stmt, int key, LYDBParams * p)
 {
     PGresult *res;
 
-    pthread_mutex_lock(&_db_lock);
-    res = PQexec(_db_conn, sql);
-    pthread_mutex_unlock(&_db_lock);
+    /* statements of the key sent earlier must be completed first */
+    ly_db_async_wait(key);
+
+    res = __db_exec_prepared(stmt, p);
 
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        logerror(_("db exec failed: %s\n"), PQerrorMessage(_db_conn));
+        logerror(_("db exec %s failed: %s\n"), ly_db_stmt_name(stmt),
+                   PQresultErrorMessage(res));
         PQclear(res);
         return -1;
     }
@@ -75,33 +102,82 @@ static int __db_exec(char *sql)
     return 0;
 }
 
+static void __db_exec_done(PGresult * res, void * data)
+{
+    if (res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK)
+        logerror(_("db exec %s failed: %s\n"), (char *)data,
+                   res ? PQresultErrorMessage(res) : "no connection");
+}
+
+/* result is not needed, send it on async connections if possible */
+static int __db_exec_async(int stmt, int key, LYDBParams * p)
+{
+    if (ly_db_async_prepared(stmt, key, p, __db_exec_done,
+                             (void *)ly_db_stmt_name(stmt)) == 0)
+        return 0;
+    return __db_exec(stmt, key, p);
+}
+
+PGresult * ly_db_select(int stmt, int key, LYDBParams * p)
+{
+    return __db_select(stmt, key, p);
+}
+
+/*
+** send the statement on async connections if possible, otherwise
+** execute it now. cb is called with the result in both cases
+*/
+int ly_db_exec_async(int stmt, int key, LYDBParams * p, LYDBCallback cb,
+                     void * data)
+{
+    if (ly_db_async_prepared(stmt, key, p, cb, data) == 0)
+        return 0;
+
+    if (ly_db_stmt_name(stmt) == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        if (cb)
+            cb(NULL, data);
+        return -1;
+    }
+
+    ly_db_async_wait(key);
+
+    PGresult * res = __db_exec_prepared(stmt, p);
+
+    if (cb)
+        cb(res, data);
+    if (res)
+        PQclear(res);
+    return 0;
+}
+
 /* return db id if exists */
 int db_node_exist(int type, void * data)
 {
     if (data == NULL) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);        
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_IP)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id from node where ip = '%s';", (char *)data);
-    else if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id from node where id = %d;", *(int *)data);
+    int ret, stmt, key;
+    LYDBParams p;
+    ly_db_params_init(&p);
+    if (type == DB_NODE_FIND_BY_IP) {
+        stmt = DB_STMT_NODE_EXIST_BY_IP;
+        key = DB_KEY_NODES;
+        ly_db_param_str(&p, (char *)data);
+    }
+    else if (type == DB_NODE_FIND_BY_ID) {
+        stmt = DB_STMT_NODE_EXIST_BY_ID;
+        key = DB_KEY_NODE(*(int *)data);
+        ly_db_param_int(&p, *(int *)data);
+    }
     else {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);        
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    PGresult *res = __db_select(stmt, key, &p);
     if (res == NULL)
         return -1;
 
@@ -111,7 +187,7 @@ int db_node_exist(int type, void * data)
         ret = -1;
     }
     else if (ret == 1) {
-        ret = atoi(PQgetvalue(res, 0, 0));
+        ret = ly_db_get_int(res, 0, 0);
         if (ret <= 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             ret = -1;
@@ -130,27 +206,25 @@ int db_node_find_secret(int type, void * data, char ** secret)
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_IP)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id, key from node where ip = '%s';",
-                       (char *)data);
-    else if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id, key from node where id = %d;",
-                       *(int *)data);
-    else {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
+    int ret, stmt, key;
+    LYDBParams p;
+    ly_db_params_init(&p);
+    if (type == DB_NODE_FIND_BY_IP) {
+        stmt = DB_STMT_NODE_SECRET_BY_IP;
+        key = DB_KEY_NODES;
+        ly_db_param_str(&p, (char *)data);
     }
-
-    if (ret >= LINE_MAX) {
+    else if (type == DB_NODE_FIND_BY_ID) {
+        stmt = DB_STMT_NODE_SECRET_BY_ID;
+        key = DB_KEY_NODE(*(int *)data);
+        ly_db_param_int(&p, *(int *)data);
+    }
+    else {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    PGresult *res = __db_select(sql);
+    PGresult *res = __db_select(stmt, key, &p);
     if (res == NULL)
         return -1;
 
@@ -160,12 +234,12 @@ int db_node_find_secret(int type, void * data, char ** secret)
         ret = -1;
     }
     else if (ret == 1) {
-        ret = atoi(PQgetvalue(res, 0, 0));
+        ret = ly_db_get_int(res, 0, 0);
         if (ret <= 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             ret = -1;
         }
-        char * s = PQgetvalue(res, 0, 1);
+        char * s = ly_db_get_str(res, 0, 1);
         if (s && strlen(s))
             *secret = strdup(s);
     }
@@ -178,51 +252,48 @@ int db_node_find_secret(int type, void * data, char ** secret)
 int db_node_find(int type, void * data, DBNodeRegInfo * db_nf)
 {
     if (data == NULL || db_nf == NULL) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);        
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_IP)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id, status, ip, key, vcpus, vmemory, isenable from node "
-                       "where ip = '%s' order by key DESC;", (char *)data);
-    else if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "SELECT id, status, ip, key, vcpus, vmemory, isenable from node "
-                       "where id = %d order by key DESC;", *(int *)data);
+    int ret, stmt, key;
+    LYDBParams p;
+    ly_db_params_init(&p);
+    if (type == DB_NODE_FIND_BY_IP) {
+        stmt = DB_STMT_NODE_FIND_BY_IP;
+        key = DB_KEY_NODES;
+        ly_db_param_str(&p, (char *)data);
+    }
+    else if (type == DB_NODE_FIND_BY_ID) {
+        stmt = DB_STMT_NODE_FIND_BY_ID;
+        key = DB_KEY_NODE(*(int *)data);
+        ly_db_param_int(&p, *(int *)data);
+    }
     else {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);        
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    PGresult *res = __db_select(stmt, key, &p);
     if (res == NULL)
         return -1;
 
     ret = PQntuples(res);
     if (ret >= 1) {
-        db_nf->id = atoi(PQgetvalue(res, 0, 0));
-        db_nf->status = atoi(PQgetvalue(res, 0, 1));
-        char * s = PQgetvalue(res, 0, 2);
+        db_nf->id = ly_db_get_int(res, 0, 0);
+        db_nf->status = ly_db_get_int(res, 0, 1);
+        char * s = ly_db_get_str(res, 0, 2);
         if (s && strlen(s))
             db_nf->ip = strdup(s);
-        s = PQgetvalue(res, 0, 3);
+        s = ly_db_get_str(res, 0, 3);
         if (s && strlen(s))
             db_nf->secret = strdup(s);
-        db_nf->cpu_vlimit = atoi(PQgetvalue(res, 0, 4));
-        db_nf->mem_vlimit = atoi(PQgetvalue(res, 0, 5));
-        s = PQgetvalue(res, 0, 6);
-        db_nf->enabled = s[0] == 't' ? 1 : 0;
+        db_nf->cpu_vlimit = ly_db_get_int(res, 0, 4);
+        db_nf->mem_vlimit = ly_db_get_int(res, 0, 5);
+        db_nf->enabled = ly_db_get_bool(res, 0, 6);
     }
     if (ret > 1) {
-        char * s = PQgetvalue(res, 1, 3);
+        char * s = ly_db_get_str(res, 1, 3);
         if (s && strlen(s))
             ret = 1;
         /* do not allow more than 1 entry with same ip and NULL key */
@@ -252,119 +323,88 @@ int db_node_update_secret(int type, void * data, char * secret)
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE node SET key = '%s', " 
-                       "updated = 'now' WHERE id= %d;",
-                       secret, *(int *)data);
-    else {
+    if (type != DB_NODE_FIND_BY_ID) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_str(&p, secret);
+    ly_db_param_int(&p, *(int *)data);
+    return __db_exec(DB_STMT_NODE_UPDATE_SECRET, DB_KEY_NODE(*(int *)data),
+                     &p);
 }
 
-int db_node_update(int type, void * data, NodeInfo * nf) 
+int db_node_update(int type, void * data, NodeInfo * nf)
 {
     if (data == NULL || nf == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_IP)
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE node SET memory = %d, "
-                       "hostname = '%s', arch = %d, cpus = %d, "
-                       "cpu_model = '%s', cpu_mhz = %d, status = %d, "
-                       "updated = 'now' WHERE ip = '%s';",
-                       nf->mem_max,
-                       nf->host_name, nf->cpu_arch, nf->cpu_max,
-                       nf->cpu_model, nf->cpu_mhz, nf->status,
-                       nf->host_ip);
-    else if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE node SET memory = %d, "
-                       "hostname = '%s', arch = %d, cpus = %d, "
-                       "cpu_model = '%s', cpu_mhz = %d, status = %d, "
-                       "ip = '%s', updated = 'now' WHERE id = %d;",
-                       nf->mem_max,
-                       nf->host_name, nf->cpu_arch, nf->cpu_max,
-                       nf->cpu_model, nf->cpu_mhz, nf->status,
-                       nf->host_ip, *(int *)data);
-    else {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
+    int stmt, key;
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, nf->mem_max);
+    ly_db_param_str(&p, nf->host_name);
+    ly_db_param_int(&p, nf->cpu_arch);
+    ly_db_param_int(&p, nf->cpu_max);
+    ly_db_param_str(&p, nf->cpu_model);
+    ly_db_param_int(&p, nf->cpu_mhz);
+    ly_db_param_int(&p, nf->status);
+    if (type == DB_NODE_FIND_BY_IP) {
+        stmt = DB_STMT_NODE_UPDATE_BY_IP;
+        key = DB_KEY_NODES;
+        ly_db_param_str(&p, nf->host_ip);
     }
-
-    if (ret >= LINE_MAX) {
+    else if (type == DB_NODE_FIND_BY_ID) {
+        stmt = DB_STMT_NODE_UPDATE_BY_ID;
+        key = DB_KEY_NODE(*(int *)data);
+        ly_db_param_str(&p, nf->host_ip);
+        ly_db_param_int(&p, *(int *)data);
+    }
+    else {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    return __db_exec(sql);
+    return __db_exec_async(stmt, key, &p);
 }
 
 int db_node_enable(int id, int enable)
 {
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "UPDATE node SET isenable = '%s', "
-                       "updated = 'now' WHERE id= %d;",
-                       enable ? "True" : "False", id);
-
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_bool(&p, enable);
+    ly_db_param_int(&p, id);
+    return __db_exec(DB_STMT_NODE_ENABLE, DB_KEY_NODE(id), &p);
 }
 
 /* upon successful completion, id of new entry is returned */
 int db_node_insert(NodeInfo * nf)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX,
-                 "INSERT INTO node (id, hostname, ip, arch, memory, "
-                 "status, cpus, cpu_model, "
-                 "vcpus, vmemory, "
-                 "cpu_mhz, created, updated) "
-                 "VALUES (nextval('node_id_seq'), '%s', '%s', %d, %d, "
-                 "%d, %d, '%s', "
-                 "%d, %d, "
-                 "%d, 'now', 'now');",
-                 nf->host_name, nf->host_ip, nf->cpu_arch, nf->mem_max,
-                 nf->status, nf->cpu_max, nf->cpu_model,
-                 nf->cpu_vlimit, nf->mem_vlimit,
-                 nf->cpu_mhz) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);        
-        return -1;
-    }
-    if (__db_exec(sql) < 0) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    if (snprintf(sql, LINE_MAX,
-                 "SELECT id from node where ip = '%s' order by id DESC; ",
-                 nf->host_ip) >= LINE_MAX) {
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_str(&p, nf->host_name);
+    ly_db_param_str(&p, nf->host_ip);
+    ly_db_param_int(&p, nf->cpu_arch);
+    ly_db_param_int(&p, nf->mem_max);
+    ly_db_param_int(&p, nf->status);
+    ly_db_param_int(&p, nf->cpu_max);
+    ly_db_param_str(&p, nf->cpu_model);
+    ly_db_param_int(&p, nf->cpu_vlimit);
+    ly_db_param_int(&p, nf->mem_vlimit);
+    ly_db_param_int(&p, nf->cpu_mhz);
+
+    PGresult *res = __db_select(DB_STMT_NODE_INSERT, DB_KEY_NODES, &p);
+    if (res == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
-    PGresult *res = __db_select(sql);
-    if (res == NULL)
-        return -1;
-    int ret = atoi(PQgetvalue(res, 0, 0));
+    int ret = -1;
+    if (PQntuples(res) == 1)
+        ret = ly_db_get_int(res, 0, 0);
     PQclear(res);
     return ret;
 }
@@ -376,52 +416,38 @@ int db_node_update_status(int type, void * data, int status)
         return -1;
     }
 
-    int ret;
-    char sql[LINE_MAX];
-    if (type == DB_NODE_FIND_BY_ID)
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE node SET status = %d, "
-                       "updated = 'now' WHERE id= %d;",
-                       status, *(int *)data);
-    else {
+    if (type != DB_NODE_FIND_BY_ID) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
 
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, status);
+    ly_db_param_int(&p, *(int *)data);
+    return __db_exec_async(DB_STMT_NODE_UPDATE_STATUS,
+                           DB_KEY_NODE(*(int *)data), &p);
 }
 
 int db_job_get(LYJobInfo * job)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX,
-                 "SELECT status, "
-                 "extract(epoch FROM created), "
-                 "extract(epoch FROM started), "
-                 "extract(epoch FROM ended), "
-                 "target_type, target_id, action "
-                 "from job where id = %d;",
-                 job->j_id) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    PGresult * res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, job->j_id);
+    PGresult * res = __db_select(DB_STMT_JOB_GET, DB_KEY_JOB(job->j_id),
+                                 &p);
     if (res == NULL)
         return -1;
 
     int ret = PQntuples(res);
     if (ret == 1) {
-        job->j_status = atoi(PQgetvalue(res, 0, 0));
-        job->j_created = atol(PQgetvalue(res, 0, 1));
-        job->j_started = atol(PQgetvalue(res, 0, 2));
-        job->j_ended = atol(PQgetvalue(res, 0, 3));
-        job->j_target_type = atoi(PQgetvalue(res, 0, 4));
-        job->j_target_id = atoi(PQgetvalue(res, 0, 5));
-        job->j_action = atoi(PQgetvalue(res, 0, 6));
+        job->j_status = ly_db_get_int(res, 0, 0);
+        job->j_created = ly_db_get_long(res, 0, 1);
+        job->j_started = ly_db_get_long(res, 0, 2);
+        job->j_ended = ly_db_get_long(res, 0, 3);
+        job->j_target_type = ly_db_get_int(res, 0, 4);
+        job->j_target_id = ly_db_get_int(res, 0, 5);
+        job->j_action = ly_db_get_int(res, 0, 6);
         logdebug(_("new job from db %d %d %d\n"), job->j_id, job->j_status, job->j_action);
         ret = 0;
     }
@@ -440,19 +466,11 @@ int db_job_get(LYJobInfo * job)
 
 int db_job_get_all(void)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX,
-                 "SELECT id, status, "
-                 "extract(epoch FROM created), "
-                 "extract(epoch FROM started), "
-                 "target_type, target_id, action "
-                 "from job "
-                 "where status >= %d and status < %d;",
-                 LY_S_PENDING, LY_S_PENDING_LAST_STATUS) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    PGresult * res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, LY_S_PENDING);
+    ly_db_param_int(&p, LY_S_PENDING_LAST_STATUS);
+    PGresult * res = __db_select(DB_STMT_JOB_GET_ALL, DB_KEY_ALL, &p);
     if (res == NULL)
         return -1;
 
@@ -463,13 +481,13 @@ int db_job_get_all(void)
         if (job == NULL)
             return -1;
         bzero(job, sizeof(LYJobInfo));
-        job->j_id = atoi(PQgetvalue(res, r, 0));
-        job->j_status = atoi(PQgetvalue(res, r, 1));
-        job->j_created = atol(PQgetvalue(res, r, 2));
-        job->j_started = atol(PQgetvalue(res, r, 3));
-        job->j_target_type = atoi(PQgetvalue(res, r, 4));
-        job->j_target_id = atoi(PQgetvalue(res, r, 5));
-        job->j_action = atoi(PQgetvalue(res, r, 6));
+        job->j_id = ly_db_get_int(res, r, 0);
+        job->j_status = ly_db_get_int(res, r, 1);
+        job->j_created = ly_db_get_long(res, r, 2);
+        job->j_started = ly_db_get_long(res, r, 3);
+        job->j_target_type = ly_db_get_int(res, r, 4);
+        job->j_target_id = ly_db_get_int(res, r, 5);
+        job->j_action = ly_db_get_int(res, r, 6);
         job_insert(job);
     }
 
@@ -479,46 +497,34 @@ int db_job_get_all(void)
 
 int db_job_update_status(LYJobInfo * job)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX,
-                 "UPDATE job SET status = %d, "
-                 "started = %ld::abstime::timestamp, "
-                 "ended = %ld::abstime::timestamp "
-                 "WHERE status != %d and id = %d;",
-                  job->j_status, (long)job->j_started, (long)job->j_ended,
-                  job->j_status, job->j_id) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    return __db_exec(sql);
-
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, job->j_status);
+    ly_db_param_long(&p, job->j_started);
+    ly_db_param_long(&p, job->j_ended);
+    ly_db_param_int(&p, job->j_id);
+    return __db_exec_async(DB_STMT_JOB_UPDATE_STATUS, DB_KEY_JOB(job->j_id),
+                           &p);
 }
 
 int db_instance_find_secret(int id, char ** secret)
 {
     *secret = NULL;
 
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "SELECT key from instance where id = %d;",
-                       id);
-
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, id);
+    PGresult *res = __db_select(DB_STMT_INS_KEY, DB_KEY_INSTANCE(id), &p);
     if (res == NULL)
         return -1;
 
-    ret = PQntuples(res);
+    int ret = PQntuples(res);
     if (ret > 1) {
         logerror(_("DB have multi instance with same id %d\n"), id);
         ret = -1;
     }
     else if (ret == 1) {
-        char * s = PQgetvalue(res, 0, 0);
+        char * s = ly_db_get_str(res, 0, 0);
         if (s && strlen(s)) {
             char * str = strdup(s);
             char * str1 = index(str, ':');
@@ -540,29 +546,22 @@ int db_instance_update_secret(int id, char * secret)
         return -1;
     }
 
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "SELECT key from instance where id = %d;",
-                       id);
-
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, id);
+    PGresult *res = __db_select(DB_STMT_INS_KEY, DB_KEY_INSTANCE(id), &p);
     if (res == NULL)
         return -1;
 
     char * str = NULL, * saveptr1 = NULL;
-    ret = PQntuples(res);
+    int ret = PQntuples(res);
     if (ret > 1) {
         logerror(_("DB have multi instance with same id %d\n"), id);
         ret = -1;
         goto done;
     }
     else if (ret == 1) {
-        char * s = PQgetvalue(res, 0, 0);
+        char * s = ly_db_get_str(res, 0, 0);
         if (s && strlen(s)) {
             str = strdup(s);
             saveptr1 = index(str, ':');
@@ -576,23 +575,24 @@ int db_instance_update_secret(int id, char * secret)
             }
         }
     }
+
+    char key[LINE_MAX];
     if (saveptr1)
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE instance SET key = '%s:%s', "
-                       "updated = 'now' WHERE id= %d;",
-                       secret, saveptr1, id);
+        ret = snprintf(key, LINE_MAX, "%s:%s", secret, saveptr1);
     else
-        ret = snprintf(sql, LINE_MAX,
-                       "UPDATE instance SET key = '%s', "
-                       "updated = 'now' WHERE id= %d;",
-                       secret, id);
+        ret = snprintf(key, LINE_MAX, "%s", secret);
     if (ret >= LINE_MAX) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         ret = -1;
         goto done;
     }
 
-    ret = __db_exec(sql);
+    ly_db_params_init(&p);
+    ly_db_param_str(&p, key);
+    ly_db_param_int(&p, id);
+    ret = __db_exec(DB_STMT_INS_UPDATE_KEY, DB_KEY_INSTANCE(id), &p);
+    if (ret == 0)
+        ly_db_cache_secret(id, secret);
 done:
     PQclear(res);
     if (str)
@@ -600,183 +600,51 @@ done:
     return ret;
 }
 
-int db_instance_update_status(int instance_id, InstanceInfo * ii, int node_id)
-{
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "SELECT key, ip, node_id, status from instance where id = %d;",
-                       instance_id);
-
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
-    if (res == NULL) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    unsigned long sum1 = 0, sum2 = 0;
-    char s_key[256], s_ip[100], s_status[20], s_node_id[20];
-    s_key[0] = '\0';
-    s_ip[0] = '\0';
-    s_node_id[0] = '\0';
-    s_status[0] = '\0';
-    ret = PQntuples(res);
-    if (ret > 1) {
-        logerror(_("DB have multi instance(%d) with same tag\n"), instance_id);
-        PQclear(res);
-        return -1;
-    }
-    else if (ret == 1) {
-        if (ii) {
-            char * s = PQgetvalue(res, 0, 0);
-            char * str = NULL, *savestr = NULL, * ptr[6];
-            int i;
-            if (s && strlen(s)) {
-                str = strdup(s);
-                savestr = str;
-            }
-            for (i=0; i<6; i++) { 
-                ptr[i] = NULL;
-                if (str && strlen(str)) {
-                    ptr[i] = str;
-                    str = index(str, ':');
-                    if (str) {
-                        *str = '\0';
-                        str++;
-                    }
-                }
-            }
-            int gport = 0;
-            unsigned long pre1 = 0, pre2 = 0;
-            if (ptr[1])
-                gport = atoi(ptr[1]);
-            if (ptr[2])
-                sum1 = atol(ptr[2]);
-            if (ptr[3])
-                pre1 = atol(ptr[3]);
-            if (ptr[4])
-                sum2 = atol(ptr[4]);
-            if (ptr[5])
-                pre2 = atol(ptr[5]);
-            if (ii->netstat[0].rx_bytes >= pre1) {
-                sum1 += ii->netstat[0].rx_bytes - pre1;
-                sum2 += ii->netstat[0].tx_bytes - pre2;
-            }
-            else {
-                /* just started or rebooted */
-                sum1 += ii->netstat[0].rx_bytes;
-                sum2 += ii->netstat[0].tx_bytes;
-            } 
-            snprintf(s_key, 256, "key = '%s:%d:%ld:%ld:%ld:%ld', vdi_port = %d, rx = %ld, tx = %ld", 
-                                 ptr[0]?ptr[0]:"",
-                                 ii->gport == -1?gport:ii->gport,
-                                 sum1, ii->netstat[0].rx_bytes,
-                                 sum2, ii->netstat[0].tx_bytes,
-                                 ii->gport == -1?gport:ii->gport,
-                                 sum1, sum2);
-            if (savestr)
-                free(savestr);
-        }
-        if (ii && ii->ip && ii->ip[0] != '\0' && ii->ip[0] != ' ') {
-            char * s = PQgetvalue(res, 0, 1);
-            if (s == NULL || strlen(s) == 0 || strcmp(ii->ip, s))
-                snprintf(s_ip, 100, "ip = '%s',", ii->ip);
-        }
-        if (node_id >= 0) {
-            char * s = PQgetvalue(res, 0, 2);
-            if (node_id == 0)
-                snprintf(s_node_id, 20, "node_id = NULL,");
-            else if (s == NULL || strlen(s) == 0 || node_id != atoi(s))
-                snprintf(s_node_id, 20, "node_id = %d,", node_id);
-        }
-        if (ii && ii->status != DOMAIN_S_UNKNOWN) {
-            char * s = PQgetvalue(res, 0, 3);
-            if (s == NULL || strlen(s) == 0 || ii->status != atoi(s))
-                snprintf(s_status, 20, "status = %d,", ii->status);
-        }
-    }
-    PQclear(res);
-
-    if (s_ip[0] == '\0' && s_status[0] == '\0' && s_node_id[0] == '\0' && s_key[0] == '\0')
-        return 0;
-
-    if (snprintf(sql, LINE_MAX, "UPDATE instance SET %s %s %s %s "
-                                "%s "
-                                "WHERE status != %d and id = %d;",
-                                s_ip, s_status, s_node_id, s_key,
-                                s_ip[0] == '\0' && s_status[0] == '\0' && s_node_id[0] == '\0' ? "" : 
-                                    s_key[0] == '\0' ? " updated = 'now' " : ", updated = 'now' ",
-                                DOMAIN_S_DELETE, instance_id) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
- 
-    return __db_exec(sql);
-}
-
 int db_instance_delete(int instance_id)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX, "DELETE from instance WHERE id = %d "
-                                "and status = %d;", 
-                                instance_id, DOMAIN_S_DELETE) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, instance_id);
+    ly_db_param_int(&p, DOMAIN_S_DELETE);
+    ly_db_cache_remove(instance_id);
+    return __db_exec(DB_STMT_INS_DELETE, DB_KEY_INSTANCE(instance_id), &p);
 }
 
 int db_node_instance_control_get(NodeCtrlInstance * ci, int * node_id)
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX,
-                 "SELECT instance.name, instance.cpus, instance.memory, "
-                 "instance.ip, instance.node_id, "
-                 "instance.appliance_id, appliance.name, "
-                 "appliance.checksum, instance.status, instance.key, "
-                 "instance.extendsize, "
-                 "instance.secret_config, instance.config "
-                 "from instance, appliance "
-                 "where instance.id = %d and "
-                 "appliance.id = instance.appliance_id;",
-                 ci->ins_id) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    PGresult * res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, ci->ins_id);
+    PGresult * res = __db_select(DB_STMT_INS_CONTROL,
+                                  DB_KEY_INSTANCE(ci->ins_id), &p);
     if (res == NULL)
         return -1;
 
     int ret = PQntuples(res);
     if (ret == 1) {
-        char * s = PQgetvalue(res, 0, 0);
+        char * s = ly_db_get_str(res, 0, 0);
         if (s && strlen(s))
             ci->ins_name = strdup(s);
-        ci->ins_vcpu = atoi(PQgetvalue(res, 0, 1));
-        ci->ins_mem = atoi(PQgetvalue(res, 0, 2));
+        ci->ins_vcpu = ly_db_get_int(res, 0, 1);
+        ci->ins_mem = ly_db_get_int(res, 0, 2);
         if (ci->ins_mem > 131072)
             ci->ins_mem = 131072; /* 128G max */
         ci->ins_mem = ci->ins_mem << 10;
-        s = PQgetvalue(res, 0, 3);
+        s = ly_db_get_str(res, 0, 3);
         if (s && strlen(s))
             ci->ins_ip = strdup(s);
         ci->ins_mac = NULL;
-        *node_id = atoi(PQgetvalue(res, 0, 4));
-        ci->app_id = atoi(PQgetvalue(res, 0, 5));
-        s = PQgetvalue(res, 0, 6);
+        *node_id = ly_db_get_int(res, 0, 4);
+        ci->app_id = ly_db_get_int(res, 0, 5);
+        s = ly_db_get_str(res, 0, 6);
         if (s && strlen(s))
             ci->app_name = strdup(s);
         ci->app_checksum = malloc(33);
         if (ci->app_checksum)
-            strncpy(ci->app_checksum, PQgetvalue(res, 0, 7), 32);
+            strncpy(ci->app_checksum, ly_db_get_str(res, 0, 7), 32);
         ci->app_checksum[32] = 0;
-        ci->ins_status = atoi(PQgetvalue(res, 0, 8));
-        s = PQgetvalue(res, 0, 9);
+        ci->ins_status = ly_db_get_int(res, 0, 8);
+        s = ly_db_get_str(res, 0, 9);
         if (s && strlen(s)) {
             char * str, * str1;
             str = strdup(s);
@@ -786,11 +654,11 @@ int db_node_instance_control_get(NodeCtrlInstance * ci, int * node_id)
             free(str);
         }
         ci->osm_tag = ci->ins_id;
-        ci->ins_extsize = atoi(PQgetvalue(res, 0, 10));
-        s = PQgetvalue(res, 0, 11);
+        ci->ins_extsize = ly_db_get_int(res, 0, 10);
+        s = ly_db_get_str(res, 0, 11);
         if (s && strlen(s))
             ci->ins_json = strdup(s);
-        s = PQgetvalue(res, 0, 12);
+        s = ly_db_get_str(res, 0, 12);
         if (s && strlen(s))
             ci->osm_json = strdup(s);
         char ins_domain[21];
@@ -816,23 +684,18 @@ int db_node_instance_control_get(NodeCtrlInstance * ci, int * node_id)
 
 int db_instance_find_ip_by_status(int status, char * ins_ip[], int size)
 {
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "SELECT ip from instance where status = %d;",
-                       status);
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, status);
+    PGresult *res = __db_select(DB_STMT_INS_IP_BY_STATUS, DB_KEY_INSTANCES,
+                                &p);
     if (res == NULL)
         return -1;
 
-    ret = PQntuples(res);
+    int ret = PQntuples(res);
     int i, j;
     for (i = j = 0; i< ret; i++) {
-        char * s = PQgetvalue(res, i, 0);
+        char * s = ly_db_get_str(res, i, 0);
         if (s && strlen(s) && strcmp(s, "0.0.0.0")) {
             if (j < size)
                 ins_ip[j] = strdup(s);
@@ -846,22 +709,16 @@ int db_instance_find_ip_by_status(int status, char * ins_ip[], int size)
 
 int db_instance_get_node(int id)
 {
-    char sql[LINE_MAX];
-    int ret = snprintf(sql, LINE_MAX,
-                       "SELECT node_id from instance where id = %d;",
-                       id);
-    if (ret >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    PGresult *res = __db_select(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, id);
+    PGresult *res = __db_select(DB_STMT_INS_NODE, DB_KEY_INSTANCE(id), &p);
     if (res == NULL)
         return -1;
 
-    ret = PQntuples(res);
+    int ret = PQntuples(res);
     if (ret > 0)
-        ret = atoi(PQgetvalue(res, 0, 0));
+        ret = ly_db_get_int(res, 0, 0);
 
     PQclear(res);
     return ret;
@@ -876,20 +733,22 @@ int * db_instance_get_all(int * num, int status)
         return NULL;
     *num = -1;
 
-    char s_status[100];
+    int stmt;
+    LYDBParams p;
+    ly_db_params_init(&p);
     if (status < 0)
-        s_status[0] = '\0';
-    else if (status == DOMAIN_S_START)
-        snprintf(s_status, 100, "where status <= %d and status >= %d", DOMAIN_S_SERVING, DOMAIN_S_START);
-    else
-        snprintf(s_status, 100, "where status = %d", status);
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX, "SELECT id from instance %s;", s_status) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return NULL;
+        stmt = DB_STMT_INS_ALL;
+    else if (status == DOMAIN_S_START) {
+        stmt = DB_STMT_INS_ALL_BY_RANGE;
+        ly_db_param_int(&p, DOMAIN_S_START);
+        ly_db_param_int(&p, DOMAIN_S_SERVING);
+    }
+    else {
+        stmt = DB_STMT_INS_ALL_BY_STATUS;
+        ly_db_param_int(&p, status);
     }
 
-    PGresult *res = __db_select(sql);
+    PGresult *res = __db_select(stmt, DB_KEY_INSTANCES, &p);
     if (res == NULL)
         return NULL;
 
@@ -906,7 +765,7 @@ int * db_instance_get_all(int * num, int status)
 
     int i;
     for (i = 0; i < ret; i++) {
-        ids[i] = atoi(PQgetvalue(res, i, 0));
+        ids[i] = ly_db_get_int(res, i, 0);
     }
 
 out:
@@ -917,32 +776,24 @@ out:
 
 int db_instance_init_status()
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX, "UPDATE instance SET status = %d "
-                                "where status >= %d and status <= %d;",
-                                DOMAIN_S_NEED_QUERY,
-                                DOMAIN_S_START,
-                                DOMAIN_S_SERVING) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, DOMAIN_S_NEED_QUERY);
+    ly_db_param_int(&p, DOMAIN_S_START);
+    ly_db_param_int(&p, DOMAIN_S_SERVING);
+    int ret = __db_exec(DB_STMT_INS_INIT_STATUS, DB_KEY_INSTANCES, &p);
+    ly_db_cache_reload(-1);
+    return ret;
 }
 
 int db_node_init_status()
 {
-    char sql[LINE_MAX];
-    if (snprintf(sql, LINE_MAX, "UPDATE node SET status = %d "
-                                "where status >= %d and status <= %d;",
-                                NODE_STATUS_OFFLINE,
-                                NODE_STATUS_INITIALIZED,
-                                NODE_STATUS_REGISTERED) >= LINE_MAX) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-
-    return __db_exec(sql);
+    LYDBParams p;
+    ly_db_params_init(&p);
+    ly_db_param_int(&p, NODE_STATUS_OFFLINE);
+    ly_db_param_int(&p, NODE_STATUS_INITIALIZED);
+    ly_db_param_int(&p, NODE_STATUS_REGISTERED);
+    return __db_exec(DB_STMT_NODE_INIT_STATUS, DB_KEY_NODES, &p);
 }
 
 
@@ -961,6 +812,20 @@ int ly_db_init(void)
         return -1;
     }
 
+    if (ly_db_prepare(_db_conn) < 0)
+        return -1;
+
+    int i;
+    char name[LYMETRIC_NAME_MAX];
+    for (i = 0; i < DB_STMT_MAX; i++) {
+        snprintf(name, sizeof(name), "ly_clc_db_seconds{stmt=\"%s\"}",
+                 ly_db_stmt_name(i));
+        g_m_db_time[i] = lymetric_histogram(name,
+                                "time of db statements executed synchronously");
+    }
+    g_m_db_errors = lymetric_counter("ly_clc_db_errors_total",
+                                     "db statements failed");
+
     pthread_mutex_init(&_db_lock, NULL);
     return 0;
 }
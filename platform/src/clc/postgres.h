@@ -1,6 +1,9 @@
 #ifndef __LY_INCLUDE_CLC_POSTGRES_H
 #define __LY_INCLUDE_CLC_POSTGRES_H
 
+#include <stdint.h>
+#include <time.h>
+#include <libpq-fe.h>
 #include "../luoyun/luoyun.h"
 #include "lyjob.h"
 
@@ -46,4 +49,135 @@ int ly_db_init();
 void ly_db_close();
 int ly_db_check(void);
 
+/*
+** prepared statements
+**
+** defined in pgstmt.c
+*/
+enum {
+    DB_STMT_NODE_EXIST_BY_IP = 0,
+    DB_STMT_NODE_EXIST_BY_ID,
+    DB_STMT_NODE_SECRET_BY_IP,
+    DB_STMT_NODE_SECRET_BY_ID,
+    DB_STMT_NODE_FIND_BY_IP,
+    DB_STMT_NODE_FIND_BY_ID,
+    DB_STMT_NODE_UPDATE_SECRET,
+    DB_STMT_NODE_UPDATE_BY_IP,
+    DB_STMT_NODE_UPDATE_BY_ID,
+    DB_STMT_NODE_ENABLE,
+    DB_STMT_NODE_INSERT,
+    DB_STMT_NODE_UPDATE_STATUS,
+    DB_STMT_NODE_INIT_STATUS,
+    DB_STMT_JOB_GET,
+    DB_STMT_JOB_GET_ALL,
+    DB_STMT_JOB_UPDATE_STATUS,
+    DB_STMT_INS_KEY,
+    DB_STMT_INS_UPDATE_KEY,
+    DB_STMT_INS_STATUS_GET,
+    DB_STMT_INS_STATUS_FLUSH,
+    DB_STMT_INS_DELETE,
+    DB_STMT_INS_CONTROL,
+    DB_STMT_INS_IP_BY_STATUS,
+    DB_STMT_INS_NODE,
+    DB_STMT_INS_ALL,
+    DB_STMT_INS_ALL_BY_STATUS,
+    DB_STMT_INS_ALL_BY_RANGE,
+    DB_STMT_INS_INIT_STATUS,
+    DB_STMT_MAX
+};
+
+#define DB_PARAMS_MAX		16
+
+/*
+** statement parameters, integers are sent in binary format.
+** values point into buf or to the strings passed in, so the
+** strings must be kept till the statement is sent.
+*/
+typedef struct LYDBParams_t {
+    int n;
+    const char * values[DB_PARAMS_MAX];
+    int lengths[DB_PARAMS_MAX];
+    int formats[DB_PARAMS_MAX];
+    char buf[DB_PARAMS_MAX][8];
+} LYDBParams;
+
+int ly_db_prepare(PGconn * conn);
+const char * ly_db_stmt_name(int stmt);
+void ly_db_params_init(LYDBParams * p);
+int ly_db_param_int(LYDBParams * p, int v);
+int ly_db_param_long(LYDBParams * p, int64_t v);
+int ly_db_param_bool(LYDBParams * p, int v);
+int ly_db_param_str(LYDBParams * p, const char * v);
+int ly_db_param_null(LYDBParams * p);
+
+/* results are read in binary format, NULL is returned as 0 or "" */
+int ly_db_get_int(const PGresult * res, int row, int col);
+int64_t ly_db_get_long(const PGresult * res, int row, int col);
+int ly_db_get_bool(const PGresult * res, int row, int col);
+char * ly_db_get_str(const PGresult * res, int row, int col);
+
+/*
+** async db access
+**
+** defined in pgasync.c
+*/
+/* epoll data of db connections, entity ids are never negative */
+#define DB_EPOLL_ID_BASE	-16
+#define DB_EPOLL_ID(i)		(DB_EPOLL_ID_BASE - (i))
+#define DB_IS_EPOLL_ID(id)	((id) <= DB_EPOLL_ID_BASE)
+
+/*
+** statements of the same key are executed in the order they are
+** issued: async ones are sent on the same connection, synchronous ones
+** wait for the async ones of the key first. rows are keyed by table and
+** id, id 0 keys statements on the whole table, e.g. writes by ip or in
+** batch. a row is ordered after the statements of its table too, the
+** table after all the rows of it.
+*/
+#define DB_KEY_NONE		-1	/* not ordered with others */
+#define DB_KEY_ALL		-2	/* after all the others, sync only */
+#define DB_KEY_ID_BITS		28
+#define DB_KEY_ID_MASK		((1 << DB_KEY_ID_BITS) - 1)
+#define DB_KEY_ROW(t, id)	(((t) << DB_KEY_ID_BITS) | ((id) & DB_KEY_ID_MASK))
+#define DB_KEY_TABLE(key)	((key) >> DB_KEY_ID_BITS)
+#define DB_KEY_ID(key)		((key) & DB_KEY_ID_MASK)
+#define DB_KEY_NODE(id)		DB_KEY_ROW(0, id)
+#define DB_KEY_INSTANCE(id)	DB_KEY_ROW(1, id)
+#define DB_KEY_JOB(id)		DB_KEY_ROW(2, id)
+#define DB_KEY_NODES		DB_KEY_NODE(0)
+#define DB_KEY_INSTANCES	DB_KEY_INSTANCE(0)
+
+/* res is NULL if the statement failed to be executed */
+typedef void (* LYDBCallback)(PGresult * res, void * data);
+
+int ly_db_async_init(int size);
+void ly_db_async_close(void);
+int ly_db_async_query(const char * sql, int key, LYDBCallback cb,
+                      void * data);
+int ly_db_async_prepared(int stmt, int key, LYDBParams * p,
+                         LYDBCallback cb, void * data);
+int ly_db_async_event(int id, uint32_t events);
+int ly_db_async_pending(void);
+int ly_db_async_wait(int key);
+void ly_db_async_lock(void);
+void ly_db_async_unlock(void);
+
+/* for the other db modules, defined in postgres.c */
+PGresult * ly_db_select(int stmt, int key, LYDBParams * p);
+int ly_db_exec_async(int stmt, int key, LYDBParams * p, LYDBCallback cb,
+                     void * data);
+
+/*
+** instance status cache, write behind
+**
+** defined in pgcache.c
+*/
+int ly_db_cache_init(int interval);
+void ly_db_cache_close(void);
+int ly_db_cache_flush(void);
+int ly_db_cache_timer(time_t now);
+void ly_db_cache_secret(int instance_id, const char * secret);
+void ly_db_cache_reload(int instance_id);
+void ly_db_cache_remove(int instance_id);
+
 #endif
@@ -0,0 +1,186 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../util/logging.h"
+#include "timer.h"
+
+#define LY_TIMER_HEAP_SIZE 64
+
+static LYTimer ** g_timer_heap = NULL;
+static int g_timer_heap_size = 0;
+static int g_timer_num = 0;
+static unsigned int g_timer_seq = 0;
+
+static long long __timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int __timer_before(LYTimer * a, LYTimer * b)
+{
+    if (a->expire != b->expire)
+        return a->expire < b->expire;
+    return (int)(a->seq - b->seq) < 0;
+}
+
+static inline void __timer_set(int i, LYTimer * t)
+{
+    g_timer_heap[i] = t;
+    t->index = i;
+}
+
+static void __timer_up(int i)
+{
+    LYTimer * t = g_timer_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!__timer_before(t, g_timer_heap[parent]))
+            break;
+        __timer_set(i, g_timer_heap[parent]);
+        i = parent;
+    }
+    __timer_set(i, t);
+}
+
+static void __timer_down(int i)
+{
+    LYTimer * t = g_timer_heap[i];
+    while (1) {
+        int child = (i << 1) + 1;
+        if (child >= g_timer_num)
+            break;
+        if (child + 1 < g_timer_num &&
+            __timer_before(g_timer_heap[child + 1], g_timer_heap[child]))
+            child++;
+        if (!__timer_before(g_timer_heap[child], t))
+            break;
+        __timer_set(i, g_timer_heap[child]);
+        i = child;
+    }
+    __timer_set(i, t);
+}
+
+void ly_timer_init(LYTimer * t, LYTimerCallback cb, void * data)
+{
+    bzero(t, sizeof(LYTimer));
+    t->index = -1;
+    t->cb = cb;
+    t->data = data;
+}
+
+int ly_timer_pending(LYTimer * t)
+{
+    return t->index >= 0;
+}
+
+int ly_timer_add(LYTimer * t, int delay)
+{
+    if (delay < 0)
+        delay = 0;
+    t->expire = __timer_now() + (long long)delay * 1000;
+    t->seq = g_timer_seq++;
+
+    if (t->index >= 0) {
+        /* reschedule */
+        __timer_up(t->index);
+        __timer_down(t->index);
+        return 0;
+    }
+
+    if (g_timer_num >= g_timer_heap_size) {
+        int size = g_timer_heap_size ? g_timer_heap_size << 1 :
+                                       LY_TIMER_HEAP_SIZE;
+        LYTimer ** heap = realloc(g_timer_heap, size * sizeof(LYTimer *));
+        if (heap == NULL) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
+        }
+        g_timer_heap = heap;
+        g_timer_heap_size = size;
+    }
+    __timer_set(g_timer_num++, t);
+    __timer_up(t->index);
+    return 0;
+}
+
+void ly_timer_del(LYTimer * t)
+{
+    int i = t->index;
+    if (i < 0)
+        return;
+    t->index = -1;
+    if (--g_timer_num == i)
+        return;
+    LYTimer * last = g_timer_heap[g_timer_num];
+    __timer_set(i, last);
+    __timer_up(i);
+    __timer_down(last->index);
+}
+
+int ly_timer_run(void)
+{
+    long long now = __timer_now();
+    /* timers added by callbacks run in the next round */
+    unsigned int seq = g_timer_seq;
+    int n = 0;
+    while (g_timer_num > 0) {
+        LYTimer * t = g_timer_heap[0];
+        if (t->expire > now || (int)(t->seq - seq) >= 0)
+            break;
+        ly_timer_del(t);
+        t->cb(t->data);
+        n++;
+    }
+    return n;
+}
+
+int ly_timer_wait(int max_ms)
+{
+    if (g_timer_num == 0)
+        return max_ms;
+    long long ms = g_timer_heap[0]->expire - __timer_now();
+    if (ms < 0)
+        return 0;
+    if (ms > max_ms)
+        return max_ms;
+    return (int)ms;
+}
+
+void ly_timer_cleanup(void)
+{
+    while (g_timer_num > 0)
+        ly_timer_del(g_timer_heap[0]);
+    free(g_timer_heap);
+    g_timer_heap = NULL;
+    g_timer_heap_size = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __LY_INCLUDE_CLC_TIMER_H
+#define __LY_INCLUDE_CLC_TIMER_H
+
+/*
+** one-shot timers kept in a min-heap, run from the clc main loop.
+** the clc lock must be held when calling these functions.
+** monotonic clock is used, so timers are not affected by system
+** clock changes.
+*/
+typedef void (*LYTimerCallback)(void * data);
+
+typedef struct LYTimer_t {
+    long long expire;           /* in ms, monotonic clock */
+    unsigned int seq;           /* timers expiring together run in order */
+    int index;                  /* position in heap, -1: not scheduled */
+    LYTimerCallback cb;
+    void * data;
+} LYTimer;
+
+void ly_timer_init(LYTimer * t, LYTimerCallback cb, void * data);
+
+/* schedule timer to run in delay seconds, rescheduled if pending */
+int ly_timer_add(LYTimer * t, int delay);
+void ly_timer_del(LYTimer * t);
+int ly_timer_pending(LYTimer * t);
+
+/* run expired timers, return number of timers run */
+int ly_timer_run(void);
+
+/* ms to the next timer, no more than max_ms, for epoll_wait */
+int ly_timer_wait(int max_ms);
+
+void ly_timer_cleanup(void);
+
+#endif
@@ -0,0 +1,314 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "../util/logging.h"
+#include "entity.h"
+#include "events.h"
+#include "worker.h"
+
+/* epoll data of the message pipe, entity ids are never negative */
+#define CLC_WORKER_PIPE_ID	-1
+
+/*
+** messages are queued in worker under clc lock, pipe only wakes the
+** worker up, so no message is lost when pipe is full.
+*/
+typedef struct CLCWorker_t {
+    int id;
+    int efd;
+    int pipefd[2];
+    pthread_t thread;
+    int started;
+    int woken;                  /* pipe written, not read yet */
+    int stop;
+    int *release;               /* entities to be released */
+    int release_num;
+    int release_size;
+} CLCWorker;
+
+static pthread_mutex_t g_clc_lock = PTHREAD_MUTEX_INITIALIZER;
+static CLCWorker *g_workers = NULL;
+static int g_worker_num = 0;
+static int g_worker_next = 0;
+
+void ly_clc_lock(void)
+{
+    pthread_mutex_lock(&g_clc_lock);
+}
+
+void ly_clc_unlock(void)
+{
+    pthread_mutex_unlock(&g_clc_lock);
+}
+
+int ly_worker_num(void)
+{
+    return g_worker_num;
+}
+
+int ly_worker_next(void)
+{
+    if (g_worker_num <= 0)
+        return -1;
+    int w = g_worker_next;
+    g_worker_next = (g_worker_next + 1) % g_worker_num;
+    return w;
+}
+
+int ly_worker_efd(int worker)
+{
+    if (worker < 0 || worker >= g_worker_num)
+        return -1;
+    return g_workers[worker].efd;
+}
+
+int ly_worker_post(int worker, int type, int ent_id)
+{
+    if (worker < 0 || worker >= g_worker_num)
+        return -1;
+
+    CLCWorker * w = &g_workers[worker];
+    if (type == CLC_WORKER_MSG_STOP)
+        w->stop = 1;
+    else if (type == CLC_WORKER_MSG_RELEASE) {
+        if (w->release_num >= w->release_size) {
+            int size = w->release_size ? w->release_size << 1 : 16;
+            int * release = realloc(w->release, size * sizeof(int));
+            if (release == NULL) {
+                logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+                return -1;
+            }
+            w->release = release;
+            w->release_size = size;
+        }
+        w->release[w->release_num++] = ent_id;
+    }
+    else
+        return -1;
+
+    if (w->woken)
+        return 0;
+    /* EAGAIN, pipe is full, worker is to wake up anyway */
+    char c = 0;
+    if (write(w->pipefd[1], &c, 1) != 1 && errno != EAGAIN) {
+        logerror(_("failed waking up worker %d, errno %d\n"),
+                   worker, errno);
+        return -1;
+    }
+    w->woken = 1;
+    return 0;
+}
+
+/* called by entity store, with clc lock held */
+static void __worker_release_notify(int worker, int ent_id)
+{
+    ly_worker_post(worker, CLC_WORKER_MSG_RELEASE, ent_id);
+}
+
+/* return 1 if worker should stop */
+static int __worker_msg(CLCWorker * w)
+{
+    char buf[64];
+    while (1) {
+        int ret = read(w->pipefd[0], buf, sizeof(buf));
+        if (ret > 0 || (ret < 0 && errno == EINTR))
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        logerror(_("worker %d message pipe error(%d, %d)\n"),
+                   w->id, ret, errno);
+        return 1;
+    }
+
+    ly_clc_lock();
+    w->woken = 0;
+    if (w->stop) {
+        ly_clc_unlock();
+        return 1;
+    }
+    /* more may be queued while releasing */
+    int i;
+    for (i = 0; i < w->release_num; i++) {
+        int ent_id = w->release[i];
+        /* entity might be released and reused already */
+        if (ly_entity_is_releasing(ent_id)) {
+            loginfo(_("release entity %d\n"), ent_id);
+            ly_entity_release(ent_id);
+        }
+    }
+    w->release_num = 0;
+    ly_clc_unlock();
+    return 0;
+}
+
+static void * __worker_loop(void * arg)
+{
+    CLCWorker * w = arg;
+    ly_entity_thread_worker(w->id);
+    logdebug(_("worker %d starts event loop\n"), w->id);
+
+    int i, n;
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+    while (1) {
+        n = epoll_wait(w->efd, events, EPOLL_EVENTS_MAX, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            logerror(_("worker %d epoll_wait error(%d)\n"), w->id, errno);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            int id = events[i].data.fd;
+            if (id == CLC_WORKER_PIPE_ID) {
+                if (__worker_msg(w))
+                    goto out;
+                continue;
+            }
+            ly_epoll_entity_event(id, events[i].events);
+        }
+    }
+
+out:
+    logdebug(_("worker %d stops event loop\n"), w->id);
+    return NULL;
+}
+
+static int __worker_init(CLCWorker * w, int id)
+{
+    w->id = id;
+    w->started = 0;
+    w->pipefd[0] = -1;
+    w->pipefd[1] = -1;
+    w->efd = epoll_create(EPOLL_EVENTS_MAX);
+    if (w->efd < 0)
+        return -1;
+
+    if (pipe(w->pipefd) < 0 ||
+        fcntl(w->pipefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(w->pipefd[1], F_SETFL, O_NONBLOCK) < 0)
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = CLC_WORKER_PIPE_ID;
+    if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->pipefd[0], &ev) < 0)
+        return -1;
+
+    return 0;
+}
+
+int ly_worker_start(int num)
+{
+    if (g_workers != NULL)
+        return -255;
+    if (num <= 0)
+        return 0;
+    if (num > CLC_WORKER_MAX)
+        num = CLC_WORKER_MAX;
+
+    g_workers = malloc(num * sizeof(CLCWorker));
+    if (g_workers == NULL)
+        return -1;
+    bzero(g_workers, num * sizeof(CLCWorker));
+
+    /* signals are handled in main thread only */
+    sigset_t set, oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    int i, ret = 0;
+    for (i = 0; i < num; i++) {
+        g_worker_num++;
+        if (__worker_init(&g_workers[i], i) < 0) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            ret = -1;
+            break;
+        }
+        if (pthread_create(&g_workers[i].thread, NULL,
+                           __worker_loop, &g_workers[i]) != 0) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            ret = -1;
+            break;
+        }
+        g_workers[i].started = 1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (ret < 0) {
+        ly_worker_stop();
+        return ret;
+    }
+
+    ly_entity_release_notify(__worker_release_notify);
+    loginfo(_("%d worker event loops started\n"), num);
+    return 0;
+}
+
+/* must be called without clc lock held */
+void ly_worker_stop(void)
+{
+    if (g_workers == NULL)
+        return;
+
+    int i;
+    for (i = 0; i < g_worker_num; i++) {
+        CLCWorker * w = &g_workers[i];
+        if (w->started) {
+            ly_clc_lock();
+            ly_worker_post(i, CLC_WORKER_MSG_STOP, -1);
+            ly_clc_unlock();
+            pthread_join(w->thread, NULL);
+        }
+    }
+
+    ly_entity_release_notify(NULL);
+    for (i = 0; i < g_worker_num; i++) {
+        CLCWorker * w = &g_workers[i];
+        if (w->efd >= 0)
+            close(w->efd);
+        if (w->pipefd[0] >= 0)
+            close(w->pipefd[0]);
+        if (w->pipefd[1] >= 0)
+            close(w->pipefd[1]);
+        free(w->release);
+    }
+    free(g_workers);
+    g_workers = NULL;
+    g_worker_num = 0;
+    g_worker_next = 0;
+    return;
+}
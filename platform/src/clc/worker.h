@@ -0,0 +1,37 @@
+#ifndef __LY_INCLUDE_CLC_WORKER_H
+#define __LY_INCLUDE_CLC_WORKER_H
+
+#include "options.h"
+
+#define CLC_WORKER_MAX		EVENT_WORKERS_MAX
+
+/* messages sent to worker event loops */
+#define CLC_WORKER_MSG_STOP	1
+#define CLC_WORKER_MSG_RELEASE	2	/* release entity owned by the worker */
+
+/*
+** clc lock protects the entity store and job queue. event handlers
+** hold it only around entity and job state, socket reading, packet
+** parsing and db access are done without it. db has its own lock, see
+** pgasync.c, taken after clc lock if both are held.
+*/
+void ly_clc_lock(void);
+void ly_clc_unlock(void);
+
+/* start/stop worker event loops, num == 0 means no worker */
+int ly_worker_start(int num);
+void ly_worker_stop(void);
+
+/* number of worker event loops */
+int ly_worker_num(void);
+
+/* pick the worker for a new entity, round robin, -1 if no worker */
+int ly_worker_next(void);
+
+/* epoll fd of worker event loop */
+int ly_worker_efd(int worker);
+
+/* send message to worker event loop, with clc lock held */
+int ly_worker_post(int worker, int type, int ent_id);
+
+#endif
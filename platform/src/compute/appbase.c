@@ -0,0 +1,489 @@
+/*
+** Copyright (C) 2012 LuoYun Co. 
+**
+**           Authors:
+**                    lijian.gnu@gmail.com 
+**                    zengdongwu@hotmail.com
+**  
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**  
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**  
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**  
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "../util/logging.h"
+#include "../util/misc.h"
+#include "appbase.h"
+
+#define LY_APPBASE_PREFIX "base-"
+#define LY_APPBASE_SUFFIX ".img"
+#define LY_APPBASE_REF_SUFFIX ".ref"
+#define LY_APPBASE_COPY_BUF_SIZE (1 << 20)
+#define LY_APPBASE_HOLE_SIZE 4096
+
+int ly_appbase_path(const char * app_dir, const char * checksum,
+                    char * path, int size)
+{
+    if (snprintf(path, size, "%s/%s%s%s", app_dir, LY_APPBASE_PREFIX,
+                 checksum, LY_APPBASE_SUFFIX) >= size) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+/* number of instances using base */
+static int __ref_get(const char * base)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s%s", base, LY_APPBASE_REF_SUFFIX);
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    int ref = 0;
+    if (fscanf(fp, "%d", &ref) != 1 || ref < 0)
+        ref = 0;
+    fclose(fp);
+    return ref;
+}
+
+static int __ref_set(const char * base, int ref)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s%s", base, LY_APPBASE_REF_SUFFIX) >=
+        PATH_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    if (ref <= 0) {
+        if (unlink(path) && errno != ENOENT)
+            return -1;
+        return 0;
+    }
+
+    if (snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    FILE * fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        logerror(_("open %s failed.\n"), tmp);
+        return -1;
+    }
+    int ret = fprintf(fp, "%d\n", ref);
+    if (fclose(fp) || ret < 0 || rename(tmp, path)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int __base_remove(const char * base)
+{
+    loginfo(_("removing appliance base %s\n"), base);
+    __ref_set(base, 0);
+    if (unlink(base) && errno != ENOENT) {
+        logerror(_("error removing %s, %s\n"), base, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* whether base is the current base in its appliance dir */
+static int __base_is_current(const char * base)
+{
+    char path[PATH_MAX], link[PATH_MAX];
+    const char * name = strrchr(base, '/');
+    if (name == NULL)
+        return 0;
+    snprintf(path, PATH_MAX, "%.*s/%s", (int)(name - base), base,
+             LY_APPBASE_CURRENT);
+    ssize_t len = readlink(path, link, PATH_MAX - 1);
+    if (len < 0)
+        return 0;
+    link[len] = '\0';
+    return strcmp(link, name + 1) == 0;
+}
+
+int ly_appbase_commit(const char * app_dir, const char * tmpfile,
+                      const char * base)
+{
+    if (rename(tmpfile, base)) {
+        logerror(_("renaming %s to %s failed, %s.\n"),
+                    tmpfile, base, strerror(errno));
+        return -1;
+    }
+
+    /* switch current link, relative to app dir */
+    char path[PATH_MAX], tmp[PATH_MAX];
+    const char * name = strrchr(base, '/');
+    name = name ? name + 1 : base;
+    if (snprintf(path, PATH_MAX, "%s/%s", app_dir, LY_APPBASE_CURRENT) >=
+        PATH_MAX ||
+        snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    unlink(tmp);
+    if (symlink(name, tmp) || rename(tmp, path)) {
+        logerror(_("error in %s(%d), %s\n"), __func__, __LINE__,
+                    strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    /* old bases no longer used */
+    DIR * d = opendir(app_dir);
+    if (d == NULL)
+        return 0;
+    struct dirent * r;
+    while ((r = readdir(d)) != NULL) {
+        int len = strlen(r->d_name);
+        int slen = strlen(LY_APPBASE_SUFFIX);
+        if (strncmp(r->d_name, LY_APPBASE_PREFIX,
+                    strlen(LY_APPBASE_PREFIX)) ||
+            len <= slen || strcmp(r->d_name + len - slen, LY_APPBASE_SUFFIX) ||
+            strcmp(r->d_name, name) == 0)
+            continue;
+        snprintf(path, PATH_MAX, "%s/%s", app_dir, r->d_name);
+        if (__ref_get(path) == 0)
+            __base_remove(path);
+    }
+    closedir(d);
+    return 0;
+}
+
+static int __write_all(int fd, const char * buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* plain copy, zero blocks are left as holes */
+static int __copy_sparse(int in, int out, off_t size)
+{
+    if (lseek(in, 0, SEEK_SET) < 0 || lseek(out, 0, SEEK_SET) < 0 ||
+        ftruncate(out, 0) < 0)
+        return -1;
+
+    char * buf = malloc(LY_APPBASE_COPY_BUF_SIZE);
+    if (buf == NULL)
+        return -1;
+
+    int ret = -1;
+    while (1) {
+        ssize_t n = read(in, buf, LY_APPBASE_COPY_BUF_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            goto out;
+        if (n == 0)
+            break;
+        /* runs of data blocks are written together */
+        ssize_t i = 0, data = -1;
+        while (i < n) {
+            ssize_t len = n - i < LY_APPBASE_HOLE_SIZE ?
+                          n - i : LY_APPBASE_HOLE_SIZE;
+            int zero = buf[i] == 0 && memcmp(buf + i, buf + i + 1, len - 1) == 0;
+            if (!zero && data < 0)
+                data = i;
+            if (zero || i + len == n) {
+                if (data >= 0) {
+                    ssize_t end = zero ? i : n;
+                    if (__write_all(out, buf + data, end - data) < 0)
+                        goto out;
+                    data = -1;
+                }
+                if (zero && lseek(out, len, SEEK_CUR) < 0)
+                    goto out;
+            }
+            i += len;
+        }
+    }
+    if (ftruncate(out, size) == 0)
+        ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+int ly_appbase_clone(const char * base, const char * disk)
+{
+    int in = open(base, O_RDONLY);
+    if (in < 0) {
+        logerror(_("open %s failed.\n"), base);
+        return -1;
+    }
+    int out = open(disk, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR);
+    if (out < 0) {
+        logerror(_("error creating file %s\n"), disk);
+        close(in);
+        return -1;
+    }
+
+    int ret = -1;
+    struct stat st;
+    if (fstat(in, &st) < 0)
+        goto out;
+#ifdef FICLONE
+    if (ioctl(out, FICLONE, in) == 0) {
+        logdebug(_("%s cloned from %s\n"), disk, base);
+        ret = 0;
+        goto out;
+    }
+#endif
+    /*
+    ** copy_file_range is not used, on file systems without reflink it
+    ** fills holes, while most of a disk image is zero
+    */
+    if (__copy_sparse(in, out, st.st_size) == 0)
+        ret = 0;
+
+out:
+    if (close(out) < 0)
+        ret = -1;
+    close(in);
+    if (ret < 0) {
+        logerror(_("error copying %s to %s, %s\n"), base, disk,
+                    strerror(errno));
+        unlink(disk);
+    }
+    return ret;
+}
+
+int ly_appbase_overlay(const char * base, const char * disk,
+                       long long size, const char * ins_dir)
+{
+    char cmd[PATH_MAX * 2 + 100], link[PATH_MAX];
+    int len = snprintf(cmd, sizeof(cmd),
+                       "qemu-img create -f qcow2 "
+                       "-o backing_file=%s,backing_fmt=raw %s",
+                       base, disk);
+    if (size > 0)
+        len += snprintf(cmd + len, sizeof(cmd) - len, " %lld", size);
+    if (len >= sizeof(cmd)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    if (system_call(cmd)) {
+        logerror(_("failed executing %s\n"), cmd);
+        unlink(disk);
+        return -1;
+    }
+
+    /* hold base */
+    snprintf(link, PATH_MAX, "%s/%s", ins_dir, LY_APPBASE_INS_LINK);
+    unlink(link);
+    if (symlink(base, link) || __ref_set(base, __ref_get(base) + 1)) {
+        logerror(_("error in %s(%d), %s\n"), __func__, __LINE__,
+                    strerror(errno));
+        unlink(link);
+        unlink(disk);
+        return -1;
+    }
+    return 0;
+}
+
+int ly_appbase_ins_base(const char * ins_dir, char * base, int size)
+{
+    char link[PATH_MAX];
+    snprintf(link, PATH_MAX, "%s/%s", ins_dir, LY_APPBASE_INS_LINK);
+    ssize_t len = readlink(link, base, size - 1);
+    if (len <= 0)
+        return -1;
+    base[len] = '\0';
+    return 0;
+}
+
+int ly_appbase_ins_app(const char * ins_dir)
+{
+    char base[PATH_MAX];
+    if (ly_appbase_ins_base(ins_dir, base, PATH_MAX) < 0)
+        return -1;
+
+    /* base is in app_data_dir/app_id/ */
+    char * p = strrchr(base, '/');
+    if (p == NULL)
+        return -1;
+    *p = '\0';
+    p = strrchr(base, '/');
+    if (p == NULL)
+        return -1;
+    int app_id = atoi(p + 1);
+    return app_id > 0 ? app_id : -1;
+}
+
+int ly_appbase_unref(const char * ins_dir)
+{
+    char base[PATH_MAX], link[PATH_MAX];
+    if (ly_appbase_ins_base(ins_dir, base, PATH_MAX) < 0)
+        return 0;
+
+    int ref = __ref_get(base) - 1;
+    if (__ref_set(base, ref) < 0)
+        return -1;
+    snprintf(link, PATH_MAX, "%s/%s", ins_dir, LY_APPBASE_INS_LINK);
+    unlink(link);
+
+    if (ref <= 0 && !__base_is_current(base))
+        return __base_remove(base);
+    return 0;
+}
+
+int ly_appbase_used(const char * app_dir)
+{
+    DIR * d = opendir(app_dir);
+    if (d == NULL)
+        return 0;
+    char path[PATH_MAX];
+    int used = 0;
+    struct dirent * r;
+    while (!used && (r = readdir(d)) != NULL) {
+        int len = strlen(r->d_name);
+        int slen = strlen(LY_APPBASE_SUFFIX);
+        if (strncmp(r->d_name, LY_APPBASE_PREFIX,
+                    strlen(LY_APPBASE_PREFIX)) ||
+            len <= slen || strcmp(r->d_name + len - slen, LY_APPBASE_SUFFIX))
+            continue;
+        snprintf(path, PATH_MAX, "%s/%s", app_dir, r->d_name);
+        if (__ref_get(path) > 0)
+            used = 1;
+    }
+    closedir(d);
+    return used;
+}
+
+/* set driver type of disk elements under node, return number set */
+static int __xml_qcow2(xmlNodePtr node, const char * disk)
+{
+    int n = 0;
+    for (; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrcmp(node->name, BAD_CAST "disk")) {
+            n += __xml_qcow2(node->children, disk);
+            continue;
+        }
+
+        xmlNodePtr c, source = NULL, driver = NULL;
+        for (c = node->children; c; c = c->next) {
+            if (c->type != XML_ELEMENT_NODE)
+                continue;
+            if (xmlStrcmp(c->name, BAD_CAST "source") == 0)
+                source = c;
+            else if (xmlStrcmp(c->name, BAD_CAST "driver") == 0)
+                driver = c;
+        }
+        if (source == NULL)
+            continue;
+        xmlChar * file = xmlGetProp(source, BAD_CAST "file");
+        int match = file && strcmp((char *)file, disk) == 0;
+        xmlFree(file);
+        if (!match)
+            continue;
+
+        if (driver == NULL) {
+            driver = xmlNewNode(NULL, BAD_CAST "driver");
+            if (driver == NULL)
+                return -1;
+            xmlNewProp(driver, BAD_CAST "name", BAD_CAST "qemu");
+            if (node->children)
+                xmlAddPrevSibling(node->children, driver);
+            else
+                xmlAddChild(node, driver);
+        }
+        if (xmlSetProp(driver, BAD_CAST "type", BAD_CAST "qcow2") == NULL)
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+char * ly_appbase_xml_qcow2(const char * xml, const char * disk,
+                            int fragment)
+{
+    char * src = (char *)xml, * ret = NULL;
+    if (fragment && asprintf(&src, "<disks>%s</disks>", xml) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return NULL;
+    }
+
+    xmlDocPtr doc = xmlReadMemory(src, strlen(src), NULL, NULL,
+                                  XML_PARSE_NONET);
+    xmlNodePtr root = doc ? xmlDocGetRootElement(doc) : NULL;
+    if (root == NULL) {
+        logerror(_("error parsing disk xml in %s(%d)\n"), __func__, __LINE__);
+        goto out;
+    }
+    int n = __xml_qcow2(root, disk);
+    if (n < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        goto out;
+    }
+    if (n == 0)
+        logwarn(_("no disk xml of %s\n"), disk);
+
+    if (fragment) {
+        xmlBufferPtr b = xmlBufferCreate();
+        if (b == NULL)
+            goto out;
+        xmlNodePtr c;
+        for (c = root->children; c; c = c->next)
+            xmlNodeDump(b, doc, c, 0, 0);
+        ret = strdup((const char *)xmlBufferContent(b));
+        xmlBufferFree(b);
+    }
+    else {
+        xmlChar * mem = NULL;
+        int len;
+        xmlDocDumpMemory(doc, &mem, &len);
+        if (mem) {
+            ret = strdup((const char *)mem);
+            xmlFree(mem);
+        }
+    }
+
+out:
+    if (doc)
+        xmlFreeDoc(doc);
+    if (src != xml)
+        free(src);
+    return ret;
+}
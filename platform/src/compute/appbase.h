@@ -0,0 +1,62 @@
+#ifndef __LY_INCLUDE_COMPUTE_APPBASE_H
+#define __LY_INCLUDE_COMPUTE_APPBASE_H
+
+/*
+** appliance base images, decompressed once per appliance and shared
+** by the instance disks created from it.
+**
+** a base is named after the appliance checksum, so instances created
+** from an older version of the appliance keep their base until they
+** are cleaned. instances depending on a base, ie. with qcow2 overlay
+** disk, hold a reference to it, recorded by a link in instance dir.
+** the appliance must be locked when calling functions working on
+** bases of it.
+*/
+#define LY_APPBASE_CURRENT "base.img"   /* link to current base, app dir */
+#define LY_APPBASE_INS_LINK "base.img"  /* link to base used, ins dir */
+
+/* base image path of appliance with checksum, in app_dir */
+int ly_appbase_path(const char * app_dir, const char * checksum,
+                    char * path, int size);
+
+/*
+** base extracted to tmpfile becomes current base of appliance,
+** old bases not used by any instance are removed
+*/
+int ly_appbase_commit(const char * app_dir, const char * tmpfile,
+                      const char * base);
+
+/* instance disk as a copy of base, cloned if file system supports it */
+int ly_appbase_clone(const char * base, const char * disk);
+
+/*
+** qcow2 disk backed by base, size in bytes, 0 for size of base.
+** reference to base is held for ins_dir
+*/
+int ly_appbase_overlay(const char * base, const char * disk,
+                       long long size, const char * ins_dir);
+
+/* base used by instance, return -1 if instance doesn't use one */
+int ly_appbase_ins_base(const char * ins_dir, char * base, int size);
+
+/* appliance id of base used by instance, -1 if no base is used */
+int ly_appbase_ins_app(const char * ins_dir);
+
+/*
+** release base used by instance, base is removed when it's
+** neither used nor current
+*/
+int ly_appbase_unref(const char * ins_dir);
+
+/* whether any base in app_dir is used by instances */
+int ly_appbase_used(const char * app_dir);
+
+/*
+** driver of disks with source file disk is set to qcow2 in domain xml,
+** or in disk elements if fragment is set, e.g. template from clc or
+** vm_xml_disk. free the xml returned after use.
+*/
+char * ly_appbase_xml_qcow2(const char * xml, const char * disk,
+                            int fragment);
+
+#endif
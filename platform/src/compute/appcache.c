@@ -0,0 +1,401 @@
+/*
+** Copyright (C) 2012 LuoYun Co. 
+**
+**           Authors:
+**                    lijian.gnu@gmail.com 
+**                    zengdongwu@hotmail.com
+**  
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**  
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**  
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**  
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../util/logging.h"
+#include "../util/list.h"
+#include "appbase.h"
+#include "appcache.h"
+
+typedef struct LYAppCache_t {
+    struct list_head list;      /* most recently used first */
+    int app_id;
+    int inuse;                  /* works using the appliance */
+    time_t used;                /* last used */
+    long long bytes;            /* disk space used by appliance dir */
+    /* appliance file with verified checksum, checksum[0] = 0 if none */
+    char checksum[LY_APPCACHE_CHECKSUM_LEN + 1];
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+} LYAppCache;
+
+static pthread_mutex_t g_appcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(g_appcache_list);
+static char * g_appcache_dir = NULL;
+static long long g_appcache_size = 0;
+static unsigned int g_appcache_hit = 0;
+static unsigned int g_appcache_miss = 0;
+
+static LYAppCache * __find(int app_id)
+{
+    LYAppCache * e;
+    list_for_each_entry(e, &g_appcache_list, list) {
+        if (e->app_id == app_id)
+            return e;
+    }
+    return NULL;
+}
+
+/* keep list ordered by last used time */
+static void __insert(LYAppCache * e)
+{
+    struct list_head * pos = &g_appcache_list;
+    LYAppCache * t;
+    list_for_each_entry(t, &g_appcache_list, list) {
+        if (t->used <= e->used) {
+            pos = &t->list;
+            break;
+        }
+    }
+    list_add_tail(&e->list, pos);
+}
+
+static LYAppCache * __new(int app_id, time_t used)
+{
+    LYAppCache * e = malloc(sizeof(LYAppCache));
+    if (e == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return NULL;
+    }
+    bzero(e, sizeof(LYAppCache));
+    e->app_id = app_id;
+    e->used = used;
+    __insert(e);
+    return e;
+}
+
+/* disk space used by files in appliance dir, sparse base counted right */
+static long long __dir_bytes(int app_id)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%d", g_appcache_dir, app_id);
+    DIR * d = opendir(path);
+    if (d == NULL)
+        return 0;
+    long long bytes = 0;
+    struct dirent * r;
+    while ((r = readdir(d)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(d), r->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(st.st_mode))
+            bytes += (long long)st.st_blocks * 512;
+    }
+    closedir(d);
+    return bytes;
+}
+
+static int __dir_remove(int app_id)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%d", g_appcache_dir, app_id);
+    DIR * d = opendir(path);
+    if (d == NULL)
+        return errno == ENOENT ? 0 : -1;
+    struct dirent * r;
+    while ((r = readdir(d)) != NULL) {
+        if (strcmp(r->d_name, ".") == 0 || strcmp(r->d_name, "..") == 0)
+            continue;
+        if (unlinkat(dirfd(d), r->d_name, 0) && errno != ENOENT)
+            logwarn(_("error removing %s/%s, %s\n"), path, r->d_name,
+                       strerror(errno));
+    }
+    closedir(d);
+    if (rmdir(path)) {
+        logerror(_("error removing %s, %s\n"), path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int __save(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%s", g_appcache_dir,
+                 LY_APPCACHE_INDEX) >= PATH_MAX ||
+        snprintf(tmp, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    FILE * fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        logerror(_("open %s failed.\n"), tmp);
+        return -1;
+    }
+    int ret = 0;
+    LYAppCache * e;
+    list_for_each_entry(e, &g_appcache_list, list) {
+        if (fprintf(fp, "%d %ld %llu %lld %ld %s\n", e->app_id,
+                    (long)e->used, (unsigned long long)e->ino,
+                    (long long)e->size, (long)e->mtime,
+                    e->checksum[0] ? e->checksum : "-") < 0)
+            ret = -1;
+    }
+    if (fclose(fp) || ret < 0 || rename(tmp, path)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+static int __load(void)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", g_appcache_dir, LY_APPCACHE_INDEX);
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    int app_id;
+    long used, mtime;
+    unsigned long long ino;
+    long long size;
+    char checksum[LY_APPCACHE_CHECKSUM_LEN + 1];
+    while (fscanf(fp, "%d %ld %llu %lld %ld %32s", &app_id, &used, &ino,
+                  &size, &mtime, checksum) == 6) {
+        struct stat st;
+        snprintf(path, PATH_MAX, "%s/%d", g_appcache_dir, app_id);
+        if (app_id <= 0 || __find(app_id) ||
+            stat(path, &st) || !S_ISDIR(st.st_mode))
+            continue;
+        LYAppCache * e = __new(app_id, used);
+        if (e == NULL)
+            break;
+        e->bytes = __dir_bytes(app_id);
+        if (strlen(checksum) == LY_APPCACHE_CHECKSUM_LEN) {
+            strcpy(e->checksum, checksum);
+            e->ino = ino;
+            e->size = size;
+            e->mtime = mtime;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* remove least recently used appliances until cache fits in size */
+static int __evict(void)
+{
+    if (g_appcache_size <= 0)
+        return 0;
+
+    long long total = 0;
+    LYAppCache * e, * n;
+    list_for_each_entry(e, &g_appcache_list, list)
+        total += e->bytes;
+
+    int num = 0;
+    char path[PATH_MAX];
+    list_for_each_entry_safe_reverse(e, n, &g_appcache_list, list) {
+        if (total <= g_appcache_size)
+            break;
+        /* instances with qcow2 disks depend on base */
+        snprintf(path, PATH_MAX, "%s/%d", g_appcache_dir, e->app_id);
+        if (e->inuse || ly_appbase_used(path))
+            continue;
+        loginfo(_("removing appliance %d from cache, %lld bytes\n"),
+                   e->app_id, e->bytes);
+        if (__dir_remove(e->app_id) < 0)
+            continue;
+        total -= e->bytes;
+        list_del(&e->list);
+        free(e);
+        num++;
+    }
+    if (total > g_appcache_size)
+        logwarn(_("appliance cache uses %lld bytes, over limit %lld\n"),
+                   total, g_appcache_size);
+    return num;
+}
+
+int ly_appcache_init(const char * app_dir, long long size)
+{
+    if (app_dir == NULL || size < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_appcache_mutex);
+    g_appcache_dir = strdup(app_dir);
+    g_appcache_size = size;
+    if (g_appcache_dir == NULL || __load() < 0) {
+        pthread_mutex_unlock(&g_appcache_mutex);
+        return -1;
+    }
+
+    /* appliances not in index */
+    DIR * d = opendir(app_dir);
+    if (d == NULL) {
+        logerror(_("open %s failed.\n"), app_dir);
+        pthread_mutex_unlock(&g_appcache_mutex);
+        return -1;
+    }
+    struct dirent * r;
+    while ((r = readdir(d)) != NULL) {
+        struct stat st;
+        int app_id = atoi(r->d_name);
+        if (app_id <= 0 || __find(app_id) ||
+            fstatat(dirfd(d), r->d_name, &st, 0) || !S_ISDIR(st.st_mode))
+            continue;
+        LYAppCache * e = __new(app_id, st.st_mtime);
+        if (e == NULL)
+            break;
+        e->bytes = __dir_bytes(app_id);
+    }
+    closedir(d);
+
+    __evict();
+    __save();
+    pthread_mutex_unlock(&g_appcache_mutex);
+    return 0;
+}
+
+int ly_appcache_verified(int app_id, const char * file, const char * checksum)
+{
+    struct stat st;
+    if (file == NULL || checksum == NULL || stat(file, &st))
+        return 0;
+
+    int ret = 0;
+    pthread_mutex_lock(&g_appcache_mutex);
+    LYAppCache * e = __find(app_id);
+    if (e && e->checksum[0] && strcasecmp(e->checksum, checksum) == 0 &&
+        e->ino == st.st_ino && e->size == st.st_size &&
+        e->mtime == st.st_mtime)
+        ret = 1;
+    pthread_mutex_unlock(&g_appcache_mutex);
+    return ret;
+}
+
+int ly_appcache_add(int app_id, const char * file, const char * checksum)
+{
+    struct stat st;
+    if (file == NULL || checksum == NULL ||
+        strlen(checksum) != LY_APPCACHE_CHECKSUM_LEN || stat(file, &st)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_appcache_mutex);
+    LYAppCache * e = __find(app_id);
+    if (e == NULL)
+        e = __new(app_id, time(NULL));
+    if (e == NULL) {
+        pthread_mutex_unlock(&g_appcache_mutex);
+        return -1;
+    }
+    strcpy(e->checksum, checksum);
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    int ret = __save();
+    pthread_mutex_unlock(&g_appcache_mutex);
+    return ret;
+}
+
+int ly_appcache_use(int app_id)
+{
+    pthread_mutex_lock(&g_appcache_mutex);
+    LYAppCache * e = __find(app_id);
+    if (e == NULL)
+        e = __new(app_id, 0);
+    if (e == NULL) {
+        pthread_mutex_unlock(&g_appcache_mutex);
+        return -1;
+    }
+    e->inuse++;
+    e->used = time(NULL);
+    list_move(&e->list, &g_appcache_list);
+    pthread_mutex_unlock(&g_appcache_mutex);
+    return 0;
+}
+
+int ly_appcache_release(int app_id)
+{
+    pthread_mutex_lock(&g_appcache_mutex);
+    LYAppCache * e = __find(app_id);
+    if (e == NULL) {
+        pthread_mutex_unlock(&g_appcache_mutex);
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    if (e->inuse > 0)
+        e->inuse--;
+    e->bytes = __dir_bytes(app_id);
+    if (e->bytes == 0 && e->inuse == 0 && e->checksum[0] == '\0') {
+        /* appliance not prepared, eg. download failed */
+        list_del(&e->list);
+        free(e);
+    }
+    __evict();
+    int ret = __save();
+    pthread_mutex_unlock(&g_appcache_mutex);
+    return ret;
+}
+
+void ly_appcache_count(int hit)
+{
+    pthread_mutex_lock(&g_appcache_mutex);
+    if (hit)
+        g_appcache_hit++;
+    else
+        g_appcache_miss++;
+    pthread_mutex_unlock(&g_appcache_mutex);
+}
+
+void ly_appcache_stats(unsigned int * hit, unsigned int * miss)
+{
+    pthread_mutex_lock(&g_appcache_mutex);
+    *hit = g_appcache_hit;
+    *miss = g_appcache_miss;
+    pthread_mutex_unlock(&g_appcache_mutex);
+}
+
+void ly_appcache_cleanup(void)
+{
+    pthread_mutex_lock(&g_appcache_mutex);
+    if (g_appcache_dir)
+        __save();
+    LYAppCache * e, * n;
+    list_for_each_entry_safe(e, n, &g_appcache_list, list) {
+        list_del(&e->list);
+        free(e);
+    }
+    free(g_appcache_dir);
+    g_appcache_dir = NULL;
+    pthread_mutex_unlock(&g_appcache_mutex);
+}
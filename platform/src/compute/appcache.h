@@ -0,0 +1,38 @@
+#ifndef __LY_INCLUDE_COMPUTE_APPCACHE_H
+#define __LY_INCLUDE_COMPUTE_APPCACHE_H
+
+/*
+** appliances cached in app_data_dir, one dir per appliance.
+**
+** checksums verified are kept in an index with inode, size and mtime
+** of the appliance file, so the file is not checksumed again as long
+** as it's not changed. when cache size is over limit, least recently
+** used appliances are removed, except those being used, or with base
+** used by instances. functions are thread safe.
+*/
+#define LY_APPCACHE_INDEX ".appcache"
+#define LY_APPCACHE_CHECKSUM_LEN 32
+
+/* load index and scan app_dir, size in bytes, 0 for no limit */
+int ly_appcache_init(const char * app_dir, long long size);
+
+/* whether checksum of appliance file was verified, file not changed */
+int ly_appcache_verified(int app_id, const char * file, const char * checksum);
+
+/* appliance file verified with checksum */
+int ly_appcache_add(int app_id, const char * file, const char * checksum);
+
+/*
+** appliance is not removed between ly_appcache_use and
+** ly_appcache_release, cache size is checked on release
+*/
+int ly_appcache_use(int app_id);
+int ly_appcache_release(int app_id);
+
+/* cache hit and miss counters */
+void ly_appcache_count(int hit);
+void ly_appcache_stats(unsigned int * hit, unsigned int * miss);
+
+void ly_appcache_cleanup(void);
+
+#endif
@@ -27,6 +27,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
 
 #include "../util/logging.h"
@@ -45,6 +49,596 @@ static inline void __this_unlock(void)
     pthread_mutex_unlock(&virt_mutex);
 }
 
+
+/*
+** domain handles cached by name, along with uuid, so that domains are
+** not looked up for each call. handles of stopped domains are dropped
+** on lifecycle events, and on errors in case events are not available.
+*/
+#define DOMAIN_NAME_LEN 64
+
+typedef struct DomainHandle_t {
+    char name[DOMAIN_NAME_LEN];
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    virDomainPtr dom;
+} DomainHandle;
+
+static pthread_mutex_t domain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DomainHandle * domain_handles = NULL;
+static int domain_handles_num = 0, domain_handles_size = 0;
+
+static void __domain_cache_add(virDomainPtr dom)
+{
+    const char * name = virDomainGetName(dom);
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    if (name == NULL || strlen(name) >= DOMAIN_NAME_LEN ||
+        virDomainGetUUIDString(dom, uuid) < 0)
+        return;
+
+    int i;
+    virDomainPtr old = NULL;
+    pthread_mutex_lock(&domain_mutex);
+    for (i = 0; i < domain_handles_num; i++) {
+        if (strcmp(domain_handles[i].name, name) == 0)
+            break;
+    }
+    if (i < domain_handles_num) {
+        DomainHandle * h = &domain_handles[i];
+        if (strcmp(h->uuid, uuid) == 0) {
+            pthread_mutex_unlock(&domain_mutex);
+            return;
+        }
+        /* domain created again with same name */
+        old = h->dom;
+        strcpy(h->uuid, uuid);
+        virDomainRef(dom);
+        h->dom = dom;
+        pthread_mutex_unlock(&domain_mutex);
+        virDomainFree(old);
+        return;
+    }
+    if (domain_handles_num == domain_handles_size) {
+        int size = domain_handles_size ? domain_handles_size * 2 : 16;
+        DomainHandle * h = realloc(domain_handles,
+                                   size * sizeof(DomainHandle));
+        if (h == NULL) {
+            pthread_mutex_unlock(&domain_mutex);
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return;
+        }
+        domain_handles = h;
+        domain_handles_size = size;
+    }
+    DomainHandle * h = &domain_handles[domain_handles_num++];
+    strcpy(h->name, name);
+    strcpy(h->uuid, uuid);
+    virDomainRef(dom);
+    h->dom = dom;
+    pthread_mutex_unlock(&domain_mutex);
+}
+
+static void __domain_cache_drop(const char * name)
+{
+    int i;
+    virDomainPtr dom = NULL;
+    pthread_mutex_lock(&domain_mutex);
+    for (i = 0; i < domain_handles_num; i++) {
+        if (strcmp(domain_handles[i].name, name) == 0) {
+            dom = domain_handles[i].dom;
+            domain_handles[i] = domain_handles[--domain_handles_num];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&domain_mutex);
+    if (dom)
+        virDomainFree(dom);
+}
+
+static void __domain_cache_clean(void)
+{
+    pthread_mutex_lock(&domain_mutex);
+    while (domain_handles_num > 0)
+        virDomainFree(domain_handles[--domain_handles_num].dom);
+    free(domain_handles);
+    domain_handles = NULL;
+    domain_handles_size = 0;
+    pthread_mutex_unlock(&domain_mutex);
+}
+
+/* domain handle to be freed by caller, cached one if fresh is 0 */
+static virDomainPtr __domain_get(const char * name, int fresh)
+{
+    int i;
+    if (fresh)
+        __domain_cache_drop(name);
+    else {
+        pthread_mutex_lock(&domain_mutex);
+        for (i = 0; i < domain_handles_num; i++) {
+            if (strcmp(domain_handles[i].name, name) == 0) {
+                virDomainPtr dom = domain_handles[i].dom;
+                virDomainRef(dom);
+                pthread_mutex_unlock(&domain_mutex);
+                return dom;
+            }
+        }
+        pthread_mutex_unlock(&domain_mutex);
+    }
+
+    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    if (dom)
+        __domain_cache_add(dom);
+    return dom;
+}
+
+/*
+** statistics snapshot of active domains. bulk stats api is used if
+** available, otherwise domains are listed and their info is queried
+** one by one, without block and interface counters.
+*/
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static DomainStats * stats_domains = NULL;
+static int stats_num = 0;
+static time_t stats_time = 0;
+static int stats_bulk = 1;
+
+/*
+** libvirt event loop implementation on node epoll.
+**
+** watched fds are added to epoll with data.fd set to the fd, and are
+** dispatched by libvirt_event_handle. timers shorten epoll_wait, and
+** a pipe in epoll wakes it when timers are changed by other threads.
+** callbacks are called by the main loop without event lock held.
+*/
+typedef struct EventHandle_t {
+    int watch;
+    int fd;
+    int events;       /* virEventHandleType */
+    virEventHandleCallback cb;
+    void * opaque;
+    virFreeCallback ff;
+    int deleted;
+} EventHandle;
+
+typedef struct EventTimeout_t {
+    int timer;
+    int interval;     /* in ms, -1 if disabled */
+    long long expires;
+    virEventTimeoutCallback cb;
+    void * opaque;
+    virFreeCallback ff;
+    int deleted;
+} EventTimeout;
+
+#define EVENT_REBOOT_NUM 16
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static int event_efd = -1;
+static int event_pipe[2] = {-1, -1};
+static EventHandle * event_handles = NULL;
+static int event_handles_num = 0, event_handles_size = 0;
+static EventTimeout * event_timeouts = NULL;
+static int event_timeouts_num = 0, event_timeouts_size = 0;
+static int event_next_id = 1;
+static void (* event_domain_cb)(const char *, int) = NULL;
+static int event_lifecycle_id = -1, event_reboot_id = -1;
+/* domain events seen, waited by workers */
+static unsigned int event_seq = 0;
+static struct {
+    unsigned int seq;
+    char name[DOMAIN_NAME_LEN];
+} event_reboots[EVENT_REBOOT_NUM];
+
+static long long __event_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void __event_wakeup(void)
+{
+    if (event_pipe[1] >= 0 && write(event_pipe[1], "w", 1) < 0 &&
+        errno != EAGAIN)
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+}
+
+/* epoll registration of fd follows its watches, event lock is held */
+static void __event_epoll_update(int fd)
+{
+    int i, events = 0;
+    for (i = 0; i < event_handles_num; i++) {
+        EventHandle * h = &event_handles[i];
+        if (h->deleted || h->fd != fd)
+            continue;
+        if (h->events & VIR_EVENT_HANDLE_READABLE)
+            events |= EPOLLIN;
+        if (h->events & VIR_EVENT_HANDLE_WRITABLE)
+            events |= EPOLLOUT;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (events == 0) {
+        /* error and hangup are always reported, so fd is removed */
+        epoll_ctl(event_efd, EPOLL_CTL_DEL, fd, &ev);
+        return;
+    }
+    if (epoll_ctl(event_efd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT ||
+         epoll_ctl(event_efd, EPOLL_CTL_ADD, fd, &ev) < 0))
+        logerror(_("epoll error for libvirt fd %d: %s\n"),
+                   fd, strerror(errno));
+}
+
+static int __event_add_handle(int fd, int events,
+                              virEventHandleCallback cb,
+                              void * opaque, virFreeCallback ff)
+{
+    pthread_mutex_lock(&event_mutex);
+    if (event_handles_num == event_handles_size) {
+        int size = event_handles_size ? event_handles_size * 2 : 8;
+        EventHandle * h = realloc(event_handles, size * sizeof(EventHandle));
+        if (h == NULL) {
+            pthread_mutex_unlock(&event_mutex);
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
+        }
+        event_handles = h;
+        event_handles_size = size;
+    }
+    EventHandle * h = &event_handles[event_handles_num++];
+    h->watch = event_next_id++;
+    h->fd = fd;
+    h->events = events;
+    h->cb = cb;
+    h->opaque = opaque;
+    h->ff = ff;
+    h->deleted = 0;
+    int watch = h->watch;
+    __event_epoll_update(fd);
+    pthread_mutex_unlock(&event_mutex);
+    return watch;
+}
+
+static void __event_update_handle(int watch, int events)
+{
+    int i;
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_handles_num; i++) {
+        EventHandle * h = &event_handles[i];
+        if (h->watch == watch && !h->deleted) {
+            h->events = events;
+            __event_epoll_update(h->fd);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&event_mutex);
+}
+
+/* free callback is called later by main loop, see __event_cleanup */
+static int __event_remove_handle(int watch)
+{
+    int i, ret = -1;
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_handles_num; i++) {
+        EventHandle * h = &event_handles[i];
+        if (h->watch == watch && !h->deleted) {
+            h->deleted = 1;
+            __event_epoll_update(h->fd);
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&event_mutex);
+    if (ret == 0)
+        __event_wakeup();
+    return ret;
+}
+
+static int __event_add_timeout(int interval, virEventTimeoutCallback cb,
+                               void * opaque, virFreeCallback ff)
+{
+    pthread_mutex_lock(&event_mutex);
+    if (event_timeouts_num == event_timeouts_size) {
+        int size = event_timeouts_size ? event_timeouts_size * 2 : 8;
+        EventTimeout * t = realloc(event_timeouts,
+                                   size * sizeof(EventTimeout));
+        if (t == NULL) {
+            pthread_mutex_unlock(&event_mutex);
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
+        }
+        event_timeouts = t;
+        event_timeouts_size = size;
+    }
+    EventTimeout * t = &event_timeouts[event_timeouts_num++];
+    t->timer = event_next_id++;
+    t->interval = interval;
+    t->expires = interval >= 0 ? __event_now() + interval : 0;
+    t->cb = cb;
+    t->opaque = opaque;
+    t->ff = ff;
+    t->deleted = 0;
+    int timer = t->timer;
+    pthread_mutex_unlock(&event_mutex);
+    __event_wakeup();
+    return timer;
+}
+
+static void __event_update_timeout(int timer, int interval)
+{
+    int i;
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_timeouts_num; i++) {
+        EventTimeout * t = &event_timeouts[i];
+        if (t->timer == timer && !t->deleted) {
+            t->interval = interval;
+            if (interval >= 0)
+                t->expires = __event_now() + interval;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&event_mutex);
+    __event_wakeup();
+}
+
+static int __event_remove_timeout(int timer)
+{
+    int i, ret = -1;
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_timeouts_num; i++) {
+        EventTimeout * t = &event_timeouts[i];
+        if (t->timer == timer && !t->deleted) {
+            t->deleted = 1;
+            ret = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&event_mutex);
+    if (ret == 0)
+        __event_wakeup();
+    return ret;
+}
+
+/* release deleted handles and timers, free callbacks without lock */
+static void __event_cleanup(void)
+{
+    int i, n, num = 0;
+    pthread_mutex_lock(&event_mutex);
+    struct {
+        virFreeCallback ff;
+        void * opaque;
+    } * fr = malloc((event_handles_num + event_timeouts_num + 1) *
+                    sizeof(*fr));
+    if (fr == NULL) {
+        pthread_mutex_unlock(&event_mutex);
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return;
+    }
+    for (i = 0, n = 0; i < event_handles_num; i++) {
+        EventHandle * h = &event_handles[i];
+        if (!h->deleted) {
+            event_handles[n++] = *h;
+            continue;
+        }
+        if (h->ff) {
+            fr[num].ff = h->ff;
+            fr[num++].opaque = h->opaque;
+        }
+    }
+    event_handles_num = n;
+    for (i = 0, n = 0; i < event_timeouts_num; i++) {
+        EventTimeout * t = &event_timeouts[i];
+        if (!t->deleted) {
+            event_timeouts[n++] = *t;
+            continue;
+        }
+        if (t->ff) {
+            fr[num].ff = t->ff;
+            fr[num++].opaque = t->opaque;
+        }
+    }
+    event_timeouts_num = n;
+    pthread_mutex_unlock(&event_mutex);
+
+    for (i = 0; i < num; i++)
+        fr[i].ff(fr[i].opaque);
+    free(fr);
+}
+
+int libvirt_event_timeout(void)
+{
+    int i;
+    long long next = -1;
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_timeouts_num; i++) {
+        EventTimeout * t = &event_timeouts[i];
+        if (t->deleted || t->interval < 0)
+            continue;
+        if (next < 0 || t->expires < next)
+            next = t->expires;
+    }
+    pthread_mutex_unlock(&event_mutex);
+    if (next < 0)
+        return -1;
+    next -= __event_now();
+    return next > 0 ? next : 0;
+}
+
+int libvirt_event_handle(struct epoll_event * ev)
+{
+    if (event_efd < 0)
+        return 0;
+
+    int fd = ev->data.fd;
+    if (fd == event_pipe[0]) {
+        char buf[64];
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+        return 1;
+    }
+
+    int events = 0;
+    if (ev->events & EPOLLIN)
+        events |= VIR_EVENT_HANDLE_READABLE;
+    if (ev->events & EPOLLOUT)
+        events |= VIR_EVENT_HANDLE_WRITABLE;
+    if (ev->events & EPOLLERR)
+        events |= VIR_EVENT_HANDLE_ERROR;
+    if (ev->events & EPOLLHUP)
+        events |= VIR_EVENT_HANDLE_HANGUP;
+
+    /* handles may be changed by callbacks, look up each time */
+    int i, found = 0;
+    for (i = 0; ; i++) {
+        pthread_mutex_lock(&event_mutex);
+        while (i < event_handles_num &&
+               (event_handles[i].fd != fd || event_handles[i].deleted ||
+                event_handles[i].events == 0))
+            i++;
+        if (i >= event_handles_num) {
+            pthread_mutex_unlock(&event_mutex);
+            break;
+        }
+        EventHandle h = event_handles[i];
+        pthread_mutex_unlock(&event_mutex);
+        h.cb(h.watch, fd, events & (h.events | VIR_EVENT_HANDLE_ERROR |
+                                    VIR_EVENT_HANDLE_HANGUP), h.opaque);
+        found = 1;
+    }
+    if (found)
+        return 1;
+
+    pthread_mutex_lock(&event_mutex);
+    for (i = 0; i < event_handles_num; i++)
+        if (event_handles[i].fd == fd)
+            found = 1;
+    pthread_mutex_unlock(&event_mutex);
+    return found;
+}
+
+void libvirt_event_run(void)
+{
+    if (event_efd < 0)
+        return;
+
+    int i;
+    long long now = __event_now();
+    for (i = 0; ; i++) {
+        pthread_mutex_lock(&event_mutex);
+        while (i < event_timeouts_num &&
+               (event_timeouts[i].deleted || event_timeouts[i].interval < 0 ||
+                event_timeouts[i].expires > now))
+            i++;
+        if (i >= event_timeouts_num) {
+            pthread_mutex_unlock(&event_mutex);
+            break;
+        }
+        EventTimeout * t = &event_timeouts[i];
+        t->expires = now + t->interval;
+        int timer = t->timer;
+        virEventTimeoutCallback cb = t->cb;
+        void * opaque = t->opaque;
+        pthread_mutex_unlock(&event_mutex);
+        cb(timer, opaque);
+    }
+    __event_cleanup();
+}
+
+static int __event_domain_lifecycle(virConnectPtr conn, virDomainPtr dom,
+                                    int event, int detail, void * opaque)
+{
+    const char * name = virDomainGetName(dom);
+    if (name == NULL)
+        return 0;
+    loginfo(_("domain %s event %d, detail %d\n"), name, event, detail);
+    if (event == VIR_DOMAIN_EVENT_STOPPED ||
+        event == VIR_DOMAIN_EVENT_UNDEFINED)
+        __domain_cache_drop(name);
+
+    pthread_mutex_lock(&event_mutex);
+    event_seq++;
+    pthread_cond_broadcast(&event_cond);
+    pthread_mutex_unlock(&event_mutex);
+
+    if (event_domain_cb)
+        event_domain_cb(name, event);
+    return 0;
+}
+
+static void __event_domain_reboot(virConnectPtr conn, virDomainPtr dom,
+                                  void * opaque)
+{
+    const char * name = virDomainGetName(dom);
+    if (name == NULL)
+        return;
+    loginfo(_("domain %s rebooted\n"), name);
+
+    pthread_mutex_lock(&event_mutex);
+    event_seq++;
+    int i = event_seq % EVENT_REBOOT_NUM;
+    event_reboots[i].seq = event_seq;
+    strncpy(event_reboots[i].name, name, DOMAIN_NAME_LEN - 1);
+    event_reboots[i].name[DOMAIN_NAME_LEN - 1] = '\0';
+    pthread_cond_broadcast(&event_cond);
+    pthread_mutex_unlock(&event_mutex);
+}
+
+int libvirt_event_init(int efd, void (* domain_event)(const char *, int))
+{
+    if (efd < 0 || event_efd >= 0)
+        return -1;
+
+    if (pipe(event_pipe) < 0 ||
+        fcntl(event_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(event_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = event_pipe[0];
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, event_pipe[0], &ev) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        close(event_pipe[0]);
+        close(event_pipe[1]);
+        event_pipe[0] = event_pipe[1] = -1;
+        return -1;
+    }
+    event_efd = efd;
+    event_domain_cb = domain_event;
+
+    virEventRegisterImpl(__event_add_handle, __event_update_handle,
+                         __event_remove_handle, __event_add_timeout,
+                         __event_update_timeout, __event_remove_timeout);
+    return 0;
+}
+
+/* wait for event_seq to change, until 1 second or deadline passes */
+static void __event_wait(unsigned int * seq, long long deadline)
+{
+    long long now = __event_now();
+    if (deadline > now + 1000)
+        deadline = now + 1000;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (deadline - now) / 1000;
+    ts.tv_nsec += (deadline - now) % 1000 * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&event_mutex);
+    while (*seq == event_seq) {
+        if (pthread_cond_timedwait(&event_cond, &event_mutex, &ts))
+            break;
+    }
+    *seq = event_seq;
+    pthread_mutex_unlock(&event_mutex);
+}
+
 static void __customErrorFunc(void *userdata, virErrorPtr err)
 {
     if (err->code == VIR_ERR_NO_DOMAIN) {
@@ -64,7 +658,7 @@ static void __customErrorFunc(void *userdata, virErrorPtr err)
     logsimple("  int2: %d\n", err->int2);
 }
 
-int libvirt_connect(int driver)
+int libvirt_connect_uri(const char * uri)
 {
     if (g_conn != NULL) {
         logwarn(_("conneted already.\n"));
@@ -73,6 +667,37 @@ int libvirt_connect(int driver)
 
     virSetErrorFunc(NULL, __customErrorFunc);
 
+    __this_lock();
+    g_conn = virConnectOpen(uri);
+    __this_unlock();
+    if (g_conn == NULL) {
+        logerror(_("Connet to %s error.\n"), uri);
+        return -1;
+    } 
+    else {
+        loginfo(_("Connect to %s success!\n"), uri);
+    }
+
+    if (event_efd < 0)
+        return 0;
+
+    /* domain state is polled if events are not available */
+    event_lifecycle_id = virConnectDomainEventRegisterAny(g_conn, NULL,
+                             VIR_DOMAIN_EVENT_ID_LIFECYCLE,
+                             VIR_DOMAIN_EVENT_CALLBACK(__event_domain_lifecycle),
+                             NULL, NULL);
+    event_reboot_id = virConnectDomainEventRegisterAny(g_conn, NULL,
+                             VIR_DOMAIN_EVENT_ID_REBOOT,
+                             VIR_DOMAIN_EVENT_CALLBACK(__event_domain_reboot),
+                             NULL, NULL);
+    if (event_lifecycle_id < 0 || event_reboot_id < 0)
+        logwarn(_("domain events not available from %s\n"), uri);
+
+    return 0;
+}
+
+int libvirt_connect(int driver)
+{
     const char * URI;
     if (driver == HYPERVISOR_IS_KVM)
         URI = HYPERVISOR_URI_KVM;
@@ -83,18 +708,7 @@ int libvirt_connect(int driver)
         return -1;
     }
 
-    __this_lock();
-    g_conn = virConnectOpen(URI);
-    __this_unlock();
-    if (g_conn == NULL) {
-        logerror(_("Connet to %s error.\n"), URI);
-        return -1;
-    } 
-    else {
-        loginfo(_("Connect to %s success!\n"), URI);
-    }
-
-    return 0;
+    return libvirt_connect_uri(URI);
 }
 
 void libvirt_close(void)
@@ -102,6 +716,19 @@ void libvirt_close(void)
     if (g_conn == NULL)
         return;
 
+    if (event_lifecycle_id >= 0)
+        virConnectDomainEventDeregisterAny(g_conn, event_lifecycle_id);
+    if (event_reboot_id >= 0)
+        virConnectDomainEventDeregisterAny(g_conn, event_reboot_id);
+    event_lifecycle_id = event_reboot_id = -1;
+
+    __domain_cache_clean();
+    pthread_mutex_lock(&stats_mutex);
+    free(stats_domains);
+    stats_domains = NULL;
+    stats_num = 0;
+    pthread_mutex_unlock(&stats_mutex);
+
     virConnectClose(g_conn);
     __this_lock();
     g_conn = NULL;
@@ -226,63 +853,251 @@ int libvirt_node_info(NodeInfo * ni)
     return 0;
 }
 
-int libvirt_node_info_update(NodeInfo * ni)
+#if LIBVIR_VERSION_NUMBER >= 1002008
+static unsigned long long __stats_ullong(virTypedParameterPtr params,
+                                         int nparams, const char * field)
 {
-    if (g_conn == NULL || ni == NULL)
-        return -1;
-
-    int ret = -1;
-    int cpu_commit = 0;
-    unsigned int mem_commit = 0;
-    int *activeDomains = NULL;
+    unsigned long long v = 0;
+    if (virTypedParamsGetULLong(params, nparams, field, &v) != 1)
+        return 0;
+    return v;
+}
 
-    __this_lock();
+static unsigned int __stats_uint(virTypedParameterPtr params,
+                                 int nparams, const char * field)
+{
+    unsigned int v = 0;
+    if (virTypedParamsGetUInt(params, nparams, field, &v) != 1)
+        return 0;
+    return v;
+}
 
-    int numDomains = virConnectNumOfDomains(g_conn);
-    if (numDomains <= 0) {
-        ret = numDomains;
-        goto out;
-    }
+/* return number of domains, -1 if bulk stats are not supported */
+static int __stats_collect_bulk(DomainStats ** domains)
+{
+    virDomainStatsRecordPtr * records = NULL;
+    int num = virConnectGetAllDomainStats(g_conn,
+                    VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_CPU_TOTAL |
+                    VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_VCPU |
+                    VIR_DOMAIN_STATS_INTERFACE | VIR_DOMAIN_STATS_BLOCK,
+                    &records, VIR_CONNECT_GET_ALL_DOMAINS_STATS_ACTIVE);
+    if (num < 0)
+        return -1;
 
-    activeDomains = malloc(sizeof(int) * numDomains);
-    if (activeDomains == NULL) {
+    DomainStats * ds = calloc(num + 1, sizeof(DomainStats));
+    if (ds == NULL) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        goto out;
+        virDomainStatsRecordListFree(records);
+        return -2;
     }
+    int i, j, n = 0;
+    char field[VIR_TYPED_PARAM_FIELD_LENGTH];
+    for (i = 0; i < num; i++) {
+        virDomainStatsRecordPtr r = records[i];
+        const char * name = virDomainGetName(r->dom);
+        if (name == NULL)
+            continue;
+        __domain_cache_add(r->dom);
+        DomainStats * d = &ds[n++];
+        strncpy(d->name, name, sizeof(d->name) - 1);
+        d->id = virDomainGetID(r->dom);
+        d->vcpus = __stats_uint(r->params, r->nparams, "vcpu.current");
+        d->max_mem = __stats_ullong(r->params, r->nparams, "balloon.maximum");
+        d->memory = __stats_ullong(r->params, r->nparams, "balloon.current");
+        d->cpu_time = __stats_ullong(r->params, r->nparams, "cpu.time");
+        int count = __stats_uint(r->params, r->nparams, "block.count");
+        for (j = 0; j < count; j++) {
+#define __BLOCK_STAT(x, f) \
+            snprintf(field, sizeof(field), "block.%d." f, j); \
+            d->x += __stats_ullong(r->params, r->nparams, field);
+            __BLOCK_STAT(rd_reqs, "rd.reqs")
+            __BLOCK_STAT(rd_bytes, "rd.bytes")
+            __BLOCK_STAT(wr_reqs, "wr.reqs")
+            __BLOCK_STAT(wr_bytes, "wr.bytes")
+#undef __BLOCK_STAT
+        }
+        count = __stats_uint(r->params, r->nparams, "net.count");
+        for (j = 0; j < count && d->nif < LIBVIRT_STATS_IF_MAX; j++) {
+            const char * ifname = NULL;
+            snprintf(field, sizeof(field), "net.%d.name", j);
+            if (virTypedParamsGetString(r->params, r->nparams,
+                                        field, &ifname) != 1)
+                continue;
+            DomainIfStats * f = &d->ifs[d->nif++];
+            strncpy(f->name, ifname, sizeof(f->name) - 1);
+#define __NET_STAT(x, s) \
+            snprintf(field, sizeof(field), "net.%d." s, j); \
+            f->x = __stats_ullong(r->params, r->nparams, field);
+            __NET_STAT(rx_bytes, "rx.bytes")
+            __NET_STAT(rx_pkts, "rx.pkts")
+            __NET_STAT(tx_bytes, "tx.bytes")
+            __NET_STAT(tx_pkts, "tx.pkts")
+#undef __NET_STAT
+        }
+    }
+    virDomainStatsRecordListFree(records);
+    *domains = ds;
+    return n;
+}
+#endif
+
+/* return number of domains, -1 on error */
+static int __stats_collect(DomainStats ** domains)
+{
+    int * ids = NULL;
+    DomainStats * ds = NULL;
+    int num = virConnectNumOfDomains(g_conn);
+    if (num < 0)
+        return -1;
 
-    numDomains = virConnectListDomains(g_conn, activeDomains, numDomains);
-    if (numDomains <= 0) {
-        ret = numDomains;
-        goto out;
+    ids = malloc(sizeof(int) * (num + 1));
+    ds = calloc(num + 1, sizeof(DomainStats));
+    if (ids == NULL || ds == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        goto failed;
     }
-    for (int i = 0; i< numDomains; i++) {
-        /* skip id dom 0 */
-        if (activeDomains[i] == 0)
+    num = virConnectListDomains(g_conn, ids, num);
+    if (num < 0)
+        goto failed;
+
+    int i, n = 0;
+    for (i = 0; i < num; i++) {
+        virDomainPtr dom = virDomainLookupByID(g_conn, ids[i]);
+        if (dom == NULL) {
+            /* stopped after listed */
             continue;
-        virDomainPtr d = virDomainLookupByID(g_conn, activeDomains[i]);
-	if (d == NULL) {
-            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-            goto out;
         }
         virDomainInfo di;
-	if (virDomainGetInfo(d, &di)) {
+        const char * name = virDomainGetName(dom);
+        if (name == NULL || virDomainGetInfo(dom, &di)) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-            goto out;
+            virDomainFree(dom);
+            goto failed;
         }
-        cpu_commit += di.nrVirtCpu;
-        mem_commit += di.maxMem;
-        virDomainFree(d);
+        __domain_cache_add(dom);
+        DomainStats * d = &ds[n++];
+        strncpy(d->name, name, sizeof(d->name) - 1);
+        d->id = ids[i];
+        d->vcpus = di.nrVirtCpu;
+        d->max_mem = di.maxMem;
+        d->memory = di.memory;
+        d->cpu_time = di.cpuTime;
+        virDomainFree(dom);
     }
-    ni->cpu_commit = cpu_commit;
-    ni->mem_commit = mem_commit;
-    ret = numDomains;
+    free(ids);
+    *domains = ds;
+    return n;
+
+failed:
+    free(ids);
+    free(ds);
+    return -1;
+}
 
-out:
-    __this_unlock();
+/* renew snapshot if older than max_age, stats lock is held by caller */
+static int __stats_update(int max_age)
+{
+    time_t now = time(NULL);
+    if (stats_domains && now - stats_time < max_age)
+        return stats_num;
+
+    DomainStats * ds = NULL;
+    int num = -1;
+#if LIBVIR_VERSION_NUMBER >= 1002008
+    if (stats_bulk) {
+        num = __stats_collect_bulk(&ds);
+        if (num == -1) {
+            virErrorPtr err = virGetLastError();
+            if (err && err->code == VIR_ERR_NO_SUPPORT) {
+                loginfo(_("bulk domain stats not supported\n"));
+                stats_bulk = 0;
+            }
+        }
+    }
+#endif
+    if (num == -1)
+        num = __stats_collect(&ds);
+    if (num < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
 
-    if (activeDomains)
-        free(activeDomains);
+    free(stats_domains);
+    stats_domains = ds;
+    stats_num = num;
+    stats_time = now;
+    return num;
+}
+
+int libvirt_domain_stats_all(DomainStats ** ds, int max_age)
+{
+    if (g_conn == NULL || ds == NULL)
+        return -1;
 
+    pthread_mutex_lock(&stats_mutex);
+    int num = __stats_update(max_age);
+    if (num >= 0) {
+        *ds = malloc((num + 1) * sizeof(DomainStats));
+        if (*ds == NULL) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            num = -1;
+        }
+        else
+            memcpy(*ds, stats_domains, num * sizeof(DomainStats));
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return num;
+}
+
+/* return 0 if domain is found in snapshot, 1 if not, -1 on error */
+int libvirt_domain_stats(char * name, DomainStats * ds)
+{
+    if (g_conn == NULL || name == NULL || ds == NULL)
+        return -1;
+
+    int i, ret;
+    pthread_mutex_lock(&stats_mutex);
+    ret = __stats_update(LIBVIRT_STATS_MAX_AGE);
+    if (ret >= 0) {
+        for (i = 0; i < stats_num; i++) {
+            if (strcmp(stats_domains[i].name, name) == 0)
+                break;
+        }
+        if (i < stats_num) {
+            *ds = stats_domains[i];
+            ret = 0;
+        }
+        else
+            ret = 1;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    return ret;
+}
+
+int libvirt_node_info_update(NodeInfo * ni)
+{
+    if (g_conn == NULL || ni == NULL)
+        return -1;
+
+    int i, cpu_commit = 0;
+    unsigned int mem_commit = 0;
+
+    /* commit is changed by domains just started or stopped */
+    pthread_mutex_lock(&stats_mutex);
+    int ret = __stats_update(0);
+    for (i = 0; i < ret; i++) {
+        /* skip id dom 0 */
+        if (stats_domains[i].id == 0)
+            continue;
+        cpu_commit += stats_domains[i].vcpus;
+        mem_commit += stats_domains[i].max_mem;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+    if (ret < 0)
+        return ret;
+
+    ni->cpu_commit = cpu_commit;
+    ni->mem_commit = mem_commit;
     return ret;
 }
 
@@ -298,6 +1113,30 @@ unsigned int libvirt_free_memory(void)
     return free_memory;
 }
 
+/* capabilities xml of host, to be freed by caller */
+char * libvirt_capabilities(void)
+{
+    if (g_conn == NULL)
+        return NULL;
+
+    char * caps = virConnectGetCapabilities(g_conn);
+    if (caps == NULL)
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+    return caps;
+}
+
+/* free memory in bytes of numa cells, return number of cells filled */
+int libvirt_cells_free_memory(unsigned long long * free_mems, int max)
+{
+    if (g_conn == NULL)
+        return -1;
+
+    int num = virNodeGetCellsFreeMemory(g_conn, free_mems, 0, max);
+    if (num < 0)
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+    return num;
+}
+
 int libvirt_domain_active(char * name)
 {
     if (g_conn == NULL)
@@ -311,6 +1150,26 @@ int libvirt_domain_active(char * name)
     return active;
 }
 
+/*
+** wait for domain to be active, or not, up to seconds. woken by domain
+** events, and domain is checked every second in case events are not
+** available. return 1 if the domain is in the state, 0 if timed out.
+*/
+int libvirt_domain_wait(char * name, int active, int seconds)
+{
+    long long deadline = __event_now() + seconds * 1000LL;
+    pthread_mutex_lock(&event_mutex);
+    unsigned int seq = event_seq;
+    pthread_mutex_unlock(&event_mutex);
+    while (1) {
+        if (libvirt_domain_active(name) == active)
+            return 1;
+        if (__event_now() >= deadline)
+            return 0;
+        __event_wait(&seq, deadline);
+    }
+}
+
 int libvirt_domain_create(char * xml)
 {
     if (g_conn == NULL)
@@ -332,11 +1191,19 @@ char * libvirt_domain_xml(char * name)
     if (g_conn == NULL)
         return NULL;
 
-    virDomainPtr domain = virDomainLookupByName(g_conn, name);
+    virDomainPtr domain = __domain_get(name, 0);
     if (domain) {
         xml = virDomainGetXMLDesc(domain, 0);
         virDomainFree(domain);
     }
+    if (xml == NULL && domain) {
+        /* cached handle may be stale */
+        domain = __domain_get(name, 1);
+        if (domain) {
+            xml = virDomainGetXMLDesc(domain, 0);
+            virDomainFree(domain);
+        }
+    }
 
     return xml;
 }
@@ -347,34 +1214,42 @@ int libvirt_domain_ifstat(char * name, char * target,
                           unsigned long * tx_bytes,
                           unsigned long * tx_pkts)
 {
-    int ret = -1;
+    int i, ret = -1;
     if (g_conn == NULL || name == NULL || target == NULL)
         return -1;
 
-    virDomainPtr domain = virDomainLookupByName(g_conn, name);
-    if (domain == NULL) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        return -1;
-    }
-    virDomainInterfaceStatsPtr statsptr = malloc(sizeof(*statsptr));
-    if (statsptr == NULL) {
-        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-        goto done;
+    /* from the snapshot, if interface counters are collected */
+    DomainStats ds;
+    if (libvirt_domain_stats(name, &ds) == 0) {
+        for (i = 0; i < ds.nif; i++) {
+            if (strcmp(ds.ifs[i].name, target) == 0) {
+                *rx_bytes = ds.ifs[i].rx_bytes;
+                *rx_pkts = ds.ifs[i].rx_pkts;
+                *tx_bytes = ds.ifs[i].tx_bytes;
+                *tx_pkts = ds.ifs[i].tx_pkts;
+                return 0;
+            }
+        }
     }
 
-    if (virDomainInterfaceStats(domain, target, statsptr, sizeof(*statsptr)) == 0) {
-        *rx_bytes = statsptr->rx_bytes;
-        *rx_pkts = statsptr->rx_packets;
-        *tx_bytes = statsptr->tx_bytes;
-        *tx_pkts = statsptr->tx_packets;
-        ret = 0;
+    virDomainInterfaceStatsStruct stats;
+    int fresh;
+    for (fresh = 0; fresh < 2 && ret < 0; fresh++) {
+        virDomainPtr domain = __domain_get(name, fresh);
+        if (domain == NULL)
+            break;
+        if (virDomainInterfaceStats(domain, target,
+                                    &stats, sizeof(stats)) == 0) {
+            *rx_bytes = stats.rx_bytes;
+            *rx_pkts = stats.rx_packets;
+            *tx_bytes = stats.tx_bytes;
+            *tx_pkts = stats.tx_packets;
+            ret = 0;
+        }
+        virDomainFree(domain);
     }
-    else
+    if (ret < 0)
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
-
-    free(statsptr);
-done:
-    virDomainFree(domain);
     return ret;
 }
 
@@ -436,6 +1311,38 @@ int libvirt_domain_reboot(char * name)
     return 0;
 }
 
+/*
+** reboot domain, and wait up to seconds for the guest to reset, which
+** is known from domain reboot event. return 1 if it is reset, 0 if
+** timed out or events are not available, -1 on error.
+*/
+int libvirt_domain_reboot_wait(char * name, int seconds)
+{
+    long long deadline = __event_now() + seconds * 1000LL;
+    pthread_mutex_lock(&event_mutex);
+    unsigned int seq = event_seq, start = event_seq;
+    pthread_mutex_unlock(&event_mutex);
+
+    if (libvirt_domain_reboot(name) < 0)
+        return -1;
+
+    while (__event_now() < deadline) {
+        int i;
+        pthread_mutex_lock(&event_mutex);
+        for (i = 0; i < EVENT_REBOOT_NUM; i++) {
+            if (event_reboots[i].seq - start > 0 &&
+                event_reboots[i].seq - start <= event_seq - start &&
+                strncmp(event_reboots[i].name, name, DOMAIN_NAME_LEN - 1) == 0)
+                break;
+        }
+        pthread_mutex_unlock(&event_mutex);
+        if (i < EVENT_REBOOT_NUM)
+            return 1;
+        __event_wait(&seq, deadline);
+    }
+    return 0;
+}
+
 #if 0
 int libvirt_domain_save(char * name, int idonweb)
 {
@@ -3,13 +3,42 @@
 
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
+#include <sys/epoll.h>
 #include "lynode.h"
 
 #define HYPERVISOR_URI_KVM "qemu:///system"
 #define HYPERVISOR_URI_XEN "xen:///"
 
+#define LIBVIRT_STATS_MAX_AGE 2   /* seconds, see libvirt_domain_stats */
+#define LIBVIRT_STATS_IF_MAX 4
+
+/* domain statistics, counters since domain started */
+typedef struct DomainIfStats_t {
+    char name[32];      /* target dev */
+    unsigned long long rx_bytes;
+    unsigned long long rx_pkts;
+    unsigned long long tx_bytes;
+    unsigned long long tx_pkts;
+} DomainIfStats;
+
+typedef struct DomainStats_t {
+    char name[64];
+    int id;
+    int vcpus;
+    unsigned long long max_mem;     /* in KB */
+    unsigned long long memory;      /* in KB */
+    unsigned long long cpu_time;    /* in ns */
+    unsigned long long rd_reqs;     /* block I/O, all disks */
+    unsigned long long rd_bytes;
+    unsigned long long wr_reqs;
+    unsigned long long wr_bytes;
+    int nif;
+    DomainIfStats ifs[LIBVIRT_STATS_IF_MAX];
+} DomainStats;
+
 int libvirt_check(int driver);
 int libvirt_connect(int driver);
+int libvirt_connect_uri(const char * uri);
 void libvirt_close(void);
 int libvirt_hypervisor(void);
 char * libvirt_hostname(void);
@@ -17,18 +46,42 @@ int libvirt_max_cpus(void);
 int libvirt_node_info(NodeInfo * ni);
 int libvirt_node_info_update(NodeInfo * ni);
 unsigned int libvirt_free_memory(void);
+char * libvirt_capabilities(void);
+int libvirt_cells_free_memory(unsigned long long * free_mems, int max);
 int libvirt_domain_active(char * name);
 int libvirt_domain_create(char * xml);
 int libvirt_domain_stop(char * name);
 int libvirt_domain_poweroff(char * name);
 int libvirt_domain_reboot(char * name);
+int libvirt_domain_reboot_wait(char * name, int seconds);
+int libvirt_domain_wait(char * name, int active, int seconds);
 char * libvirt_domain_xml(char * name);
+/*
+** statistics of active domains are collected in one snapshot, shared
+** by resource reports and instance queries. the snapshot is renewed if
+** it is older than max_age seconds. libvirt_domain_stats_all returns
+** number of domains in *ds, which is freed by caller.
+*/
+int libvirt_domain_stats(char * name, DomainStats * ds);
+int libvirt_domain_stats_all(DomainStats ** ds, int max_age);
 int libvirt_domain_ifstat(char * name, char * target,
                           unsigned long * rx_bytes,
                           unsigned long * rx_pkts,
                           unsigned long * tx_bytes,
                           unsigned long * tx_pkts);
 
+/*
+** libvirt events processed in node epoll, init before connecting.
+** domain_event is called with domain name and virDomainEventType on
+** lifecycle events, domain waits are woken by them.
+*/
+int libvirt_event_init(int efd, void (* domain_event)(const char *, int));
+/* timeout for epoll_wait in ms, -1 if no timer is pending */
+int libvirt_event_timeout(void);
+/* process epoll event, return 1 if it is for libvirt, 0 if not */
+int libvirt_event_handle(struct epoll_event * ev);
+/* run expired timers, call after each epoll_wait */
+void libvirt_event_run(void);
 
 #if 0
 int libvirt_domain_save(char * name, int idonweb)
@@ -40,6 +40,7 @@
 #include "../util/lyutil.h"
 #include "../util/lyauth.h"
 #include "../util/lyxml.h"
+#include "../util/lymetric.h"
 #include "domain.h"
 #include "handler.h"
 #include "node.h"
@@ -72,13 +73,14 @@ static int __process_node_query(int req_id)
     r.msg = NULL;
     r.data = g_c->node;
     logdebug(_("sending node query reply...\n"));
-    char * xml = lyxml_data_reply_node_info(&r, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_reply_node_info(g_c->proto, &r, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
         return -1;
     }
     int ret = ly_packet_send(g_c->wfd, PKT_TYPE_CLC_NODE_CONTROL_REPLY,
-                             xml, strlen(xml));
+                             xml, len);
     free(xml);
 
     /* clear one time error/check status */
@@ -89,198 +91,116 @@ static int __process_node_query(int req_id)
     return ret;
 }
 
+/* request of clc */
+static const LYXmlField g_request_fields[] = {
+    LYXML_INT("request@id", NodeCtrlInstance, req_id, 1),
+    LYXML_INT("request@action", NodeCtrlInstance, req_action, 1),
+    LYXML_FLAG("request/reply/result", NodeCtrlInstance, reply,
+               LUOYUN_REQUEST_REPLY_RESULT),
+    LYXML_FLAG("request/reply/status", NodeCtrlInstance, reply,
+               LUOYUN_REQUEST_REPLY_STATUS),
+};
+
+/* appliance parameters of request */
+static const LYXmlField g_appliance_fields[] = {
+    LYXML_INT("request/parameters/appliance@id", NodeCtrlInstance,
+              app_id, 0),
+    LYXML_STR("request/parameters/appliance/name", NodeCtrlInstance,
+              app_name, 0),
+    LYXML_STR("request/parameters/appliance/uri", NodeCtrlInstance,
+              app_uri, 0),
+    LYXML_STR("request/parameters/appliance/checksum", NodeCtrlInstance,
+              app_checksum, 0),
+};
+
+/* instance parameters of request */
+static const LYXmlField g_instance_fields[] = {
+    LYXML_INT("request/parameters/instance@id", NodeCtrlInstance,
+              ins_id, 1),
+    LYXML_STR("request/parameters/instance/name", NodeCtrlInstance,
+              ins_name, 0),
+    LYXML_STR("request/parameters/instance/domain", NodeCtrlInstance,
+              ins_domain, 1),
+    LYXML_STR("request/parameters/instance/domxml", NodeCtrlInstance,
+              ins_json, 0),
+    LYXML_INT("request/parameters/instance@status", NodeCtrlInstance,
+              ins_status, 0),
+    LYXML_INT("request/parameters/instance/vcpu", NodeCtrlInstance,
+              ins_vcpu, 0),
+    LYXML_INT("request/parameters/instance/memory", NodeCtrlInstance,
+              ins_mem, 0),
+    LYXML_INT("request/parameters/instance/extsize", NodeCtrlInstance,
+              ins_extsize, 0),
+    LYXML_STR("request/parameters/instance/mac", NodeCtrlInstance,
+              ins_mac, 0),
+    LYXML_STR("request/parameters/instance/ip", NodeCtrlInstance,
+              ins_ip, 0),
+    LYXML_STR("request/parameters/osmanager/clc/ip", NodeCtrlInstance,
+              osm_clcip, 0),
+    LYXML_INT("request/parameters/osmanager/clc/port", NodeCtrlInstance,
+              osm_clcport, 0),
+    LYXML_INT("request/parameters/osmanager/tag", NodeCtrlInstance,
+              osm_tag, 0),
+    LYXML_STR("request/parameters/osmanager/secret", NodeCtrlInstance,
+              osm_secret, 0),
+    LYXML_STR("request/parameters/osmanager/json", NodeCtrlInstance,
+              osm_json, 0),
+    LYXML_STR("request/parameters/storage/ip", NodeCtrlInstance,
+              storage_ip, 0),
+    LYXML_INT("request/parameters/storage/method", NodeCtrlInstance,
+              storage_method, 0),
+    LYXML_STR("request/parameters/storage/parm", NodeCtrlInstance,
+              storage_parm, 0),
+};
+
 /* process xml request */
-static int __process_xml_request(xmlDocPtr doc, xmlNodePtr node)
+static int __process_xml_request(LYXmlMsg * msg)
 {
-    /* get id attributes */
-    char * str = (char *)xmlGetProp(node, (const xmlChar *)"id");
-    if (str == NULL) {
-        logerror(_("error processing xml node(%s, %d)\n"),
-                   __func__, __LINE__);
-        return -1;
-    }
-    int id = atoi(str);
-    free(str);
-
-    /* get action attributes */
-    str = (char *)xmlGetProp(node, (const xmlChar *)"action");
-    if (str == NULL) {
+    /* strings of ci are in msg, handlers keep copies */
+    NodeCtrlInstance ci;
+    bzero(&ci, sizeof(NodeCtrlInstance));
+    if (lyxml_msg_decode(msg, g_request_fields,
+                         LYXML_FIELD_NUM(g_request_fields), &ci) < 0) {
         logerror(_("error processing xml node(%s, %d)\n"),
                    __func__, __LINE__);
         return -1;
     }
-    int action = atoi(str);
-    free(str);
 
-    loginfo(_("process request %d(id=%d)\n"), action, id);
+    ci.req_time = lymetric_now_us();
+    loginfo(_("process request %d(id=%d)\n"), ci.req_action, ci.req_id);
 
-    if (action == LY_A_NODE_QUERY)
-        return __process_node_query(id);
+    if (ci.req_action == LY_A_NODE_QUERY)
+        return __process_node_query(ci.req_id);
 
     /* others are instance control requests */
-    NodeCtrlInstance ci;
-    bzero(&ci, sizeof(NodeCtrlInstance));
-    ci.req_id = id;
-    ci.req_action = action;
+    lyxml_msg_decode(msg, g_appliance_fields,
+                     LYXML_FIELD_NUM(g_appliance_fields), &ci);
+    if (ci.req_action == LY_A_NODE_PREFETCH_APPLIANCE)
+        return ly_handler_appliance_prefetch(&ci);
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if(xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                   __func__, __LINE__);
+    if (lyxml_msg_decode(msg, g_instance_fields,
+                         LYXML_FIELD_NUM(g_instance_fields), &ci) < 0)
         return -1;
-    }
-    int ret = -1;
-    if (xml_xpath_exist_from_ctx(xpathCtx,
-                        "/" LYXML_ROOT "/request/reply/result"))
-        ci.reply |= LUOYUN_REQUEST_REPLY_RESULT;
-    if (xml_xpath_exist_from_ctx(xpathCtx, 
-                        "/" LYXML_ROOT "/request/reply/status"))
-        ci.reply |= LUOYUN_REQUEST_REPLY_STATUS;
-    str = xml_xpath_prop_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance", "id");
-    if (str == NULL)
-        goto out;
-    ci.ins_id = atoi(str);
-    free(str);
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/name");
-    if (str != NULL) {
-        ci.ins_name = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/domain");
-    if (str == NULL)
-        goto out;
-    ci.ins_domain = str;
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/domxml");
-    if (str != NULL) {
-        ci.ins_json = str;
-    }
-    str = xml_xpath_prop_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance", "status");
-    if (str != NULL) {
-        ci.ins_status = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/vcpu");
-    if (str != NULL) {
-        ci.ins_vcpu = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/memory");
-    if (str != NULL) {
-        ci.ins_mem = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/extsize");
-    if (str != NULL) {
-        ci.ins_extsize = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/mac");
-    if (str != NULL) {
-        ci.ins_mac = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/instance/ip");
-    if (str != NULL) {
-        ci.ins_ip = str;
-    }
-    str = xml_xpath_prop_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/appliance", "id");
-    if (str != NULL) {
-        ci.app_id = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/appliance/name");
-    if (str != NULL) {
-        ci.app_name = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/appliance/uri");
-    if (str != NULL) {
-        ci.app_uri = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/appliance/checksum");
-    if (str != NULL) {
-        ci.app_checksum = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/osmanager/clc/ip");
-    if (str != NULL) {
-        ci.osm_clcip = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/osmanager/clc/port");
-    if (str != NULL) {
-        ci.osm_clcport = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/osmanager/tag");
-    if (str != NULL) {
-        ci.osm_tag = atoi(str);
-        free(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/osmanager/secret");
-    if (str != NULL) {
-        ci.osm_secret = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/osmanager/json");
-    if (str != NULL) {
-        ci.osm_json = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/storage/ip");
-    if (str != NULL) {
-        ci.storage_ip = str;
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/storage/method");
-    if (str != NULL) {
-        ci.storage_method = atoi(str);
-    }
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/request/parameters/storage/parm");
-    if (str != NULL) {
-        ci.storage_parm = str;
-    }
 
     if (g_c->config.debug)
         luoyun_node_ctrl_instance_print(&ci);
-    ret = ly_handler_instance_control(&ci);
-
-out:
-    luoyun_node_ctrl_instance_cleanup(&ci);
-    xmlXPathFreeContext(xpathCtx);
-    return ret;
+    return ly_handler_instance_control(&ci);
 }
 
 /* process xml response */
-static int __process_xml_response(xmlDoc *doc, xmlNode * node)
+static int __process_xml_response(LYXmlMsg * msg)
 {
     /* simplified response processing, */
     /* only node register reply is expected, id is not used */
 
     /* get response status */
-    char * str = (char *)xmlGetProp(node, (const xmlChar *)"status");
+    char * str = lyxml_msg_text(msg, "response@status");
     if (str == NULL) {
         logerror(_("error processing xml node(%s, %d)\n"),
                    __func__, __LINE__);
         return -1;
     }
     int status = atoi(str);
-    free(str);
     loginfo(_("process response status %d\n"), status);
 
     NodeInfo * nf = g_c->node;
@@ -314,34 +234,22 @@ static int __process_xml_response(xmlDoc *doc, xmlNode * node)
 
     loginfo(_("Auth info received. node being initialized\n"));
 
-    /* Create xpath evaluation context */
-    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
-    if (xpathCtx == NULL) {
-        logerror(_("unable to create new XPath context %s, %d\n"),
-                 __func__, __LINE__);
-        return -1;
-    }
-
-    str = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/tag");
+    str = lyxml_msg_text(msg, "response/data/tag");
     if (str == NULL) 
-        goto failed;
+        return -1;
     nf->host_tag = atoi(str);
-    free(str);
 
     if (ac->secret) {
         free(ac->secret);
         ac->secret = NULL;
     }
-    ac->secret = xml_xpath_text_from_ctx(xpathCtx,
-                         "/" LYXML_ROOT "/response/data/secret");
-    if (ac->secret == NULL) 
-        goto failed;
+    str = lyxml_msg_text(msg, "response/data/secret");
+    if (str == NULL) 
+        return -1;
+    ac->secret = strdup(str);
 
     g_c->state = NODE_STATUS_INITIALIZED;
 
-    xmlXPathFreeContext(xpathCtx);
-
     /* start authetication */
     if (ly_register_node() != 0) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
@@ -349,56 +257,36 @@ static int __process_xml_response(xmlDoc *doc, xmlNode * node)
     }
 
     return 0;
-
-failed:
-    xmlXPathFreeContext(xpathCtx);
-    return -1;
 }
 
 /* process xml packet */
-static int __process_work_xml(char *xml)
+static int __process_work_xml(char *xml, int len)
 {
     int ret = 0;
-    xmlDoc *doc = xml_doc_from_str(xml);
-    if (doc == NULL) {
+    LYXmlMsg * msg = lyxml_msg_parse(xml, len);
+    if (msg == NULL) {
         logerror(_("error: could not parse xml string.\n"));
         logdebug("%s\n", xml);
         return -255;
     }
-    logdebug("%s\n", xml);
-    xmlNode * node = xmlDocGetRootElement(doc);
-    if (node == NULL || strcmp((char *)node->name, LYXML_ROOT) != 0) {
-        logwarn(_("error: xml string not for %s\n"), LYXML_ROOT);
-        return 0;
-    }
-    node = node->children;
+    if (xml[0] == '<')
+        logdebug("%s\n", xml);
 
-    for (; node; node = node->next) {
-        if (node->type == XML_ELEMENT_NODE) {
-            logdebug(_("xml node %s\n"), node->name);
-            if (strcmp((char *)node->name, "response") == 0 ) {
-                if (__process_xml_response(doc, node) < 0) {
-                    ret = -1;
-                    break;
-                }
-            }
-            else if (strcmp((char *)node->name, "request") == 0 ) {
-                if (__process_xml_request(doc, node) < 0) {
-                    ret = -1;
-                    break;
-                }
-            }
-            /* other nodes ignored */
-        }
-    }
-    xmlFreeDoc(doc);
-    return ret;
+    if (lyxml_msg_exist(msg, "response"))
+        ret = __process_xml_response(msg);
+    else if (lyxml_msg_exist(msg, "request"))
+        ret = __process_xml_request(msg);
+    /* other nodes ignored */
+
+    lyxml_msg_free(msg);
+    return ret < 0 ? -1 : 0;
 }
 
 /* process authentication packets */
 static int __process_work_authtication(int is_reply, void * buf, int len)
 {
-    if (buf == NULL || len != sizeof(AuthInfo)) {
+    if (buf == NULL ||
+        (len != sizeof(AuthInfo) && len != sizeof(AuthProto))) {
         logerror(_("error in %s(%d)\n"), __func__, __LINE__);
         return -1;
     }
@@ -420,6 +308,11 @@ static int __process_work_authtication(int is_reply, void * buf, int len)
         if (ret) {
             loginfo(_("chanllenge verification passed.\n"));
             g_c->state = NODE_STATUS_AUTHENTICATED;
+            /* old clc replies without wire format */
+            if (len == sizeof(AuthProto))
+                g_c->proto = ((AuthProto *)buf)->proto & LUOYUN_PROTO_BIN;
+            if (g_c->proto & LUOYUN_PROTO_BIN)
+                loginfo(_("binary packet data agreed with clc\n"));
         }
         else {
             logwarn(_("chanllenge verification failed.\n"));
@@ -542,7 +435,7 @@ int ly_epoll_work_recv(void)
         }
         else if (PKT_TYPE_ENTITY_GROUP_CLC(type) ||
                  PKT_TYPE_ENTITY_GROUP_NODE(type)) {
-            ret = __process_work_xml(buf);
+            ret = __process_work_xml(buf, len);
             if (ret < 0)
                 logerror(_("xml packet process error in %s.\n"), __func__);
         }
@@ -580,12 +473,13 @@ int ly_register_node()
             return -1;
         }
         
-        AuthInfo ai;
-        ai.tag = nf->host_tag;
-        bzero(ai.data, LUOYUN_AUTH_DATA_LEN);
-        strncpy((char *)ai.data, ac->challenge, LUOYUN_AUTH_DATA_LEN);
+        AuthProto ap;
+        ap.ai.tag = nf->host_tag;
+        bzero(ap.ai.data, LUOYUN_AUTH_DATA_LEN);
+        strncpy((char *)ap.ai.data, ac->challenge, LUOYUN_AUTH_DATA_LEN);
+        ap.proto = LUOYUN_PROTO_BIN;
         if (ly_packet_send(g_c->wfd, PKT_TYPE_NODE_AUTH_REQUEST,
-                           &ai, sizeof(AuthInfo)) < 0) {
+                           &ap, sizeof(AuthProto)) < 0) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             return -1;
         }
@@ -605,13 +499,14 @@ int ly_register_node()
         g_c->state = NODE_STATUS_UNREGISTERED;
 
     /* build xml string */
-    char * xml = lyxml_data_node_register(nf, NULL, 0);
+    int size;
+    char * xml = lyxml_msg_node_register(g_c->proto, nf, &size);
     if (xml == NULL) {
         logerror(_("build register xml request error\n"));
         return -1;
     }
-    int size = strlen(xml);
-    logdebug(_("xml string(%d):\n%s\n"), size, xml);
+    if (xml[0] == '<')
+        logdebug(_("xml string(%d):\n%s\n"), size, xml);
 
     if (ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REGISTER_REQUEST, xml, size) < 0) {
         logerror(_("packet send error(%d, %d)\n"), __LINE__, errno);
@@ -1070,6 +965,7 @@ int ly_epoll_work_close(void)
     ly_packet_cleanup(&g_c->wfd_pkt);
 
     g_c->state = NODE_STATUS_UNKNOWN;
+    g_c->proto = LUOYUN_PROTO_XML;
     return 0;
 }
 
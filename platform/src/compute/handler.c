@@ -43,39 +43,48 @@
 #include "../util/lyutil.h"
 #include "../util/disk.h"
 #include "../util/download.h"
+#include "../util/decompress.h"
+#include "../util/ext2.h"
 #include "../util/base64.h"
+#include "../util/lymetric.h"
 #include "domain.h"
 #include "node.h"
+#include "work.h"
+#include "appbase.h"
+#include "appcache.h"
+#include "numa.h"
 #include "handler.h"
 
 #define LIBVIRT_XML_DATA_MAX 4096
 
-static pthread_mutex_t handler_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int g_handler_thread_num = 0;
+/*
+** work keys, requests on an instance are keyed by instance id, works
+** on appliance files by appliance key, so they wait in queue.
+*/
+#define WORK_KEY_APP(id) (-(id))
+
+/* appliance base refs being accessed */
+static LYWorkLock g_app_lock = LY_WORK_LOCK_INITIALIZER;
 
 /* check whether the handler is busy */
 int ly_handler_busy(void)
 {
-    return g_handler_thread_num > LY_NODE_THREAD_MAX ? 1 : 0;
-}
-
-/* update g_handler_thread_num */
-static void __update_thread_num(int change)
-{
-   pthread_mutex_lock(&handler_mutex);
-   g_handler_thread_num += change;
-   pthread_mutex_unlock(&handler_mutex);
-   return;
+    return ly_work_num() > LY_NODE_THREAD_MAX ? 1 : 0;
 }
 
 /* send respond to control server */
 static int __send_response(int socket, NodeCtrlInstance * ci, int status)
 {
+    /* prefetch is not a job of control server */
+    if (ci->req_action == LY_A_NODE_PREFETCH_APPLIANCE)
+        return 0;
+
     LYReply r;
     r.req_id = ci->req_id;
     r.from = LY_ENTITY_NODE;
     r.to = LY_ENTITY_CLC;
     r.status = status;
+    r.elapsed = (lymetric_now_us() - ci->req_time) / 1000;
     if (status == LY_S_FINISHED_SUCCESS) 
         r.msg = "success";
     else if (status == LY_S_FINISHED_FAILURE)
@@ -96,6 +105,8 @@ static int __send_response(int socket, NodeCtrlInstance * ci, int status)
         r.msg = "starting instance domain";
     else if (status == LY_S_RUNNING_WAITING)
         r.msg = "waiting for resouces";
+    else if (status == LY_S_RUNNING_PROCESSING)
+        r.msg = "resources acquired";
     else if (status == LY_S_RUNNING_STOPPING)
         r.msg = "instance shutting down";
     else if (status == LY_S_RUNNING_STOPPED)
@@ -104,13 +115,14 @@ static int __send_response(int socket, NodeCtrlInstance * ci, int status)
         r.msg = NULL;
 
     logdebug(_("sending responses ..., %s\n"), r.msg);
-    char * xml = lyxml_data_reply(&r, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_reply(g_c->proto, &r, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
         return -1;
     }
     int ret = ly_packet_send(socket, PKT_TYPE_CLC_INSTANCE_CONTROL_REPLY,
-                             xml, strlen(xml));
+                             xml, len);
     free(xml);
     if (ret < 0) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
@@ -120,71 +132,6 @@ static int __send_response(int socket, NodeCtrlInstance * ci, int status)
     return 0;
 }
 
-/* lock handling file accessing */
-static int __file_lock_get(char * lock_dir, char * lock_ext)
-{
-    if (lock_dir == NULL)
-        return -1;
-    if (access(lock_dir,  R_OK | W_OK | X_OK) != 0) {
-        logerror(_("error in %s(%d). errno:%d\n"),
-                    __func__, __LINE__, errno);
-        return -1;
-    }
-    char path[PATH_MAX];
-    if (snprintf(path, PATH_MAX, "%s/.forlock", lock_dir) >= PATH_MAX)
-        return -1;
-    int fd = creat(path, S_IWUSR);
-    if (fd < 0 ){
-        logerror(_("error in %s(%d). errno:%d\n"),
-                    __func__, __LINE__, errno);
-        return -1;
-    }
-    close(fd);
-    char link_path[PATH_MAX];
-    if (snprintf(link_path, PATH_MAX, "%s/.forlock.%s",
-                 lock_dir, lock_ext) >= PATH_MAX)
-        return -1;
-    int time_warn = 30; 
-    int time_warn_cnt = 20; 
-    while (link(path, link_path) < 0) {
-        /* someone has the lock already */
-        if (time_warn == 0) {
-            logwarn(_("waited thread lock for 30 seconds."
-                      "continue waiting...\n"));
-            time_warn = 30;
-            time_warn_cnt--;
-        }
-        sleep(1);
-        time_warn--;
-        if (time_warn_cnt <= 0) {
-            logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-            return -1;
-        }
-    }
-    return 0; /* lock granted */
-}
-        
-static int __file_lock_put(char * lock_dir, char * lock_ext)
-{
-    if (lock_dir == NULL)
-        return -1;
-    if (access(lock_dir,  R_OK | W_OK | X_OK) != 0) {
-        logerror(_("error in %s(%d). errno:%d\n"),
-                    __func__, __LINE__, errno);
-        return -1;
-    }
-    char link_path[PATH_MAX];
-    if (snprintf(link_path, PATH_MAX, "%s/.forlock.%s",
-                 lock_dir, lock_ext) >= PATH_MAX)
-        return -1;
-    if (unlink(link_path) < 0) {
-        logerror(_("error in %s(%d). unlink %s errno:%d\n"),
-                    __func__, __LINE__, link_path, errno);
-        return -1;
-    }
-    return 0; /* lock released */
-}
-
 static int __domain_instance_clean(int id, int keepdir)
 {
     char path[PATH_MAX], trash[PATH_MAX];
@@ -206,6 +153,15 @@ static int __domain_instance_clean(int id, int keepdir)
         i++;
     }
 
+    /* release appliance base used by instance disk */
+    snprintf(path, PATH_MAX, "%s/%d", g_c->config.ins_data_dir, id);
+    int app_id = ly_appbase_ins_app(path);
+    if (app_id > 0 && ly_work_lock(&g_app_lock, app_id) == 0) {
+        if (ly_appbase_unref(path) < 0)
+            logwarn(_("error releasing appliance base of instance %d\n"), id);
+        ly_work_unlock(&g_app_lock, app_id);
+    }
+
     if (keepdir)
         return 0;
 
@@ -784,7 +740,9 @@ static char * __domain_xml(NodeCtrlInstance * ci, int hypervisor, int fullvirt)
     int net_size = 1024, disk_size = 1024;
     char path[1024], conf_path[1024];
 
-    /* os disk */
+    /* os disk, qcow2 if backed by appliance base */
+    snprintf(path, 1024, "%s/%d", g_c->config.ins_data_dir, ci->ins_id);
+    int qcow2 = ly_appbase_ins_app(path) > 0;
     if (snprintf(path, 1024, "%s/%d/%s", g_c->config.ins_data_dir,
                  ci->ins_id, LUOYUN_INSTANCE_DISK_FILE) >= 1024) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
@@ -792,11 +750,34 @@ static char * __domain_xml(NodeCtrlInstance * ci, int hypervisor, int fullvirt)
     }
     if ((xml = __domain_xml_template(ci)) != NULL) {
         net_size = disk_size = 0;
+        /* template from clc describes os disk as raw */
+        if (qcow2) {
+            char * xmlnew = ly_appbase_xml_qcow2(xml, path, 0);
+            free(xml);
+            xml = xmlnew;
+            if (xml == NULL) {
+                logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+                return NULL;
+            }
+        }
     }
-    else if (g_c->config.vm_xml_disk)
+    else if (g_c->config.vm_xml_disk) {
         snprintf(disk, 1024, g_c->config.vm_xml_disk, path);
+        if (qcow2) {
+            char * xmlnew = ly_appbase_xml_qcow2(disk, path, 1);
+            if (xmlnew == NULL || strlen(xmlnew) >= 1024) {
+                logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+                free(xmlnew);
+                return NULL;
+            }
+            strcpy(disk, xmlnew);
+            free(xmlnew);
+        }
+    }
     else if (hypervisor == HYPERVISOR_IS_XEN)
         snprintf(disk, 1024, LIBVIRT_XML_TMPL_XEN_DISK, path, LUOYUN_INSTANCE_XEN_DISK1_NAME);
+    else if (hypervisor == HYPERVISOR_IS_KVM && qcow2)
+        snprintf(disk, 1024, LIBVIRT_XML_TMPL_KVM_DISK_QCOW2, path, LUOYUN_INSTANCE_KVM_DISK1_NAME);
     else if (hypervisor == HYPERVISOR_IS_KVM)
         snprintf(disk, 1024, LIBVIRT_XML_TMPL_KVM_DISK, path, LUOYUN_INSTANCE_KVM_DISK1_NAME);
     else {
@@ -804,8 +785,8 @@ static char * __domain_xml(NodeCtrlInstance * ci, int hypervisor, int fullvirt)
         return NULL;
     }
 
-    /* extend os disk */
-    if (ci->ins_extsize > 0 && ci->ins_extsize < 1000) {
+    /* extend os disk, qcow2 disk is sized when created */
+    if (ci->ins_extsize > 0 && ci->ins_extsize < 1000 && !qcow2) {
         struct stat statbuf;
         if (stat(path, &statbuf)) {
             logerror(_("error in %s(%d), %s(%d).\n"), __func__, __LINE__, strerror(errno), errno);
@@ -1103,17 +1084,8 @@ done:
 
     return ret;
 }
-static int __domain_run_data_check(NodeCtrlInstance * ci)
+static int __appliance_data_check(NodeCtrlInstance * ci)
 {
-    if (ci == NULL || g_c == NULL)
-        return -255;
-
-    if (ci->ins_vcpu == 0)
-        ci->ins_vcpu = LUOYUN_INSTANCE_CPU_DEFAULT;
-    if (ci->ins_mem == 0)
-        ci->ins_mem = LUOYUN_INSTANCE_MEM_DEFAULT;
-    if (ci->ins_mac == NULL && ci->osm_json == NULL)
-        return -1;
     if (ci->app_id == 0 ||
         ci->app_name == NULL ||
         ci->app_checksum == NULL)
@@ -1128,6 +1100,22 @@ static int __domain_run_data_check(NodeCtrlInstance * ci)
                      ci->app_checksum) >= LUOYUN_APPLIANCE_URI_MAX)
             return -1;
     }
+    return 0;
+}
+
+static int __domain_run_data_check(NodeCtrlInstance * ci)
+{
+    if (ci == NULL || g_c == NULL)
+        return -255;
+
+    if (ci->ins_vcpu == 0)
+        ci->ins_vcpu = LUOYUN_INSTANCE_CPU_DEFAULT;
+    if (ci->ins_mem == 0)
+        ci->ins_mem = LUOYUN_INSTANCE_MEM_DEFAULT;
+    if (ci->ins_mac == NULL && ci->osm_json == NULL)
+        return -1;
+    if (__appliance_data_check(ci) < 0)
+        return -1;
     if (ci->osm_clcip == NULL)
         ci->osm_clcip = strdup(g_c->clc_ip);
     if (ci->osm_clcport == 0)
@@ -1136,6 +1124,264 @@ static int __domain_run_data_check(NodeCtrlInstance * ci)
     return 0;
 }
 
+/* qcow2 disk is for kvm only */
+static int __disk_mode(void)
+{
+    if (g_c->config.disk_mode == NODE_DISK_MODE_QCOW2 &&
+        g_c->node->hypervisor != HYPERVISOR_IS_KVM)
+        return NODE_DISK_MODE_CLONE;
+    return g_c->config.disk_mode;
+}
+
+/*
+** get appliance ready, checked, downloaded if needed. when disk_mode
+** uses base, path_base is set to base of appliance, created if not
+** exist. otherwise, instance disk is extracted to path_disk along with
+** appliance checking, unless path_disk is empty. path_disk is cleared
+** if disk is not extracted. called by works holding appliance key.
+*/
+static int __appliance_prepare(NodeCtrlInstance * ci, int disk_mode,
+                               char * path_base, char * path_disk)
+{
+    int ret = -1;
+    char path[PATH_MAX];
+    char app_dir[PATH_MAX];
+    char path_tmp[PATH_MAX];
+    char * disk = path_disk[0] ? path_disk : NULL;
+    /* cache hit and miss are counted for instance starts only */
+    int count = ci->req_action != LY_A_NODE_PREFETCH_APPLIANCE;
+
+    path_base[0] = '\0';
+    path_disk[0] = '\0';
+
+    /* prepare appliance dir */
+    if (snprintf(app_dir, PATH_MAX, "%s/%d", g_c->config.app_data_dir,
+                 ci->app_id) >= PATH_MAX) {
+        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+        goto out;
+    }
+    if (access(app_dir, F_OK)) {
+        if (mkdir(app_dir, 0755) == -1) {
+            logerror(_("can not create directory: %s\n"), app_dir);
+            logerror(_("error: %d, %s\n"), errno, strerror(errno)); 
+            goto out;
+        }
+    }
+    if (disk_mode != NODE_DISK_MODE_COPY &&
+        ly_appbase_path(app_dir, ci->app_checksum, path_base, PATH_MAX) == 0) {
+        if (access(path_base, F_OK) == 0) {
+            loginfo(_("appliance %s base found locally\n"), ci->app_name);
+            if (count)
+                ly_appcache_count(1);
+            ret = 0;
+            goto out;
+        }
+        /* disk extracted becomes base of appliance */
+        if (snprintf(path_tmp, PATH_MAX, "%s.tmp", path_base) >= PATH_MAX) {
+            logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+            path_base[0] = '\0';
+            goto out;
+        }
+        disk = path_tmp;
+    }
+    else
+        path_base[0] = '\0';
+
+    /* check whether to download appliance */
+    if (snprintf(path, PATH_MAX, "%s/%s", app_dir,
+                 LUOYUN_APPLIANCE_FILE) >= PATH_MAX) {
+        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+        path_base[0] = '\0';
+        goto out;
+    }
+    int new_app = 1;
+    if (lyutil_download_partial(path))
+        loginfo(_("appliance %s partially downloaded\n"), ci->app_name);
+    else if (access(path, F_OK) == 0) {
+        loginfo(_("appliance %s found locally\n"), ci->app_name);
+        /* not checksumed again if verified before and not changed */
+        char * checksum = ci->app_checksum;
+        if (ly_appcache_verified(ci->app_id, path, checksum)) {
+            loginfo(_("appliance %s checksum verified before\n"),
+                       ci->app_name);
+            checksum = NULL;
+        }
+        if (checksum == NULL && disk == NULL)
+            new_app = 0;
+        else {
+            loginfo(_("checking checksum and extracting disk file ...\n"));
+            __send_response(g_c->wfd, ci, checksum ?
+                            LY_S_RUNNING_CHECKING_APP :
+                            LY_S_RUNNING_EXTRACTING_APP);
+            if (lyutil_decompress_parallel(path, checksum, disk,
+                                           g_c->config.decompress_threads)) {
+                logwarn(_("%s checksum(%s) failed. old appliance removed\n"),
+                          ci->app_name, ci->app_checksum);
+                unlink(path);
+            }
+            else {
+                new_app = 0;
+                if (checksum)
+                    ly_appcache_add(ci->app_id, path, checksum);
+            }
+        }
+    }
+    if (count)
+        ly_appcache_count(!new_app);
+    /* download appliance */
+    if (new_app) {
+        ret = LY_S_FINISHED_FAILURE_APP_DOWNLOAD;
+        loginfo(_("downloading %s from %s ...\n"), ci->app_name, ci->app_uri);
+        __send_response(g_c->wfd, ci, LY_S_RUNNING_DOWNLOADING_APP);
+        /* checksum and disk extracting are done along with download */
+        if (lyutil_download_parallel(ci->app_uri, path, ci->app_checksum,
+                                     disk, g_c->config.download_conns)) {
+            /* partial file is kept for resuming */
+            logwarn(_("downloading %s from %s failed, %s.\n"), 
+                       ci->app_name, ci->app_uri,
+                       "file not downloaded or checksum failed");
+            goto out;
+        }
+        if (access(path, F_OK)) {
+            logerror(_("downloading %s from %s failed, %s.\n"),
+                       ci->app_name, ci->app_uri, "file not exist");
+            goto out_clean;
+        }
+        struct stat statbuf;
+        if (stat(path, &statbuf)) {
+            logerror(_("error in %s(%d), %s(%d).\n"), __func__, __LINE__,
+                        strerror(errno), errno);
+            goto out_clean;
+        }
+        if (statbuf.st_size < 1000000) {
+            logerror(_("downloading %s from %s failed, %s.\n"),
+                       ci->app_name, ci->app_uri, "file too small");
+            goto out_clean;
+        }
+        ly_appcache_add(ci->app_id, path, ci->app_checksum);
+    }
+    ret = 0;
+    if (path_base[0]) {
+        /* older bases not referenced are removed */
+        int err = ly_work_lock(&g_app_lock, ci->app_id);
+        if (err == 0) {
+            err = ly_appbase_commit(app_dir, path_tmp, path_base);
+            ly_work_unlock(&g_app_lock, ci->app_id);
+        }
+        if (err < 0) {
+            /* disk is extracted from appliance again */
+            unlink(path_tmp);
+            path_base[0] = '\0';
+        }
+    }
+    else if (disk)
+        strcpy(path_disk, disk);
+    goto out;
+
+out_clean:
+    unlink(path);
+    if (disk)
+        unlink(disk);
+out:
+    return ret;
+}
+
+/* create instance disk from appliance base */
+static int __domain_disk_from_base(NodeCtrlInstance * ci, int disk_mode,
+                                   char * base, char * disk)
+{
+    loginfo(_("Creating disk file from %s\n"), base);
+    __send_response(g_c->wfd, ci, LY_S_RUNNING_EXTRACTING_APP);
+    if (disk_mode == NODE_DISK_MODE_CLONE)
+        return ly_appbase_clone(base, disk);
+
+    /* qcow2 disk can't be extended by truncate, size it now */
+    long long size = 0;
+    if (ci->ins_extsize > 0 && ci->ins_extsize < 1000) {
+        struct stat statbuf;
+        if (stat(base, &statbuf)) {
+            logerror(_("error in %s(%d), %s(%d).\n"), __func__, __LINE__,
+                        strerror(errno), errno);
+            return -1;
+        }
+        if (ci->ins_extsize > (int)(statbuf.st_size>>30))
+            size = (long long)ci->ins_extsize << 30;
+    }
+
+    char ins_dir[PATH_MAX];
+    snprintf(ins_dir, PATH_MAX, "%s/%d", g_c->config.ins_data_dir, ci->ins_id);
+    if (ly_work_lock(&g_app_lock, ci->app_id) < 0) {
+        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+        return -1;
+    }
+    int ret = ly_appbase_overlay(base, disk, size, ins_dir);
+    ly_work_unlock(&g_app_lock, ci->app_id);
+    return ret;
+}
+
+/*
+** copy kernel/initrd out of instance image into instance dir, reading
+** the file system in image directly. return 1 if the file system is
+** not ext2/3/4 or can not be read this way, then the image has to be
+** mounted instead.
+*/
+static int __domain_boot_files(int ins_id, const char *image, long long offset)
+{
+    LYExt2 *fs = lyutil_ext2_open(image, offset);
+    if (fs == NULL)
+        return 1;
+
+    char path[PATH_MAX];
+    int ret = 0;
+    snprintf(path, PATH_MAX, "%s/%d/kernel", g_c->config.ins_data_dir, ins_id);
+    if (lyutil_ext2_copy(fs, "kernel", path) < 0) {
+        logerror(_("can not copy kernel from %s\n"), image);
+        ret = -1;
+    }
+    snprintf(path, PATH_MAX, "%s/%d/initrd", g_c->config.ins_data_dir, ins_id);
+    if (ret == 0 && lyutil_ext2_copy(fs, "initrd", path) < 0) {
+        logerror(_("can not copy initrd from %s\n"), image);
+        ret = -1;
+    }
+    lyutil_ext2_close(fs);
+
+    if (ret < 0) {
+        /* kernel without initrd is not usable */
+        snprintf(path, PATH_MAX, "%s/%d/kernel", g_c->config.ins_data_dir, ins_id);
+        unlink(path);
+        snprintf(path, PATH_MAX, "%s/%d/initrd", g_c->config.ins_data_dir, ins_id);
+        unlink(path);
+        logwarn(_("mounting %s instead\n"), image);
+        return 1;
+    }
+    return 0;
+}
+
+/* phases of __domain_run, metrics are registered in ly_handler_init */
+enum {
+    RUN_PHASE_LOCK = 0,
+    RUN_PHASE_APPLIANCE,
+    RUN_PHASE_DISK,
+    RUN_PHASE_IMAGE,
+    RUN_PHASE_CREATE,
+    RUN_PHASE_ACTIVE,
+    RUN_PHASE_NUM
+};
+static const char * g_run_phase_name[RUN_PHASE_NUM] = {
+    "lock", "appliance", "disk", "image", "create", "active"
+};
+static LYMetric * g_m_run_phase[RUN_PHASE_NUM];
+static LYMetric * g_m_run_time;
+static LYMetric * g_m_run_errors;
+
+/* time spent in a phase of __domain_run since *t, *t is set to now */
+static void __domain_run_phase(int phase, unsigned long long * t)
+{
+    unsigned long long now = lymetric_now_us();
+    lymetric_observe(g_m_run_phase[phase], now - *t);
+    *t = now;
+}
+
 static int __domain_run(NodeCtrlInstance * ci)
 {
     if (__domain_run_data_check(ci) < 0) {
@@ -1145,21 +1391,25 @@ static int __domain_run(NodeCtrlInstance * ci)
     }
     if (g_c->config.debug)
         luoyun_node_ctrl_instance_print(ci);
+    unsigned long long t_start = lymetric_now_us(), t = t_start;
 
     int ret = -1;
     char path[PATH_MAX];
     char tmpstr1024[1024];
-
-    char ins_idstr[10];
-    snprintf(ins_idstr, 10, "%d", ci->ins_id);
-
-    logdebug(_("trying to gain access to instance files...\n"));
-    __send_response(g_c->wfd, ci, LY_S_RUNNING_WAITING);
-    if (__file_lock_get(g_c->config.ins_data_dir, ins_idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        logerror(_("error for ins id:%d\n"), ci->ins_id);
-        goto out;
-    }
+    /*
+    ** instance disk extracted while appliance is downloaded or checked,
+    ** kept in ins_data_dir so it can be renamed into instance dir
+    */
+    char path_disk[PATH_MAX];
+    path_disk[0] = '\0';
+    /* appliance base shared by instance disks, see appbase.h */
+    char path_base[PATH_MAX];
+    path_base[0] = '\0';
+    int disk_mode = __disk_mode();
+
+    __domain_run_phase(RUN_PHASE_LOCK, &t);
+    /* appliance is kept in cache while instance is being created */
+    ly_appcache_use(ci->app_id);
 
     if (libvirt_domain_active(ci->ins_domain)) {
         loginfo(_("instance %s is running already\n"), ci->ins_domain);
@@ -1169,92 +1419,13 @@ static int __domain_run(NodeCtrlInstance * ci)
 
     snprintf(path, PATH_MAX, "%s/%d", g_c->config.ins_data_dir, ci->ins_id);
     if (ci->ins_status == DOMAIN_S_NEW || access(path, F_OK)) {
-        /* prepare appliance */
-        char app_idstr[10];
-        snprintf(app_idstr, 10, "%d", ci->app_id);
-        /* get lockfile for appliance */
-        logdebug(_("trying to gain access to appliance %d ...\n"), ci->app_id);
-        __send_response(g_c->wfd, ci, LY_S_RUNNING_WAITING);
-        if (__file_lock_get(g_c->config.app_data_dir, app_idstr) < 0) {
-            logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-            goto out_unlock;
-        }
-        /* prepare appliance dir */
-        snprintf(path, PATH_MAX, "%s/%d", g_c->config.app_data_dir, ci->app_id);
-        if (access(path, F_OK)) {
-            if (mkdir(path, 0755) == -1) {
-                logerror(_("can not create directory: %s\n"), path);
-                logerror(_("error: %d, %s\n"), errno, strerror(errno)); 
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-        }
-        /* check whether to download appliance */
-        snprintf(path, PATH_MAX, "%s/%d/%s", g_c->config.app_data_dir,
-                                  ci->app_id, LUOYUN_APPLIANCE_FILE);
-        int new_app = 1;
-        if (access(path, F_OK) == 0) {
-            loginfo(_("appliance %s found locally\n"), ci->app_name);
-            loginfo(_("checking checksum ...\n"));
-            __send_response(g_c->wfd, ci, LY_S_RUNNING_CHECKING_APP);
-            if (lyutil_checksum(path, ci->app_checksum)) {
-                logwarn(_("%s checksum(%s) failed. old appliance removed\n"),
-                          ci->app_name, ci->app_checksum);
-                unlink(path);
-            }
-            else
-                new_app = 0;
-        }
-        /* download appliance */
-        if (new_app) {
-            ret = LY_S_FINISHED_FAILURE_APP_DOWNLOAD;
-            loginfo(_("downloading %s from %s ...\n"), ci->app_name, ci->app_uri);
-            __send_response(g_c->wfd, ci, LY_S_RUNNING_DOWNLOADING_APP);
-            if (lyutil_download(ci->app_uri, path)) {
-                logwarn(_("downloading %s from %s failed, %s.\n"), 
-                           ci->app_name, ci->app_uri, "file not downloaded");
-                unlink(path);
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-            if (access(path, F_OK)) {
-                logerror(_("downloading %s from %s failed, %s.\n"),
-                           ci->app_name, ci->app_uri, "file not exist");
-                unlink(path);
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-            struct stat statbuf;
-            if (stat(path, &statbuf)) {
-                logerror(_("error in %s(%d), %s(%d).\n"), __func__, __LINE__,
-                            strerror(errno), errno);
-                unlink(path);
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-            if (statbuf.st_size < 1000000) {
-                logerror(_("downloading %s from %s failed, %s.\n"),
-                           ci->app_name, ci->app_uri, "file too small");
-                unlink(path);
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-            loginfo(_("verifying checksum...\n"));
-            __send_response(g_c->wfd, ci, LY_S_RUNNING_CHECKING_APP);
-            if (lyutil_checksum(path, ci->app_checksum)) {
-                logwarn(_("%s checksum(%s) failed.\n"), ci->app_name, ci->app_checksum);
-                unlink(path);
-                __file_lock_put(g_c->config.app_data_dir, app_idstr);
-                goto out_unlock;
-            }
-            ret = -1;
-        }
-        /* done with appliance, release lock */
-        if (__file_lock_put(g_c->config.app_data_dir, app_idstr) < 0) {
-            logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-            logerror(_("error for ins id:%d, app_idstr: %s\n"), ci->ins_id, app_idstr);
+        snprintf(path_disk, PATH_MAX, "%s/.%d.%s", g_c->config.ins_data_dir,
+                                  ci->ins_id, LUOYUN_INSTANCE_DISK_FILE);
+        ret = __appliance_prepare(ci, disk_mode, path_base, path_disk);
+        if (ret != 0)
             goto out_unlock;
-        }
+        ret = -1;
+        __domain_run_phase(RUN_PHASE_APPLIANCE, &t);
     }
 
     /* prepare instance dir */
@@ -1284,32 +1455,50 @@ static int __domain_run(NodeCtrlInstance * ci)
     if (access(path_ins, F_OK)) {
         ret = LY_S_FINISHED_FAILURE_APP_ERROR;
         ins_create_new = 1;
-        snprintf(path, PATH_MAX, "%s/%d/%s", g_c->config.app_data_dir,
-                                  ci->app_id, LUOYUN_APPLIANCE_FILE);
-        loginfo(_("Extracting disk file\n"));
-        __send_response(g_c->wfd, ci, LY_S_RUNNING_EXTRACTING_APP);
-        int fd = creat(path_ins, S_IRUSR|S_IWUSR);
-        if (fd < 0) {
-            logerror(_("error creating file %s\n"), path_ins);
-            logerror(_("error: %d, %s\n"), errno, strerror(errno)); 
-            goto out_insclean;
+        if (path_disk[0] && rename(path_disk, path_ins) == 0) {
+            /* extracted along with appliance checking */
+            path_disk[0] = '\0';
         }
-        close(fd);
-        if (lyutil_decompress_gz(path, path_ins)) {
-            logwarn(_("decompress %s to %s failed.\n"), path, path_ins);
-            unlink(path_ins);
-            goto out_insclean;
+        else if (path_base[0] &&
+                 __domain_disk_from_base(ci, disk_mode, path_base,
+                                         path_ins) == 0) {
+            /* created from appliance base */
+        }
+        else {
+            snprintf(path, PATH_MAX, "%s/%d/%s", g_c->config.app_data_dir,
+                                      ci->app_id, LUOYUN_APPLIANCE_FILE);
+            loginfo(_("Extracting disk file\n"));
+            __send_response(g_c->wfd, ci, LY_S_RUNNING_EXTRACTING_APP);
+            int fd = creat(path_ins, S_IRUSR|S_IWUSR);
+            if (fd < 0) {
+                logerror(_("error creating file %s\n"), path_ins);
+                logerror(_("error: %d, %s\n"), errno, strerror(errno)); 
+                goto out_insclean;
+            }
+            close(fd);
+            if (lyutil_decompress_gz(path, path_ins)) {
+                logwarn(_("decompress %s to %s failed.\n"), path, path_ins);
+                unlink(path_ins);
+                goto out_insclean;
+            }
         }
         if (access(path_ins, F_OK)) {
             logerror(_("instance disk file(%s) not exist\n"), path_ins);
             goto out_insclean;
         }
         ret = -1;
+        __domain_run_phase(RUN_PHASE_DISK, &t);
     }
 
+    /* raw disk image, the base for qcow2 disk */
+    char path_img[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%d", g_c->config.ins_data_dir, ci->ins_id);
+    if (ly_appbase_ins_base(path, path_img, PATH_MAX) < 0)
+        strcpy(path_img, path_ins);
+
     /* use disk offset to determine using xen or kvm */
     long long offset;
-    offset = lyutil_get_disk_offset(path_ins);
+    offset = lyutil_get_disk_offset(path_img);
     if (offset < 0) {
         logwarn(_("instance %d, get disk offset error\n"), ci->ins_id);
         goto out_insclean;
@@ -1317,8 +1506,13 @@ static int __domain_run(NodeCtrlInstance * ci)
 
     char * mount_path = NULL;
     snprintf(path, PATH_MAX, "%s/%d/kernel", g_c->config.ins_data_dir, ci->ins_id);
+    int boot_files = 0;
     if (offset == 0 && access(path, F_OK)) {
-        /* mount instance image */
+        __send_response(g_c->wfd, ci, LY_S_RUNNING_PREPARING_IMAGE);
+        boot_files = __domain_boot_files(ci->ins_id, path_img, offset);
+    }
+    if (boot_files == 1) {
+        /* not ext2/3/4, mount instance image */
         __send_response(g_c->wfd, ci, LY_S_RUNNING_MOUNTING_IMAGE);
         char nametemp[32] = "/tmp/LuoYun_XXXXXX";
         mount_path = mkdtemp(nametemp);
@@ -1327,10 +1521,11 @@ static int __domain_run(NodeCtrlInstance * ci)
             logerror(_("error: %d, %s\n"), errno, strerror(errno)); 
             goto out_insclean;
         }
-        snprintf(path, PATH_MAX, "%s/%d/%s", g_c->config.ins_data_dir, ci->ins_id,
-                                  LUOYUN_INSTANCE_DISK_FILE);
-        if (snprintf(tmpstr1024, 1024, "mount %s %s -o loop,offset=%lld",
-                                        path, mount_path, offset) >= 1024) {
+        /* base is shared, mount it read only */
+        if (snprintf(tmpstr1024, 1024, "mount %s %s -o loop,offset=%lld%s",
+                                        path_img, mount_path, offset,
+                                        strcmp(path_img, path_ins) ?
+                                        ",ro" : "") >= 1024) {
             logerror(_("error in %s(%d)\n"), __func__, __LINE__);
             remove(mount_path);
             goto out_insclean;
@@ -1373,6 +1568,7 @@ static int __domain_run(NodeCtrlInstance * ci)
         remove(mount_path);
         mount_path = NULL;
     }
+    __domain_run_phase(RUN_PHASE_IMAGE, &t);
 
     /* create instance config file */
     snprintf(path, PATH_MAX, "%s/%d/%s", g_c->config.ins_data_dir, ci->ins_id,
@@ -1444,30 +1640,34 @@ static int __domain_run(NodeCtrlInstance * ci)
         logerror(_("error creating domain xml\n"));
         goto out_insclean;
     }
+    if (g_c->node->hypervisor == HYPERVISOR_IS_KVM) {
+        char * xmlnew = ly_numa_place(xml);
+        if (xmlnew) {
+            free(xml);
+            xml = xmlnew;
+        }
+    }
 
     /* start instance */
     __send_response(g_c->wfd, ci, LY_S_RUNNING_STARTING_INSTANCE);
     ret = libvirt_domain_create(xml);
     if (ret < 0) {
         logerror(_("error start domain %s\n"), ci->ins_domain);
+        ly_numa_release(ci->ins_domain);
         free(xml);
         goto out_insclean;
     }
     free(xml);
+    __domain_run_phase(RUN_PHASE_CREATE, &t);
 
     ret = LY_S_WAITING_STARTING_OSM;
     ly_node_send_report_resource();
 
     /* check whether the domain is active */
-    int wait = LY_NODE_START_INSTANCE_WAIT;
-    while (wait > 0) {
-        wait--;
-        if (libvirt_domain_active(ci->ins_domain)) {
-            loginfo(_("instance %s active.\n"), ci->ins_domain);
-            break;
-        }
-        sleep(1);
-    }
+    if (libvirt_domain_wait(ci->ins_domain, 1, LY_NODE_START_INSTANCE_WAIT))
+        loginfo(_("instance %s active.\n"), ci->ins_domain);
+    __domain_run_phase(RUN_PHASE_ACTIVE, &t);
+    lymetric_observe(g_m_run_time, t - t_start);
     goto out_unlock;
 
 out_umount:
@@ -1483,10 +1683,12 @@ out_insclean:
         __domain_instance_clean(ci->ins_id, 0); 
     }
 out_unlock:
-    if (__file_lock_put(g_c->config.ins_data_dir, ins_idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-    }
-out:
+    if (path_disk[0])
+        unlink(path_disk);
+    ly_appcache_release(ci->app_id);
+    if (ret != LY_S_WAITING_STARTING_OSM &&
+        ret != LY_S_FINISHED_INSTANCE_RUNNING)
+        lymetric_inc(g_m_run_errors);
     return ret;
 }
 
@@ -1494,22 +1696,7 @@ static int __domain_stop(NodeCtrlInstance * ci)
 {
     loginfo(_("%s is called\n"), __func__);
 
-    char path_lock[PATH_MAX];
-    if (snprintf(path_lock, PATH_MAX, "%s/%s",
-                 g_c->config.node_data_dir, "instances") >= PATH_MAX) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
-    char idstr[10];
-    snprintf(idstr, 10, "%d", ci->ins_id);
-
     int ret;
-    __send_response(g_c->wfd, ci, LY_S_RUNNING_WAITING);
-    logdebug(_("tring to gain access to instance files...\n"));
-    if (__file_lock_get(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
     if (libvirt_domain_active(ci->ins_domain) == 0) {
         loginfo(_("instance %s is not running.\n"), ci->ins_domain);
         ret = LY_S_FINISHED_INSTANCE_NOT_RUNNING;
@@ -1521,15 +1708,10 @@ static int __domain_stop(NodeCtrlInstance * ci)
         goto out;
     }
     __send_response(g_c->wfd, ci, LY_S_RUNNING_STOPPING);
-    int wait = LY_NODE_STOP_INSTANCE_WAIT;
-    while (wait > 0) {
-        wait--;
-        if (libvirt_domain_active(ci->ins_domain) == 0) {
-            loginfo(_("instance %s stopped.\n"), ci->ins_domain);
-            ret = LY_S_FINISHED_SUCCESS;
-            goto out;
-        }
-        sleep(1);
+    if (libvirt_domain_wait(ci->ins_domain, 0, LY_NODE_STOP_INSTANCE_WAIT)) {
+        loginfo(_("instance %s stopped.\n"), ci->ins_domain);
+        ret = LY_S_FINISHED_SUCCESS;
+        goto out;
     }
     if (libvirt_domain_poweroff(ci->ins_domain) == 0) {
         loginfo(_("instance %s forced off.\n"), ci->ins_domain);
@@ -1538,10 +1720,6 @@ static int __domain_stop(NodeCtrlInstance * ci)
     }
     ret = LY_S_FINISHED_FAILURE;
 out:
-    if (__file_lock_put(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-    }
-
     if (ci->req_action == LY_A_NODE_STOP_INSTANCE && ret == LY_S_FINISHED_SUCCESS)
         ly_node_send_report_resource();
     return ret;
@@ -1566,39 +1744,23 @@ static int __domain_acpireboot(NodeCtrlInstance * ci)
 {
     loginfo(_("%s is called\n"), __func__);
 
-    char path_lock[PATH_MAX];
-    if (snprintf(path_lock, PATH_MAX, "%s/%s",
-                 g_c->config.node_data_dir, "instances") >= PATH_MAX) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
-    char idstr[10];
-    snprintf(idstr, 10, "%d", ci->ins_id);
-
     int ret;
-    __send_response(g_c->wfd, ci, LY_S_RUNNING_WAITING);
-    logdebug(_("tring to gain access to instance files...\n"));
-    if (__file_lock_get(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
     if (libvirt_domain_active(ci->ins_domain) == 0) {
         loginfo(_("instance %s is not running.\n"), ci->ins_domain);
         ret = LY_S_FINISHED_INSTANCE_NOT_RUNNING;
         goto out;
     }
-    ret = libvirt_domain_reboot(ci->ins_domain);
+    ret = libvirt_domain_reboot_wait(ci->ins_domain,
+                                     LY_NODE_REBOOT_INSTANCE_WAIT);
     if (ret < 0) {
         logerror(_("reboot domain %s failed\n"), ci->ins_domain);
         ret = LY_S_FINISHED_FAILURE;
         goto out;
     }
+    if (ret == 1)
+        loginfo(_("instance %s rebooted.\n"), ci->ins_domain);
     ret = LY_S_FINISHED_SUCCESS;
-    sleep(LY_NODE_REBOOT_INSTANCE_WAIT);
 out:
-    if (__file_lock_put(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-    }
     return ret;
 }
 
@@ -1617,27 +1779,13 @@ static int __domain_destroy(NodeCtrlInstance * ci)
 {
     loginfo(_("%s is called\n"), __func__);
 
-    char path_lock[PATH_MAX];
-    if (snprintf(path_lock, PATH_MAX, "%s/%s",
-                 g_c->config.node_data_dir, "instances") >= PATH_MAX) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
     char path_clean[PATH_MAX];
     if (snprintf(path_clean, PATH_MAX, "%s/%d",
                  g_c->config.ins_data_dir, ci->ins_id) >= PATH_MAX) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
         return -1;
     }
-    char idstr[10];
-    snprintf(idstr, 10, "%d", ci->ins_id);
-
     int ret;
-    logdebug(_("tring to gain access to instance files...\n"));
-    if (__file_lock_get(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-        return -1;
-    }
     if (libvirt_domain_active(ci->ins_domain)) {
         logwarn(_("instance %s is still running. stop it first\n"),
                    ci->ins_domain);
@@ -1654,9 +1802,6 @@ static int __domain_destroy(NodeCtrlInstance * ci)
 
     ly_node_send_report_resource();
 out:
-    if (__file_lock_put(path_lock, idstr) < 0) {
-        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
-    }
     return ret;
 }
 
@@ -1703,13 +1848,14 @@ static int __domain_query(NodeCtrlInstance * ci)
     r.data = &ii;
 
     logdebug(_("sending instance query reply...\n"));
-    char * xml = lyxml_data_reply_instance_info(&r, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_reply_instance_info(g_c->proto, &r, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
         return -1;
     }
     int ret = ly_packet_send(g_c->wfd, PKT_TYPE_CLC_INSTANCE_CONTROL_REPLY,
-                             xml, strlen(xml));
+                             xml, len);
     free(xml);
     if (ret < 0) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
@@ -1719,7 +1865,16 @@ static int __domain_query(NodeCtrlInstance * ci)
     return 0;
 }
 
-void * __instance_control_func(void * arg)
+/* requests reporting waiting for other works on the instance */
+static int __instance_control_waits(NodeCtrlInstance * ci)
+{
+    return ci->req_action == LY_A_NODE_RUN_INSTANCE ||
+           ci->req_action == LY_A_NODE_STOP_INSTANCE ||
+           ci->req_action == LY_A_NODE_ACPIREBOOT_INSTANCE ||
+           ci->req_action == LY_A_NODE_FULLREBOOT_INSTANCE;
+}
+
+static void __instance_control_func(void * arg)
 {
     NodeCtrlInstance * ci = arg;
 
@@ -1727,6 +1882,10 @@ void * __instance_control_func(void * arg)
 
     loginfo(_("Start domain control, action = %d\n"), ci->req_action);
 
+    /* works on the instance and its appliance before it are done */
+    if (__instance_control_waits(ci))
+        __send_response(g_c->wfd, ci, LY_S_RUNNING_PROCESSING);
+
     switch (ci->req_action) {
 
     case LY_A_NODE_RUN_INSTANCE:
@@ -1788,9 +1947,10 @@ void * __instance_control_func(void * arg)
         r.to = LY_ENTITY_CLC;
         r.status = ret;
         r.data = &ii;
-        xml = lyxml_data_reply_instance_info(&r, NULL, 0);
+        int len;
+        xml = lyxml_msg_reply_instance_info(g_c->proto, &r, &len);
         if (xml) {
-            if (ly_packet_send(g_c->wfd, PKT_TYPE_CLC_INSTANCE_CONTROL_REPLY, xml, strlen(xml)) < 0)
+            if (ly_packet_send(g_c->wfd, PKT_TYPE_CLC_INSTANCE_CONTROL_REPLY, xml, len) < 0)
                 logerror(_("error in %s(%d).\n"), __func__, __LINE__);
             free(xml);
         }
@@ -1803,9 +1963,8 @@ void * __instance_control_func(void * arg)
 done:
     luoyun_node_ctrl_instance_cleanup(ci);
     free(ci);
-    __update_thread_num(-1);
     logdebug(_("%s returns %d\n"), __func__, ret);
-    return NULL;
+    return;
 }
 
 int ly_handler_instance_control(NodeCtrlInstance * ci)
@@ -1825,27 +1984,93 @@ int ly_handler_instance_control(NodeCtrlInstance * ci)
     if (arg == NULL)
         return -1;
 
-#if 1
-    pthread_attr_t attr;
-    if (pthread_attr_init(&attr) != 0 || 
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-        logerror(_("threading state config failed\n"));
+    /*
+    ** requests on the same instance are processed in order,
+    ** query does not wait for other requests on the instance.
+    ** instance start waits for works on its appliance in queue.
+    */
+    int key = arg->req_action == LY_A_NODE_QUERY_INSTANCE ? 0 : arg->ins_id;
+    int key2 = 0;
+    if ((arg->req_action == LY_A_NODE_RUN_INSTANCE ||
+         arg->req_action == LY_A_NODE_FULLREBOOT_INSTANCE) &&
+        arg->app_id > 0)
+        key2 = WORK_KEY_APP(arg->app_id);
+    /*
+    ** requests are queued by main loop only, works found in queue are
+    ** still there when the request is added. waiting is reported
+    ** before that, so it never comes after processing.
+    */
+    if (__instance_control_waits(arg) && ly_work_busy(key, key2))
+        __send_response(g_c->wfd, ci, LY_S_RUNNING_WAITING);
+    if (ly_work_add_keys(key, key2, __instance_control_func, arg) < 0) {
+        logerror(_("queuing instance control request failed\n"));
+        luoyun_node_ctrl_instance_cleanup(arg);
+        free(arg);
         return -1;
     }
+    logdebug(_("instance control requests in queue: %d\n"), ly_work_num());
+
+    return 0;
+}
+
+static void __appliance_prefetch_func(void * arg)
+{
+    NodeCtrlInstance * ci = arg;
+    char path_base[PATH_MAX];
+    char path_disk[PATH_MAX];
+    path_disk[0] = '\0';
+
+    loginfo(_("prefetching appliance %s\n"), ci->app_name);
+    ly_appcache_use(ci->app_id);
+    if (__appliance_prepare(ci, __disk_mode(), path_base, path_disk) != 0)
+        logwarn(_("prefetching appliance %s failed\n"), ci->app_name);
+    ly_appcache_release(ci->app_id);
+
+    luoyun_node_ctrl_instance_cleanup(ci);
+    free(ci);
+}
 
-    pthread_t instance_tid;
-    if (pthread_create(&instance_tid, &attr,
-                       __instance_control_func, (void *)arg) != 0) {
-        logerror(_("threading __instance_control_func failed\n"));
+int ly_handler_appliance_prefetch(NodeCtrlInstance * ci)
+{
+    if (ci == NULL || g_c == NULL || g_c->node == NULL)
+        return -255;
+
+    /* prefetch is a hint, not worth waiting for */
+    if (ly_handler_busy() || ly_node_busy()) {
+        loginfo(_("node busy, drop prefetch request\n"));
+        return 0;
+    }
+    if (__appliance_data_check(ci) < 0) {
+        logerror(_("appliance data check failed\n"));
         return -1;
     }
 
-    logdebug(_("start __instance_control_func in thread %d\n"), instance_tid);
-    __update_thread_num(1);
-    logdebug(_("__instance_control_func thread num is %d\n"), g_handler_thread_num);
-#else
-    __instance_control_func((void *)arg);
-#endif
-
+    NodeCtrlInstance *arg = luoyun_node_ctrl_instance_copy(ci);
+    if (arg == NULL)
+        return -1;
+    if (ly_work_add(WORK_KEY_APP(arg->app_id), __appliance_prefetch_func,
+                    arg) < 0) {
+        logerror(_("queuing appliance prefetch request failed\n"));
+        luoyun_node_ctrl_instance_cleanup(arg);
+        free(arg);
+        return -1;
+    }
     return 0;
 }
+
+void ly_handler_init(void)
+{
+    int i;
+    char name[LYMETRIC_NAME_MAX];
+    for (i = 0; i < RUN_PHASE_NUM; i++) {
+        snprintf(name, sizeof(name),
+                 "ly_node_instance_run_seconds{phase=\"%s\"}",
+                 g_run_phase_name[i]);
+        g_m_run_phase[i] = lymetric_histogram(name,
+                               "time spent in phases of starting instance");
+    }
+    g_m_run_time = lymetric_histogram("ly_node_instance_start_seconds",
+                                      "time of starting instance, all phases");
+    g_m_run_errors = lymetric_counter("ly_node_instance_start_errors_total",
+                                      "instances failed starting");
+}
@@ -23,9 +23,13 @@
 #define LUOYUN_INSTANCE_MEM_DEFAULT 256000 /* in kB */
 #define LUOYUN_INSTANCE_CPU_DEFAULT 1
 
+/* register metrics of instance control, before requests are processed */
+void ly_handler_init(void);
 /* process/dispatch instance control requests */
 int ly_handler_instance_control(NodeCtrlInstance * ci);
 int ly_handler_busy(void);
+/* get appliance ready in cache before instances ask for it */
+int ly_handler_appliance_prefetch(NodeCtrlInstance * ci);
 
 /* build node register request, caller needs to free the returned string */
 /*extern char * ly_node_xml_register_node(int * size); */
@@ -94,6 +98,13 @@ int ly_handler_busy(void);
       "<target dev=\'%s\' bus='ide'/>"\
     "</disk>"
 
+#define LIBVIRT_XML_TMPL_KVM_DISK_QCOW2 \
+    "<disk type='file' device='disk'>"\
+      "<driver name='qemu' type='qcow2' io='threads'/>"\
+      "<source file=\'%s\'/>"\
+      "<target dev=\'%s\' bus='ide'/>"\
+    "</disk>"
+
 #define LIBVIRT_XML_TMPL_KVM_NET_BRIDGE \
     "<interface type='bridge'>"\
       "<source bridge=\'%s\'/>"\
@@ -35,10 +35,15 @@
 #include "../util/lypacket.h"
 #include "../util/lyxml.h"
 #include "../util/lyutil.h"
+#include "../util/lymetric.h"
 #include "options.h"
 #include "events.h"
 #include "domain.h"
 #include "node.h"
+#include "handler.h"
+#include "work.h"
+#include "appcache.h"
+#include "numa.h"
 
 /* Global value */
 NodeControl *g_c = NULL;
@@ -63,6 +68,13 @@ static int __print_config(NodeConfig *c)
     return 0;
 }
 
+static long long __now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void __main_clean(int keeppid)
 {
     if (g_c == NULL)
@@ -72,8 +84,10 @@ static void __main_clean(int keeppid)
     NodeConfig *c = &g_c->config;
     NodeSysConfig *s = &g_c->config_sys;
 
-    ly_epoll_close();
+    lymetric_stop();
+    ly_numa_cleanup();
     libvirt_close();
+    ly_epoll_close();
     if (keeppid == 0)
         lyutil_remove_pid_file(c->pid_path, PROGRAM_NAME);
     lyauth_free(&g_c->auth);
@@ -87,6 +101,7 @@ static void __main_clean(int keeppid)
     MY_SAFE_FREE(c->app_data_dir)
     MY_SAFE_FREE(c->log_path)
     MY_SAFE_FREE(c->pid_path)
+    MY_SAFE_FREE(c->metrics_path)
     MY_SAFE_FREE(c->osm_key_path)
     MY_SAFE_FREE(c->osm_conf_path)
     MY_SAFE_FREE(c->vm_template_path)
@@ -288,6 +303,8 @@ int main(int argc, char *argv[])
             printf(_("Run as daemon, log to %s.\n"), c->log_path);
         lyutil_daemonize(__main_clean, keeppidfile);
         logfile(c->log_path, c->debug ? LYDEBUG : c->verbose ? LYINFO : LYWARN);
+        if (c->log_async && logasync() < 0)
+            logwarn(_("failed starting async logging\n"));
 
         /* log currently work dir */
         char cwd[1024];
@@ -313,6 +330,16 @@ int main(int argc, char *argv[])
     }
     keeppidfile = 0;
 
+    /* initialize g_c->efd, libvirt events are processed in it */
+    if (ly_epoll_init(MAX_EVENTS) != 0) {
+        logsimple(_("ly_epoll_init failed.\n"));
+        ret = -255;
+        goto out;
+    }
+    if (libvirt_event_init(g_c->efd, ly_node_domain_event) != 0)
+        logsimple(_("libvirt events not processed, "
+                    "domain state will be polled.\n"));
+
     /* Connect to libvirt daemon */
     if (libvirt_connect(c->driver) < 0) {
         logsimple(_("error connecting hypervisor.\n"));
@@ -329,6 +356,11 @@ int main(int argc, char *argv[])
     }
     NodeInfo * nf = g_c->node;
     nf->host_tag = s->node_tag;
+    /* numa cells, domains are placed in when possible */
+    if (c->numa_placement && nf->hypervisor == HYPERVISOR_IS_KVM &&
+        ly_numa_init(c->hugepages) < 0)
+        logwarn(_("numa topology unknown, instances not bound to cells\n"));
+    ly_numa_info(nf);
     if (c->debug)
         luoyun_node_info_print(nf);
 
@@ -352,13 +384,26 @@ int main(int argc, char *argv[])
     sigaddset(&sig, SIGCHLD);
     pthread_sigmask(SIG_BLOCK, &sig, NULL);
 
-    /* initialize g_c->efd */
-    if (ly_epoll_init(MAX_EVENTS) != 0) {
-        logsimple(_("ly_epoll_init failed.\n"));
+    /* appliances cached, cache size is checked */
+    if (ly_appcache_init(g_c->config.app_data_dir,
+                         (long long)g_c->config.app_cache_size << 30) != 0) {
+        logsimple(_("ly_appcache_init failed.\n"));
+        ret = -255;
+        goto out;
+    }
+
+    /* start threads processing instance control requests */
+    ly_handler_init();
+    if (ly_work_start(LY_NODE_WORKER_NUM) != 0) {
+        logsimple(_("ly_work_start failed.\n"));
         ret = -255;
         goto out;
     }
 
+    /* node runs without metrics if they can't be served */
+    if (lymetric_serve(c->metrics_path) < 0)
+        logwarn(_("metrics are not served on %s\n"), c->metrics_path);
+
     /* start main event driven loop */
     int i, n;
     int wait = -1;
@@ -398,12 +443,24 @@ int main(int argc, char *argv[])
         }
 
         logdebug(_("waiting for events ...\n"));
-        n = epoll_wait(g_c->efd, events, MAX_EVENTS, wait);
-        if (wait > 0)
-            wait = -1;
+        int timeout = libvirt_event_timeout();
+        if (timeout < 0 || (wait >= 0 && wait < timeout))
+            timeout = wait;
+        long long t0 = __now_ms();
+        n = epoll_wait(g_c->efd, events, MAX_EVENTS, timeout);
+        if (wait > 0) {
+            /* libvirt timers may end epoll_wait before retry wait */
+            wait -= __now_ms() - t0;
+            if (wait <= 0)
+                wait = -1;
+        }
         loginfo(_("waiting ... got %d events\n"), n);
         for (i = 0; i < n; i++) {
-            if (LY_EVENT_MCAST_DATAIN(events[i])) {
+            if (libvirt_event_handle(&events[i])) {
+                /* libvirt connection, domain events */
+                continue;
+            }
+            else if (LY_EVENT_MCAST_DATAIN(events[i])) {
                 /* mcast data received */
                 ret = ly_epoll_mcast_recv();
                 if (ret < 0) {
@@ -450,6 +507,7 @@ int main(int argc, char *argv[])
                            events[i].events, events[i].data.fd);
             }
         }
+        libvirt_event_run();
     }
 
 out:
@@ -10,7 +10,8 @@
 #define LY_NODE_STOP_INSTANCE_WAIT 60
 #define LY_NODE_START_INSTANCE_WAIT 20
 #define LY_NODE_REBOOT_INSTANCE_WAIT 10
-#define LY_NODE_THREAD_MAX 100
+#define LY_NODE_THREAD_MAX 100 /* instance control requests queued */
+#define LY_NODE_WORKER_NUM 16  /* threads processing the requests */
 #define LY_NODE_LOAD_MAX   2000
 #define LY_NODE_KEEPALIVE_INTVL  10
 #define LY_NODE_KEEPALIVE_PROBES 3
@@ -28,6 +29,9 @@ typedef struct NodeControl_t {
     /* tracking node state */
     int state;
 
+    /* wire format agreed with clc, LUOYUN_PROTO_* */
+    int proto;
+
     /* clc ip/port being used */
     char * clc_ip;
     int    clc_port;
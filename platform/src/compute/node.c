@@ -36,6 +36,8 @@
 #include "../util/lyxml.h"
 #include "domain.h"
 #include "handler.h"
+#include "appcache.h"
+#include "numa.h"
 #include "node.h"
 
 
@@ -64,10 +66,11 @@ void ly_node_send_report(int type, char * msg)
     r.to = LY_ENTITY_CLC;
     r.status = g_c->node->status;
     r.msg = msg;
-    char * xml = lyxml_data_report(&r, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_report(g_c->proto, &r, &len);
     if (xml == NULL)
         return;
-    ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REPORT, xml, strlen(xml));
+    ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REPORT, xml, len);
     free(xml);
     return;
 }
@@ -90,15 +93,74 @@ void ly_node_send_report_resource(void)
     r.msg = NULL;
     r.data = g_c->node;
     logdebug(_("sending node info report...\n"));
-    char * xml = lyxml_data_report_node_info(&r, NULL, 0);
+    int len;
+    char * xml = lyxml_msg_report_node_info(g_c->proto, &r, &len);
     if (xml == NULL) {
         logerror(_("error in %s(%d).\n"), __func__, __LINE__);
         return;
     }
-    ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REPORT, xml, strlen(xml));
+    ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REPORT, xml, len);
     free(xml);
     return;
 }
+
+void ly_node_send_report_instance(int ins_id, int status)
+{
+    if (g_c == NULL || g_c->wfd < 0)
+        return;
+
+    InstanceInfo ii;
+    bzero(&ii, sizeof(InstanceInfo));
+    ii.id = ins_id;
+    ii.status = status;
+    LYReport r;
+    r.from = LY_ENTITY_NODE;
+    r.to = LY_ENTITY_CLC;
+    r.status = LY_S_FINISHED_SUCCESS;
+    r.msg = NULL;
+    r.data = &ii;
+    logdebug(_("sending instance %d status %d report...\n"), ins_id, status);
+    int len;
+    char * xml = lyxml_msg_report_instance_info(g_c->proto, &r, &len);
+    if (xml == NULL) {
+        logerror(_("error in %s(%d).\n"), __func__, __LINE__);
+        return;
+    }
+    ly_packet_send(g_c->wfd, PKT_TYPE_NODE_REPORT, xml, len);
+    free(xml);
+    return;
+}
+
+/*
+** domain lifecycle event from libvirt, called in main loop.
+** instance id is the number at the end of domain name.
+*/
+void ly_node_domain_event(const char * name, int event)
+{
+    int len = strlen(name);
+    while (len > 0 && name[len-1] >= '0' && name[len-1] <= '9')
+        len--;
+    if (name[len] == '\0') {
+        logdebug(_("domain %s is not an instance\n"), name);
+        return;
+    }
+    int ins_id = atoi(name + len);
+
+    if (event == VIR_DOMAIN_EVENT_STARTED)
+        ly_node_send_report_instance(ins_id, DOMAIN_S_START);
+    else if (event == VIR_DOMAIN_EVENT_STOPPED) {
+        ly_numa_release(name);
+        ly_node_send_report_instance(ins_id, DOMAIN_S_STOP);
+    }
+    else if (event == VIR_DOMAIN_EVENT_CRASHED) {
+        logwarn(_("instance %d crashed\n"), ins_id);
+        ly_numa_release(name);
+        ly_node_send_report_instance(ins_id, DOMAIN_S_STOP);
+    }
+    else
+        return;
+    ly_node_send_report_resource();
+}
                             
 int ly_node_busy(void)
 {
@@ -141,6 +203,8 @@ int ly_node_info_update()
     }
     nf->load_average = load_average;
 
+    ly_appcache_stats(&nf->app_cache_hit, &nf->app_cache_miss);
+
     nf->status = g_c->state;
 
     if (nf->status >= NODE_STATUS_ONLINE &&
@@ -159,6 +223,9 @@ int ly_node_info_update()
         return -1;
     }
 
+    /* after domain snapshot is updated */
+    ly_numa_info(nf);
+
     return 0;
 }
 
@@ -7,5 +7,7 @@ int ly_node_busy(void);
 
 void ly_node_send_report(int type, char * msg);
 void ly_node_send_report_resource(void);
+void ly_node_send_report_instance(int ins_id, int status);
+void ly_node_domain_event(const char * name, int event);
 
 #endif
@@ -0,0 +1,460 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include "../util/logging.h"
+#include "../util/list.h"
+#include "../util/lyxml.h"
+#include "domain.h"
+#include "numa.h"
+
+#define NUMA_CPUSET_LEN 256
+#define NUMA_DOMAIN_NAME_LEN 64
+
+typedef struct LYNumaCell_t {
+    int id;
+    int cpus;
+    char cpuset[NUMA_CPUSET_LEN];   /* eg. 0-5,12-17, empty if too long */
+    unsigned long long memory;      /* in KiB */
+    unsigned long long commit;      /* memory of domains placed in cell */
+    int vcpus;                      /* vcpus of domains placed in cell */
+} LYNumaCell;
+
+typedef struct LYNumaDomain_t {
+    struct list_head list;
+    char name[NUMA_DOMAIN_NAME_LEN];
+    LYNumaCell * cell;
+    int vcpus;
+    unsigned long long memory;
+    time_t placed;
+    int seen;                       /* found running */
+} LYNumaDomain;
+
+static pthread_mutex_t g_numa_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LYNumaCell g_numa_cells[LY_NUMA_CELL_MAX];
+static int g_numa_num = 0;
+static int g_numa_hugepages = 0;
+static LIST_HEAD(g_numa_domains);
+
+/* first element child of node with name */
+static xmlNode * __xml_child(xmlNode * node, const char * name)
+{
+    for (node = node ? node->children : NULL; node; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE &&
+            strcmp((char *)node->name, name) == 0)
+            return node;
+    }
+    return NULL;
+}
+
+static int __xml_prop_int(xmlNode * node, const char * name, int def)
+{
+    char * str = (char *)xmlGetProp(node, (const xmlChar *)name);
+    if (str == NULL)
+        return def;
+    int v = atoi(str);
+    free(str);
+    return v;
+}
+
+/* memory element of libvirt xml in KiB, 0 on error */
+static unsigned long long __xml_memory(xmlNode * node)
+{
+    if (node == NULL)
+        return 0;
+
+    char * str = (char *)xmlNodeGetContent(node);
+    if (str == NULL)
+        return 0;
+    unsigned long long v = strtoull(str, NULL, 10);
+    free(str);
+
+    str = (char *)xmlGetProp(node, (const xmlChar *)"unit");
+    if (str == NULL || strcmp(str, "k") == 0 || strcmp(str, "KiB") == 0)
+        ;
+    else if (strcmp(str, "b") == 0 || strcmp(str, "bytes") == 0)
+        v >>= 10;
+    else if (strcmp(str, "KB") == 0)
+        v = v * 1000 >> 10;
+    else if (strcmp(str, "M") == 0 || strcmp(str, "MiB") == 0)
+        v <<= 10;
+    else if (strcmp(str, "MB") == 0)
+        v = v * 1000000 >> 10;
+    else if (strcmp(str, "G") == 0 || strcmp(str, "GiB") == 0)
+        v <<= 20;
+    else if (strcmp(str, "GB") == 0)
+        v = v * 1000000000 >> 10;
+    else {
+        logwarn(_("unknown memory unit %s\n"), str);
+        v = 0;
+    }
+    free(str);
+    return v;
+}
+
+/* cpu ids, in increasing order, into cpuset of ranges */
+static void __cpuset_add(char * cpuset, int * last, int * first, int id)
+{
+    int len = strlen(cpuset);
+    if (len >= NUMA_CPUSET_LEN - 1)
+        return;
+    if (*last >= 0 && id == *last + 1) {
+        *last = id;
+        return;
+    }
+    if (*last > *first)
+        len += snprintf(cpuset + len, NUMA_CPUSET_LEN - len, "-%d", *last);
+    if (id >= 0 && len < NUMA_CPUSET_LEN)
+        snprintf(cpuset + len, NUMA_CPUSET_LEN - len, "%s%d",
+                 len ? "," : "", id);
+    *first = *last = id;
+}
+
+static int __numa_topology(const char * caps)
+{
+    xmlDoc * doc = xml_doc_from_str(caps);
+    if (doc == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+
+    xmlNode * node = xmlDocGetRootElement(doc);
+    node = __xml_child(__xml_child(__xml_child(node, "host"),
+                                   "topology"), "cells");
+    int num = 0;
+    for (node = node ? node->children : NULL; node; node = node->next) {
+        if (node->type != XML_ELEMENT_NODE ||
+            strcmp((char *)node->name, "cell") != 0)
+            continue;
+        if (num >= LY_NUMA_CELL_MAX) {
+            logwarn(_("too many numa cells, %d used\n"), num);
+            break;
+        }
+        LYNumaCell * c = &g_numa_cells[num];
+        bzero(c, sizeof(LYNumaCell));
+        c->id = __xml_prop_int(node, "id", num);
+        c->memory = __xml_memory(__xml_child(node, "memory"));
+
+        int first = -1, last = -1;
+        xmlNode * cpu = __xml_child(node, "cpus");
+        for (cpu = cpu ? cpu->children : NULL; cpu; cpu = cpu->next) {
+            if (cpu->type != XML_ELEMENT_NODE ||
+                strcmp((char *)cpu->name, "cpu") != 0)
+                continue;
+            int id = __xml_prop_int(cpu, "id", -1);
+            if (id < 0)
+                continue;
+            __cpuset_add(c->cpuset, &last, &first, id);
+            c->cpus++;
+        }
+        __cpuset_add(c->cpuset, &last, &first, -1);
+        if (strlen(c->cpuset) >= NUMA_CPUSET_LEN - 1) {
+            logwarn(_("cpus of numa cell %d not used\n"), c->id);
+            c->cpuset[0] = '\0';
+        }
+        logdebug(_("numa cell %d, %llu KiB, cpus %s\n"),
+                    c->id, c->memory, c->cpuset);
+        num++;
+    }
+
+    xmlFreeDoc(doc);
+    return num;
+}
+
+static LYNumaCell * __numa_cell(int id)
+{
+    int i;
+    for (i = 0; i < g_numa_num; i++) {
+        if (g_numa_cells[i].id == id)
+            return &g_numa_cells[i];
+    }
+    return NULL;
+}
+
+static LYNumaDomain * __numa_domain(const char * name)
+{
+    LYNumaDomain * d;
+    list_for_each_entry(d, &g_numa_domains, list) {
+        if (strcmp(d->name, name) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+static LYNumaDomain * __numa_domain_add(const char * name, LYNumaCell * c,
+                                        int vcpus, unsigned long long memory)
+{
+    LYNumaDomain * d = malloc(sizeof(LYNumaDomain));
+    if (d == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return NULL;
+    }
+    strncpy(d->name, name, NUMA_DOMAIN_NAME_LEN - 1);
+    d->name[NUMA_DOMAIN_NAME_LEN - 1] = '\0';
+    d->cell = c;
+    d->vcpus = vcpus;
+    d->memory = memory;
+    d->placed = time(NULL);
+    d->seen = 0;
+    c->commit += memory;
+    c->vcpus += vcpus;
+    list_add(&d->list, &g_numa_domains);
+    return d;
+}
+
+static void __numa_domain_del(LYNumaDomain * d)
+{
+    d->cell->commit -= d->memory;
+    d->cell->vcpus -= d->vcpus;
+    list_del(&d->list);
+    free(d);
+}
+
+/* cell of running domain bound to a single cell, -1 if none */
+static int __numa_domain_cell(const char * xml)
+{
+    xmlDoc * doc = xml_doc_from_str(xml);
+    if (doc == NULL)
+        return -1;
+
+    int id = -1;
+    xmlNode * node = __xml_child(__xml_child(xmlDocGetRootElement(doc),
+                                             "numatune"), "memory");
+    char * str = node ? (char *)xmlGetProp(node, (const xmlChar *)"nodeset")
+                      : NULL;
+    if (str) {
+        char * end;
+        id = strtol(str, &end, 10);
+        if (end == str || *end != '\0')
+            id = -1;
+        free(str);
+    }
+    xmlFreeDoc(doc);
+    return id;
+}
+
+int ly_numa_init(int hugepages)
+{
+    char * caps = libvirt_capabilities();
+    if (caps == NULL)
+        return -1;
+    int num = __numa_topology(caps);
+    free(caps);
+    if (num < 0)
+        return -1;
+
+    pthread_mutex_lock(&g_numa_mutex);
+    g_numa_num = num;
+    g_numa_hugepages = hugepages;
+
+    /* domains placed before lynode restarted */
+    DomainStats * ds = NULL;
+    int i, n = num > 1 ? libvirt_domain_stats_all(&ds, 0) : 0;
+    for (i = 0; i < n; i++) {
+        if (ds[i].id == 0 || __numa_domain(ds[i].name))
+            continue;
+        char * xml = libvirt_domain_xml(ds[i].name);
+        if (xml == NULL)
+            continue;
+        LYNumaCell * c = __numa_cell(__numa_domain_cell(xml));
+        free(xml);
+        if (c == NULL)
+            continue;
+        LYNumaDomain * d = __numa_domain_add(ds[i].name, c, ds[i].vcpus,
+                                             ds[i].max_mem);
+        if (d)
+            d->seen = 1;
+    }
+    if (ds)
+        free(ds);
+    pthread_mutex_unlock(&g_numa_mutex);
+
+    loginfo(_("%d numa cells found\n"), num);
+    return num;
+}
+
+char * ly_numa_place(const char * xml)
+{
+    if (g_numa_num < 2 || xml == NULL)
+        return NULL;
+
+    xmlDoc * doc = xml_doc_from_str(xml);
+    if (doc == NULL) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return NULL;
+    }
+
+    char * newxml = NULL;
+    char * name = NULL;
+    xmlNode * root = xmlDocGetRootElement(doc);
+    if (root == NULL || strcmp((char *)root->name, "domain") != 0)
+        goto out;
+
+    /* tuning in template is kept */
+    if (__xml_child(root, "cputune") || __xml_child(root, "numatune") ||
+        __xml_child(root, "memoryBacking"))
+        goto out;
+
+    xmlNode * node = __xml_child(root, "name");
+    name = node ? (char *)xmlNodeGetContent(node) : NULL;
+    node = __xml_child(root, "vcpu");
+    char * str = node ? (char *)xmlNodeGetContent(node) : NULL;
+    int vcpus = str ? atoi(str) : 0;
+    free(str);
+    unsigned long long memory = __xml_memory(__xml_child(root, "memory"));
+    if (name == NULL || vcpus <= 0 || memory == 0)
+        goto out;
+
+    /* free memory of cells, not meaningful with hugepages */
+    unsigned long long free_mems[LY_NUMA_CELL_MAX];
+    int free_num = g_numa_hugepages ? 0 :
+                   libvirt_cells_free_memory(free_mems, LY_NUMA_CELL_MAX);
+
+    pthread_mutex_lock(&g_numa_mutex);
+    LYNumaDomain * d = __numa_domain(name);
+    if (d)
+        __numa_domain_del(d);
+
+    /* cell with most memory left */
+    int i;
+    LYNumaCell * best = NULL;
+    for (i = 0; i < g_numa_num; i++) {
+        LYNumaCell * c = &g_numa_cells[i];
+        if (c->cpuset[0] == '\0' || c->cpus < vcpus ||
+            c->memory < c->commit + memory)
+            continue;
+        if (i < free_num && (free_mems[i] >> 10) < memory)
+            continue;
+        if (best == NULL ||
+            c->memory - c->commit > best->memory - best->commit)
+            best = c;
+    }
+    if (best == NULL || __numa_domain_add(name, best, vcpus, memory) == NULL) {
+        pthread_mutex_unlock(&g_numa_mutex);
+        logdebug(_("domain %s not placed in numa cell\n"), name);
+        goto out;
+    }
+    pthread_mutex_unlock(&g_numa_mutex);
+
+    char tmp[20];
+    node = xmlNewChild(root, NULL, BAD_CAST "cputune", NULL);
+    for (i = 0; i < vcpus; i++) {
+        xmlNode * pin = xmlNewChild(node, NULL, BAD_CAST "vcpupin", NULL);
+        snprintf(tmp, sizeof(tmp), "%d", i);
+        xmlNewProp(pin, BAD_CAST "vcpu", BAD_CAST tmp);
+        xmlNewProp(pin, BAD_CAST "cpuset", BAD_CAST best->cpuset);
+    }
+    xmlNewProp(xmlNewChild(node, NULL, BAD_CAST "emulatorpin", NULL),
+               BAD_CAST "cpuset", BAD_CAST best->cpuset);
+
+    node = xmlNewChild(root, NULL, BAD_CAST "numatune", NULL);
+    node = xmlNewChild(node, NULL, BAD_CAST "memory", NULL);
+    snprintf(tmp, sizeof(tmp), "%d", best->id);
+    xmlNewProp(node, BAD_CAST "mode", BAD_CAST "strict");
+    xmlNewProp(node, BAD_CAST "nodeset", BAD_CAST tmp);
+
+    if (g_numa_hugepages) {
+        node = xmlNewChild(root, NULL, BAD_CAST "memoryBacking", NULL);
+        xmlNewChild(node, NULL, BAD_CAST "hugepages", NULL);
+    }
+
+    int len;
+    xmlDocDumpMemory(doc, (xmlChar **)&newxml, &len);
+    loginfo(_("domain %s placed in numa cell %d, cpus %s\n"),
+               name, best->id, best->cpuset);
+
+out:
+    if (name)
+        free(name);
+    xmlFreeDoc(doc);
+    return newxml;
+}
+
+void ly_numa_release(const char * name)
+{
+    if (name == NULL)
+        return;
+
+    pthread_mutex_lock(&g_numa_mutex);
+    LYNumaDomain * d = __numa_domain(name);
+    if (d) {
+        logdebug(_("domain %s released from numa cell %d\n"),
+                    name, d->cell->id);
+        __numa_domain_del(d);
+    }
+    pthread_mutex_unlock(&g_numa_mutex);
+}
+
+void ly_numa_info(NodeInfo * nf)
+{
+    if (nf == NULL)
+        return;
+
+    pthread_mutex_lock(&g_numa_mutex);
+
+    /* domains gone without events, or never started */
+    time_t now = time(NULL);
+    LYNumaDomain * d, * n;
+    list_for_each_entry_safe(d, n, &g_numa_domains, list) {
+        DomainStats ds;
+        int ret = libvirt_domain_stats(d->name, &ds);
+        if (ret == 0)
+            d->seen = 1;
+        else if (ret == 1 &&
+                 (d->seen || now - d->placed > LY_NUMA_PLACE_WAIT))
+            __numa_domain_del(d);
+    }
+
+    int i;
+    nf->numa_cells = g_numa_num;
+    nf->numa_cell_cpus = 0;
+    nf->numa_mem_free = 0;
+    for (i = 0; i < g_numa_num; i++) {
+        LYNumaCell * c = &g_numa_cells[i];
+        if (c->cpus > nf->numa_cell_cpus)
+            nf->numa_cell_cpus = c->cpus;
+        if (c->memory > c->commit && c->memory - c->commit > nf->numa_mem_free)
+            nf->numa_mem_free = c->memory - c->commit;
+    }
+    pthread_mutex_unlock(&g_numa_mutex);
+}
+
+void ly_numa_cleanup(void)
+{
+    pthread_mutex_lock(&g_numa_mutex);
+    LYNumaDomain * d, * n;
+    list_for_each_entry_safe(d, n, &g_numa_domains, list)
+        __numa_domain_del(d);
+    g_numa_num = 0;
+    pthread_mutex_unlock(&g_numa_mutex);
+}
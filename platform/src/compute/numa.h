@@ -0,0 +1,42 @@
+#ifndef __LY_INCLUDE_COMPUTE_NUMA_H
+#define __LY_INCLUDE_COMPUTE_NUMA_H
+
+#include "../luoyun/luoyun.h"
+
+/*
+** numa aware placement of domains.
+**
+** cells of host are read from capabilities of libvirt. domain fits in
+** a cell if its vcpus are no more than cpus of the cell and its memory
+** is no more than memory of the cell not committed to other domains
+** placed there. such domain has its vcpus pinned to cpus of the cell,
+** and its memory bound to the cell, optionally backed by hugepages.
+** domains not fitting in any cell are left to the host scheduler.
+** functions are thread safe.
+*/
+#define LY_NUMA_CELL_MAX 64
+
+/* seconds a placed domain may take to show up before it's forgotten */
+#define LY_NUMA_PLACE_WAIT 300
+
+/*
+** read topology of host, and cells of running domains placed before.
+** return number of cells, -1 on error.
+*/
+int ly_numa_init(int hugepages);
+
+/*
+** choose cell for domain in xml, return new xml with the domain bound
+** to the cell, or NULL if domain is not placed.
+*/
+char * ly_numa_place(const char * xml);
+
+/* domain is not running */
+void ly_numa_release(const char * name);
+
+/* topology and free memory of cells for node info */
+void ly_numa_info(NodeInfo * nf);
+
+void ly_numa_cleanup(void);
+
+#endif
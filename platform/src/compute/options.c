@@ -211,10 +211,23 @@ static int __parse_config(NodeConfig *c)
 
     char * driver = NULL;
     char * auto_connect = NULL;
+    char * disk_mode = NULL;
     if (__parse_oneitem_str("LYNODE_SYSCONF_PATH", &c->sysconf_path, 
                              0, ini_config) || 
         __parse_oneitem_str("LYNODE_DRIVER", &driver, 
                              0, ini_config) || 
+        __parse_oneitem_str("LYNODE_DISK_MODE", &disk_mode, 
+                             0, ini_config) || 
+        __parse_oneitem_int("LYNODE_APP_CACHE_SIZE", &c->app_cache_size, 
+                             ini_config) || 
+        __parse_oneitem_int("LYNODE_DOWNLOAD_CONNECTIONS", &c->download_conns,
+                             ini_config) || 
+        __parse_oneitem_int("LYNODE_DECOMPRESS_THREADS",
+                             &c->decompress_threads, ini_config) || 
+        __parse_oneitem_int("LYNODE_NUMA_PLACEMENT",
+                             &c->numa_placement, ini_config) || 
+        __parse_oneitem_int("LYNODE_HUGEPAGES", &c->hugepages,
+                             ini_config) || 
         __parse_oneitem_str("LYCLC_AUTO_CONNECT", &auto_connect, 
                              0, ini_config) || 
         __parse_oneitem_str("LYCLC_HOST", &c->clc_ip,
@@ -231,6 +244,8 @@ static int __parse_config(NodeConfig *c)
                              0, ini_config) || 
         __parse_oneitem_str("LYNODE_PID_PATH", &c->pid_path,
                              0, ini_config) || 
+        __parse_oneitem_str("LYNODE_METRICS_PATH", &c->metrics_path,
+                             0, ini_config) || 
         __parse_oneitem_str("LYNODE_VM_TEMPLATE", &c->vm_template_path,
                              0, ini_config) || 
         __parse_oneitem_str("LYNODE_VM_NET_NAT_TEMPLATE", &c->vm_template_net_nat_path,
@@ -270,6 +285,46 @@ static int __parse_config(NodeConfig *c)
         }
         free(auto_connect);
     }
+    if (disk_mode != NULL) {
+        if (strcasecmp(disk_mode, "COPY") == 0)
+            c->disk_mode = NODE_DISK_MODE_COPY;
+        else if (strcasecmp(disk_mode, "CLONE") == 0)
+            c->disk_mode = NODE_DISK_MODE_CLONE;
+        else if (strcasecmp(disk_mode, "QCOW2") == 0)
+            c->disk_mode = NODE_DISK_MODE_QCOW2;
+        else {
+            logsimple(_("unrecognized value for LYNODE_DISK_MODE %s\n"), disk_mode);
+            return NODE_CONFIG_RET_ERR_CONF;
+        }
+        free(disk_mode);
+    }
+    if (c->app_cache_size < 0) {
+        logsimple(_("invalid value for LYNODE_APP_CACHE_SIZE %d\n"),
+                    c->app_cache_size);
+        return NODE_CONFIG_RET_ERR_CONF;
+    }
+    if (c->download_conns < 0 || c->download_conns > NODE_DOWNLOAD_CONNS_MAX) {
+        logsimple(_("invalid value for LYNODE_DOWNLOAD_CONNECTIONS %d\n"),
+                    c->download_conns);
+        return NODE_CONFIG_RET_ERR_CONF;
+    }
+    if (c->decompress_threads < 0 ||
+        c->decompress_threads > NODE_DECOMPRESS_THREADS_MAX) {
+        logsimple(_("invalid value for LYNODE_DECOMPRESS_THREADS %d\n"),
+                    c->decompress_threads);
+        return NODE_CONFIG_RET_ERR_CONF;
+    }
+    if (c->numa_placement != UNDEFINED_CFG_INT &&
+        c->numa_placement != 0 && c->numa_placement != 1) {
+        logsimple(_("invalid value for LYNODE_NUMA_PLACEMENT %d\n"),
+                    c->numa_placement);
+        return NODE_CONFIG_RET_ERR_CONF;
+    }
+    if (c->hugepages != 0 && c->hugepages != 1) {
+        logsimple(_("invalid value for LYNODE_HUGEPAGES %d\n"),
+                    c->hugepages);
+        return NODE_CONFIG_RET_ERR_CONF;
+    }
     if (c->daemon == UNDEFINED_CFG_INT) {
         if (__parse_oneitem_int("LYNODE_DAEMON", &c->daemon, ini_config))
             return NODE_CONFIG_RET_ERR_CONF;
@@ -278,6 +333,16 @@ static int __parse_config(NodeConfig *c)
         if (__parse_oneitem_int("LYNODE_DEBUG", &c->debug, ini_config))
             return NODE_CONFIG_RET_ERR_CONF;
     }
+    if (c->log_async == UNDEFINED_CFG_INT) {
+        if (__parse_oneitem_int("LYNODE_LOG_ASYNC", &c->log_async, ini_config))
+            return NODE_CONFIG_RET_ERR_CONF;
+        if (c->log_async != UNDEFINED_CFG_INT &&
+            c->log_async != 0 && c->log_async != 1) {
+            logsimple(_("invalid value for LYNODE_LOG_ASYNC %d\n"),
+                        c->log_async);
+            return NODE_CONFIG_RET_ERR_CONF;
+        }
+    }
     if (c->log_path == NULL) {
         if (__parse_oneitem_str("LYNODE_LOG_PATH", &c->log_path, 0, ini_config))
             return NODE_CONFIG_RET_ERR_CONF;
@@ -410,7 +475,9 @@ int node_config(int argc, char *argv[], NodeConfig *c, NodeSysConfig *s)
     c->auto_connect = UNKNOWN;
     c->verbose = UNDEFINED_CFG_INT;
     c->daemon = UNDEFINED_CFG_INT;
+    c->log_async = UNDEFINED_CFG_INT;
     c->debug = UNDEFINED_CFG_INT;
+    c->numa_placement = UNDEFINED_CFG_INT;
     c->driver = HYPERVISOR_IS_KVM;
 
     /* parse command line options */
@@ -492,10 +559,24 @@ int node_config(int argc, char *argv[], NodeConfig *c, NodeSysConfig *s)
         c->verbose = 0;
     if (c->daemon == UNDEFINED_CFG_INT)
         c->daemon = 1;
+    if (c->log_async == UNDEFINED_CFG_INT)
+        c->log_async = 1;
     if (c->debug == UNDEFINED_CFG_INT)
         c->debug = 0;
     if (c->clc_port == 0)
         c->clc_port = DEFAULT_LYCLC_PORT;
+    if (c->download_conns == 0)
+        c->download_conns = DEFAULT_NODE_DOWNLOAD_CONNS;
+    if (c->decompress_threads == 0) {
+        /* one for each cpu */
+        c->decompress_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (c->decompress_threads > NODE_DECOMPRESS_THREADS_MAX)
+            c->decompress_threads = NODE_DECOMPRESS_THREADS_MAX;
+        if (c->decompress_threads < 1)
+            c->decompress_threads = 1;
+    }
+    if (c->numa_placement == UNDEFINED_CFG_INT)
+        c->numa_placement = 1;
     if (c->clc_mcast_ip == NULL)
         c->clc_mcast_ip = strdup(DEFAULT_LYCLC_MCAST_IP);
     if (c->clc_mcast_port == 0)
@@ -510,6 +591,11 @@ int node_config(int argc, char *argv[], NodeConfig *c, NodeSysConfig *s)
         if (c->pid_path == NULL)
             return NODE_CONFIG_RET_ERR_NOMEM;
     }
+    if (c->metrics_path == NULL) {
+        c->metrics_path = strdup(DEFAULT_LYNODE_METRICS_PATH);
+        if (c->metrics_path == NULL)
+            return NODE_CONFIG_RET_ERR_NOMEM;
+    }
     if (c->osm_conf_path == NULL) {
         c->osm_conf_path = strdup(DEFAULT_LYOSM_CONF_PATH);
         if (c->osm_conf_path == NULL)
@@ -31,6 +31,7 @@ typedef struct NodeConfig_t {
     char *sysconf_path;    /* sysconf file path */
     char *log_path;        /* log file path */
     char *pid_path;        /* pid file path */
+    char *metrics_path;    /* unix socket metrics are served on */
     char *osm_conf_path;   /* osmanage configuraton path inside instance */
     char *osm_key_path;    /* osmanage key file path inside instance */
     char *vm_template_path; /* vm xml template file path */
@@ -46,9 +47,33 @@ typedef struct NodeConfig_t {
     int  verbose;
     int  debug;
     int  daemon;
+    int  log_async;        /* 1: log written by a thread, 0: inline */
     int  driver;
+    int  disk_mode;        /* how instance disks are created */
+    int  app_cache_size;   /* appliance cache size in GB, 0: no limit */
+    int  download_conns;   /* connections used to download appliance */
+    int  decompress_threads; /* threads used to decompress appliance */
+    int  numa_placement;   /* bind instances to numa cells, kvm only */
+    int  hugepages;        /* back memory of bound instances by hugepages */
 } NodeConfig;
 
+/*
+** instance disk modes
+** COPY  -- appliance is decompressed for each instance
+** CLONE -- appliance is decompressed once as base, instance disks are
+**          cloned from base, sharing blocks if file system supports it
+** QCOW2 -- instance disks are qcow2 overlays backed by base, kvm only
+*/
+#define NODE_DISK_MODE_COPY     0
+#define NODE_DISK_MODE_CLONE    1
+#define NODE_DISK_MODE_QCOW2    2
+
+#define DEFAULT_LYNODE_METRICS_PATH     "/var/run/lynode.metrics"
+
+#define DEFAULT_NODE_DOWNLOAD_CONNS     4
+#define NODE_DOWNLOAD_CONNS_MAX         16
+#define NODE_DECOMPRESS_THREADS_MAX     32
+
 /*
 ** compute node dynamic configuration, populated based on lynode.sysconf
 */
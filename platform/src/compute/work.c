@@ -0,0 +1,330 @@
+/*
+** Copyright (C) 2012 LuoYun Co. 
+**
+**           Authors:
+**                    lijian.gnu@gmail.com 
+**                    zengdongwu@hotmail.com
+**  
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**  
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**  
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**  
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "../util/logging.h"
+#include "../util/list.h"
+#include "work.h"
+
+/* number of hash buckets for keys, must be power of 2 */
+#define LY_WORK_HASH_SIZE 64
+
+/* works queued or running of a key, the first one holds the key */
+typedef struct LYWorkKey_t {
+    struct list_head hash;
+    int key;
+    struct list_head works;     /* LYWorkLink list, in order queued */
+} LYWorkKey;
+
+struct LYWork_t;
+
+/* work in works list of a key */
+typedef struct LYWorkLink_t {
+    struct list_head list;
+    struct LYWork_t * work;
+    LYWorkKey * key;
+} LYWorkLink;
+
+typedef struct LYWork_t {
+    struct list_head list;      /* in run queue */
+    LYWorkLink link[LY_WORK_KEYS];
+    int num;                    /* number of keys */
+    LYWorkFunc func;
+    void * arg;
+} LYWork;
+
+static pthread_mutex_t g_work_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(g_work_queue);
+static struct list_head g_work_hash[LY_WORK_HASH_SIZE];
+static pthread_t * g_work_threads = NULL;
+static int g_work_thread_num = 0;
+static int g_work_num = 0;
+static int g_work_stop = 0;
+
+static inline struct list_head * __work_hash(int key)
+{
+    unsigned int h = (unsigned int)key * 2654435761U;
+    return &g_work_hash[h & (LY_WORK_HASH_SIZE - 1)];
+}
+
+static LYWorkKey * __work_key_find(int key)
+{
+    LYWorkKey * k;
+    list_for_each_entry(k, __work_hash(key), hash) {
+        if (k->key == key)
+            return k;
+    }
+    return NULL;
+}
+
+static inline LYWorkLink * __work_key_holder(LYWorkKey * k)
+{
+    return list_first_entry(&k->works, LYWorkLink, list);
+}
+
+/* work holds all of its keys, ready to run */
+static int __work_ready(LYWork * w)
+{
+    int i;
+    for (i = 0; i < w->num; i++) {
+        if (__work_key_holder(w->link[i].key) != &w->link[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* remove work from works list of its keys, free keys not used */
+static void __work_unlink(LYWork * w)
+{
+    int i;
+    for (i = 0; i < w->num; i++) {
+        LYWorkKey * k = w->link[i].key;
+        int held = __work_key_holder(k) == &w->link[i];
+        list_del(&w->link[i].list);
+        if (list_empty(&k->works)) {
+            list_del(&k->hash);
+            free(k);
+            continue;
+        }
+        if (!held)
+            continue;
+        /* let the next work of the key run if it holds all its keys */
+        LYWorkLink * next = __work_key_holder(k);
+        if (__work_ready(next->work)) {
+            list_add_tail(&next->work->list, &g_work_queue);
+            pthread_cond_signal(&g_work_cond);
+        }
+    }
+    w->num = 0;
+}
+
+/* work is done, let the next works with the same keys run */
+static void __work_done(LYWork * w)
+{
+    __work_unlink(w);
+    g_work_num--;
+    free(w);
+}
+
+static void * __work_thread(void * arg)
+{
+    pthread_mutex_lock(&g_work_mutex);
+    while (1) {
+        while (list_empty(&g_work_queue) && !g_work_stop)
+            pthread_cond_wait(&g_work_cond, &g_work_mutex);
+        if (list_empty(&g_work_queue))
+            break;
+
+        LYWork * w = list_first_entry(&g_work_queue, LYWork, list);
+        list_del(&w->list);
+        pthread_mutex_unlock(&g_work_mutex);
+
+        w->func(w->arg);
+
+        pthread_mutex_lock(&g_work_mutex);
+        __work_done(w);
+    }
+    pthread_mutex_unlock(&g_work_mutex);
+    return NULL;
+}
+
+int ly_work_start(int num)
+{
+    if (g_work_threads != NULL || num <= 0)
+        return -255;
+
+    int i;
+    for (i = 0; i < LY_WORK_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&g_work_hash[i]);
+    g_work_stop = 0;
+
+    g_work_threads = malloc(num * sizeof(pthread_t));
+    if (g_work_threads == NULL)
+        return -1;
+
+    /* signals are handled in main thread only */
+    sigset_t set, oldset;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    int ret = 0;
+    for (i = 0; i < num; i++) {
+        if (pthread_create(&g_work_threads[i], NULL, __work_thread, NULL)) {
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            ret = -1;
+            break;
+        }
+        g_work_thread_num++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (ret < 0)
+        ly_work_stop();
+    return ret;
+}
+
+int ly_work_add_keys(int key, int key2, LYWorkFunc func, void * arg)
+{
+    if (func == NULL || g_work_threads == NULL)
+        return -255;
+
+    LYWork * w = malloc(sizeof(LYWork));
+    if (w == NULL)
+        return -1;
+    w->num = 0;
+    w->func = func;
+    w->arg = arg;
+
+    int keys[LY_WORK_KEYS] = { key, key2 == key ? 0 : key2 };
+    int i;
+    pthread_mutex_lock(&g_work_mutex);
+    for (i = 0; i < LY_WORK_KEYS; i++) {
+        if (keys[i] == 0)
+            continue;
+        LYWorkKey * k = __work_key_find(keys[i]);
+        if (k == NULL) {
+            k = malloc(sizeof(LYWorkKey));
+            if (k == NULL) {
+                __work_unlink(w);
+                pthread_mutex_unlock(&g_work_mutex);
+                free(w);
+                return -1;
+            }
+            k->key = keys[i];
+            INIT_LIST_HEAD(&k->works);
+            list_add(&k->hash, __work_hash(keys[i]));
+        }
+        LYWorkLink * l = &w->link[w->num++];
+        l->work = w;
+        l->key = k;
+        list_add_tail(&l->list, &k->works);
+    }
+
+    /* otherwise, it's queued when the works before it are done */
+    int ret = 0;
+    if (__work_ready(w)) {
+        list_add_tail(&w->list, &g_work_queue);
+        pthread_cond_signal(&g_work_cond);
+    }
+    else
+        ret = 1;
+    g_work_num++;
+    pthread_mutex_unlock(&g_work_mutex);
+    return ret;
+}
+
+int ly_work_add(int key, LYWorkFunc func, void * arg)
+{
+    return ly_work_add_keys(key, 0, func, arg);
+}
+
+int ly_work_busy(int key, int key2)
+{
+    pthread_mutex_lock(&g_work_mutex);
+    int busy = (key && __work_key_find(key)) || (key2 && __work_key_find(key2));
+    pthread_mutex_unlock(&g_work_mutex);
+    return busy;
+}
+
+int ly_work_num(void)
+{
+    pthread_mutex_lock(&g_work_mutex);
+    int num = g_work_num;
+    pthread_mutex_unlock(&g_work_mutex);
+    return num;
+}
+
+void ly_work_stop(void)
+{
+    if (g_work_threads == NULL)
+        return;
+
+    pthread_mutex_lock(&g_work_mutex);
+    g_work_stop = 1;
+    pthread_cond_broadcast(&g_work_cond);
+    pthread_mutex_unlock(&g_work_mutex);
+
+    int i;
+    for (i = 0; i < g_work_thread_num; i++)
+        pthread_join(g_work_threads[i], NULL);
+    free(g_work_threads);
+    g_work_threads = NULL;
+    g_work_thread_num = 0;
+    return;
+}
+
+static int __work_lock_held(LYWorkLock * l, int key)
+{
+    int i;
+    for (i = 0; i < l->num; i++)
+        if (l->keys[i] == key)
+            return 1;
+    return 0;
+}
+
+int ly_work_lock(LYWorkLock * l, int key)
+{
+    pthread_mutex_lock(&l->mutex);
+    while (__work_lock_held(l, key))
+        pthread_cond_wait(&l->cond, &l->mutex);
+
+    if (l->num >= l->size) {
+        int size = l->size ? l->size << 1 : 16;
+        int * keys = realloc(l->keys, size * sizeof(int));
+        if (keys == NULL) {
+            pthread_mutex_unlock(&l->mutex);
+            logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+            return -1;
+        }
+        l->keys = keys;
+        l->size = size;
+    }
+    l->keys[l->num++] = key;
+    pthread_mutex_unlock(&l->mutex);
+    return 0;
+}
+
+void ly_work_unlock(LYWorkLock * l, int key)
+{
+    pthread_mutex_lock(&l->mutex);
+    int i;
+    for (i = 0; i < l->num; i++) {
+        if (l->keys[i] == key) {
+            l->keys[i] = l->keys[--l->num];
+            /* wake up waiters, they check their own keys */
+            pthread_cond_broadcast(&l->cond);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l->mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef __LY_INCLUDE_COMPUTE_WORK_H
+#define __LY_INCLUDE_COMPUTE_WORK_H
+
+#include <pthread.h>
+
+/*
+** fixed number of worker threads running queued works.
+** works with the same key run one after another, in the order they
+** are queued, works with different keys or key 0 run in parallel.
+** a work with two keys runs when it holds both, it waits in queue
+** without taking a thread.
+*/
+typedef void (*LYWorkFunc)(void * arg);
+
+#define LY_WORK_KEYS 2
+
+int ly_work_start(int num);
+/* return 1 if work waits for works of the same key, 0 if not */
+int ly_work_add(int key, LYWorkFunc func, void * arg);
+int ly_work_add_keys(int key, int key2, LYWorkFunc func, void * arg);
+/* return 1 if works of key or key2 are queued or running */
+int ly_work_busy(int key, int key2);
+/* number of works queued or running */
+int ly_work_num(void);
+/* wait for all works done, then stop worker threads */
+void ly_work_stop(void);
+
+/*
+** keyed lock, for resources shared by works of different keys and
+** held for a short while. waiters sleep until the key is released,
+** use work keys for long waits.
+*/
+typedef struct LYWorkLock_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int *keys;                  /* keys being held */
+    int num;
+    int size;
+} LYWorkLock;
+
+#define LY_WORK_LOCK_INITIALIZER \
+        { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 }
+
+int ly_work_lock(LYWorkLock * l, int key);
+void ly_work_unlock(LYWorkLock * l, int key);
+
+#endif
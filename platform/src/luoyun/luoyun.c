@@ -160,13 +160,20 @@ void luoyun_node_info_print(NodeInfo * nf)
               "\tload_average = %d\n"
               "\tstorage_total = %d\n"
               "\tstorage_free = %d\n"
+              "\tapp_cache_hit = %u\n"
+              "\tapp_cache_miss = %u\n"
+              "\tnuma_cells = %u\n"
+              "\tnuma_cell_cpus = %u\n"
+              "\tnuma_mem_free = %u\n"
               "}\n",
               nf->status, nf->hypervisor, 
               nf->host_name, nf->host_ip, nf->host_tag,
               nf->mem_max, nf->mem_free, nf->mem_commit,
               nf->cpu_arch, nf->cpu_max, nf->cpu_model,
               nf->cpu_mhz, nf->cpu_commit,
-              nf->load_average, nf->storage_total, nf->storage_free);
+              nf->load_average, nf->storage_total, nf->storage_free,
+              nf->app_cache_hit, nf->app_cache_miss,
+              nf->numa_cells, nf->numa_cell_cpus, nf->numa_mem_free);
 }
 
 void luoyun_node_info_cleanup(NodeInfo * nf)
@@ -77,6 +77,7 @@ typedef enum LYAction_t {
      ** actions taken by node to control node
      */
      LY_A_NODE_QUERY = 251,
+     LY_A_NODE_PREFETCH_APPLIANCE = 252,
 
      /*
      ** actions taken by OS manager to control instance itself
@@ -97,6 +98,7 @@ typedef enum LYActionStatus_t {
      LY_S_RUNNING_MOUNTING_IMAGE = 214,
      LY_S_RUNNING_PREPARING_IMAGE = 215,
      LY_S_RUNNING_UNMOUNTING_IMAGE = 216,
+     LY_S_RUNNING_PROCESSING = 217,
      LY_S_RUNNING_STARTING_INSTANCE = 221,
      LY_S_RUNNING_STOPPING = 250,
      LY_S_RUNNING_STOPPED = 259,
@@ -351,6 +353,7 @@ typedef struct NodeCtrlInstance_t {
     int   storage_method;
     char *storage_parm;
     int   reply;                 /* flags about what kind of result to be returned */
+    unsigned long long req_time; /* when node got the request, in us */
 } NodeCtrlInstance;
 
 /* flags used by InstanceCtrl result field */
@@ -379,6 +382,11 @@ typedef struct NodeInfo_t {
     char *host_ip;                    /* eg 192.168.0.1 */
     int   host_tag;
     unsigned int load_average;
+    unsigned int app_cache_hit;     /* appliances found in node cache */
+    unsigned int app_cache_miss;    /* appliances downloaded */
+    unsigned int numa_cells;        /* numa cells, 0 if not known */
+    unsigned int numa_cell_cpus;    /* cpus of largest cell */
+    unsigned int numa_mem_free;     /* memory not committed in most free cell */
 } NodeInfo;
 
 /*
@@ -392,6 +400,21 @@ typedef struct AuthInfo_t {
 } AuthInfo;
 #pragma pack()
 
+/*
+** wire formats of packet data between clc and node, xml is always
+** supported. node appends formats it supports to auth request, clc
+** appends formats agreed to its auth reply. peers not knowing it
+** send plain AuthInfo, and stay with xml.
+*/
+#define LUOYUN_PROTO_XML 0x00
+#define LUOYUN_PROTO_BIN 0x01
+#pragma pack(1)
+typedef struct AuthProto_t {
+    AuthInfo ai;
+    int32_t proto;
+} AuthProto;
+#pragma pack()
+
 /*
 ** common data structure for instance info
 */
@@ -429,6 +452,7 @@ typedef struct LYReply_t {
    int status; /* see LYActionStatus */
    char * msg; /* readable string for status */
    void * data; /* reply specific data */
+   int elapsed; /* ms since the request was received, for job trace */
 } LYReply;
 
 /*
@@ -0,0 +1,588 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <bzlib.h>
+#include <zlib.h>
+
+#include "logging.h"
+#include "md5.h"
+#include "lyutil.h"
+#include "decompress.h"
+
+#define LY_UNZIP_BUF_SIZE (1 << 20)    /* gz data inflated per write */
+#define LY_UNZIP_SCAN_MIN (4 << 20)    /* least input scanned by a thread */
+
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC   0x177245385090ULL
+#define BZ_MAGIC_MASK  0xffffffffffffULL
+
+/*
+** a gz member or bzip2 block, decompressed by one thread.
+** positions are in bytes for gz, in bits for bzip2.
+*/
+typedef struct LYUnzipUnit_t {
+    long long start;
+    long long end;
+    long long offset;           /* in dstfile */
+    unsigned int crc;           /* bzip2 block crc */
+    int eos;                    /* bzip2 block ends stream */
+    unsigned int eos_crc;       /* bzip2 stream crc */
+} LYUnzipUnit;
+
+/* unit boundaries found by a thread in its part of srcfile */
+typedef struct LYUnzipScan_t {
+    struct LYUnzip_t *u;
+    long long from;             /* bytes */
+    long long to;
+    long long *pos;             /* gz: byte, bzip2: bit << 1 | eos */
+    int num;
+    int size;
+} LYUnzipScan;
+
+typedef struct LYUnzip_t {
+    const unsigned char *src;   /* srcfile mapped */
+    long long src_len;
+    int dst_fd;
+    int bz;                     /* bzip2, otherwise gz */
+    LYUnzipUnit *unit;
+    int unit_num;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;                   /* next unit to decompress */
+    int placed;                 /* bzip2 units with offset known */
+    long long out_len;          /* bzip2 data placed */
+    unsigned int bz_crc;        /* bzip2 stream crc so far */
+    int error;
+} LYUnzip;
+
+/* candidate gz member header at p */
+static inline int __gz_header(const unsigned char *p)
+{
+    return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+           (p[3] & 0xe0) == 0 &&
+           (p[8] == 0 || p[8] == 2 || p[8] == 4) &&
+           (p[9] <= 13 || p[9] == 255);
+}
+
+static int __scan_add(LYUnzipScan *s, long long pos)
+{
+    if (s->num >= s->size) {
+        int size = s->size ? s->size << 1 : 1024;
+        long long *p = realloc(s->pos, size * sizeof(long long));
+        if (p == NULL)
+            return -1;
+        s->pos = p;
+        s->size = size;
+    }
+    s->pos[s->num++] = pos;
+    return 0;
+}
+
+static void *__scan_func(void *arg)
+{
+    LYUnzipScan *s = arg;
+    LYUnzip *u = s->u;
+    const unsigned char *src = u->src;
+    long long i;
+
+    if (!u->bz) {
+        /* member header must be followed by a trailer at least */
+        long long to = s->to < u->src_len - 18 ? s->to : u->src_len - 18;
+        for (i = s->from; i < to; i++) {
+            const unsigned char *p = memchr(src + i, 0x1f, to - i);
+            if (p == NULL)
+                break;
+            i = p - src;
+            if (__gz_header(p) && __scan_add(s, i) < 0)
+                return (void *)-1;
+        }
+        return NULL;
+    }
+
+    /* 48 bit magic at any bit position */
+    unsigned long long w = 0;
+    long long to = s->to + 7 < u->src_len ? s->to + 7 : u->src_len;
+    for (i = s->from; i < to; i++) {
+        w = (w << 8) | src[i];
+        int sh;
+        for (sh = 0; sh < 8; sh++) {
+            unsigned long long m = (w >> sh) & BZ_MAGIC_MASK;
+            if (m != BZ_BLOCK_MAGIC && m != BZ_EOS_MAGIC)
+                continue;
+            long long pos = (i + 1) * 8 - sh - 48;
+            if (pos < s->from * 8 || pos >= s->to * 8)
+                continue;
+            if (__scan_add(s, pos << 1 | (m == BZ_EOS_MAGIC)) < 0)
+                return (void *)-1;
+        }
+    }
+    return NULL;
+}
+
+/* 32 bits at bit pos of srcfile */
+static int __bits32(LYUnzip *u, long long pos, unsigned int *v)
+{
+    if (((pos + 32 + 7) >> 3) > u->src_len)
+        return -1;
+    unsigned long long w = 0;
+    int i, n = (pos & 7) ? 5 : 4;
+    for (i = 0; i < n; i++)
+        w = (w << 8) | u->src[(pos >> 3) + i];
+    if (n == 5)
+        w >>= 8 - (pos & 7);
+    *v = w & 0xffffffff;
+    return 0;
+}
+
+/* gz members or bzip2 blocks of srcfile, 0 if not splittable */
+static int __unzip_split(LYUnzip *u, int threads)
+{
+    if (threads > u->src_len / LY_UNZIP_SCAN_MIN)
+        threads = u->src_len / LY_UNZIP_SCAN_MIN;
+    if (threads < 1)
+        threads = 1;
+    LYUnzipScan scan[LY_DECOMPRESS_THREADS_MAX];
+    pthread_t tid[LY_DECOMPRESS_THREADS_MAX];
+    void *res[LY_DECOMPRESS_THREADS_MAX];
+    int created[LY_DECOMPRESS_THREADS_MAX];
+    bzero(scan, sizeof(scan));
+    int i, j, ret = 0, num = 0;
+    for (i = 0; i < threads; i++) {
+        scan[i].u = u;
+        scan[i].from = u->src_len * i / threads;
+        scan[i].to = u->src_len * (i + 1) / threads;
+        created[i] = pthread_create(&tid[i], NULL, __scan_func,
+                                    &scan[i]) == 0;
+        if (!created[i])
+            res[i] = __scan_func(&scan[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        if (created[i])
+            pthread_join(tid[i], &res[i]);
+        if (res[i] != NULL)
+            ret = -1;
+        num += scan[i].num;
+    }
+    if (ret < 0 || num < 2)
+        goto out;
+
+    u->unit = calloc(num, sizeof(LYUnzipUnit));
+    if (u->unit == NULL) {
+        ret = -1;
+        goto out;
+    }
+    LYUnzipUnit *last = NULL;
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < scan[i].num; j++) {
+            long long pos = scan[i].pos[j];
+            if (!u->bz) {
+                if (last)
+                    last->end = pos;
+                last = &u->unit[u->unit_num++];
+                last->start = pos;
+                last->end = u->src_len;
+                continue;
+            }
+            if (last && last->end < 0) {
+                /* block ends at next magic */
+                last->end = pos >> 1;
+                if ((pos & 1) && __bits32(u, (pos >> 1) + 48,
+                                          &last->eos_crc) == 0)
+                    last->eos = 1;
+            }
+            if (pos & 1)
+                continue;
+            last = &u->unit[u->unit_num++];
+            last->start = pos >> 1;
+            last->end = -1;
+            if (__bits32(u, last->start + 48, &last->crc) < 0)
+                ret = -1;
+        }
+    }
+
+    if (ret == 0 && u->unit_num < 2)
+        goto out;
+    if (!u->bz) {
+        /* first member at start, each ending with size of its data */
+        long long offset = 0;
+        if (u->unit[0].start != 0)
+            ret = -1;
+        for (i = 0; ret == 0 && i < u->unit_num; i++) {
+            const unsigned char *p = u->src + u->unit[i].end - 4;
+            u->unit[i].offset = offset;
+            offset += p[0] | p[1] << 8 | p[2] << 16 |
+                      (unsigned long long)p[3] << 24;
+        }
+        u->out_len = offset;
+    }
+    else {
+        /* every block ends, the last one ends stream */
+        for (i = 0; ret == 0 && i < u->unit_num; i++)
+            if (u->unit[i].end < 0)
+                ret = -1;
+        if (ret == 0 && !u->unit[u->unit_num - 1].eos)
+            ret = -1;
+    }
+    if (ret == 0)
+        ret = u->unit_num;
+
+out:
+    for (i = 0; i < threads; i++)
+        free(scan[i].pos);
+    return ret;
+}
+
+static int __pwrite_all(int fd, const void *data, size_t len, off_t off)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            char err[100];
+            logerror(_("write error: %d, %s\n"),
+                        errno, strerror_r(errno, err, 100));
+            return -1;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+/* inflate one member, must end at end of unit with the size expected */
+static int __gz_unit(LYUnzip *u, LYUnzipUnit *t, z_stream *z,
+                     unsigned char *buf)
+{
+    if (inflateReset(z) != Z_OK)
+        return -1;
+    z->next_in = (Bytef *)u->src + t->start;
+    z->avail_in = t->end - t->start;
+    long long offset = t->offset;
+    long long end = t + 1 < u->unit + u->unit_num ? (t + 1)->offset :
+                    u->out_len;
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        z->next_out = buf;
+        z->avail_out = LY_UNZIP_BUF_SIZE;
+        ret = inflate(z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return -1;
+        unsigned int len = LY_UNZIP_BUF_SIZE - z->avail_out;
+        if (offset + len > end ||
+            __pwrite_all(u->dst_fd, buf, len, offset) < 0)
+            return -1;
+        offset += len;
+    }
+    return z->avail_in == 0 && offset == end ? 0 : -1;
+}
+
+/* block rebuilt as bzip2 stream of its own */
+static int __bz_unit(LYUnzip *u, LYUnzipUnit *t, char **out, size_t *out_size,
+                     size_t *out_len)
+{
+    long long nbits = t->end - t->start;
+    size_t len = 4 + ((nbits + 80 + 7) >> 3);
+    unsigned char *in = calloc(len, 1);
+    if (in == NULL)
+        return -1;
+    memcpy(in, "BZh9", 4);
+    const unsigned char *src = u->src + (t->start >> 3);
+    int sh = t->start & 7;
+    long long i, nbytes = (nbits + 7) >> 3;
+    for (i = 0; i < nbytes; i++) {
+        unsigned char b = src[i] << sh;
+        if (sh && (t->start >> 3) + i + 1 < u->src_len)
+            b |= src[i + 1] >> (8 - sh);
+        in[4 + i] = b;
+    }
+    if (nbits & 7)
+        in[4 + nbytes - 1] &= 0xff << (8 - (nbits & 7));
+    /* end of stream, crc of stream is that of the only block */
+    unsigned long long tail = BZ_EOS_MAGIC;
+    long long pos = 32 + nbits;
+    for (i = 79; i >= 0; i--, pos++) {
+        int bit = i >= 32 ? (tail >> (i - 32)) & 1 : (t->crc >> i) & 1;
+        if (bit)
+            in[pos >> 3] |= 0x80 >> (pos & 7);
+    }
+
+    bz_stream bz;
+    bzero(&bz, sizeof(bz_stream));
+    if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+        free(in);
+        return -1;
+    }
+    bz.next_in = (char *)in;
+    bz.avail_in = len;
+    *out_len = 0;
+    int ret = BZ_OK;
+    while (ret == BZ_OK) {
+        if (*out_len == *out_size) {
+            size_t size = *out_size ? *out_size << 1 : LY_UNZIP_BUF_SIZE;
+            char *p = realloc(*out, size);
+            if (p == NULL)
+                break;
+            *out = p;
+            *out_size = size;
+        }
+        bz.next_out = *out + *out_len;
+        bz.avail_out = *out_size - *out_len;
+        ret = BZ2_bzDecompress(&bz);
+        *out_len = *out_size - bz.avail_out;
+        if (ret == BZ_OK && bz.avail_in == 0 && bz.avail_out > 0)
+            break;
+    }
+    BZ2_bzDecompressEnd(&bz);
+    free(in);
+    return ret == BZ_STREAM_END ? 0 : -1;
+}
+
+/* place bzip2 block after the previous one, check crc of stream */
+static long long __bz_place(LYUnzip *u, int i, size_t len)
+{
+    long long offset = -1;
+    pthread_mutex_lock(&u->lock);
+    while (u->placed < i && !u->error)
+        pthread_cond_wait(&u->cond, &u->lock);
+    if (!u->error) {
+        LYUnzipUnit *t = &u->unit[i];
+        u->bz_crc = ((u->bz_crc << 1) | (u->bz_crc >> 31)) ^ t->crc;
+        if (t->eos) {
+            if (u->bz_crc != t->eos_crc) {
+                logerror(_("bzip2 stream crc error\n"));
+                u->error = 1;
+            }
+            u->bz_crc = 0;
+        }
+        offset = u->out_len;
+        u->out_len += len;
+        u->placed = i + 1;
+    }
+    if (u->error)
+        offset = -1;
+    pthread_cond_broadcast(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    return offset;
+}
+
+static void *__unzip_func(void *arg)
+{
+    LYUnzip *u = arg;
+    z_stream z;
+    unsigned char *buf = NULL;
+    char *out = NULL;
+    size_t out_size = 0, out_len;
+
+    bzero(&z, sizeof(z_stream));
+    if (!u->bz) {
+        buf = malloc(LY_UNZIP_BUF_SIZE);
+        if (buf == NULL || inflateInit2(&z, 16 + MAX_WBITS) != Z_OK) {
+            free(buf);
+            u->error = 1;
+            return NULL;
+        }
+    }
+
+    while (1) {
+        pthread_mutex_lock(&u->lock);
+        int i = u->error ? u->unit_num : u->next++;
+        pthread_mutex_unlock(&u->lock);
+        if (i >= u->unit_num)
+            break;
+        int ret;
+        if (!u->bz)
+            ret = __gz_unit(u, &u->unit[i], &z, buf);
+        else {
+            ret = __bz_unit(u, &u->unit[i], &out, &out_size, &out_len);
+            long long offset = ret < 0 ? -1 : __bz_place(u, i, out_len);
+            if (offset < 0 ||
+                __pwrite_all(u->dst_fd, out, out_len, offset) < 0)
+                ret = -1;
+        }
+        if (ret < 0) {
+            pthread_mutex_lock(&u->lock);
+            u->error = 1;
+            pthread_cond_broadcast(&u->cond);
+            pthread_mutex_unlock(&u->lock);
+        }
+    }
+
+    if (!u->bz)
+        inflateEnd(&z);
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+static int __checksum_md5(const unsigned char *data, long long len,
+                          const char *checksum)
+{
+    struct MD5Context md5c;
+    unsigned char sig[16];
+    char str[33];
+    int i;
+    MD5Init(&md5c);
+    while (len > 0) {
+        unsigned int n = len > LY_UNZIP_BUF_SIZE ? LY_UNZIP_BUF_SIZE : len;
+        MD5Update(&md5c, data, n);
+        data += n;
+        len -= n;
+    }
+    MD5Final(sig, &md5c);
+    for (i = 0; i < 16; i++)
+        sprintf(str + i * 2, "%02x", sig[i]);
+    return strcasecmp(str, checksum) ? 1 : 0;
+}
+
+int lyutil_decompress_parallel(const char *srcfile, const char *checksum,
+                               const char *dstfile, int threads)
+{
+    if (threads > LY_DECOMPRESS_THREADS_MAX)
+        threads = LY_DECOMPRESS_THREADS_MAX;
+
+    int fd = open(srcfile, O_RDONLY);
+    if (fd < 0) {
+        logerror(_("open %s failed.\n"), srcfile);
+        return -1;
+    }
+    struct stat st;
+    unsigned char magic[3];
+    if (fstat(fd, &st) < 0 || pread(fd, magic, 3, 0) != 3) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        close(fd);
+        return -1;
+    }
+    int bz = memcmp(magic, "BZh", 3) == 0;
+    int gz = magic[0] == 0x1f && magic[1] == 0x8b;
+    if (checksum && strlen(checksum) != 32) {
+        logerror("checksum(%s) is %d long, probably not md5?\n",
+                  checksum, 32);
+        close(fd);
+        return -1;
+    }
+    /* not compressed, copied as it is */
+    if (dstfile == NULL || (threads <= 1 && !bz) || (!gz && !bz)) {
+        close(fd);
+        return lyutil_checksum_decompress_gz(srcfile, checksum, dstfile);
+    }
+
+    LYUnzip u;
+    bzero(&u, sizeof(LYUnzip));
+    u.src_len = st.st_size;
+    u.bz = bz;
+    u.dst_fd = -1;
+    void *src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    u.src = src;
+    pthread_mutex_init(&u.lock, NULL);
+    pthread_cond_init(&u.cond, NULL);
+
+    int ret = -1;
+    int num = threads > 1 ? __unzip_split(&u, threads) : 0;
+    if (num <= 0) {
+        /* one member or block, or split failed */
+        logdebug(_("%s decompressed as a stream\n"), srcfile);
+        goto stream;
+    }
+
+    u.dst_fd = open(dstfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (u.dst_fd < 0) {
+        logerror(_("open %s failed.\n"), dstfile);
+        goto out;
+    }
+    if (!bz && ftruncate(u.dst_fd, u.out_len) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        goto out;
+    }
+    if (bz)
+        u.out_len = 0;
+    if (threads > num)
+        threads = num;
+    logdebug(_("%s decompressed in %d parts by %d threads\n"),
+               srcfile, num, threads);
+
+    pthread_t tid[LY_DECOMPRESS_THREADS_MAX];
+    int i, started = 0;
+    for (i = 0; i < threads; i++)
+        if (pthread_create(&tid[started], NULL, __unzip_func, &u) == 0)
+            started++;
+    if (started == 0)
+        __unzip_func(&u);
+    /* checksum along */
+    int check = checksum ? __checksum_md5(u.src, u.src_len, checksum) : 0;
+    for (i = 0; i < started; i++)
+        pthread_join(tid[i], NULL);
+    if (check) {
+        ret = 1;
+        goto out;
+    }
+    if (u.error) {
+        /* possibly split at wrong places, data checked again as a stream */
+        logwarn(_("parallel decompressing %s failed\n"), srcfile);
+        close(u.dst_fd);
+        u.dst_fd = -1;
+        checksum = NULL;
+        goto stream;
+    }
+    ret = 0;
+    goto out;
+
+stream:
+    if (!bz)
+        ret = lyutil_checksum_decompress_gz(srcfile, checksum, dstfile);
+    else if (checksum && __checksum_md5(u.src, u.src_len, checksum))
+        ret = 1;
+    else
+        ret = lyutil_decompress_bzip2(srcfile, dstfile);
+
+out:
+    if (u.dst_fd >= 0 && close(u.dst_fd) < 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(dstfile);
+    munmap(src, st.st_size);
+    pthread_mutex_destroy(&u.lock);
+    pthread_cond_destroy(&u.cond);
+    free(u.unit);
+    return ret;
+}
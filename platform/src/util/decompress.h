@@ -0,0 +1,19 @@
+#ifndef __LY_INCLUDE_UTIL_DECOMPRESS_H
+#define __LY_INCLUDE_UTIL_DECOMPRESS_H
+
+#define LY_DECOMPRESS_THREADS_MAX 32
+
+/*
+** decompress gz or bzip2 srcfile into dstfile with up to threads threads.
+** gz file of several members (bgzip, concatenated gz files) is split at
+** member boundaries, bzip2 file at block boundaries. parts are
+** decompressed in parallel, each written in place in dstfile with pwrite.
+** gz file of single member is decompressed as a stream.
+** other srcfile is copied into dstfile as it is.
+** srcfile is checksumed along if checksum is not NULL.
+** return 0 on success, 1 on checksum mismatch, -1 on other errors.
+*/
+int lyutil_decompress_parallel(const char *srcfile, const char *checksum,
+                               const char *dstfile, int threads);
+
+#endif
@@ -26,13 +26,83 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
 #include <curl/easy.h>
 
 #include "logging.h"
+#include "lyutil.h"
 #include "download.h"
 
+/* bigger receive buffer, less callbacks */
+#define LY_DOWNLOAD_BUF_SIZE (512 * 1024)
+
+/* range fetched by one request in parallel download */
+#define LY_DOWNLOAD_CHUNK_SIZE (16 << 20)
+#define LY_DOWNLOAD_CONN_MAX 16
+#define LY_DOWNLOAD_RETRY 3
+#define LY_DOWNLOAD_PART_SUFFIX ".part"
+
+/*
+** curl is initialized once. dns cache and ssl sessions are shared by
+** all downloads. connection cache is not thread-safe to share, it's
+** kept in each handle, connections of parallel download are reused
+** through the multi handle.
+*/
+static pthread_once_t g_download_once = PTHREAD_ONCE_INIT;
+static CURLSH *g_download_share = NULL;
+static pthread_mutex_t g_download_mutex[CURL_LOCK_DATA_LAST];
+
+static void __share_lock(CURL *handle, curl_lock_data data,
+                         curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&g_download_mutex[data]);
+}
+
+static void __share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&g_download_mutex[data]);
+}
+
+static void __download_init(void)
+{
+    int i;
+    curl_global_init(CURL_GLOBAL_ALL);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&g_download_mutex[i], NULL);
+    g_download_share = curl_share_init();
+    if (g_download_share == NULL) {
+        logwarn("curl share not available, dns cache not shared\n");
+        return;
+    }
+    curl_share_setopt(g_download_share, CURLSHOPT_LOCKFUNC, __share_lock);
+    curl_share_setopt(g_download_share, CURLSHOPT_UNLOCKFUNC, __share_unlock);
+    curl_share_setopt(g_download_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(g_download_share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static CURL *__download_handle(const char *url)
+{
+    pthread_once(&g_download_once, __download_init);
+    CURL *curl = curl_easy_init();
+    if (curl == NULL)
+        return NULL;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    /* called in threads */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    if (g_download_share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, g_download_share);
+    return curl;
+}
+
 static size_t write_data(void *ptr, size_t size, size_t nmemb,
                          void *stream)
 {
@@ -40,9 +110,6 @@ static size_t write_data(void *ptr, size_t size, size_t nmemb,
     return written;
 }
 
-/*
-** This function is not thread-safe, protection required
-*/
 int lyutil_download(const char *url, const char *file)
 {
     FILE *fp;
@@ -55,12 +122,8 @@ int lyutil_download(const char *url, const char *file)
 
     logdebug("Download \"%s\" => \"%s\"\n", url, file);
 
-    CURL *curl;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
+    CURL *curl = __download_handle(url);
     if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
         if (curl_easy_perform(curl) == CURLE_OK)
@@ -71,10 +134,441 @@ int lyutil_download(const char *url, const char *file)
         }
         curl_easy_cleanup(curl);
     }
-    curl_global_cleanup();
 
     fclose(fp);                 /* you should do this */
 
     return res;
 }
 
+static size_t write_stream(void *ptr, size_t size, size_t nmemb,
+                           void *stream)
+{
+    if (lyutil_stream_write((LYStream *) stream, ptr, size * nmemb) < 0)
+        return 0;               /* abort transfer */
+    return size * nmemb;
+}
+
+int lyutil_download_stream(const char *url, const char *file,
+                           const char *checksum, const char *dstfile)
+{
+    LYStream *s = lyutil_stream_open(file, dstfile);
+    if (s == NULL) {
+        logerror("Can not open file: %s\n", file);
+        return -1;
+    }
+
+    logdebug("Download \"%s\" => \"%s\", \"%s\"\n", url, file,
+              dstfile ? dstfile : "");
+
+    int res = -1;
+    CURL *curl = __download_handle(url);
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)LY_DOWNLOAD_BUF_SIZE);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_stream);
+        if (curl_easy_perform(curl) == CURLE_OK)
+            res = 0;
+        else
+            logerror("Failed downloading %s to %s\n", url, file);
+        curl_easy_cleanup(curl);
+    }
+
+    int ret = lyutil_stream_close(s, res == 0 ? checksum : NULL);
+    if (res == 0 && ret != 0) {
+        logerror("Failed checking %s\n", file);
+        res = ret;
+    }
+    if (res != 0) {
+        remove(file);
+        if (dstfile)
+            remove(dstfile);
+    }
+
+    return res;
+}
+
+/*
+** parallel download
+*/
+#define LY_CHUNK_PENDING 0
+#define LY_CHUNK_RUNNING 1
+#define LY_CHUNK_DONE    2
+
+typedef struct LYDownload_t {
+    int fd;
+    long long size;
+    int chunk_num;
+    char *state;                /* LY_CHUNK_* */
+    long long *got;             /* bytes received of chunk */
+    int *retry;
+    FILE *part;                 /* chunks done, for resuming */
+    LYStream *s;                /* data in order, NULL if not needed */
+    long long s_off;            /* data passed to stream */
+    char *buf;
+} LYDownload;
+
+typedef struct LYDownloadConn_t {
+    LYDownload *d;
+    CURL *curl;
+    int chunk;
+    int checked;                /* response is partial content */
+    char range[64];
+} LYDownloadConn;
+
+static inline long long __chunk_start(int chunk)
+{
+    return (long long)chunk * LY_DOWNLOAD_CHUNK_SIZE;
+}
+
+static inline long long __chunk_len(LYDownload *d, int chunk)
+{
+    long long len = d->size - __chunk_start(chunk);
+    return len > LY_DOWNLOAD_CHUNK_SIZE ? LY_DOWNLOAD_CHUNK_SIZE : len;
+}
+
+static size_t __probe_header(void *ptr, size_t size, size_t nmemb,
+                             void *data)
+{
+    const char *h = "Accept-Ranges: bytes";
+    if (size * nmemb >= strlen(h) && strncasecmp(ptr, h, strlen(h)) == 0)
+        *(int *)data = 1;
+    return size * nmemb;
+}
+
+/* size of file, -1 if unknown or range requests not supported */
+static long long __download_probe(const char *url)
+{
+    CURL *curl = __download_handle(url);
+    if (curl == NULL)
+        return -1;
+    int ranges = 0;
+    curl_off_t size = -1;
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, __probe_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ranges);
+    if (curl_easy_perform(curl) != CURLE_OK ||
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                          &size) != CURLE_OK)
+        size = -1;
+    curl_easy_cleanup(curl);
+    return ranges ? size : -1;
+}
+
+/* chunks done in previous download of file */
+static int __part_load(LYDownload *d, const char *part, const char *file)
+{
+    FILE *fp = fopen(part, "r");
+    if (fp == NULL)
+        return 0;
+    long long size, chunk_size;
+    struct stat st;
+    if (fscanf(fp, "%lld %lld", &size, &chunk_size) != 2 ||
+        size != d->size || chunk_size != LY_DOWNLOAD_CHUNK_SIZE ||
+        stat(file, &st) || st.st_size != d->size) {
+        fclose(fp);
+        return 0;
+    }
+    int chunk, num = 0;
+    while (fscanf(fp, "%d", &chunk) == 1) {
+        if (chunk < 0 || chunk >= d->chunk_num ||
+            d->state[chunk] == LY_CHUNK_DONE)
+            continue;
+        d->state[chunk] = LY_CHUNK_DONE;
+        d->got[chunk] = __chunk_len(d, chunk);
+        num++;
+    }
+    fclose(fp);
+    return num;
+}
+
+static size_t __chunk_write(void *ptr, size_t size, size_t nmemb,
+                            void *data)
+{
+    LYDownloadConn *c = data;
+    LYDownload *d = c->d;
+    size_t len = size * nmemb;
+    if (!c->checked) {
+        /* server may ignore range and send whole file */
+        long code = 0;
+        curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (code != 206) {
+            logerror("range request not honored, response %ld\n", code);
+            return 0;
+        }
+        c->checked = 1;
+    }
+    if (d->got[c->chunk] + len > __chunk_len(d, c->chunk))
+        return 0;
+    off_t off = __chunk_start(c->chunk) + d->got[c->chunk];
+    const char *p = ptr;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = pwrite(d->fd, p, left, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        off += n;
+        left -= n;
+    }
+    d->got[c->chunk] += len;
+    return len;
+}
+
+/* request rest of chunk on connection */
+static int __chunk_start_conn(CURLM *multi, LYDownloadConn *c, int chunk)
+{
+    LYDownload *d = c->d;
+    c->chunk = chunk;
+    c->checked = 0;
+    d->state[chunk] = LY_CHUNK_RUNNING;
+    snprintf(c->range, sizeof(c->range), "%lld-%lld",
+             __chunk_start(chunk) + d->got[chunk],
+             __chunk_start(chunk) + __chunk_len(d, chunk) - 1);
+    curl_easy_setopt(c->curl, CURLOPT_RANGE, c->range);
+    if (curl_multi_add_handle(multi, c->curl) != CURLM_OK) {
+        logerror("error in %s(%d)\n", __func__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+static int __chunk_next(LYDownload *d)
+{
+    int i;
+    for (i = 0; i < d->chunk_num; i++)
+        if (d->state[i] == LY_CHUNK_PENDING)
+            return i;
+    return -1;
+}
+
+/* pass data received in order to stream, read back from file */
+static int __download_feed(LYDownload *d)
+{
+    if (d->s == NULL)
+        return 0;
+    int chunk = d->s_off / LY_DOWNLOAD_CHUNK_SIZE;
+    long long end = d->s_off;
+    for (; chunk < d->chunk_num; chunk++) {
+        end = __chunk_start(chunk) + d->got[chunk];
+        if (d->got[chunk] < __chunk_len(d, chunk))
+            break;
+    }
+    while (d->s_off < end) {
+        size_t len = end - d->s_off > LY_DOWNLOAD_BUF_SIZE ?
+                     LY_DOWNLOAD_BUF_SIZE : end - d->s_off;
+        ssize_t n = pread(d->fd, d->buf, len, d->s_off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || lyutil_stream_write(d->s, d->buf, n) < 0)
+            return -1;
+        d->s_off += n;
+    }
+    return 0;
+}
+
+static int __download_run(LYDownload *d, const char *url, int conns)
+{
+    CURLM *multi = curl_multi_init();
+    if (multi == NULL)
+        return -1;
+    LYDownloadConn conn[LY_DOWNLOAD_CONN_MAX];
+    bzero(conn, sizeof(conn));
+
+    int i, ret = 0, failed = 0, active = 0;
+    for (i = 0; i < conns; i++) {
+        int chunk = __chunk_next(d);
+        if (chunk < 0)
+            break;
+        LYDownloadConn *c = &conn[i];
+        c->d = d;
+        c->curl = __download_handle(url);
+        if (c->curl == NULL) {
+            ret = -1;
+            goto out;
+        }
+        curl_easy_setopt(c->curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(c->curl, CURLOPT_BUFFERSIZE,
+                         (long)LY_DOWNLOAD_BUF_SIZE);
+        curl_easy_setopt(c->curl, CURLOPT_WRITEDATA, c);
+        curl_easy_setopt(c->curl, CURLOPT_WRITEFUNCTION, __chunk_write);
+        curl_easy_setopt(c->curl, CURLOPT_PRIVATE, c);
+        if (__chunk_start_conn(multi, c, chunk) < 0) {
+            ret = -1;
+            goto out;
+        }
+        active++;
+    }
+
+    while (active > 0) {
+        int running;
+        if (curl_multi_perform(multi, &running) != CURLM_OK) {
+            ret = -1;
+            break;
+        }
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            LYDownloadConn *c = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &c);
+            CURLcode res = msg->data.result;
+            curl_multi_remove_handle(multi, c->curl);
+            active--;
+            int chunk = c->chunk;
+            if (res == CURLE_OK && d->got[chunk] == __chunk_len(d, chunk)) {
+                d->state[chunk] = LY_CHUNK_DONE;
+                if (d->part) {
+                    fprintf(d->part, "%d\n", chunk);
+                    fflush(d->part);
+                }
+            }
+            else {
+                logwarn("chunk %d of %s failed, %s\n", chunk, url,
+                         curl_easy_strerror(res));
+                d->state[chunk] = LY_CHUNK_PENDING;
+                if (++d->retry[chunk] > LY_DOWNLOAD_RETRY)
+                    failed = 1;
+            }
+            /* on failure, running chunks are finished for resuming */
+            if (failed)
+                continue;
+            chunk = __chunk_next(d);
+            if (chunk < 0)
+                continue;
+            if (__chunk_start_conn(multi, c, chunk) < 0)
+                ret = -1;
+            else
+                active++;
+        }
+        if (ret < 0 || __download_feed(d) < 0) {
+            ret = -1;
+            break;
+        }
+        if (active > 0 &&
+            curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK) {
+            ret = -1;
+            break;
+        }
+    }
+
+out:
+    for (i = 0; i < conns; i++) {
+        if (conn[i].curl == NULL)
+            continue;
+        curl_multi_remove_handle(multi, conn[i].curl);
+        curl_easy_cleanup(conn[i].curl);
+    }
+    curl_multi_cleanup(multi);
+    if (failed || (ret == 0 && __chunk_next(d) >= 0))
+        ret = -1;
+    return ret;
+}
+
+int lyutil_download_partial(const char *file)
+{
+    char part[PATH_MAX];
+    snprintf(part, PATH_MAX, "%s%s", file, LY_DOWNLOAD_PART_SUFFIX);
+    return access(part, F_OK) == 0;
+}
+
+int lyutil_download_parallel(const char *url, const char *file,
+                             const char *checksum, const char *dstfile,
+                             int conns)
+{
+    char part[PATH_MAX];
+    snprintf(part, PATH_MAX, "%s%s", file, LY_DOWNLOAD_PART_SUFFIX);
+    if (conns > LY_DOWNLOAD_CONN_MAX)
+        conns = LY_DOWNLOAD_CONN_MAX;
+
+    long long size = conns > 1 ? __download_probe(url) : -1;
+    if (size <= LY_DOWNLOAD_CHUNK_SIZE) {
+        /* small file, or server not supporting range requests */
+        unlink(part);
+        return lyutil_download_stream(url, file, checksum, dstfile);
+    }
+
+    LYDownload d;
+    bzero(&d, sizeof(LYDownload));
+    d.size = size;
+    d.chunk_num = (size + LY_DOWNLOAD_CHUNK_SIZE - 1) / LY_DOWNLOAD_CHUNK_SIZE;
+    d.state = calloc(d.chunk_num, sizeof(char));
+    d.got = calloc(d.chunk_num, sizeof(long long));
+    d.retry = calloc(d.chunk_num, sizeof(int));
+    d.buf = malloc(LY_DOWNLOAD_BUF_SIZE);
+    d.fd = -1;
+    int res = -1;
+    if (d.state == NULL || d.got == NULL || d.retry == NULL || d.buf == NULL)
+        goto out;
+
+    int done = __part_load(&d, part, file);
+    if (done)
+        loginfo("resuming download of %s, %d of %d chunks done\n",
+                 file, done, d.chunk_num);
+    else
+        unlink(part);
+    /* sparse file of full size, chunks written in place */
+    d.fd = open(file, O_WRONLY | O_CREAT | (done ? 0 : O_TRUNC), 0644);
+    if (d.fd < 0 || (!done && ftruncate(d.fd, size) < 0)) {
+        logerror("Can not open file: %s\n", file);
+        goto out;
+    }
+    d.part = fopen(part, "a");
+    if (d.part == NULL) {
+        logerror("Can not open file: %s\n", part);
+        goto out;
+    }
+    if (!done)
+        fprintf(d.part, "%lld %d\n", size, LY_DOWNLOAD_CHUNK_SIZE);
+    if (checksum || dstfile) {
+        d.s = lyutil_stream_open(NULL, dstfile);
+        if (d.s == NULL)
+            goto out;
+    }
+    /* stream reads file back */
+    close(d.fd);
+    d.fd = open(file, O_RDWR);
+    if (d.fd < 0) {
+        logerror("Can not open file: %s\n", file);
+        goto out;
+    }
+
+    logdebug("Download \"%s\" => \"%s\", \"%s\", %d connections\n",
+              url, file, dstfile ? dstfile : "", conns);
+    res = __download_run(&d, url, conns);
+    if (res < 0)
+        logerror("Failed downloading %s to %s\n", url, file);
+    else if (__download_feed(&d) < 0)
+        res = -1;
+
+out:
+    if (d.s) {
+        int ret = lyutil_stream_close(d.s, res == 0 ? checksum : NULL);
+        if (res == 0 && ret != 0) {
+            logerror("Failed checking %s\n", file);
+            res = ret;
+        }
+    }
+    if (d.part)
+        fclose(d.part);
+    if (d.fd >= 0)
+        close(d.fd);
+    if (res == 0)
+        unlink(part);
+    else if (res > 0) {
+        /* wrong data, not worth resuming */
+        unlink(part);
+        remove(file);
+    }
+    if (res != 0 && dstfile)
+        remove(dstfile);
+    free(d.state);
+    free(d.got);
+    free(d.retry);
+    free(d.buf);
+    return res;
+}
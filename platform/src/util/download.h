@@ -11,9 +11,34 @@
 #include "misc.h"
 
 /*
-** download file,
-** function is not thread-safe
+** download functions are thread-safe, dns lookups and ssl sessions are
+** reused across calls.
 */
+
+/* download file */
 int lyutil_download(const char *uri, const char *name);
 
+/*
+** download file, checksum it and decompress gz or bzip2 data into
+** dstfile while data is received, other data is copied as it is.
+** dstfile is optional.
+** return 0 on success, 1 on checksum mismatch, -1 on other errors.
+*/
+int lyutil_download_stream(const char *uri, const char *name,
+                           const char *checksum, const char *dstfile);
+
+/*
+** as lyutil_download_stream, big file is fetched in ranges over up to
+** conns connections, into a sparse file of full size. data is checksumed
+** and decompressed as soon as it's received in order. on errors other
+** than checksum mismatch, file is kept with its progress in name.part,
+** and the download is resumed next time.
+*/
+int lyutil_download_parallel(const char *uri, const char *name,
+                             const char *checksum, const char *dstfile,
+                             int conns);
+
+/* whether file is a download to be resumed */
+int lyutil_download_partial(const char *name);
+
 #endif
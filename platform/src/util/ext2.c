@@ -0,0 +1,573 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+#include "ext2.h"
+
+/* Ref linux/fs/ext4/ext4.h */
+#define EXT2_SUPER_OFFSET       1024
+#define EXT2_SUPER_MAGIC        0xEF53
+#define EXT2_ROOT_INO           2
+#define EXT2_NDIR_BLOCKS        12
+#define EXT2_N_BLOCKS           15
+
+#define EXT2_INCOMPAT_FILETYPE      0x0002
+#define EXT3_INCOMPAT_RECOVER       0x0004
+#define EXT4_INCOMPAT_EXTENTS       0x0040
+#define EXT4_INCOMPAT_64BIT         0x0080
+#define EXT4_INCOMPAT_MMP           0x0100
+#define EXT4_INCOMPAT_FLEX_BG       0x0200
+#define EXT4_INCOMPAT_EA_INODE      0x0400
+#define EXT4_INCOMPAT_CSUM_SEED     0x2000
+#define EXT4_INCOMPAT_LARGEDIR      0x4000
+/* no inline data or casefold, images using them are mounted instead */
+#define EXT2_INCOMPAT_SUPP (EXT2_INCOMPAT_FILETYPE | EXT3_INCOMPAT_RECOVER | \
+                            EXT4_INCOMPAT_EXTENTS | EXT4_INCOMPAT_64BIT | \
+                            EXT4_INCOMPAT_MMP | EXT4_INCOMPAT_FLEX_BG | \
+                            EXT4_INCOMPAT_EA_INODE | EXT4_INCOMPAT_CSUM_SEED | \
+                            EXT4_INCOMPAT_LARGEDIR)
+
+#define EXT4_EXTENTS_FL         0x00080000
+#define EXT4_INLINE_DATA_FL     0x10000000
+#define EXT4_EXT_MAGIC          0xF30A
+#define EXT4_EXT_INIT_MAX_LEN   32768
+
+#define LY_EXT2_SYMLINK_MAX     8
+#define LY_EXT2_BUF_SIZE        (1 << 20)
+
+struct LYExt2_t {
+    int fd;
+    long long offset;           /* of file system in image */
+    unsigned int block_size;
+    unsigned long long blocks_count;
+    unsigned int first_data_block;
+    unsigned int inodes_per_group;
+    unsigned int inodes_count;
+    unsigned int inode_size;
+    unsigned int desc_size;
+    unsigned int group_num;
+    unsigned long long *inode_table;    /* of each group */
+};
+
+typedef struct LYExt2Inode_t {
+    unsigned int ino;
+    unsigned short mode;
+    unsigned long long size;
+    unsigned int flags;
+    unsigned char block[EXT2_N_BLOCKS * 4];
+} LYExt2Inode;
+
+/* data blocks of inode, pblk 0 for holes */
+typedef int (*LYExt2RunFunc)(LYExt2 *fs, void *arg, unsigned long long lblk,
+                             unsigned long long pblk, unsigned int len);
+
+static inline unsigned int __get16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static inline unsigned int __get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static int __read(LYExt2 *fs, void *buf, size_t len, unsigned long long off)
+{
+    char *p = buf;
+    off += fs->offset;
+    while (len > 0) {
+        ssize_t n = pread(fs->fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int __read_block(LYExt2 *fs, void *buf, unsigned long long pblk)
+{
+    if (pblk >= fs->blocks_count)
+        return -1;
+    return __read(fs, buf, fs->block_size, pblk * fs->block_size);
+}
+
+LYExt2 * lyutil_ext2_open(const char *image, long long offset)
+{
+    unsigned char sb[1024];
+    LYExt2 *fs = malloc(sizeof(LYExt2));
+    if (fs == NULL)
+        return NULL;
+    bzero(fs, sizeof(LYExt2));
+    fs->offset = offset;
+    fs->fd = open(image, O_RDONLY);
+    if (fs->fd < 0) {
+        logerror(_("open %s failed.\n"), image);
+        free(fs);
+        return NULL;
+    }
+    if (__read(fs, sb, sizeof(sb), EXT2_SUPER_OFFSET) < 0 ||
+        __get16(sb + 56) != EXT2_SUPER_MAGIC) {
+        logdebug(_("no ext2/3/4 file system in %s\n"), image);
+        goto failed;
+    }
+    unsigned int incompat = __get32(sb + 96);
+    if (incompat & ~EXT2_INCOMPAT_SUPP) {
+        loginfo(_("ext file system in %s has features %x not supported\n"),
+                  image, incompat & ~EXT2_INCOMPAT_SUPP);
+        goto failed;
+    }
+    unsigned int log_block_size = __get32(sb + 24);
+    if (log_block_size > 6)
+        goto failed;
+    fs->block_size = 1024 << log_block_size;
+    fs->inodes_count = __get32(sb + 0);
+    fs->blocks_count = __get32(sb + 4);
+    fs->first_data_block = __get32(sb + 20);
+    unsigned int blocks_per_group = __get32(sb + 32);
+    fs->inodes_per_group = __get32(sb + 40);
+    fs->inode_size = __get32(sb + 76) ? __get16(sb + 88) : 128;
+    fs->desc_size = 32;
+    if (incompat & EXT4_INCOMPAT_64BIT) {
+        fs->blocks_count |= (unsigned long long)__get32(sb + 0x150) << 32;
+        fs->desc_size = __get16(sb + 0xfe);
+    }
+    if (blocks_per_group == 0 || fs->inodes_per_group == 0 ||
+        fs->inode_size < 128 || fs->inode_size > fs->block_size ||
+        fs->desc_size < 32 || fs->desc_size > fs->block_size) {
+        logerror(_("bad ext file system in %s\n"), image);
+        goto failed;
+    }
+    fs->group_num = (fs->blocks_count - fs->first_data_block +
+                     blocks_per_group - 1) / blocks_per_group;
+
+    /* inode table of each group, from group descriptors */
+    size_t len = (size_t)fs->group_num * fs->desc_size;
+    unsigned char *desc = malloc(len);
+    fs->inode_table = malloc(fs->group_num * sizeof(unsigned long long));
+    if (desc == NULL || fs->inode_table == NULL ||
+        __read(fs, desc, len, (unsigned long long)(fs->first_data_block + 1) *
+                              fs->block_size) < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        free(desc);
+        goto failed;
+    }
+    unsigned int i;
+    for (i = 0; i < fs->group_num; i++) {
+        unsigned char *d = desc + i * fs->desc_size;
+        fs->inode_table[i] = __get32(d + 8);
+        if (fs->desc_size >= 64)
+            fs->inode_table[i] |= (unsigned long long)__get32(d + 0x28) << 32;
+    }
+    free(desc);
+    return fs;
+
+failed:
+    lyutil_ext2_close(fs);
+    return NULL;
+}
+
+void lyutil_ext2_close(LYExt2 *fs)
+{
+    if (fs == NULL)
+        return;
+    if (fs->fd >= 0)
+        close(fs->fd);
+    free(fs->inode_table);
+    free(fs);
+}
+
+static int __read_inode(LYExt2 *fs, unsigned int ino, LYExt2Inode *inode)
+{
+    if (ino == 0 || ino > fs->inodes_count)
+        return -1;
+    unsigned int group = (ino - 1) / fs->inodes_per_group;
+    unsigned int index = (ino - 1) % fs->inodes_per_group;
+    if (group >= fs->group_num)
+        return -1;
+    unsigned char raw[128];
+    if (__read(fs, raw, sizeof(raw), fs->inode_table[group] * fs->block_size +
+                                     (unsigned long long)index *
+                                     fs->inode_size) < 0)
+        return -1;
+    inode->ino = ino;
+    inode->mode = __get16(raw + 0);
+    inode->size = __get32(raw + 4);
+    if (S_ISREG(inode->mode))
+        inode->size |= (unsigned long long)__get32(raw + 108) << 32;
+    inode->flags = __get32(raw + 32);
+    memcpy(inode->block, raw + 40, sizeof(inode->block));
+    return 0;
+}
+
+static int __extent_walk(LYExt2 *fs, const unsigned char *node, int level,
+                         LYExt2RunFunc func, void *arg)
+{
+    if (__get16(node) != EXT4_EXT_MAGIC || level > 5)
+        return -1;
+    unsigned int entries = __get16(node + 2);
+    unsigned int max = __get16(node + 4);
+    unsigned int depth = __get16(node + 6);
+    /* root node is in inode i_block, others take a whole block */
+    unsigned int room = ((level ? fs->block_size : 60) - 12) / 12;
+    if (entries > max || max > room) {
+        logerror(_("bad extent node, %u of %u entries, room for %u\n"),
+                 entries, max, room);
+        return -1;
+    }
+    const unsigned char *e = node + 12;
+    unsigned int i;
+    int ret = 0;
+    if (depth == 0) {
+        for (i = 0; i < entries && ret == 0; i++, e += 12) {
+            unsigned int len = __get16(e + 4);
+            unsigned long long pblk = __get32(e + 8) |
+                                      (unsigned long long)__get16(e + 6) << 32;
+            if (len > EXT4_EXT_INIT_MAX_LEN) {
+                /* not initialized, reads as zero */
+                len -= EXT4_EXT_INIT_MAX_LEN;
+                pblk = 0;
+            }
+            ret = func(fs, arg, __get32(e), pblk, len);
+        }
+        return ret;
+    }
+    unsigned char *buf = malloc(fs->block_size);
+    if (buf == NULL)
+        return -1;
+    for (i = 0; i < entries && ret == 0; i++, e += 12) {
+        unsigned long long pblk = __get32(e + 4) |
+                                  (unsigned long long)__get16(e + 8) << 32;
+        if (__read_block(fs, buf, pblk) < 0)
+            ret = -1;
+        else
+            ret = __extent_walk(fs, buf, level + 1, func, arg);
+    }
+    free(buf);
+    return ret;
+}
+
+/* indirect block of level, contiguous blocks are merged in runs */
+typedef struct LYExt2Run_t {
+    LYExt2RunFunc func;
+    void *arg;
+    unsigned long long lblk;
+    unsigned long long pblk;
+    unsigned int len;
+} LYExt2Run;
+
+static int __run_add(LYExt2 *fs, LYExt2Run *r, unsigned long long lblk,
+                     unsigned long long pblk)
+{
+    if (r->len && r->pblk && pblk == r->pblk + r->len &&
+        lblk == r->lblk + r->len) {
+        r->len++;
+        return 0;
+    }
+    int ret = r->len ? r->func(fs, r->arg, r->lblk, r->pblk, r->len) : 0;
+    r->lblk = lblk;
+    r->pblk = pblk;
+    r->len = 1;
+    return ret;
+}
+
+static int __indirect_walk(LYExt2 *fs, unsigned int pblk, int level,
+                           unsigned long long *lblk,
+                           unsigned long long lblk_end, LYExt2Run *r)
+{
+    unsigned int per_block = fs->block_size / 4;
+    unsigned long long span = 1;
+    int i;
+    for (i = 0; i < level; i++)
+        span *= per_block;
+    if (pblk == 0) {
+        /* hole */
+        *lblk += span * per_block;
+        return 0;
+    }
+    unsigned char *buf = malloc(fs->block_size);
+    if (buf == NULL || __read_block(fs, buf, pblk) < 0) {
+        free(buf);
+        return -1;
+    }
+    int ret = 0;
+    unsigned int j;
+    for (j = 0; j < per_block && ret == 0 && *lblk < lblk_end; j++) {
+        unsigned int p = __get32(buf + j * 4);
+        if (level > 0)
+            ret = __indirect_walk(fs, p, level - 1, lblk, lblk_end, r);
+        else {
+            if (p)
+                ret = __run_add(fs, r, *lblk, p);
+            (*lblk)++;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+static int __inode_walk(LYExt2 *fs, LYExt2Inode *inode, LYExt2RunFunc func,
+                        void *arg)
+{
+    if (inode->flags & EXT4_INLINE_DATA_FL) {
+        logerror(_("inline data of inode %u not supported\n"), inode->ino);
+        return -1;
+    }
+    if (inode->flags & EXT4_EXTENTS_FL)
+        return __extent_walk(fs, inode->block, 0, func, arg);
+
+    unsigned long long lblk_end = (inode->size + fs->block_size - 1) /
+                                  fs->block_size;
+    LYExt2Run r;
+    bzero(&r, sizeof(r));
+    r.func = func;
+    r.arg = arg;
+    unsigned long long lblk;
+    int i, ret = 0;
+    for (lblk = 0; lblk < EXT2_NDIR_BLOCKS && lblk < lblk_end; lblk++) {
+        unsigned int p = __get32(inode->block + lblk * 4);
+        if (p && (ret = __run_add(fs, &r, lblk, p)) != 0)
+            return ret;
+    }
+    for (i = 0; i < 3 && ret == 0 && lblk < lblk_end; i++)
+        ret = __indirect_walk(fs, __get32(inode->block +
+                                         (EXT2_NDIR_BLOCKS + i) * 4),
+                              i, &lblk, lblk_end, &r);
+    if (ret == 0 && r.len)
+        ret = func(fs, arg, r.lblk, r.pblk, r.len);
+    return ret;
+}
+
+typedef struct LYExt2Find_t {
+    const char *name;
+    unsigned int name_len;
+    unsigned int ino;
+    unsigned char *buf;
+} LYExt2Find;
+
+static int __dir_run(LYExt2 *fs, void *arg, unsigned long long lblk,
+                     unsigned long long pblk, unsigned int len)
+{
+    LYExt2Find *f = arg;
+    unsigned int i;
+    for (i = 0; i < len && pblk; i++) {
+        if (__read_block(fs, f->buf, pblk + i) < 0)
+            return -1;
+        unsigned int off = 0;
+        while (off + 8 <= fs->block_size) {
+            unsigned char *d = f->buf + off;
+            unsigned int rec_len = __get16(d + 4);
+            unsigned int name_len = d[6];
+            if (rec_len < 8 || off + rec_len > fs->block_size ||
+                name_len + 8 > rec_len)
+                return -1;
+            if (__get32(d) && name_len == f->name_len &&
+                memcmp(d + 8, f->name, name_len) == 0) {
+                f->ino = __get32(d);
+                return 1;
+            }
+            off += rec_len;
+        }
+    }
+    return 0;
+}
+
+static int __dir_find(LYExt2 *fs, LYExt2Inode *dir, const char *name,
+                      unsigned int name_len, unsigned int *ino)
+{
+    if (!S_ISDIR(dir->mode))
+        return -1;
+    LYExt2Find f;
+    f.name = name;
+    f.name_len = name_len;
+    f.ino = 0;
+    f.buf = malloc(fs->block_size);
+    if (f.buf == NULL)
+        return -1;
+    int ret = __inode_walk(fs, dir, __dir_run, &f);
+    free(f.buf);
+    if (ret != 1)
+        return -1;
+    *ino = f.ino;
+    return 0;
+}
+
+static int __read_link(LYExt2 *fs, LYExt2Inode *inode, char *target)
+{
+    if (inode->size >= PATH_MAX)
+        return -1;
+    if (inode->size < sizeof(inode->block) &&
+        !(inode->flags & (EXT4_EXTENTS_FL | EXT4_INLINE_DATA_FL))) {
+        /* fast symlink, target kept in inode */
+        memcpy(target, inode->block, inode->size);
+    }
+    else if (inode->flags & EXT4_INLINE_DATA_FL) {
+        if (inode->size > sizeof(inode->block))
+            return -1;
+        memcpy(target, inode->block, inode->size);
+    }
+    else {
+        unsigned long long pblk = 0;
+        if (inode->flags & EXT4_EXTENTS_FL) {
+            if (__get16(inode->block) != EXT4_EXT_MAGIC ||
+                __get16(inode->block + 2) == 0 || __get16(inode->block + 6))
+                return -1;
+            pblk = __get32(inode->block + 20) |
+                   (unsigned long long)__get16(inode->block + 18) << 32;
+        }
+        else
+            pblk = __get32(inode->block);
+        unsigned char *buf = malloc(fs->block_size);
+        if (buf == NULL || __read_block(fs, buf, pblk) < 0 ||
+            inode->size > fs->block_size) {
+            free(buf);
+            return -1;
+        }
+        memcpy(target, buf, inode->size);
+        free(buf);
+    }
+    target[inode->size] = '\0';
+    return 0;
+}
+
+/* inode of path, relative to directory dir */
+static int __lookup(LYExt2 *fs, unsigned int dir, const char *path,
+                    int depth, LYExt2Inode *inode)
+{
+    if (*path == '/')
+        dir = EXT2_ROOT_INO;
+    if (__read_inode(fs, dir, inode) < 0)
+        return -1;
+    while (1) {
+        while (*path == '/')
+            path++;
+        unsigned int len = strcspn(path, "/");
+        if (len == 0)
+            return 0;
+        unsigned int ino;
+        if (__dir_find(fs, inode, path, len, &ino) < 0 ||
+            __read_inode(fs, ino, inode) < 0)
+            return -1;
+        path += len;
+        if (S_ISLNK(inode->mode)) {
+            char target[PATH_MAX];
+            if (depth >= LY_EXT2_SYMLINK_MAX ||
+                __read_link(fs, inode, target) < 0 ||
+                __lookup(fs, dir, target, depth + 1, inode) < 0)
+                return -1;
+        }
+        dir = inode->ino;
+    }
+}
+
+typedef struct LYExt2Copy_t {
+    int fd;
+    unsigned long long size;
+    unsigned char *buf;
+} LYExt2Copy;
+
+static int __copy_run(LYExt2 *fs, void *arg, unsigned long long lblk,
+                      unsigned long long pblk, unsigned int len)
+{
+    LYExt2Copy *c = arg;
+    if (pblk == 0)
+        return 0;
+    if (pblk + len > fs->blocks_count)
+        return -1;
+    unsigned long long off = lblk * fs->block_size;
+    unsigned long long end = off + (unsigned long long)len * fs->block_size;
+    if (end > c->size)
+        end = c->size;
+    unsigned long long src = pblk * fs->block_size;
+    while (off < end) {
+        size_t n = end - off > LY_EXT2_BUF_SIZE ? LY_EXT2_BUF_SIZE : end - off;
+        if (__read(fs, c->buf, n, src) < 0)
+            return -1;
+        size_t done = 0;
+        while (done < n) {
+            ssize_t w = pwrite(c->fd, c->buf + done, n - done, off + done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                return -1;
+            done += w;
+        }
+        off += n;
+        src += n;
+    }
+    return 0;
+}
+
+int lyutil_ext2_copy(LYExt2 *fs, const char *path, const char *dstfile)
+{
+    LYExt2Inode inode;
+    if (fs == NULL || __lookup(fs, EXT2_ROOT_INO, path, 0, &inode) < 0) {
+        logerror(_("%s not found in file system\n"), path);
+        return -1;
+    }
+    if (!S_ISREG(inode.mode)) {
+        logerror(_("%s is not a regular file\n"), path);
+        return -1;
+    }
+
+    LYExt2Copy c;
+    c.size = inode.size;
+    c.buf = malloc(LY_EXT2_BUF_SIZE);
+    c.fd = open(dstfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (c.buf == NULL || c.fd < 0) {
+        logerror(_("open %s failed.\n"), dstfile);
+        free(c.buf);
+        if (c.fd >= 0)
+            close(c.fd);
+        return -1;
+    }
+    int ret = __inode_walk(fs, &inode, __copy_run, &c);
+    /* holes at end */
+    if (ret == 0 && ftruncate(c.fd, c.size) < 0)
+        ret = -1;
+    if (close(c.fd) < 0)
+        ret = -1;
+    free(c.buf);
+    if (ret != 0) {
+        logerror(_("copying %s to %s failed\n"), path, dstfile);
+        unlink(dstfile);
+        return -1;
+    }
+    return 0;
+}
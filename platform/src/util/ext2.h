@@ -0,0 +1,21 @@
+#ifndef __LY_INCLUDE_UTIL_EXT2_H
+#define __LY_INCLUDE_UTIL_EXT2_H
+
+/*
+** read only access to ext2/3/4 file system in disk image,
+** files are read without mounting the image.
+*/
+typedef struct LYExt2_t LYExt2;
+
+/* file system starting at offset of image, NULL if not ext2/3/4 */
+LYExt2 * lyutil_ext2_open(const char *image, long long offset);
+void lyutil_ext2_close(LYExt2 *fs);
+
+/*
+** copy regular file at path of file system to dstfile, symlinks are
+** followed, relative to the directory of link, absolute ones to root
+** of the file system. return 0 on success, -1 on error.
+*/
+int lyutil_ext2_copy(LYExt2 *fs, const char *path, const char *dstfile);
+
+#endif
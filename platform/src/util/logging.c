@@ -29,9 +29,13 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>             
 #include <limits.h>
 
@@ -42,7 +46,7 @@
 #endif
 
 static int logging = 0; 
-static int loglevel = LYDEBUG;
+int g_loglevel = LYDEBUG;
 static FILE *LOGFH = NULL;
 static char logFile[MAX_PATH];
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -51,6 +55,73 @@ static void (* __callback)(int type, char * msg, int data) = NULL;
 static int __callback_data;
 static pthread_mutex_t cb_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+** async logging. producers format records into a ring of their own
+** thread, the writer thread is the only consumer of all rings. it
+** writes records in batches with writev, rotates log file and calls
+** logging callback.
+*/
+typedef struct LogRecord_t {
+    time_t time;
+    short level;
+    short callback;             /* deliver to logging callback */
+    int len;
+    char msg[LOG_ASYNC_MSG_MAX];
+} LogRecord;
+
+typedef struct LogRing_t {
+    volatile unsigned int head; /* written by producer only */
+    volatile unsigned int tail; /* written by writer only */
+    volatile int closed;        /* thread exited */
+    volatile unsigned int dropped;
+    unsigned int dropped_seen;
+    struct LogRing_t * next;
+    LogRecord rec[LOG_ASYNC_SLOTS];
+} LogRing;
+
+static volatile int __async_on = 0;
+static volatile int __async_stop = 0;
+static pthread_t __async_thread;
+static pthread_key_t __async_key;
+static LogRing * volatile __async_rings = NULL;
+static __thread LogRing * __async_ring = NULL;
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+/* used by writer thread only */
+static off_t __async_size;
+static time_t __async_time;
+static char __async_ctime[27];
+
+static const char * __level_tag[] = { "DD", "II", "WW", "EE", "FF" };
+
+/*
+** rotate log file, totally 5 rotated files are allowed.
+** log_mutex must be held, return the file to write to.
+*/
+static FILE * __log_rotate(void)
+{
+    struct stat statbuf;
+    int i;
+    char oldFile[MAX_PATH], newFile[MAX_PATH];
+
+    fclose(LOGFH);
+    if (!stat(logFile, &statbuf) && ((int) statbuf.st_size > MAXLOGFILESIZE)) {
+        for (i = 4; i >= 0; i--) {
+            snprintf(oldFile, MAX_PATH, "%s.%d", logFile, i);
+            snprintf(newFile, MAX_PATH, "%s.%d", logFile, i + 1);
+            rename(oldFile, newFile);
+        }
+        snprintf(oldFile, MAX_PATH, "%s", logFile);
+        snprintf(newFile, MAX_PATH, "%s.%d", logFile, 0);
+        rename(oldFile, newFile);
+    }
+    LOGFH = fopen(logFile, "a");
+    if (LOGFH)
+        return LOGFH;
+    logging = 0;
+    return stdout;
+}
+
 /*
 ** initialize logging related syste variables
 */
@@ -63,10 +134,10 @@ int logfile(const char *file, int in_loglevel)
 
     logging = 0;
     if (in_loglevel >= LYDEBUG && in_loglevel <= LYFATAL) {
-        loglevel = in_loglevel;
+        g_loglevel = in_loglevel;
     }
     else {
-        loglevel = LYDEBUG;
+        g_loglevel = LYDEBUG;
     }
     if (file == NULL) {
         LOGFH = NULL;
@@ -163,7 +234,7 @@ int logprintfl(int level, const char *format, ...)
     struct stat statbuf;
     FILE *file;
 
-    if (level < loglevel) {
+    if (level < g_loglevel) {
         return (0);
     }
 
@@ -252,6 +323,232 @@ int logprintfl(int level, const char *format, ...)
     return (rc);
 }
 
+static void __async_ring_close(void * ring)
+{
+    __sync_synchronize();
+    ((LogRing *) ring)->closed = 1;
+}
+
+static LogRing * __async_ring_get(void)
+{
+    if (__async_ring)
+        return __async_ring;
+
+    LogRing * r = calloc(1, sizeof(LogRing));
+    if (r == NULL)
+        return NULL;
+    do {
+        r->next = __async_rings;
+    } while (!__sync_bool_compare_and_swap(&__async_rings, r->next, r));
+    pthread_setspecific(__async_key, r);
+    __async_ring = r;
+    return r;
+}
+
+/*
+** put message in ring of current thread, return -1 if it should be
+** written synchronously. the ring is drained first to keep order.
+** writer thread may log from logging callback, its messages are
+** dropped when its ring is full.
+*/
+static int __async_log(int level, const char *format, va_list ap)
+{
+    LogRing * r = __async_ring_get();
+    if (r == NULL)
+        return -1;
+
+    /* ring full, wait for writer, it can't wait for itself */
+    unsigned int head = r->head;
+    int self = pthread_equal(pthread_self(), __async_thread);
+    while (head - r->tail >= LOG_ASYNC_SLOTS) {
+        if (self) {
+            r->dropped++;
+            return 0;
+        }
+        if (!__async_on)
+            return -1;
+        pthread_cond_signal(&async_cond);
+        sched_yield();
+    }
+
+    LogRecord * rec = &r->rec[head & (LOG_ASYNC_SLOTS - 1)];
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(rec->msg, LOG_ASYNC_MSG_MAX, format, aq);
+    va_end(aq);
+    if (n < 0 || n >= LOG_ASYNC_MSG_MAX) {
+        if (self)
+            return -1;
+        pthread_cond_signal(&async_cond);
+        while (__async_on && r->tail != head)
+            usleep(1000);
+        /* written by caller, callback gets the beginning of it */
+        if (n > 0 && __callback && (level == LYWARN || level == LYERROR)) {
+            pthread_mutex_lock(&cb_mutex);
+            rec->msg[LOG_CALLBACK_MSG_MAX-1] = '\0';
+            __callback(level, rec->msg, __callback_data);
+            pthread_mutex_unlock(&cb_mutex);
+        }
+        return -1;
+    }
+    rec->len = n;
+    rec->level = level;
+    rec->time = time(NULL);
+    rec->callback = __callback && (level == LYWARN || level == LYERROR);
+    __sync_synchronize();
+    r->head = head + 1;
+
+    if (level >= LYFATAL || head - r->tail == LOG_ASYNC_SLOTS / 2)
+        pthread_cond_signal(&async_cond);
+    return n;
+}
+
+/* write a batch of records in ring, return number of records */
+static int __async_flush_ring(LogRing * r)
+{
+    unsigned int tail = r->tail;
+    int num = r->head - tail;
+    __sync_synchronize();
+    if (num > LOG_ASYNC_BATCH)
+        num = LOG_ASYNC_BATCH;
+
+    struct iovec iov[LOG_ASYNC_BATCH * 2 + 1];
+    char tag[LOG_ASYNC_BATCH][40];
+    char drop[64];
+    int i, n = 0;
+    for (i = 0; i < num; i++) {
+        LogRecord * rec = &r->rec[(tail + i) & (LOG_ASYNC_SLOTS - 1)];
+        if (rec->time != __async_time) {
+            __async_time = rec->time;
+            if (ctime_r(&__async_time, __async_ctime) == NULL)
+                __async_ctime[0] = '\0';
+            char * eol = strchr(__async_ctime, '\n');
+            if (eol)
+                *eol = '\0';
+        }
+        int level = rec->level;
+        if (level < LYDEBUG || level > LYFATAL)
+            level = LYDEBUG;
+        iov[n].iov_base = tag[i];
+        iov[n++].iov_len = snprintf(tag[i], sizeof(tag[i]), "[%s][%s] ",
+                                    __async_ctime, __level_tag[level]);
+        iov[n].iov_base = rec->msg;
+        iov[n++].iov_len = rec->len;
+    }
+    unsigned int dropped = r->dropped;
+    if (dropped != r->dropped_seen) {
+        iov[n].iov_base = drop;
+        iov[n++].iov_len = snprintf(drop, sizeof(drop),
+                                    "[%s][WW] %u log messages dropped\n",
+                                    __async_ctime, dropped - r->dropped_seen);
+        r->dropped_seen = dropped;
+    }
+    if (n == 0)
+        return 0;
+
+    pthread_mutex_lock(&log_mutex);
+    FILE * file = stdout;
+    if (logging) {
+        file = LOGFH;
+        struct stat statbuf;
+        if (__async_size > MAXLOGFILESIZE &&
+            !fstat(fileno(file), &statbuf)) {
+            __async_size = statbuf.st_size;
+            if ((int) statbuf.st_size > MAXLOGFILESIZE) {
+                file = __log_rotate();
+                __async_size = 0;
+            }
+        }
+    }
+    ssize_t size = writev(fileno(file), iov, n);
+    if (size > 0)
+        __async_size += size;
+    pthread_mutex_unlock(&log_mutex);
+
+    /* callback is not reentrant, also called on long message path */
+    pthread_mutex_lock(&cb_mutex);
+    for (i = 0; i < num; i++) {
+        LogRecord * rec = &r->rec[(tail + i) & (LOG_ASYNC_SLOTS - 1)];
+        if (rec->callback && __callback) {
+            rec->msg[LOG_CALLBACK_MSG_MAX-1] = '\0';
+            __callback(rec->level, rec->msg, __callback_data);
+        }
+    }
+    pthread_mutex_unlock(&cb_mutex);
+
+    __sync_synchronize();
+    r->tail = tail + num;
+    return num;
+}
+
+static void * __async_writer(void * arg)
+{
+    while (1) {
+        LogRing * r, * next, * prev = NULL;
+        int num = 0;
+        for (r = __async_rings; r; r = next) {
+            next = r->next;
+            num += __async_flush_ring(r);
+            if (!r->closed || r->tail != r->head) {
+                prev = r;
+                continue;
+            }
+            /* thread is gone, producers only change list head */
+            if (prev)
+                prev->next = next;
+            else if (!__sync_bool_compare_and_swap(&__async_rings, r, next)) {
+                prev = r;
+                continue;
+            }
+            free(r);
+        }
+        if (num)
+            continue;
+        if (__async_stop)
+            break;
+
+        struct timeval now;
+        struct timespec ts;
+        gettimeofday(&now, NULL);
+        ts.tv_sec = now.tv_sec;
+        ts.tv_nsec = now.tv_usec * 1000 + LOG_ASYNC_WAIT * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&async_mutex);
+        if (!__async_stop)
+            pthread_cond_timedwait(&async_cond, &async_mutex, &ts);
+        pthread_mutex_unlock(&async_mutex);
+    }
+    return NULL;
+}
+
+/*
+** write log in background thread, must be called after daemonize.
+** messages still in rings are lost if process crashes.
+*/
+int logasync(void)
+{
+    if (__async_on)
+        return 0;
+
+    if (pthread_key_create(&__async_key, __async_ring_close))
+        return -1;
+
+    struct stat statbuf;
+    __async_size = 0;
+    if (logging && !fstat(fileno(LOGFH), &statbuf))
+        __async_size = statbuf.st_size;
+    __async_stop = 0;
+    if (pthread_create(&__async_thread, NULL, __async_writer, NULL)) {
+        pthread_key_delete(__async_key);
+        return -1;
+    }
+    __async_on = 1;
+    return 0;
+}
+
 /* same as logprintfl */
 static int lylogprintfl(int level, const char *format, va_list ap)
 {
@@ -261,10 +558,16 @@ static int lylogprintfl(int level, const char *format, va_list ap)
     struct stat statbuf;
     FILE *file;
 
-    if (level < loglevel) {
+    if (level < g_loglevel) {
         return (0);
     }
 
+    if (__async_on) {
+        rc = __async_log(level, format, ap);
+        if (rc >= 0)
+            return (rc);
+    }
+
     pthread_mutex_lock(&log_mutex);
 
     rc = 1;
@@ -274,31 +577,8 @@ static int lylogprintfl(int level, const char *format, va_list ap)
         fd = fileno(file);
         if (fd >= 0) {
             rc = fstat(fd, &statbuf);
-            if (!rc && ((int) statbuf.st_size > MAXLOGFILESIZE)) {
-                int i;
-                char oldFile[MAX_PATH], newFile[MAX_PATH];
-
-                fclose(LOGFH);
-                rc = stat(logFile, &statbuf);
-                if (!rc && ((int) statbuf.st_size > MAXLOGFILESIZE)) {
-                    for (i = 4; i >= 0; i--) {
-                        snprintf(oldFile, MAX_PATH, "%s.%d", logFile, i);
-                        snprintf(newFile, MAX_PATH, "%s.%d", logFile,
-                                 i + 1);
-                        rename(oldFile, newFile);
-                    }
-                    snprintf(oldFile, MAX_PATH, "%s", logFile);
-                    snprintf(newFile, MAX_PATH, "%s.%d", logFile, 0);
-                    rename(oldFile, newFile);
-                }
-                LOGFH = fopen(logFile, "a");
-                if (LOGFH) {
-                    file = LOGFH;
-                }
-                else {
-                    file = stdout;
-                }
-            }
+            if (!rc && ((int) statbuf.st_size > MAXLOGFILESIZE))
+                file = __log_rotate();
         }
     }
     else {
@@ -355,7 +635,8 @@ int logerror(const char *format, ...)
     rc = lylogprintfl(LYERROR, format, ap);
     va_end(ap);
 
-    if (__callback) {
+    /* writer thread calls it in async mode */
+    if (__callback && !__async_on) {
         pthread_mutex_lock(&cb_mutex);
         va_start(ap, format);
         char s[LOG_CALLBACK_MSG_MAX] = {'\0', };
@@ -370,7 +651,7 @@ int logerror(const char *format, ...)
     return (rc);
 }
 
-int logdebug(const char *format, ...)
+int (logdebug)(const char *format, ...)
 {
     int rc;
     va_list ap;
@@ -380,7 +661,7 @@ int logdebug(const char *format, ...)
     return (rc);
 }
 
-int loginfo(const char *format, ...)
+int (loginfo)(const char *format, ...)
 {
     int rc;
     va_list ap;
@@ -398,7 +679,8 @@ int logwarn(const char *format, ...)
     rc = lylogprintfl(LYWARN, format, ap);
     va_end(ap);
 
-    if (__callback) {
+    /* writer thread calls it in async mode */
+    if (__callback && !__async_on) {
         pthread_mutex_lock(&cb_mutex);
         va_start(ap, format);
         char s[LOG_CALLBACK_MSG_MAX] = {'\0', };
@@ -423,6 +705,15 @@ int logcallback(void (* func)(), int data)
 /* close log file */
 int logclose(void)
 {
+    if (__async_on) {
+        __async_on = 0;
+        pthread_mutex_lock(&async_mutex);
+        __async_stop = 1;
+        pthread_cond_signal(&async_cond);
+        pthread_mutex_unlock(&async_mutex);
+        pthread_join(__async_thread, NULL);
+        pthread_key_delete(__async_key);
+    }
     if (LOGFH != NULL){
        fclose(LOGFH);
        LOGFH = NULL;
@@ -15,8 +15,20 @@
 /* the max of log message sent to logging callback */
 #define LOG_CALLBACK_MSG_MAX 100
 
+/*
+** async logging, see logasync. each thread has its own ring of
+** records, longer messages are written synchronously.
+*/
+#define LOG_ASYNC_SLOTS 128     /* power of 2 */
+#define LOG_ASYNC_MSG_MAX 1024
+#define LOG_ASYNC_BATCH 64
+#define LOG_ASYNC_WAIT 20       /* ms, writer waits when all rings empty */
+
 enum { LYDEBUG, LYINFO, LYWARN, LYERROR, LYFATAL };
 
+/* current log level, messages below it are dropped */
+extern int g_loglevel;
+
 /* dan's functions */
 int logfile(const char *file, int in_loglevel);
 int logsimple(const char *format, ...);
@@ -30,6 +42,15 @@ int loginfo(const char *format, ...);
 int logwarn(const char *format, ...);
 int logclose(void);
 
+/* start background writer, stopped and flushed by logclose */
+int logasync(void);
+
+/* disabled levels cost one compare, arguments are not evaluated */
+#define logdebug(...) \
+    (__builtin_expect(g_loglevel > LYDEBUG, 1) ? 0 : (logdebug)(__VA_ARGS__))
+#define loginfo(...) \
+    (g_loglevel > LYINFO ? 0 : (loginfo)(__VA_ARGS__))
+
 /* allow caller to specify callback function for log messages */
 int logcallback(void (* func)(), int data);
 
@@ -0,0 +1,441 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "logging.h"
+#include "lymetric.h"
+
+#define LYMETRIC_EXPORT_SIZE 4096
+/* histogram buckets exported, le of 4^k us */
+#define LYMETRIC_EXPORT_LE_MIN 2
+#define LYMETRIC_EXPORT_LE_MAX 15
+
+struct LYMetric_t {
+    int type;
+    char name[LYMETRIC_NAME_MAX];
+    int family_len;             /* length of name without labels */
+    const char * help;
+    volatile long long value;   /* counter, gauge */
+    volatile unsigned long long count;
+    volatile unsigned long long sum;
+    volatile unsigned long long * bucket;
+};
+
+/* entries are never removed, readers don't lock */
+static LYMetric g_metrics[LYMETRIC_MAX];
+static volatile int g_metric_num = 0;
+static pthread_mutex_t g_metric_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int g_metric_fd = -1;
+static char g_metric_path[108];
+static pthread_t g_metric_thread;
+
+static LYMetric * __metric_find(const char * name)
+{
+    int i, num = g_metric_num;
+    __sync_synchronize();
+    for (i = 0; i < num; i++)
+        if (strcmp(g_metrics[i].name, name) == 0)
+            return &g_metrics[i];
+    return NULL;
+}
+
+static LYMetric * __metric_new(int type, const char * name, const char * help)
+{
+    if (name == NULL || strlen(name) >= LYMETRIC_NAME_MAX)
+        return NULL;
+
+    LYMetric * m = __metric_find(name);
+    if (m)
+        return m->type == type ? m : NULL;
+
+    pthread_mutex_lock(&g_metric_mutex);
+    m = __metric_find(name);
+    if (m) {
+        pthread_mutex_unlock(&g_metric_mutex);
+        return m->type == type ? m : NULL;
+    }
+    if (g_metric_num >= LYMETRIC_MAX) {
+        pthread_mutex_unlock(&g_metric_mutex);
+        logwarn(_("too many metrics, %s ignored\n"), name);
+        return NULL;
+    }
+    m = &g_metrics[g_metric_num];
+    bzero(m, sizeof(LYMetric));
+    if (type == LYMETRIC_HISTOGRAM) {
+        m->bucket = calloc(LYMETRIC_HIST_BUCKETS, sizeof(unsigned long long));
+        if (m->bucket == NULL) {
+            pthread_mutex_unlock(&g_metric_mutex);
+            return NULL;
+        }
+    }
+    m->type = type;
+    strcpy(m->name, name);
+    char * p = strchr(m->name, '{');
+    m->family_len = p ? p - m->name : strlen(m->name);
+    m->help = help;
+    __sync_synchronize();
+    g_metric_num++;
+    pthread_mutex_unlock(&g_metric_mutex);
+    return m;
+}
+
+LYMetric * lymetric_counter(const char * name, const char * help)
+{
+    return __metric_new(LYMETRIC_COUNTER, name, help);
+}
+
+LYMetric * lymetric_gauge(const char * name, const char * help)
+{
+    return __metric_new(LYMETRIC_GAUGE, name, help);
+}
+
+LYMetric * lymetric_histogram(const char * name, const char * help)
+{
+    return __metric_new(LYMETRIC_HISTOGRAM, name, help);
+}
+
+void lymetric_inc(LYMetric * m)
+{
+    if (m)
+        __sync_fetch_and_add(&m->value, 1);
+}
+
+void lymetric_add(LYMetric * m, long long v)
+{
+    if (m)
+        __sync_fetch_and_add(&m->value, v);
+}
+
+void lymetric_set(LYMetric * m, long long v)
+{
+    if (m)
+        m->value = v;
+}
+
+long long lymetric_value(LYMetric * m)
+{
+    return m ? m->value : 0;
+}
+
+/* index of bucket holding v */
+static int __hist_bucket(unsigned long long v)
+{
+    if (v < LYMETRIC_HIST_SUB)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int i = (e - 1) * LYMETRIC_HIST_SUB +
+            ((v >> (e - 2)) & (LYMETRIC_HIST_SUB - 1));
+    return i < LYMETRIC_HIST_BUCKETS ? i : LYMETRIC_HIST_BUCKETS - 1;
+}
+
+/* values in bucket i are not above it */
+static unsigned long long __hist_upper(int i)
+{
+    if (i < LYMETRIC_HIST_SUB)
+        return i + 1;
+    int e = i / LYMETRIC_HIST_SUB + 1;
+    int sub = i % LYMETRIC_HIST_SUB;
+    return (unsigned long long)(LYMETRIC_HIST_SUB + sub + 1) << (e - 2);
+}
+
+void lymetric_observe(LYMetric * m, unsigned long long us)
+{
+    if (m == NULL || m->bucket == NULL)
+        return;
+    /* upper bound is inclusive, as le of prometheus */
+    __sync_fetch_and_add(&m->bucket[__hist_bucket(us ? us - 1 : 0)], 1);
+    __sync_fetch_and_add(&m->sum, us);
+    __sync_fetch_and_add(&m->count, 1);
+}
+
+unsigned long long lymetric_count(LYMetric * m)
+{
+    return m ? m->count : 0;
+}
+
+unsigned long long lymetric_quantile(LYMetric * m, double q)
+{
+    if (m == NULL || m->bucket == NULL || m->count == 0)
+        return 0;
+
+    unsigned long long total = 0, n = 0;
+    int i;
+    for (i = 0; i < LYMETRIC_HIST_BUCKETS; i++)
+        total += m->bucket[i];
+    for (i = 0; i < LYMETRIC_HIST_BUCKETS; i++) {
+        n += m->bucket[i];
+        if (n && n >= q * total)
+            return __hist_upper(i);
+    }
+    return __hist_upper(LYMETRIC_HIST_BUCKETS - 1);
+}
+
+unsigned long long lymetric_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+typedef struct LYMetricBuf_t {
+    char * buf;
+    int len;
+    int size;
+} LYMetricBuf;
+
+static void __buf_printf(LYMetricBuf * b, const char * format, ...)
+{
+    if (b->buf == NULL)
+        return;
+
+    va_list ap;
+    while (1) {
+        va_start(ap, format);
+        int n = vsnprintf(b->buf + b->len, b->size - b->len, format, ap);
+        va_end(ap);
+        if (n < 0) {
+            free(b->buf);
+            b->buf = NULL;
+            return;
+        }
+        if (n < b->size - b->len) {
+            b->len += n;
+            return;
+        }
+        char * buf = realloc(b->buf, b->size * 2);
+        if (buf == NULL) {
+            free(b->buf);
+            b->buf = NULL;
+            return;
+        }
+        b->buf = buf;
+        b->size *= 2;
+    }
+}
+
+/* labels of m, without braces, with sep appended if any */
+static void __export_labels(LYMetricBuf * b, LYMetric * m, const char * sep)
+{
+    int len = strlen(m->name) - m->family_len;
+    if (len > 2)
+        __buf_printf(b, "%.*s%s", len - 2, m->name + m->family_len + 1, sep);
+}
+
+static void __export_histogram(LYMetricBuf * b, LYMetric * m)
+{
+    int family = m->family_len;
+    unsigned long long n = 0;
+    int i = 0, k;
+    for (k = LYMETRIC_EXPORT_LE_MIN; k <= LYMETRIC_EXPORT_LE_MAX; k++) {
+        unsigned long long le = 1ULL << (2 * k);
+        for (; i < LYMETRIC_HIST_BUCKETS && __hist_upper(i) <= le; i++)
+            n += m->bucket[i];
+        __buf_printf(b, "%.*s_bucket{", family, m->name);
+        __export_labels(b, m, ",");
+        __buf_printf(b, "le=\"%.6f\"} %llu\n", le / 1e6, n);
+    }
+    /* +Inf must match _count and not be below other buckets */
+    unsigned long long count = m->count;
+    if (count < n)
+        count = n;
+    __buf_printf(b, "%.*s_bucket{", family, m->name);
+    __export_labels(b, m, ",");
+    __buf_printf(b, "le=\"+Inf\"} %llu\n", count);
+    __buf_printf(b, "%.*s_sum%s %.6f\n", family, m->name,
+                 m->name + family, m->sum / 1e6);
+    __buf_printf(b, "%.*s_count%s %llu\n", family, m->name,
+                 m->name + family, count);
+}
+
+char * lymetric_export(int * len)
+{
+    static const char * types[] = { "counter", "gauge", "histogram" };
+    LYMetricBuf b;
+    b.size = LYMETRIC_EXPORT_SIZE;
+    b.len = 0;
+    b.buf = malloc(b.size);
+    if (b.buf == NULL)
+        return NULL;
+    b.buf[0] = '\0';
+
+    int i, j, num = g_metric_num;
+    __sync_synchronize();
+    for (i = 0; i < num; i++) {
+        LYMetric * m = &g_metrics[i];
+        /* metrics of a family are written together, after its header */
+        for (j = 0; j < i; j++)
+            if (g_metrics[j].family_len == m->family_len &&
+                strncmp(g_metrics[j].name, m->name, m->family_len) == 0)
+                break;
+        if (j < i)
+            continue;
+        if (m->help)
+            __buf_printf(&b, "# HELP %.*s %s\n", m->family_len, m->name,
+                         m->help);
+        __buf_printf(&b, "# TYPE %.*s %s\n", m->family_len, m->name,
+                     types[m->type]);
+        for (j = i; j < num; j++) {
+            LYMetric * f = &g_metrics[j];
+            if (f->family_len != m->family_len ||
+                strncmp(f->name, m->name, m->family_len) != 0)
+                continue;
+            if (f->type == LYMETRIC_HISTOGRAM)
+                __export_histogram(&b, f);
+            else
+                __buf_printf(&b, "%s %lld\n", f->name, f->value);
+        }
+    }
+
+    if (b.buf && len)
+        *len = b.len;
+    return b.buf;
+}
+
+static int __send_all(int fd, const char * buf, int len)
+{
+    while (len > 0) {
+        int n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void __metric_client(int fd)
+{
+    /* request is optional, wait for it shortly */
+    char req[1024];
+    int n = 0;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) == 1)
+        n = recv(fd, req, sizeof(req), 0);
+
+    int len;
+    char * text = lymetric_export(&len);
+    if (text == NULL)
+        return;
+    if (n >= 4 && strncmp(req, "GET ", 4) == 0) {
+        char head[256];
+        int l = snprintf(head, sizeof(head),
+                         "HTTP/1.0 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %d\r\n\r\n", len);
+        if (__send_all(fd, head, l) < 0) {
+            free(text);
+            return;
+        }
+    }
+    __send_all(fd, text, len);
+    free(text);
+}
+
+static void * __metric_server(void * arg)
+{
+    int lfd = (long) arg;
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* socket shut down by lymetric_stop */
+            break;
+        }
+        __metric_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int lymetric_serve(const char * path)
+{
+    if (path == NULL || g_metric_fd >= 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        logerror(_("metrics socket path too long, %s\n"), path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) < 0 ||
+        listen(fd, 8) < 0) {
+        logerror(_("can not listen on %s, %s\n"), path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (pthread_create(&g_metric_thread, NULL, __metric_server,
+                       (void *)(long) fd)) {
+        logerror(_("error in %s(%d)\n"), __func__, __LINE__);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    g_metric_fd = fd;
+    strcpy(g_metric_path, path);
+    return 0;
+}
+
+void lymetric_stop(void)
+{
+    if (g_metric_fd < 0)
+        return;
+    shutdown(g_metric_fd, SHUT_RDWR);
+    pthread_join(g_metric_thread, NULL);
+    close(g_metric_fd);
+    unlink(g_metric_path);
+    g_metric_fd = -1;
+}
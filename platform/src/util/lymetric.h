@@ -0,0 +1,59 @@
+#ifndef __LY_INCLUDE_UTIL_LYMETRIC_H
+#define __LY_INCLUDE_UTIL_LYMETRIC_H
+
+/*
+** metrics of daemons, exported in prometheus text format.
+**
+** metrics are registered once by name, which may carry labels, e.g.
+** ly_clc_db_seconds{stmt="job_update"}. registering the same name
+** again returns the same metric. updates are lock free, NULL metric
+** is ignored so callers don't check registration errors.
+*/
+#define LYMETRIC_MAX 256
+#define LYMETRIC_NAME_MAX 128
+
+#define LYMETRIC_COUNTER 0
+#define LYMETRIC_GAUGE 1
+#define LYMETRIC_HISTOGRAM 2
+
+/*
+** histogram of values in microseconds, HDR style: each power of 2 is
+** split into LYMETRIC_HIST_SUB buckets, relative error below 25%.
+** values over 2^36 us, about 19 hours, go to the last bucket.
+*/
+#define LYMETRIC_HIST_SUB 4
+#define LYMETRIC_HIST_BUCKETS 140
+
+typedef struct LYMetric_t LYMetric;
+
+LYMetric * lymetric_counter(const char * name, const char * help);
+LYMetric * lymetric_gauge(const char * name, const char * help);
+LYMetric * lymetric_histogram(const char * name, const char * help);
+
+void lymetric_inc(LYMetric * m);
+void lymetric_add(LYMetric * m, long long v);
+void lymetric_set(LYMetric * m, long long v);
+long long lymetric_value(LYMetric * m);
+
+/* histogram, us is time spent, see lymetric_now_us */
+void lymetric_observe(LYMetric * m, unsigned long long us);
+unsigned long long lymetric_count(LYMetric * m);
+/* upper bound of bucket q, 0 < q <= 1, of values observed, in us */
+unsigned long long lymetric_quantile(LYMetric * m, double q);
+
+/* monotonic time in us */
+unsigned long long lymetric_now_us(void);
+
+/* all metrics in text format, free it after use */
+char * lymetric_export(int * len);
+
+/*
+** serve metrics on unix socket at path, in a thread. clients sending
+** http GET get an http response, e.g.
+**     curl --unix-socket /var/run/lyclc.metrics http://localhost/metrics
+** others get the text only.
+*/
+int lymetric_serve(const char * path);
+void lymetric_stop(void);
+
+#endif
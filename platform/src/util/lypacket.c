@@ -27,8 +27,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "lypacket.h"
@@ -38,7 +40,7 @@ int ly_packet_send(int fd, int32_t type, void * data, int32_t size)
     if (fd < 0 || type <= 0 || data == NULL || size <= 0)
        return -255;
 
-    if (size + sizeof(LYPacketHeader) >= LUOYUN_PACKET_SIZE_MAX)
+    if (size + sizeof(LYPacketHeader) > LUOYUN_PACKET_SEND_MAX)
        return -1;
 
     LYPacketHeader header;
@@ -69,6 +71,138 @@ int ly_packet_send(int fd, int32_t type, void * data, int32_t size)
     return 0;
 }
 
+void ly_packet_queue_init(LYPacketSendQueue * q)
+{
+    bzero(q, sizeof(LYPacketSendQueue));
+}
+
+int ly_packet_queue(LYPacketSendQueue * q, int32_t type, void * data, int32_t size)
+{
+    if (type <= 0 || data == NULL || size <= 0)
+       return -255;
+
+    if (size + sizeof(LYPacketHeader) > LUOYUN_PACKET_SEND_MAX)
+       return -1;
+
+    LYPacketChunk * c = malloc(sizeof(LYPacketChunk) +
+                               sizeof(LYPacketHeader) + size);
+    if (c == NULL)
+        return -1;
+
+    /* assume same endiness on all entities in system */
+    LYPacketHeader header;
+    header.type = type;
+    header.length = size;
+    memcpy(c->data, &header, sizeof(header));
+    memcpy(c->data + sizeof(header), data, size);
+    c->size = sizeof(header) + size;
+    c->next = NULL;
+
+    if (q->tail)
+        q->tail->next = c;
+    else
+        q->head = c;
+    q->tail = c;
+    q->bytes += c->size;
+    q->num++;
+    return 0;
+}
+
+int ly_packet_queue_flush(LYPacketSendQueue * q, int fd)
+{
+    if (fd < 0)
+        return -255;
+
+    struct iovec s[LUOYUN_PACKET_SEND_IOV_MAX];
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = s;
+
+    while (q->head) {
+        /* coalesce pending packets into one write */
+        LYPacketChunk * c = q->head;
+        int n = 0;
+        s[n].iov_base = c->data + q->sent;
+        s[n].iov_len = c->size - q->sent;
+        for (c = c->next, n++; c && n < LUOYUN_PACKET_SEND_IOV_MAX;
+             c = c->next, n++) {
+            s[n].iov_base = c->data;
+            s[n].iov_len = c->size;
+        }
+        msg.msg_iovlen = n;
+
+        ssize_t len = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        /* release chunks sent */
+        q->bytes -= len;
+        len += q->sent;
+        while (q->head && len >= q->head->size) {
+            c = q->head;
+            len -= c->size;
+            q->head = c->next;
+            q->num--;
+            free(c);
+        }
+        q->sent = len;
+        if (q->head == NULL)
+            q->tail = NULL;
+    }
+    return 0;
+}
+
+void ly_packet_queue_cleanup(LYPacketSendQueue * q)
+{
+    while (q->head) {
+        LYPacketChunk * c = q->head;
+        q->head = c->next;
+        free(c);
+    }
+    bzero(q, sizeof(LYPacketSendQueue));
+}
+
+/* length of current packet including header, 0 if header not received */
+static unsigned int __packet_total(LYPacketRecv * pkt)
+{
+    if (pkt->pkt_buf_received < sizeof(LYPacketHeader))
+        return 0;
+
+    /* assume the endiness of sending and receiving entities are same */
+    LYPacketHeader header;
+    memcpy(&header, (char *)pkt->pkt_buf + pkt->pkt_buf_head, sizeof(header));
+    if (header.length < 0 ||
+        header.length > LUOYUN_PACKET_SIZE_MAX - sizeof(LYPacketHeader))
+        return LUOYUN_PACKET_SIZE_MAX + 1;
+    return header.length + sizeof(LYPacketHeader);
+}
+
+/* move remaining data to the front of buffer */
+static void __packet_compact(LYPacketRecv * pkt)
+{
+    if (pkt->pkt_buf_head == 0)
+        return;
+    if (pkt->pkt_buf_received > 0)
+        memmove(pkt->pkt_buf, (char *)pkt->pkt_buf + pkt->pkt_buf_head,
+                pkt->pkt_buf_received);
+    pkt->pkt_buf_head = 0;
+}
+
+static int __packet_resize(LYPacketRecv * pkt, unsigned int size)
+{
+    void * buf = realloc(pkt->pkt_buf, size + 1);
+    if (buf == NULL)
+        return -1;
+    pkt->pkt_buf = buf;
+    pkt->pkt_buf_size = size;
+    return 0;
+}
+
 /* size is the length of data just received */
 int ly_packet_recv(LYPacketRecv * pkt, int size)
 {
@@ -83,13 +217,18 @@ int ly_packet_recv(LYPacketRecv * pkt, int size)
         return -1;
     pkt->pkt_buf_received += size;
 
-    if (pkt->pkt_buf_received < sizeof(LYPacketHeader)) {
+    /* current packet not processed yet */
+    if (pkt->pkt_data != NULL)
+        return 1;
+
+    unsigned int this_pkt_total = __packet_total(pkt);
+    if (this_pkt_total == 0)
         return 0;
-    }
-    /* assume the endiness of sending and receiving entities are same */
-    pkt->pkt_header = *(LYPacketHeader *)buf;
+    if (this_pkt_total > LUOYUN_PACKET_SIZE_MAX)
+        return -1;
 
-    int this_pkt_total = pkt->pkt_header.length + sizeof(LYPacketHeader);
+    buf += pkt->pkt_buf_head;
+    memcpy(&pkt->pkt_header, buf, sizeof(LYPacketHeader));
     if (this_pkt_total <= pkt->pkt_buf_received) {
         pkt->pkt_data = buf + sizeof(LYPacketHeader);
         pkt->pkt_head_byte = *(buf + this_pkt_total);
@@ -102,21 +241,26 @@ int ly_packet_recv(LYPacketRecv * pkt, int size)
 
 int ly_packet_recv_done(LYPacketRecv * pkt)
 {
-    if (pkt->pkt_buf_received < sizeof(LYPacketHeader)) {
+    if (pkt->pkt_data == NULL) {
+        /* drop incomplete packet */
         pkt->pkt_buf_received = 0;
-        return 0;
     }
-
-    int this_pkt_total = pkt->pkt_header.length + sizeof(LYPacketHeader);
-    if (pkt->pkt_buf_received <= this_pkt_total) {
-        pkt->pkt_buf_received = 0;
-        return 0;
+    else {
+        unsigned char *buf = (unsigned char *) pkt->pkt_buf;
+        unsigned int this_pkt_total = pkt->pkt_header.length +
+                                      sizeof(LYPacketHeader);
+        *(buf + pkt->pkt_buf_head + this_pkt_total) = pkt->pkt_head_byte;
+        pkt->pkt_data = NULL;
+        pkt->pkt_buf_head += this_pkt_total;
+        pkt->pkt_buf_received -= this_pkt_total;
     }
 
-    unsigned char *buf = (unsigned char *) pkt->pkt_buf;
-    pkt->pkt_buf_received -= this_pkt_total;
-    memmove(buf, buf + this_pkt_total, pkt->pkt_buf_received);
-    *buf = pkt->pkt_head_byte;
+    if (pkt->pkt_buf_received == 0) {
+        pkt->pkt_buf_head = 0;
+        /* give back memory used by large packet */
+        if (pkt->pkt_buf_size > LUOYUN_PACKET_BUF_SIZE)
+            __packet_resize(pkt, LUOYUN_PACKET_BUF_SIZE);
+    }
     return 0;
 }
 
@@ -125,14 +269,29 @@ void *ly_packet_buf(LYPacketRecv * pkt, int *size)
     if (pkt->pkt_buf == NULL)
         return NULL;
 
-    if (pkt->pkt_buf_size <= pkt->pkt_buf_received){
-        *size = 0;
-        return NULL;
+    if (pkt->pkt_buf_head + pkt->pkt_buf_received >= pkt->pkt_buf_size) {
+        /* buffer end reached, make room for the rest of packet */
+        unsigned int this_pkt_total = __packet_total(pkt);
+        if (this_pkt_total <= pkt->pkt_buf_received)
+            this_pkt_total = pkt->pkt_buf_received + 1;
+        __packet_compact(pkt);
+        if (this_pkt_total > pkt->pkt_buf_size) {
+            unsigned int new_size = pkt->pkt_buf_size << 1;
+            while (new_size < this_pkt_total)
+                new_size <<= 1;
+            if (new_size > LUOYUN_PACKET_SIZE_MAX)
+                new_size = LUOYUN_PACKET_SIZE_MAX;
+            if (this_pkt_total > new_size ||
+                __packet_resize(pkt, new_size) < 0) {
+                *size = 0;
+                return NULL;
+            }
+        }
     }
-    else
-        *size = pkt->pkt_buf_size - pkt->pkt_buf_received;
 
-    return (unsigned char *) pkt->pkt_buf + pkt->pkt_buf_received;
+    *size = pkt->pkt_buf_size - pkt->pkt_buf_head - pkt->pkt_buf_received;
+    return (unsigned char *) pkt->pkt_buf + pkt->pkt_buf_head +
+           pkt->pkt_buf_received;
 }
 
 int ly_packet_type(LYPacketRecv * pkt)
@@ -150,7 +309,8 @@ void *ly_packet_data(LYPacketRecv * pkt, int *size)
 
     if (size)
         *size = pkt->pkt_header.length;
-    return (unsigned char *) pkt->pkt_buf + sizeof(LYPacketHeader);
+    return (unsigned char *) pkt->pkt_buf + pkt->pkt_buf_head +
+           sizeof(LYPacketHeader);
 }
 
 int ly_packet_init(LYPacketRecv * pkt)
@@ -159,13 +319,12 @@ int ly_packet_init(LYPacketRecv * pkt)
         free(pkt->pkt_buf);
     bzero(pkt, sizeof(LYPacketRecv));
 
-    pkt->pkt_buf_size = LUOYUN_PACKET_SIZE_MAX;
-    pkt->pkt_buf = malloc(pkt->pkt_buf_size);
+    /* save space for making string */
+    pkt->pkt_buf = malloc(LUOYUN_PACKET_BUF_SIZE + 1);
     if (pkt->pkt_buf == NULL)
         return -1;
 
-    /* save space for making string */
-    pkt->pkt_buf_size = LUOYUN_PACKET_SIZE_MAX - 1;
+    pkt->pkt_buf_size = LUOYUN_PACKET_BUF_SIZE;
     return 0;
 }
 
@@ -175,7 +334,9 @@ int ly_packet_reinit(LYPacketRecv * pkt)
         return ly_packet_init(pkt);
 
     bzero(&pkt->pkt_header, sizeof(LYPacketHeader));
+    pkt->pkt_buf_head = 0;
     pkt->pkt_buf_received = 0;
+    pkt->pkt_data = NULL;
     return 0;
 }
 
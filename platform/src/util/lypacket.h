@@ -8,30 +8,43 @@
 ** packet header which identifies the packet type and data length.
 */
 
-/* LuoYun packet receive structure */
-#define LUOYUN_PACKET_SIZE_MAX 40960
+/*
+** LuoYun packet receive structure
+**
+** received data stays where recv put it, packets are parsed in place
+** and handed out as pointers into the buffer. the buffer starts small
+** and grows on demand, up to LUOYUN_PACKET_SIZE_MAX, to hold a large
+** packet. remaining data is moved to the front of the buffer only when
+** the buffer end is reached, and the buffer shrinks back once drained.
+**
+** packets sent are limited to LUOYUN_PACKET_SEND_MAX, the size older
+** releases receive, so peers not upgraded yet still take them.
+*/
+#define LUOYUN_PACKET_SIZE_MAX 4194304
+#define LUOYUN_PACKET_SEND_MAX 40960
+#define LUOYUN_PACKET_BUF_SIZE 4096
 
 typedef struct LYPacketRecv_t {
     /* packet header */
     LYPacketHeader pkt_header;
  
-    /* complete packet buffer */
+    /* packet buffer, one more byte is allocated for making string */
     unsigned int pkt_buf_size;
-    unsigned int pkt_buf_received;
+    unsigned int pkt_buf_head;          /* start of current packet */
+    unsigned int pkt_buf_received;      /* data after pkt_buf_head */
     void *pkt_buf;
 
-    /* points to packet data */
-    /* for now it should be (char *)buf + sizeof(LYPacketHeader) */
+    /* points to data of current packet, NULL if packet not complete */
     void *pkt_data;
 
-    /* to help make packet a string */
+    /* byte after current packet, replaced by NUL to make string */
     unsigned char pkt_head_byte;
 
 } LYPacketRecv;
 
 /* size is the length of data just received */
 int ly_packet_recv(LYPacketRecv * pkt, int size);
-/* re-org data after some data is processed */
+/* current packet is processed, or drop incomplete packet */
 int ly_packet_recv_done(LYPacketRecv * pkt);
 
 int ly_packet_init(LYPacketRecv * pkt);
@@ -44,4 +57,34 @@ int ly_packet_type(LYPacketRecv * pkt);
 /* send message with header */
 int ly_packet_send(int fd, int32_t type, void * msg, int32_t size);
 
+/*
+** LuoYun packet send queue
+**
+** packets are copied to the queue and written out later, all pending
+** packets at once, without blocking. what the socket can not take is
+** kept in queue until the socket is writable again.
+*/
+#define LUOYUN_PACKET_SEND_IOV_MAX 64
+
+typedef struct LYPacketChunk_t {
+    struct LYPacketChunk_t *next;
+    unsigned int size;                  /* header and data */
+    char data[];
+} LYPacketChunk;
+
+typedef struct LYPacketSendQueue_t {
+    LYPacketChunk *head;
+    LYPacketChunk *tail;
+    unsigned int sent;                  /* data of head chunk sent */
+    unsigned int bytes;                 /* data not sent yet */
+    unsigned int num;                   /* packets in queue */
+} LYPacketSendQueue;
+
+void ly_packet_queue_init(LYPacketSendQueue * q);
+/* add packet to send queue */
+int ly_packet_queue(LYPacketSendQueue * q, int32_t type, void * msg, int32_t size);
+/* return 0 if queue is empty, 1 if socket is full, negative on error */
+int ly_packet_queue_flush(LYPacketSendQueue * q, int fd);
+void ly_packet_queue_cleanup(LYPacketSendQueue * q);
+
 #endif
@@ -590,7 +590,7 @@ int lyutil_decompress_bzip2(const char *srcfile, const char *dstfile)
     bzerror = BZ_OK;
     while (bzerror == BZ_OK) {
         nBuf = BZ2_bzRead(&bzerror, b, buf, BZ_BUF_SIZE);
-        if (fwrite(buf, nBuf, 1, t) != nBuf) {
+        if (fwrite(buf, 1, nBuf, t) != nBuf) {
             char err[100];
             logerror(_("writing %s failed. error: %d, %s\n"),
                         dstfile, errno, strerror_r(errno, err, 100));
@@ -622,7 +622,7 @@ int lyutil_decompress_gz(const char *srcfile, const char *dstfile)
         return -1;
     }
     FILE *out = fopen(dstfile, "wb");
-    if (!in) {
+    if (!out) {
         logerror(_("open %s failed.\n"), dstfile);
         gzclose(in);
         return -1;
@@ -649,6 +649,21 @@ out:
 }
 
 
+/* compare md5 signature with checksum string */
+static int __checksum_match(unsigned char *signature, const char *checksum)
+{
+    int j;
+    char t[3];
+    t[2] = 0;
+    for (j=0; j<16; j++) {
+        t[0] = checksum[j<<1];
+        t[1] = checksum[(j<<1)+1];
+        if (signature[j] != (unsigned char)strtol(t, NULL, 16))
+            return 1;
+    }
+    return 0;
+}
+
 /* file checksum checking */
 int lyutil_checksum(char *filename, char *checksum)
 {
@@ -677,14 +692,330 @@ int lyutil_checksum(char *filename, char *checksum)
 
     fclose(in);
     MD5Final(signature, &md5c);
+    return __checksum_match(signature, checksum);
+}
 
-    char t[3];
-    t[2] = 0;
-    for (j=0; j<16; j++) {
-        t[0] = checksum[j<<1];
-        t[1] = checksum[(j<<1)+1];
-        if (signature[j] != (unsigned char)strtol(t, NULL, 16))
-            return 1;
+/*
+** streaming checksum and decompression
+*/
+#define LY_STREAM_BUF_SIZE (1 << 20)   /* decompressed data buffer */
+#define LY_STREAM_BUF_ALIGN 4096
+
+/* format of data, known from the first bytes */
+#define LY_STREAM_UNKNOWN 0
+#define LY_STREAM_GZ      1
+#define LY_STREAM_BZ2     2
+#define LY_STREAM_RAW     3     /* not compressed, passed through */
+
+struct LYStream_t {
+    int fd;                     /* data saved, -1 if not */
+    int dst_fd;                 /* data decompressed, -1 if not */
+    int md5;                    /* checksum data */
+    struct MD5Context md5c;
+    int fmt;                    /* LY_STREAM_xxx */
+    unsigned char magic[3];     /* first bytes, until format is known */
+    int magic_len;
+    z_stream z;
+    bz_stream bz;
+    int z_end;                  /* compressed stream ends */
+    unsigned char *buf;
+    unsigned int buf_len;
+};
+
+static int __write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            char err[100];
+            logerror(_("write error: %d, %s\n"),
+                        errno, strerror_r(errno, err, 100));
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+LYStream * lyutil_stream_open(const char *file, const char *dstfile)
+{
+    LYStream *s = malloc(sizeof(LYStream));
+    if (s == NULL)
+        return NULL;
+    bzero(s, sizeof(LYStream));
+    s->fd = -1;
+    s->dst_fd = -1;
+    s->md5 = 1;
+    MD5Init(&s->md5c);
+
+    if (file) {
+        s->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (s->fd < 0) {
+            logerror(_("open %s failed.\n"), file);
+            goto failed;
+        }
+    }
+    if (dstfile) {
+        /* decoder is set up when format is known */
+        if (posix_memalign((void **)&s->buf, LY_STREAM_BUF_ALIGN,
+                           LY_STREAM_BUF_SIZE))
+            goto failed;
+        s->dst_fd = open(dstfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (s->dst_fd < 0) {
+            logerror(_("open %s failed.\n"), dstfile);
+            goto failed;
+        }
+    }
+    return s;
+
+failed:
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->buf);
+    free(s);
+    return NULL;
+}
+
+static int __stream_inflate(LYStream *s, const void *data, size_t len)
+{
+    s->z.next_in = (Bytef *)data;
+    s->z.avail_in = len;
+    while (s->z.avail_in > 0) {
+        if (s->z_end) {
+            /* concatenated gz members, as gzread does */
+            if (inflateReset(&s->z) != Z_OK)
+                return -1;
+            s->z_end = 0;
+        }
+        s->z.next_out = s->buf + s->buf_len;
+        s->z.avail_out = LY_STREAM_BUF_SIZE - s->buf_len;
+        int ret = inflate(&s->z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            logerror(_("inflate error %d\n"), ret);
+            return -1;
+        }
+        s->buf_len = LY_STREAM_BUF_SIZE - s->z.avail_out;
+        if (ret == Z_STREAM_END)
+            s->z_end = 1;
+        if (s->buf_len == LY_STREAM_BUF_SIZE) {
+            if (__write_all(s->dst_fd, s->buf, s->buf_len) < 0)
+                return -1;
+            s->buf_len = 0;
+        }
+        else if (ret == Z_BUF_ERROR)
+            break;
+    }
+    return 0;
+}
+
+static int __stream_bunzip(LYStream *s, const void *data, size_t len)
+{
+    s->bz.next_in = (char *)data;
+    s->bz.avail_in = len;
+    while (s->bz.avail_in > 0) {
+        if (s->z_end) {
+            /* concatenated bzip2 streams, as pbzip2 writes */
+            BZ2_bzDecompressEnd(&s->bz);
+            char *next_in = s->bz.next_in;
+            unsigned int avail_in = s->bz.avail_in;
+            bzero(&s->bz, sizeof(bz_stream));
+            if (BZ2_bzDecompressInit(&s->bz, 0, 0) != BZ_OK)
+                return -1;
+            s->bz.next_in = next_in;
+            s->bz.avail_in = avail_in;
+            s->z_end = 0;
+        }
+        s->bz.next_out = (char *)s->buf + s->buf_len;
+        s->bz.avail_out = LY_STREAM_BUF_SIZE - s->buf_len;
+        int ret = BZ2_bzDecompress(&s->bz);
+        if (ret != BZ_OK && ret != BZ_STREAM_END) {
+            logerror(_("bunzip2 error %d\n"), ret);
+            return -1;
+        }
+        s->buf_len = LY_STREAM_BUF_SIZE - s->bz.avail_out;
+        if (ret == BZ_STREAM_END)
+            s->z_end = 1;
+        if (s->buf_len == LY_STREAM_BUF_SIZE) {
+            if (__write_all(s->dst_fd, s->buf, s->buf_len) < 0)
+                return -1;
+            s->buf_len = 0;
+        }
+    }
+    return 0;
+}
+
+static int __stream_copy(LYStream *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t n = LY_STREAM_BUF_SIZE - s->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(s->buf + s->buf_len, p, n);
+        s->buf_len += n;
+        p += n;
+        len -= n;
+        if (s->buf_len == LY_STREAM_BUF_SIZE) {
+            if (__write_all(s->dst_fd, s->buf, s->buf_len) < 0)
+                return -1;
+            s->buf_len = 0;
+        }
+    }
+    return 0;
+}
+
+static int __stream_decode(LYStream *s, const void *data, size_t len)
+{
+    if (s->fmt == LY_STREAM_GZ)
+        return __stream_inflate(s, data, len);
+    if (s->fmt == LY_STREAM_BZ2)
+        return __stream_bunzip(s, data, len);
+    return __stream_copy(s, data, len);
+}
+
+/* set up decoder by the first bytes, the way gzread passes through data */
+static int __stream_start(LYStream *s)
+{
+    unsigned char *m = s->magic;
+    if (s->magic_len >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+        if (inflateInit2(&s->z, 16 + MAX_WBITS) != Z_OK)
+            return -1;
+        s->fmt = LY_STREAM_GZ;
+    }
+    else if (s->magic_len == 3 && memcmp(m, "BZh", 3) == 0) {
+        if (BZ2_bzDecompressInit(&s->bz, 0, 0) != BZ_OK)
+            return -1;
+        s->fmt = LY_STREAM_BZ2;
+    }
+    else {
+        logdebug(_("data is not gz or bzip2, copied as it is\n"));
+        s->fmt = LY_STREAM_RAW;
+        s->z_end = 1;
+    }
+    return __stream_decode(s, s->magic, s->magic_len);
+}
+
+static int __stream_extract(LYStream *s, const void *data, size_t len)
+{
+    if (s->fmt == LY_STREAM_UNKNOWN) {
+        const unsigned char *p = data;
+        while (len > 0 && s->magic_len < sizeof(s->magic)) {
+            s->magic[s->magic_len++] = *p++;
+            len--;
+        }
+        if (s->magic_len < sizeof(s->magic))
+            return 0;
+        if (__stream_start(s) < 0)
+            return -1;
+        data = p;
+    }
+    return len ? __stream_decode(s, data, len) : 0;
+}
+
+int lyutil_stream_write(LYStream *s, const void *data, size_t len)
+{
+    if (s == NULL || data == NULL)
+        return -1;
+
+    if (s->md5)
+        MD5Update(&s->md5c, (unsigned char *)data, (unsigned)len);
+    if (s->fd >= 0 && __write_all(s->fd, data, len) < 0)
+        return -1;
+    if (s->dst_fd >= 0 && __stream_extract(s, data, len) < 0)
+        return -1;
+    return 0;
+}
+
+int lyutil_stream_close(LYStream *s, const char *checksum)
+{
+    if (s == NULL)
+        return -1;
+
+    int ret = 0;
+    if (s->fd >= 0 && close(s->fd) < 0)
+        ret = -1;
+    if (s->dst_fd >= 0) {
+        /* less data than magic */
+        if (s->fmt == LY_STREAM_UNKNOWN && __stream_start(s) < 0)
+            ret = -1;
+        if (s->buf_len && __write_all(s->dst_fd, s->buf, s->buf_len) < 0)
+            ret = -1;
+        if (!s->z_end) {
+            logerror(_("compressed data is truncated\n"));
+            ret = -1;
+        }
+        if (s->fmt == LY_STREAM_GZ)
+            inflateEnd(&s->z);
+        else if (s->fmt == LY_STREAM_BZ2)
+            BZ2_bzDecompressEnd(&s->bz);
+        if (close(s->dst_fd) < 0)
+            ret = -1;
+    }
+
+    unsigned char signature[16];
+    MD5Final(signature, &s->md5c);
+    if (ret == 0 && checksum && s->md5) {
+        if (strlen(checksum) != 32) {
+            logerror("checksum(%s) is %d long, probably not md5?\n",
+                      checksum, 32);
+            ret = -1;
+        }
+        else
+            ret = __checksum_match(signature, checksum);
+    }
+
+    free(s->buf);
+    free(s);
+    return ret;
+}
+
+/*
+** checksum and decompress gz or bzip2 file in one pass, other data is
+** copied as it is. checksum is skipped if NULL, so is decompressing if
+** dstfile is NULL
+*/
+int lyutil_checksum_decompress_gz(const char *srcfile, const char *checksum,
+                                  const char *dstfile)
+{
+    int fd = open(srcfile, O_RDONLY);
+    if (fd < 0) {
+        logerror(_("open %s failed.\n"), srcfile);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    LYStream *s = lyutil_stream_open(NULL, dstfile);
+    void *buf = malloc(LY_STREAM_BUF_SIZE);
+    if (s == NULL || buf == NULL) {
+        close(fd);
+        free(buf);
+        lyutil_stream_close(s, NULL);
+        return -1;
+    }
+    if (checksum == NULL)
+        s->md5 = 0;
+
+    int ret = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, LY_STREAM_BUF_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || lyutil_stream_write(s, buf, n) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    close(fd);
+    free(buf);
+
+    if (lyutil_stream_close(s, checksum) != 0 || ret < 0) {
+        if (dstfile)
+            unlink(dstfile);
+        return ret < 0 ? -1 : 1;
     }
     return 0;
 }
@@ -50,6 +50,26 @@ int lyutil_decompress_gz(const char *srcfile, const char *dstfile);
 /* file checksum checking */
 int lyutil_checksum(char *filename, char *checksum);
 
+/*
+** data stream saved to file, checksumed and decompressed on the fly,
+** so data is read only once. gz and bzip2 data are detected by their
+** header, other data is copied into dstfile as it is, like gzread does.
+** file and dstfile are optional.
+** lyutil_stream_close returns 1 if checksum doesn't match.
+*/
+typedef struct LYStream_t LYStream;
+LYStream * lyutil_stream_open(const char *file, const char *dstfile);
+int lyutil_stream_write(LYStream *s, const void *data, size_t len);
+int lyutil_stream_close(LYStream *s, const char *checksum);
+
+/*
+** checksum and decompress gz or bzip2 file in one pass, other data is
+** copied as it is. checksum is skipped if NULL, so is decompressing if
+** dstfile is NULL
+*/
+int lyutil_checksum_decompress_gz(const char *srcfile, const char *checksum,
+                                  const char *dstfile);
+
 /* generate uuid string */
 #define LUOYUN_UUID_STR_LEN 40
 char *lyutil_uuid(char * in, int in_len);
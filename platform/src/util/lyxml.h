@@ -1,6 +1,7 @@
 #ifndef __LUOYUN_INCLUDE_util_lyxml_H
 #define __LUOYUN_INCLUDE_util_lyxml_H
 
+#include <stddef.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/encoding.h>
@@ -44,6 +45,87 @@ int lyxml_init(void);
 void lyxml_cleanup(void);
 int lyxml_process(char * xml, int (* req_func)(), int (* resp_func)(), int data);
 
+/*
+** decoding xml packet data in one pass, without dom. paths of elements
+** and attributes are relative to root, eg. request/parameters/instance
+** and request/parameters/instance@id. text is kept for elements without
+** child elements, NULL if empty. strings are sliced from one arena of
+** the message, valid until lyxml_msg_free. NULL is returned if xml is
+** not well formed, or not for LYXML_ROOT.
+*/
+typedef struct LYXmlMsg_t LYXmlMsg;
+LYXmlMsg * lyxml_msg_parse(const char * xml, int len);
+void lyxml_msg_free(LYXmlMsg * msg);
+int lyxml_msg_exist(LYXmlMsg * msg, const char * path);
+char * lyxml_msg_text(LYXmlMsg * msg, const char * path);
+
+/*
+** struct fields filled from message, table driven. int fields are
+** converted with atoi, string fields point to arena of message, flag
+** is or'ed to int field if the element exists. fields not found are
+** not changed.
+*/
+#define LYXML_FIELD_INT  0
+#define LYXML_FIELD_STR  1
+#define LYXML_FIELD_FLAG 2
+typedef struct LYXmlField_t {
+    const char * path;
+    int type;
+    int required;
+    int flag;
+    size_t offset;
+} LYXmlField;
+
+#define LYXML_INT(path, type, member, required) \
+    { path, LYXML_FIELD_INT, required, 0, offsetof(type, member) }
+#define LYXML_STR(path, type, member, required) \
+    { path, LYXML_FIELD_STR, required, 0, offsetof(type, member) }
+#define LYXML_FLAG(path, type, member, flag) \
+    { path, LYXML_FIELD_FLAG, 0, flag, offsetof(type, member) }
+#define LYXML_FIELD_NUM(fields) ((int)(sizeof(fields) / sizeof(LYXmlField)))
+
+/* return -1 if any required field is not found */
+int lyxml_msg_decode(LYXmlMsg * msg, const LYXmlField * fields, int num,
+                     void * data);
+
+/*
+** binary message, used instead of xml if agreed with peer during
+** authentication, see AuthProto. it starts with LYXML_BIN_MAGIC and
+** version, followed by elements and attributes as they would be in
+** xml, each as hash of its path, type and value. int value takes 4
+** bytes, string value 4 bytes of length and the string, element with
+** child elements has no value. numbers are in network byte order.
+** lyxml_msg_parse takes either xml or binary message.
+*/
+#define LYXML_BIN_MAGIC "LYB"
+#define LYXML_BIN_VERSION 1
+#define LYXML_BIN_ELEM 0
+#define LYXML_BIN_INT  1
+#define LYXML_BIN_UINT 2
+#define LYXML_BIN_STR  3
+
+/* FNV-1a hash of path */
+#define LYXML_HASH_INIT 2166136261U
+#define LYXML_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619U)
+unsigned int lyxml_msg_hash(const char * path, int len);
+
+/*
+** building packet data in wire format of proto, LUOYUN_PROTO_*.
+** length of data is returned in len, data should be freed by caller.
+*/
+char * lyxml_msg_node_register(int proto, NodeInfo * ni, int * len);
+char * lyxml_msg_node_info(int proto, int req_id, int * len);
+char * lyxml_msg_reply_auth_info(int proto, LYReply * reply, int * len);
+char * lyxml_msg_instance_run(int proto, NodeCtrlInstance * ci, int * len);
+char * lyxml_msg_instance_other(int proto, NodeCtrlInstance * ci, int * len);
+char * lyxml_msg_appliance_prefetch(int proto, NodeCtrlInstance * ci, int * len);
+char * lyxml_msg_reply(int proto, LYReply * reply, int * len);
+char * lyxml_msg_reply_instance_info(int proto, LYReply * reply, int * len);
+char * lyxml_msg_reply_node_info(int proto, LYReply * reply, int * len);
+char * lyxml_msg_report(int proto, LYReport * r, int * len);
+char * lyxml_msg_report_node_info(int proto, LYReport * r, int * len);
+char * lyxml_msg_report_instance_info(int proto, LYReport * r, int * len);
+
 /*
 ** building xml packet data
 */
@@ -55,6 +137,7 @@ char * lyxml_data_reply_auth_info(LYReply * reply, char * buf, unsigned int size
 char * lyxml_data_instance_run(NodeCtrlInstance * ci, char * buf, unsigned int size);
 char * lyxml_data_instance_stop(NodeCtrlInstance * ci, char * buf, unsigned int size);
 char * lyxml_data_instance_other(NodeCtrlInstance * ci, char * buf, unsigned int size);
+char * lyxml_data_appliance_prefetch(NodeCtrlInstance * ci, char * buf, unsigned int size);
 char * lyxml_data_instance_register(int id, char * hostname, char * ip,
                                     char * buf, unsigned int size);
 char * lyxml_data_reply(LYReply * reply, char * buf, unsigned int size);
@@ -62,5 +145,6 @@ char * lyxml_data_reply_instance_info(LYReply * reply, char * buf, unsigned int
 char * lyxml_data_reply_node_info(LYReply * reply, char * buf, unsigned int size);
 char * lyxml_data_report(LYReport * r, char * buf, unsigned int size);
 char * lyxml_data_report_node_info(LYReport * r, char * buf, unsigned int size);
+char * lyxml_data_report_instance_info(LYReport * r, char * buf, unsigned int size);
 
 #endif
@@ -0,0 +1,434 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lyxml.h"
+
+#define LYXML_BIN_SIZE 512
+#define LYXML_BIN_ELEM_MAX 16
+
+/* binary message being built */
+typedef struct LYXmlBin_t {
+    char * buf;
+    int len;
+    int size;
+    int error;
+    /* hash of elements with child elements written */
+    unsigned int elem[LYXML_BIN_ELEM_MAX];
+    int elem_num;
+} LYXmlBin;
+
+static void __bin_put(LYXmlBin * b, const void * data, int len)
+{
+    if (b->error)
+        return;
+    if (b->len + len > b->size) {
+        int size = b->size * 2;
+        while (b->len + len > size)
+            size *= 2;
+        char * buf = realloc(b->buf, size);
+        if (buf == NULL) {
+            b->error = 1;
+            return;
+        }
+        b->buf = buf;
+        b->size = size;
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+static void __bin_u32(LYXmlBin * b, unsigned int v)
+{
+    unsigned char p[4] = { v >> 24, v >> 16, v >> 8, v };
+    __bin_put(b, p, 4);
+}
+
+static void __bin_tag(LYXmlBin * b, unsigned int hash, int type)
+{
+    unsigned char t = type;
+    __bin_u32(b, hash);
+    __bin_put(b, &t, 1);
+}
+
+/*
+** tag of path, hashed in one pass. elements containing path are
+** written before it, once.
+*/
+static void __bin_path(LYXmlBin * b, const char * path, int type)
+{
+    unsigned int h = LYXML_HASH_INIT;
+    const char * p;
+    for (p = path; *p; h = LYXML_HASH_STEP(h, *p), p++) {
+        if (*p != '/' && *p != '@')
+            continue;
+        int i;
+        for (i = 0; i < b->elem_num; i++)
+            if (b->elem[i] == h)
+                break;
+        if (i < b->elem_num)
+            continue;
+        if (b->elem_num < LYXML_BIN_ELEM_MAX)
+            b->elem[b->elem_num++] = h;
+        __bin_tag(b, h, LYXML_BIN_ELEM);
+    }
+    __bin_tag(b, h, type);
+}
+
+static void __bin_elem(LYXmlBin * b, const char * path)
+{
+    __bin_path(b, path, LYXML_BIN_ELEM);
+}
+
+static void __bin_int(LYXmlBin * b, const char * path, int v)
+{
+    __bin_path(b, path, LYXML_BIN_INT);
+    __bin_u32(b, v);
+}
+
+static void __bin_uint(LYXmlBin * b, const char * path, unsigned int v)
+{
+    __bin_path(b, path, LYXML_BIN_UINT);
+    __bin_u32(b, v);
+}
+
+/* NULL is written as empty string, as in xml */
+static void __bin_str(LYXmlBin * b, const char * path, const char * v)
+{
+    int len = v ? strlen(v) : 0;
+    __bin_path(b, path, LYXML_BIN_STR);
+    __bin_u32(b, len);
+    if (len)
+        __bin_put(b, v, len);
+}
+
+static int __bin_init(LYXmlBin * b, int from, int to)
+{
+    bzero(b, sizeof(LYXmlBin));
+    b->size = LYXML_BIN_SIZE;
+    b->buf = malloc(b->size);
+    if (b->buf == NULL)
+        return -1;
+    memcpy(b->buf, LYXML_BIN_MAGIC, 3);
+    b->buf[3] = LYXML_BIN_VERSION;
+    b->len = 4;
+    __bin_int(b, "from@entity", from);
+    __bin_int(b, "to@entity", to);
+    return 0;
+}
+
+static char * __bin_done(LYXmlBin * b, int * len)
+{
+    if (b->error) {
+        free(b->buf);
+        return NULL;
+    }
+    *len = b->len;
+    return b->buf;
+}
+
+/* xml data built by lyxml_data functions */
+static char * __xml_done(char * xml, int * len)
+{
+    if (xml)
+        *len = strlen(xml);
+    return xml;
+}
+
+/* node resource under path, a string literal, so paths are literals too */
+#define __BIN_RESOURCE(b, path, ni) do { \
+    __bin_uint(b, path "/cpu/commit", (ni)->cpu_commit); \
+    __bin_uint(b, path "/memory/free", (ni)->mem_free); \
+    __bin_uint(b, path "/memory/commit", (ni)->mem_commit); \
+    __bin_uint(b, path "/storage/free", (ni)->storage_free); \
+    __bin_uint(b, path "/load/average", (ni)->load_average); \
+    __bin_uint(b, path "/appcache/hit", (ni)->app_cache_hit); \
+    __bin_uint(b, path "/appcache/miss", (ni)->app_cache_miss); \
+    __bin_uint(b, path "/numa/free", (ni)->numa_mem_free); \
+} while (0)
+
+char * lyxml_msg_node_register(int proto, NodeInfo * ni, int * len)
+{
+    if (ni == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_node_register(ni, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, LY_ENTITY_NODE, LY_ENTITY_CLC) < 0)
+        return NULL;
+    __bin_int(&b, "request@id", lynode_new_request_id());
+    __bin_int(&b, "request@action", LY_A_CLC_REGISTER_NODE);
+    __bin_str(&b, "request/reply@required", "yes");
+    __bin_elem(&b, "request/reply/result");
+    __bin_uint(&b, "request/parameters/status", ni->status);
+    __bin_uint(&b, "request/parameters/hypervisor", ni->hypervisor);
+    __bin_int(&b, "request/parameters/host/tag", ni->host_tag);
+    __bin_str(&b, "request/parameters/host/name", ni->host_name);
+    __bin_str(&b, "request/parameters/host/ip", ni->host_ip);
+    __bin_uint(&b, "request/parameters/memory/total", ni->mem_max);
+    __bin_uint(&b, "request/parameters/memory/free", ni->mem_free);
+    __bin_uint(&b, "request/parameters/memory/commit", ni->mem_commit);
+    __bin_uint(&b, "request/parameters/cpu/arch", ni->cpu_arch);
+    __bin_str(&b, "request/parameters/cpu/model", ni->cpu_model);
+    __bin_uint(&b, "request/parameters/cpu/mhz", ni->cpu_mhz);
+    __bin_uint(&b, "request/parameters/cpu/max", ni->cpu_max);
+    __bin_uint(&b, "request/parameters/cpu/commit", ni->cpu_commit);
+    __bin_uint(&b, "request/parameters/storage/total", ni->storage_total);
+    __bin_uint(&b, "request/parameters/storage/free", ni->storage_free);
+    __bin_uint(&b, "request/parameters/load/average", ni->load_average);
+    __bin_uint(&b, "request/parameters/numa/cells", ni->numa_cells);
+    __bin_uint(&b, "request/parameters/numa/cpus", ni->numa_cell_cpus);
+    __bin_uint(&b, "request/parameters/numa/free", ni->numa_mem_free);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_node_info(int proto, int req_id, int * len)
+{
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_node_info(req_id, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, LY_ENTITY_CLC, LY_ENTITY_NODE) < 0)
+        return NULL;
+    __bin_int(&b, "request@id", req_id);
+    __bin_int(&b, "request@action", LY_A_NODE_QUERY);
+    __bin_str(&b, "request/reply@required", "yes");
+    __bin_elem(&b, "request/reply/result");
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_reply_auth_info(int proto, LYReply * reply, int * len)
+{
+    if (reply == NULL || reply->data == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_reply_auth_info(reply, NULL, 0), len);
+
+    AuthInfo * ai = reply->data;
+    LYXmlBin b;
+    if (__bin_init(&b, reply->from, reply->to) < 0)
+        return NULL;
+    __bin_int(&b, "response@id", reply->req_id);
+    __bin_int(&b, "response@status", reply->status);
+    __bin_int(&b, "response/data/tag", ai->tag);
+    /* data is not NUL terminated if it's full */
+    char secret[LUOYUN_AUTH_DATA_LEN + 1];
+    strncpy(secret, (char *)ai->data, LUOYUN_AUTH_DATA_LEN);
+    secret[LUOYUN_AUTH_DATA_LEN] = '\0';
+    __bin_str(&b, "response/data/secret", secret);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_instance_run(int proto, NodeCtrlInstance * ci, int * len)
+{
+    if (ci == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_instance_run(ci, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, LY_ENTITY_CLC, LY_ENTITY_NODE) < 0)
+        return NULL;
+    __bin_int(&b, "request@id", ci->req_id);
+    __bin_int(&b, "request@action", ci->req_action);
+    __bin_str(&b, "request/reply@required", "yes");
+    __bin_elem(&b, "request/reply/status");
+    __bin_elem(&b, "request/reply/result");
+    __bin_int(&b, "request/parameters/instance@id", ci->ins_id);
+    __bin_int(&b, "request/parameters/instance@status", ci->ins_status);
+    __bin_str(&b, "request/parameters/instance/name", ci->ins_name);
+    __bin_int(&b, "request/parameters/instance/vcpu", ci->ins_vcpu);
+    __bin_int(&b, "request/parameters/instance/memory", ci->ins_mem);
+    __bin_int(&b, "request/parameters/instance/extsize", ci->ins_extsize);
+    __bin_str(&b, "request/parameters/instance/mac", ci->ins_mac);
+    __bin_str(&b, "request/parameters/instance/ip", ci->ins_ip);
+    __bin_str(&b, "request/parameters/instance/domain", ci->ins_domain);
+    __bin_str(&b, "request/parameters/instance/domxml", ci->ins_json);
+    __bin_int(&b, "request/parameters/appliance@id", ci->app_id);
+    __bin_str(&b, "request/parameters/appliance/name", ci->app_name);
+    __bin_str(&b, "request/parameters/appliance/uri", ci->app_uri);
+    __bin_str(&b, "request/parameters/appliance/checksum", ci->app_checksum);
+    __bin_str(&b, "request/parameters/osmanager/clc/ip", ci->osm_clcip);
+    __bin_int(&b, "request/parameters/osmanager/clc/port", ci->osm_clcport);
+    __bin_int(&b, "request/parameters/osmanager/tag", ci->osm_tag);
+    __bin_str(&b, "request/parameters/osmanager/secret", ci->osm_secret);
+    __bin_str(&b, "request/parameters/osmanager/json", ci->osm_json);
+    __bin_str(&b, "request/parameters/storage/ip", ci->storage_ip);
+    __bin_int(&b, "request/parameters/storage/method", ci->storage_method);
+    __bin_str(&b, "request/parameters/storage/parm", ci->storage_parm);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_instance_other(int proto, NodeCtrlInstance * ci, int * len)
+{
+    if (ci == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_instance_other(ci, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, LY_ENTITY_CLC, LY_ENTITY_NODE) < 0)
+        return NULL;
+    __bin_int(&b, "request@id", ci->req_id);
+    __bin_int(&b, "request@action", ci->req_action);
+    __bin_str(&b, "request/reply@required", "yes");
+    __bin_elem(&b, "request/reply/result");
+    __bin_int(&b, "request/parameters/instance@id", ci->ins_id);
+    __bin_str(&b, "request/parameters/instance/domain", ci->ins_domain);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_appliance_prefetch(int proto, NodeCtrlInstance * ci, int * len)
+{
+    if (ci == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_appliance_prefetch(ci, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, LY_ENTITY_CLC, LY_ENTITY_NODE) < 0)
+        return NULL;
+    __bin_int(&b, "request@id", ci->req_id);
+    __bin_int(&b, "request@action", LY_A_NODE_PREFETCH_APPLIANCE);
+    __bin_str(&b, "request/reply@required", "no");
+    __bin_int(&b, "request/parameters/appliance@id", ci->app_id);
+    __bin_str(&b, "request/parameters/appliance/name", ci->app_name);
+    __bin_str(&b, "request/parameters/appliance/uri", ci->app_uri);
+    __bin_str(&b, "request/parameters/appliance/checksum", ci->app_checksum);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_reply(int proto, LYReply * reply, int * len)
+{
+    if (reply == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_reply(reply, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, reply->from, reply->to) < 0)
+        return NULL;
+    __bin_int(&b, "response@id", reply->req_id);
+    __bin_int(&b, "response@status", reply->status);
+    __bin_int(&b, "response@elapsed", reply->elapsed);
+    __bin_str(&b, "response/result", reply->msg);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_reply_instance_info(int proto, LYReply * reply, int * len)
+{
+    if (reply == NULL || reply->data == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_reply_instance_info(reply, NULL, 0), len);
+
+    InstanceInfo * ii = reply->data;
+    char netstat[96];
+    snprintf(netstat, sizeof(netstat), "%ld %ld %ld %ld",
+             ii->netstat[0].rx_bytes, ii->netstat[0].rx_pkts,
+             ii->netstat[0].tx_bytes, ii->netstat[0].tx_pkts);
+
+    LYXmlBin b;
+    if (__bin_init(&b, reply->from, reply->to) < 0)
+        return NULL;
+    __bin_int(&b, "response@id", reply->req_id);
+    __bin_int(&b, "response@status", reply->status);
+    __bin_int(&b, "response/data@type", DATA_INSTANCE_INFO);
+    __bin_int(&b, "response/data/id", ii->id);
+    __bin_int(&b, "response/data/status", ii->status);
+    __bin_str(&b, "response/data/ip", ii->ip);
+    __bin_int(&b, "response/data/gport", ii->gport);
+    __bin_str(&b, "response/data/netstat0", netstat);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_reply_node_info(int proto, LYReply * reply, int * len)
+{
+    if (reply == NULL || reply->data == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_reply_node_info(reply, NULL, 0), len);
+
+    NodeInfo * ni = reply->data;
+    LYXmlBin b;
+    if (__bin_init(&b, reply->from, reply->to) < 0)
+        return NULL;
+    __bin_int(&b, "response@id", reply->req_id);
+    __bin_int(&b, "response@status", reply->status);
+    __bin_int(&b, "response/data@type", DATA_NODE_INFO);
+    __bin_uint(&b, "response/data/status", ni->status);
+    __BIN_RESOURCE(&b, "response/data", ni);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_report(int proto, LYReport * r, int * len)
+{
+    if (r == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_report(r, NULL, 0), len);
+
+    LYXmlBin b;
+    if (__bin_init(&b, r->from, r->to) < 0)
+        return NULL;
+    __bin_int(&b, "report/status", r->status);
+    __bin_str(&b, "report/message", r->msg);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_report_node_info(int proto, LYReport * r, int * len)
+{
+    if (r == NULL || r->data == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_report_node_info(r, NULL, 0), len);
+
+    NodeInfo * ni = r->data;
+    LYXmlBin b;
+    if (__bin_init(&b, r->from, r->to) < 0)
+        return NULL;
+    __BIN_RESOURCE(&b, "report/resource", ni);
+    return __bin_done(&b, len);
+}
+
+char * lyxml_msg_report_instance_info(int proto, LYReport * r, int * len)
+{
+    if (r == NULL || r->data == NULL)
+        return NULL;
+    if (!(proto & LUOYUN_PROTO_BIN))
+        return __xml_done(lyxml_data_report_instance_info(r, NULL, 0), len);
+
+    InstanceInfo * ii = r->data;
+    LYXmlBin b;
+    if (__bin_init(&b, r->from, r->to) < 0)
+        return NULL;
+    __bin_int(&b, "report/instance/id", ii->id);
+    __bin_int(&b, "report/instance/status", ii->status);
+    return __bin_done(&b, len);
+}
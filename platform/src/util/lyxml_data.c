@@ -157,6 +157,11 @@ char * lyxml_data_join(int id, char * host, int port,
       "<load>"\
         "<average>%d</average>"\
       "</load>"\
+      "<numa>"\
+        "<cells>%u</cells>"\
+        "<cpus>%u</cpus>"\
+        "<free>%u</free>"\
+      "</numa>"\
     "</parameters>"\
   "</request>"\
 "</" LYXML_ROOT ">"
@@ -183,7 +188,8 @@ char * lyxml_data_node_register(NodeInfo * ni, char * buf, unsigned int size)
                        ni->cpu_model ? (char *)(BAD_CAST ni->cpu_model) : "",
                        ni->cpu_mhz, ni->cpu_max, ni->cpu_commit,
                        ni->storage_total, ni->storage_free,
-                       ni->load_average);
+                       ni->load_average,
+                       ni->numa_cells, ni->numa_cell_cpus, ni->numa_mem_free);
     __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
 }
 
@@ -270,6 +276,13 @@ char * lyxml_data_node_info(int req_id, char * buf, unsigned int size)
       "<load>"\
         "<average>%d</average>"\
       "</load>"\
+      "<appcache>"\
+        "<hit>%u</hit>"\
+        "<miss>%u</miss>"\
+      "</appcache>"\
+      "<numa>"\
+        "<free>%u</free>"\
+      "</numa>"\
     "</data>"\
   "</response>"\
 "</" LYXML_ROOT ">"
@@ -291,7 +304,39 @@ char * lyxml_data_reply_node_info(LYReply * reply, char * buf, unsigned int size
                        ni->mem_free,
                        ni->mem_commit,
                        ni->storage_free,
-                       ni->load_average);
+                       ni->load_average,
+                       ni->app_cache_hit,
+                       ni->app_cache_miss,
+                       ni->numa_mem_free);
+    __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
+}
+
+/*
+** Instance state report xml template
+*/
+#define LUOYUN_XML_DATA_REPORT_INSTANCE_INFO \
+"<?xml version=\"1.0\" encoding=\"" LYXML_ENCODING "\"?>"\
+"<" LYXML_ROOT ">"\
+  "<from entity=\"%d\"/>"\
+  "<to entity=\"%d\"/>"\
+  "<report>"\
+    "<instance>"\
+      "<id>%d</id>"\
+      "<status>%d</status>"\
+    "</instance>"\
+  "</report>"\
+"</" LYXML_ROOT ">"
+
+char * lyxml_data_report_instance_info(LYReport * r, char * buf, unsigned int size)
+{
+    if (r == NULL || r->data == NULL)
+        return NULL;
+
+    int caller_buf_flag = 1;
+    __LUOYUN_XML_DATA_PREPARE(caller_buf_flag, buf, size)
+    InstanceInfo * ii = r->data;
+    int len = snprintf(buf, size, LUOYUN_XML_DATA_REPORT_INSTANCE_INFO,
+                       r->from, r->to, ii->id, ii->status);
     __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
 }
 
@@ -389,6 +434,43 @@ char * lyxml_data_instance_run(NodeCtrlInstance * ii, char * buf, unsigned int s
     __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
 }
 
+/*
+** appliance prefetch request xml template
+*/
+#define LUOYUN_XML_DATA_APPLIANCE_PREFETCH \
+"<?xml version=\"1.0\" encoding=\"" LYXML_ENCODING "\"?>"\
+"<" LYXML_ROOT ">"\
+  "<from entity=\"%d\"/>"\
+  "<to entity=\"%d\"/>"\
+  "<request id=\"%d\" action=\"%d\">"\
+    "<reply required=\"no\"/>"\
+    "<parameters>"\
+      "<appliance id=\"%d\">"\
+        "<name>%s</name>"\
+        "<uri>%s</uri>"\
+        "<checksum>%s</checksum>"\
+      "</appliance>"\
+    "</parameters>"\
+  "</request>"\
+"</" LYXML_ROOT ">"
+
+char * lyxml_data_appliance_prefetch(NodeCtrlInstance * ii, char * buf, unsigned int size)
+{
+    if (ii == NULL)
+        return NULL;
+
+    int caller_buf_flag = 1;
+    __LUOYUN_XML_DATA_PREPARE(caller_buf_flag, buf, size)
+    int len = snprintf(buf, size, LUOYUN_XML_DATA_APPLIANCE_PREFETCH,
+                       LY_ENTITY_CLC, 
+                       LY_ENTITY_NODE, 
+                       ii->req_id, LY_A_NODE_PREFETCH_APPLIANCE, ii->app_id,
+                       ii->app_name ? (char *)(BAD_CAST ii->app_name) : "",
+                       ii->app_uri ? (char *)(BAD_CAST ii->app_uri) : "",
+                       ii->app_checksum ? (char *)(BAD_CAST ii->app_checksum) : "");
+    __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
+}
+
 /*
 ** instance stop request xml template
 */
@@ -500,7 +582,7 @@ char * lyxml_data_instance_register(int id, char * hostname, char * ip,
 "<" LYXML_ROOT ">"\
   "<from entity=\"%d\"/>"\
   "<to entity=\"%d\"/>"\
-  "<response id=\"%d\" status=\"%d\">"\
+  "<response id=\"%d\" status=\"%d\" elapsed=\"%d\">"\
     "<result>%s</result>"\
   "</response>"\
 "</" LYXML_ROOT ">"
@@ -514,7 +596,7 @@ char * lyxml_data_reply(LYReply * reply, char * buf, unsigned int size)
     __LUOYUN_XML_DATA_PREPARE(caller_buf_flag, buf, size)
     int len = snprintf(buf, size, LUOYUN_XML_DATA_REPLY,
                        reply->from, reply->to, reply->req_id,
-                       reply->status,
+                       reply->status, reply->elapsed,
                        reply->msg ? (char *)(BAD_CAST reply->msg) : "");
     __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
 }
@@ -609,6 +691,13 @@ char * lyxml_data_report(LYReport * r, char * buf, unsigned int size)
       "<load>"\
         "<average>%d</average>"\
       "</load>"\
+      "<appcache>"\
+        "<hit>%u</hit>"\
+        "<miss>%u</miss>"\
+      "</appcache>"\
+      "<numa>"\
+        "<free>%u</free>"\
+      "</numa>"\
     "</resource>"\
   "</report>"\
 "</" LYXML_ROOT ">"
@@ -627,7 +716,10 @@ char * lyxml_data_report_node_info(LYReport * r, char * buf, unsigned int size)
                        ni->mem_free,
                        ni->mem_commit,
                        ni->storage_free,
-                       ni->load_average);
+                       ni->load_average,
+                       ni->app_cache_hit,
+                       ni->app_cache_miss,
+                       ni->numa_mem_free);
     __LUOYUN_XML_DATA_RETURN(caller_buf_flag, buf, size, len)
 }
 
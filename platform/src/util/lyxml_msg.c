@@ -0,0 +1,371 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+#include "lyxml.h"
+
+#define LYXML_MSG_DEPTH 16
+#define LYXML_MSG_PATH_LEN 256
+
+/* element or attribute, strings are offsets in arena while parsing */
+typedef struct LYXmlEntry_t {
+    unsigned int hash;
+    int path;                   /* -1 in binary message, hash only */
+    int value;                  /* -1 if no text */
+} LYXmlEntry;
+
+struct LYXmlMsg_t {
+    char * arena;
+    int arena_len;
+    int arena_size;
+    LYXmlEntry * entries;
+    int num;
+    int size;
+    /* parsing state */
+    int error;
+    int depth;
+    int path_len[LYXML_MSG_DEPTH + 1];
+    char path[LYXML_MSG_PATH_LEN];
+    int text;                   /* entry of element text goes to, -1 if none */
+    int text_start;
+};
+
+unsigned int lyxml_msg_hash(const char * path, int len)
+{
+    unsigned int h = LYXML_HASH_INIT;
+    int i;
+    for (i = 0; i < len; i++)
+        h = LYXML_HASH_STEP(h, path[i]);
+    return h;
+}
+
+/* append to arena, return offset */
+static int __arena_add(LYXmlMsg * m, const char * s, int len, int nul)
+{
+    if (m->arena_len + len + 1 > m->arena_size) {
+        int size = m->arena_size * 2;
+        while (m->arena_len + len + 1 > size)
+            size *= 2;
+        char * arena = realloc(m->arena, size);
+        if (arena == NULL) {
+            m->error = 1;
+            return -1;
+        }
+        m->arena = arena;
+        m->arena_size = size;
+    }
+    int off = m->arena_len;
+    memcpy(m->arena + off, s, len);
+    m->arena_len += len;
+    if (nul)
+        m->arena[m->arena_len++] = '\0';
+    return off;
+}
+
+static int __entry_new(LYXmlMsg * m, unsigned int hash, int path)
+{
+    if (m->num >= m->size) {
+        int size = m->size * 2;
+        LYXmlEntry * entries = realloc(m->entries, size * sizeof(LYXmlEntry));
+        if (entries == NULL) {
+            m->error = 1;
+            return -1;
+        }
+        m->entries = entries;
+        m->size = size;
+    }
+    LYXmlEntry * e = &m->entries[m->num];
+    e->hash = hash;
+    e->path = path;
+    e->value = -1;
+    return m->num++;
+}
+
+static int __entry_add(LYXmlMsg * m, const char * path, int len)
+{
+    int off = __arena_add(m, path, len, 1);
+    if (off < 0)
+        return -1;
+    return __entry_new(m, lyxml_msg_hash(path, len), off);
+}
+
+/* text collected is kept for elements without child elements only */
+static void __text_end(LYXmlMsg * m)
+{
+    if (m->text < 0)
+        return;
+    if (m->arena_len > m->text_start && __arena_add(m, "", 0, 1) >= 0)
+        m->entries[m->text].value = m->text_start;
+    m->text = -1;
+}
+
+static void __sax_start(void * ctx, const xmlChar * localname,
+                        const xmlChar * prefix, const xmlChar * URI,
+                        int nb_namespaces, const xmlChar ** namespaces,
+                        int nb_attributes, int nb_defaulted,
+                        const xmlChar ** attributes)
+{
+    LYXmlMsg * m = ctx;
+    if (m->error)
+        return;
+
+    /* text before child element is dropped */
+    if (m->text >= 0) {
+        m->arena_len = m->text_start;
+        m->text = -1;
+    }
+
+    int len = m->path_len[m->depth];
+    if (m->depth == 0) {
+        if (strcmp((const char *)localname, LYXML_ROOT) != 0) {
+            m->error = 1;
+            return;
+        }
+    }
+    else {
+        int n = snprintf(m->path + len, LYXML_MSG_PATH_LEN - len, "%s%s",
+                         len ? "/" : "", localname);
+        if (n >= LYXML_MSG_PATH_LEN - len || m->depth >= LYXML_MSG_DEPTH) {
+            m->error = 1;
+            return;
+        }
+        len += n;
+    }
+    m->depth++;
+    m->path_len[m->depth] = len;
+
+    int ent = __entry_add(m, m->path, len);
+    if (ent < 0)
+        return;
+
+    int i;
+    for (i = 0; i < nb_attributes; i++) {
+        const char * name = (const char *)attributes[i * 5];
+        const char * value = (const char *)attributes[i * 5 + 3];
+        const char * end = (const char *)attributes[i * 5 + 4];
+        int n = snprintf(m->path + len, LYXML_MSG_PATH_LEN - len, "@%s", name);
+        if (n >= LYXML_MSG_PATH_LEN - len) {
+            m->error = 1;
+            return;
+        }
+        int a = __entry_add(m, m->path, len + n);
+        if (a < 0)
+            return;
+        m->entries[a].value = __arena_add(m, value, end - value, 1);
+    }
+    m->path[len] = '\0';
+
+    m->text = ent;
+    m->text_start = m->arena_len;
+}
+
+static void __sax_end(void * ctx, const xmlChar * localname,
+                      const xmlChar * prefix, const xmlChar * URI)
+{
+    LYXmlMsg * m = ctx;
+    if (m->error)
+        return;
+    __text_end(m);
+    m->depth--;
+    m->path[m->path_len[m->depth]] = '\0';
+}
+
+static void __sax_text(void * ctx, const xmlChar * ch, int len)
+{
+    LYXmlMsg * m = ctx;
+    if (m->error == 0 && m->text >= 0)
+        __arena_add(m, (const char *)ch, len, 0);
+}
+
+static void __sax_error(void * ctx, xmlErrorPtr error)
+{
+    LYXmlMsg * m = ctx;
+    m->error = 1;
+}
+
+static unsigned int __bin_u32(const unsigned char * p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* binary message, see LYXML_BIN_MAGIC, values are kept as text */
+static int __bin_parse(LYXmlMsg * m, const unsigned char * p, int len)
+{
+    const unsigned char * end = p + len;
+    char num[16];
+    p += 4;
+    while (p < end) {
+        if (end - p < 5)
+            return -1;
+        int ent = __entry_new(m, __bin_u32(p), -1);
+        int type = p[4];
+        p += 5;
+        if (ent < 0)
+            return -1;
+        if (type == LYXML_BIN_ELEM)
+            continue;
+        if (end - p < 4)
+            return -1;
+        unsigned int v = __bin_u32(p);
+        p += 4;
+        int off = -1;
+        if (type == LYXML_BIN_INT || type == LYXML_BIN_UINT) {
+            int n = snprintf(num, sizeof(num),
+                             type == LYXML_BIN_INT ? "%d" : "%u", v);
+            off = __arena_add(m, num, n, 1);
+        }
+        else if (type == LYXML_BIN_STR) {
+            if (v > end - p)
+                return -1;
+            if (v > 0)
+                off = __arena_add(m, (const char *)p, v, 1);
+            p += v;
+        }
+        else
+            return -1;
+        if (m->error)
+            return -1;
+        m->entries[ent].value = off;
+    }
+    return 0;
+}
+
+LYXmlMsg * lyxml_msg_parse(const char * xml, int len)
+{
+    if (xml == NULL || len <= 0)
+        return NULL;
+
+    LYXmlMsg * m = calloc(1, sizeof(LYXmlMsg));
+    if (m == NULL)
+        return NULL;
+    /* enough for most packets, text may grow in utf-8 */
+    m->arena_size = len + (len >> 1) + 256;
+    m->arena = malloc(m->arena_size);
+    m->size = 64;
+    m->entries = malloc(m->size * sizeof(LYXmlEntry));
+    m->text = -1;
+    if (m->arena == NULL || m->entries == NULL)
+        goto failed;
+
+    if (len >= 4 && memcmp(xml, LYXML_BIN_MAGIC, 3) == 0) {
+        if (xml[3] != LYXML_BIN_VERSION ||
+            __bin_parse(m, (const unsigned char *)xml, len) < 0 ||
+            m->num == 0)
+            goto failed;
+        return m;
+    }
+
+    xmlSAXHandler sax;
+    bzero(&sax, sizeof(xmlSAXHandler));
+    sax.initialized = XML_SAX2_MAGIC;
+    sax.startElementNs = __sax_start;
+    sax.endElementNs = __sax_end;
+    sax.characters = __sax_text;
+    sax.cdataBlock = __sax_text;
+    sax.serror = (xmlStructuredErrorFunc)__sax_error;
+    if (xmlSAXUserParseMemory(&sax, m, xml, len) != 0 || m->error ||
+        m->num == 0)
+        goto failed;
+    return m;
+
+failed:
+    lyxml_msg_free(m);
+    return NULL;
+}
+
+void lyxml_msg_free(LYXmlMsg * m)
+{
+    if (m == NULL)
+        return;
+    if (m->arena)
+        free(m->arena);
+    if (m->entries)
+        free(m->entries);
+    free(m);
+}
+
+static LYXmlEntry * __msg_find(LYXmlMsg * m, const char * path)
+{
+    if (m == NULL || path == NULL)
+        return NULL;
+
+    unsigned int h = lyxml_msg_hash(path, strlen(path));
+    int i;
+    for (i = 0; i < m->num; i++) {
+        LYXmlEntry * e = &m->entries[i];
+        if (e->hash == h &&
+            (e->path < 0 || strcmp(m->arena + e->path, path) == 0))
+            return e;
+    }
+    return NULL;
+}
+
+int lyxml_msg_exist(LYXmlMsg * m, const char * path)
+{
+    return __msg_find(m, path) != NULL;
+}
+
+char * lyxml_msg_text(LYXmlMsg * m, const char * path)
+{
+    LYXmlEntry * e = __msg_find(m, path);
+    if (e == NULL || e->value < 0)
+        return NULL;
+    return m->arena + e->value;
+}
+
+int lyxml_msg_decode(LYXmlMsg * m, const LYXmlField * fields, int num,
+                     void * data)
+{
+    if (m == NULL || fields == NULL || data == NULL)
+        return -1;
+
+    int i, ret = 0;
+    for (i = 0; i < num; i++) {
+        const LYXmlField * f = &fields[i];
+        void * p = (char *)data + f->offset;
+        if (f->type == LYXML_FIELD_FLAG) {
+            if (lyxml_msg_exist(m, f->path))
+                *(int *)p |= f->flag;
+            continue;
+        }
+        char * str = lyxml_msg_text(m, f->path);
+        if (str == NULL) {
+            if (f->required) {
+                logdebug(_("%s not found in xml\n"), f->path);
+                ret = -1;
+            }
+            continue;
+        }
+        if (f->type == LYXML_FIELD_INT)
+            *(int *)p = atoi(str);
+        else
+            *(char **)p = str;
+    }
+    return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef __LY_INCLUDE_TEST_TEST_H
+#define __LY_INCLUDE_TEST_TEST_H
+
+/*
+** helpers shared by test programs. tests count errors, print timings
+** and end with test_result, exit status is 0 if no error found.
+*/
+
+#include <stdio.h>
+#include <time.h>
+
+/* monotonic time */
+static inline double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline double now_us(void)
+{
+    return now_ns() / 1e3;
+}
+
+static inline double now_ms(void)
+{
+    return now_ns() / 1e6;
+}
+
+/* print result of test, return exit status */
+static inline int test_result(const char * name, int err)
+{
+    if (err) {
+        printf("%d errors found\n", err);
+        return 1;
+    }
+    printf("%s test passed\n", name);
+    return 0;
+}
+
+#endif
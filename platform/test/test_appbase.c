@@ -0,0 +1,259 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** appliance base image test
+**
+** usage: test_appbase [image size in MB]
+**
+** an appliance base is committed, then instance disks are cloned from
+** it and compared with copying. qcow2 overlays are tested if qemu-img
+** is found. at last a new version of the appliance is committed, the
+** old base should go away with the last instance using it. disks in
+** domain templates from clc are switched to qcow2 driver as well.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "../src/util/logging.h"
+#include "../src/compute/appbase.h"
+#include "test.h"
+
+#define BLOCK_SIZE (64 * 1024)
+#define INS_NUM 5
+
+static char g_dir[] = "/tmp/test_appbase_XXXXXX";
+
+/* disk image alike, half of it is zero */
+static int make_image(const char * path, int size)
+{
+    FILE * fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    static char block[BLOCK_SIZE];
+    long long n;
+    srand(1);
+    for (n = 0; n < (long long)size << 20; n += BLOCK_SIZE) {
+        int i;
+        if (rand() % 2)
+            bzero(block, BLOCK_SIZE);
+        else
+            for (i = 0; i < BLOCK_SIZE; i++)
+                block[i] = rand();
+        if (fwrite(block, BLOCK_SIZE, 1, fp) != 1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    return fclose(fp);
+}
+
+static int same_file(const char * a, const char * b)
+{
+    FILE * fa = fopen(a, "r"), * fb = fopen(b, "r");
+    int ret = fa && fb;
+    while (ret) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb)
+            ret = 0;
+        if (ca == EOF || cb == EOF)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return ret;
+}
+
+static long long disk_usage(const char * path)
+{
+    struct stat st;
+    if (stat(path, &st))
+        return -1;
+    return (long long)st.st_blocks * 512;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 256;
+    if (size <= 0) {
+        printf("usage: %s [image size in MB]\n", argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    if (mkdtemp(g_dir) == NULL) {
+        printf("failed to create %s\n", g_dir);
+        return 1;
+    }
+
+    char app_dir[PATH_MAX], tmp[PATH_MAX], base[PATH_MAX], base2[PATH_MAX];
+    char ins_dir[PATH_MAX], disk[PATH_MAX], link[PATH_MAX];
+    snprintf(app_dir, PATH_MAX, "%s/12", g_dir);
+    snprintf(tmp, PATH_MAX, "%s/.base.tmp", app_dir);
+    mkdir(app_dir, 0755);
+    int err = 0, i;
+
+    /* first version of appliance */
+    if (make_image(tmp, size) < 0 ||
+        ly_appbase_path(app_dir, "0123456789abcdef0123456789abcdef",
+                        base, PATH_MAX) < 0 ||
+        ly_appbase_commit(app_dir, tmp, base) < 0 ||
+        access(base, F_OK)) {
+        printf("failed to create base\n");
+        return 1;
+    }
+
+    /* clone, compared with plain copy */
+    double t = now_ms();
+    snprintf(disk, PATH_MAX, "%s/copy.img", g_dir);
+    snprintf(tmp, PATH_MAX, "cp --sparse=never %s %s", base, disk);
+    if (system(tmp))
+        err++;
+    printf("copy    : %8.1f ms, %lld KB used\n", now_ms() - t,
+           disk_usage(disk) >> 10);
+    unlink(disk);
+
+    t = now_ms();
+    for (i = 1; i <= INS_NUM; i++) {
+        snprintf(disk, PATH_MAX, "%s/clone%d.img", g_dir, i);
+        if (ly_appbase_clone(base, disk) < 0)
+            err++;
+    }
+    snprintf(disk, PATH_MAX, "%s/clone1.img", g_dir);
+    printf("clone   : %8.1f ms, %lld KB used\n", (now_ms() - t) / INS_NUM,
+           disk_usage(disk) >> 10);
+    for (i = 1; i <= INS_NUM; i++) {
+        snprintf(disk, PATH_MAX, "%s/clone%d.img", g_dir, i);
+        if (!same_file(base, disk))
+            err++;
+        unlink(disk);
+    }
+
+    /* instances referencing base */
+    int qemu = system("qemu-img --help > /dev/null 2>&1") == 0;
+    for (i = 1; i <= INS_NUM; i++) {
+        snprintf(ins_dir, PATH_MAX, "%s/ins%d", g_dir, i);
+        snprintf(disk, PATH_MAX, "%s/os.img", ins_dir);
+        mkdir(ins_dir, 0755);
+        if (qemu) {
+            t = now_ms();
+            if (ly_appbase_overlay(base, disk, 0, ins_dir) < 0)
+                err++;
+            if (i == 1)
+                printf("qcow2   : %8.1f ms, %lld KB used\n", now_ms() - t,
+                       disk_usage(disk) >> 10);
+        }
+        else {
+            /* reference held the way overlay does */
+            snprintf(link, PATH_MAX, "%s/%s", ins_dir, LY_APPBASE_INS_LINK);
+            snprintf(tmp, PATH_MAX, "%s.ref", base);
+            FILE * fp = fopen(tmp, "w");
+            if (symlink(base, link) || fp == NULL)
+                err++;
+            else
+                fprintf(fp, "%d\n", i);
+            if (fp)
+                fclose(fp);
+        }
+        if (ly_appbase_ins_app(ins_dir) != 12 ||
+            ly_appbase_ins_base(ins_dir, tmp, PATH_MAX) < 0 ||
+            strcmp(tmp, base))
+            err++;
+    }
+    if (!qemu)
+        printf("qcow2   : qemu-img not found, skipped\n");
+
+    /* new version of appliance, old base is still in use */
+    snprintf(tmp, PATH_MAX, "%s/.base.tmp", app_dir);
+    if (make_image(tmp, 1) < 0 ||
+        ly_appbase_path(app_dir, "fedcba9876543210fedcba9876543210",
+                        base2, PATH_MAX) < 0 ||
+        ly_appbase_commit(app_dir, tmp, base2) < 0 ||
+        access(base2, F_OK) || access(base, F_OK))
+        err++;
+
+    for (i = 1; i <= INS_NUM; i++) {
+        snprintf(ins_dir, PATH_MAX, "%s/ins%d", g_dir, i);
+        if (ly_appbase_unref(ins_dir) < 0 || ly_appbase_ins_app(ins_dir) != -1)
+            err++;
+        /* removed with the last instance */
+        if ((access(base, F_OK) == 0) != (i < INS_NUM))
+            err++;
+        snprintf(disk, PATH_MAX, "%s/os.img", ins_dir);
+        unlink(disk);
+        rmdir(ins_dir);
+    }
+
+    /* current base is kept */
+    if (access(base2, F_OK))
+        err++;
+
+    /* qcow2 overlay described in domain template from clc */
+    const char * tmpl =
+        "<domain type='kvm'><devices>"
+        "<disk type='file' device='disk'>"
+        "<driver name='qemu' type='raw'/>"
+        "<source file='/ins/1/os.img'/><target dev='vda'/></disk>"
+        "<disk type='file' device='disk'>"
+        "<driver name='qemu' type='raw'/>"
+        "<source file='/ins/1/data.img'/><target dev='vdb'/></disk>"
+        "</devices></domain>";
+    char * xml = ly_appbase_xml_qcow2(tmpl, "/ins/1/os.img", 0);
+    /* only the os disk, data disk stays raw */
+    char * q = xml ? strstr(xml, "type=\"qcow2\"") : NULL;
+    char * r = xml ? strstr(xml, "type=\"raw\"") : NULL;
+    if (q == NULL || r == NULL || q > r || strstr(r, "qcow2") ||
+        strstr(q, "os.img") > r)
+        err++;
+    free(xml);
+
+    /* vm_xml_disk without driver */
+    xml = ly_appbase_xml_qcow2("<disk type='file' device='disk'>"
+                               "<source file='/ins/1/os.img'/>"
+                               "<target dev='hda'/></disk>",
+                               "/ins/1/os.img", 1);
+    if (xml == NULL || strncmp(xml, "<disk", 5) ||
+        strstr(xml, "<driver name=\"qemu\" type=\"qcow2\"/>") == NULL)
+        err++;
+    free(xml);
+
+    snprintf(tmp, PATH_MAX, "rm -rf %s", g_dir);
+    if (system(tmp))
+        err++;
+
+    return test_result("appliance base", err);
+}
@@ -0,0 +1,227 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** appliance cache test
+**
+** usage: test_appcache [appliance size in MB]
+**
+** appliances are put in a cache limited to a few of them, least
+** recently used ones should be removed, except those in use or with
+** base used by instances. checking verified checksum in index is
+** compared with checksuming the appliance file again.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/lyutil.h"
+#include "../src/util/md5.h"
+#include "../src/compute/appcache.h"
+#include "test.h"
+
+#define BLOCK_SIZE (64 * 1024)
+#define APP_NUM 5
+#define APP_FILE "app.img.gz"
+#define CHECKSUM_BAD "0123456789abcdef0123456789abcdef"
+
+static char g_dir[] = "/tmp/test_appcache_XXXXXX";
+
+static void app_file(int app_id, char * path)
+{
+    snprintf(path, PATH_MAX, "%s/%d/%s", g_dir, app_id,
+             APP_FILE);
+}
+
+static int app_exist(int app_id)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%d", g_dir, app_id);
+    return access(path, F_OK) == 0;
+}
+
+/* appliance dir with random data, last used at time t */
+static int make_app(int app_id, int size, time_t t)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%d", g_dir, app_id);
+    if (mkdir(path, 0755))
+        return -1;
+    app_file(app_id, path);
+    FILE * fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    static char block[BLOCK_SIZE];
+    long long n;
+    for (n = 0; n < (long long)size << 20; n += BLOCK_SIZE) {
+        int i;
+        for (i = 0; i < BLOCK_SIZE; i++)
+            block[i] = rand();
+        if (fwrite(block, BLOCK_SIZE, 1, fp) != 1) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    if (fclose(fp))
+        return -1;
+    struct utimbuf ut = { t, t };
+    snprintf(path, PATH_MAX, "%s/%d", g_dir, app_id);
+    return utime(path, &ut);
+}
+
+static int file_md5(const char * path, char * checksum)
+{
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    static unsigned char block[BLOCK_SIZE];
+    unsigned char signature[16];
+    struct MD5Context md5c;
+    size_t n;
+    MD5Init(&md5c);
+    while ((n = fread(block, 1, BLOCK_SIZE, fp)) > 0)
+        MD5Update(&md5c, block, n);
+    fclose(fp);
+    MD5Final(signature, &md5c);
+    for (n = 0; n < 16; n++)
+        sprintf(checksum + n * 2, "%02x", signature[n]);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 64;
+    if (size <= 0) {
+        printf("usage: %s [appliance size in MB]\n", argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+    srand(1);
+    if (mkdtemp(g_dir) == NULL) {
+        printf("can not create %s\n", g_dir);
+        return 1;
+    }
+
+    int i, err = 0;
+    char path[PATH_MAX], checksum[64];
+    long long app_size = (long long)size << 20;
+    time_t t = time(NULL) - 3600;
+    for (i = 1; i <= APP_NUM; i++) {
+        if (make_app(i, size, t + i) < 0) {
+            printf("can not create appliance %d\n", i);
+            return 1;
+        }
+    }
+    /* oldest appliance has base used by an instance */
+    snprintf(path, PATH_MAX, "%s/1/base-%s.img.ref", g_dir, CHECKSUM_BAD);
+    FILE * fp = fopen(path, "w");
+    if (fp == NULL)
+        return 1;
+    fprintf(fp, "1\n");
+    fclose(fp);
+    snprintf(path, PATH_MAX, "%s/1/base-%s.img", g_dir, CHECKSUM_BAD);
+    if (symlink(APP_FILE, path))
+        return 1;
+
+    /* room for 3 appliances and a half, 2 and 3 are evicted */
+    if (ly_appcache_init(g_dir, app_size * 7 / 2) < 0) {
+        printf("ly_appcache_init failed\n");
+        return 1;
+    }
+    if (!app_exist(1) || app_exist(2) || app_exist(3) ||
+        !app_exist(4) || !app_exist(5))
+        err++;
+
+    /* checksum verified */
+    app_file(4, path);
+    if (file_md5(path, checksum) < 0) {
+        printf("file_md5 failed\n");
+        return 1;
+    }
+    double t0 = now_ms();
+    int ret = lyutil_checksum_decompress_gz(path, checksum, NULL);
+    printf("checksum  : %8.1f ms\n", now_ms() - t0);
+    /* not gz, only checksum matters */
+    if (ret < 0)
+        err++;
+    if (ly_appcache_verified(4, path, checksum) ||
+        ly_appcache_add(4, path, checksum) < 0)
+        err++;
+    t0 = now_ms();
+    ret = ly_appcache_verified(4, path, checksum);
+    printf("verified  : %8.3f ms\n", now_ms() - t0);
+    if (!ret || ly_appcache_verified(4, path, CHECKSUM_BAD) ||
+        ly_appcache_verified(5, path, checksum))
+        err++;
+
+    /* 4 is in use, 5 is the least recently used */
+    if (ly_appcache_use(4) < 0 || ly_appcache_use(6) < 0 ||
+        make_app(6, size, time(NULL)) < 0 || ly_appcache_release(6) < 0)
+        err++;
+    if (!app_exist(1) || !app_exist(4) || app_exist(5) || !app_exist(6))
+        err++;
+    if (ly_appcache_release(4) < 0 || !app_exist(4))
+        err++;
+
+    /* index survives restart */
+    ly_appcache_cleanup();
+    if (ly_appcache_init(g_dir, app_size * 7 / 2) < 0 ||
+        !ly_appcache_verified(4, path, checksum))
+        err++;
+
+    /* file changed, checksum it again */
+    fp = fopen(path, "a");
+    if (fp == NULL || fputc(0, fp) == EOF)
+        err++;
+    if (fp)
+        fclose(fp);
+    if (ly_appcache_verified(4, path, checksum))
+        err++;
+
+    unsigned int hit, miss;
+    ly_appcache_count(1);
+    ly_appcache_count(0);
+    ly_appcache_count(1);
+    ly_appcache_stats(&hit, &miss);
+    if (hit != 2 || miss != 1)
+        err++;
+    ly_appcache_cleanup();
+
+    snprintf(path, PATH_MAX, "rm -rf %s", g_dir);
+    if (system(path))
+        err++;
+
+    return test_result("appliance cache", err);
+}
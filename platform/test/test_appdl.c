@@ -0,0 +1,374 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** appliance cold start benchmark
+**
+** usage: test_appdl [image size in MB [port [MB/s per connection]]]
+**
+** a local http server stands in for the web server, serving a gzip
+** compressed disk image. the image is then prepared for instance the
+** way it was done before, download, checksum and decompress, each in
+** its own pass, in one pass with lyutil_download_stream, and over
+** several connections with lyutil_download_parallel. connections can
+** be rate limited, as a single tcp connection over wan is.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <zlib.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/md5.h"
+#include "../src/util/lyutil.h"
+#include "../src/util/download.h"
+#include "test.h"
+
+#define IMG_FILE "test_appdl.img.gz"
+#define APP_FILE "test_appdl.app.gz"
+#define DISK_FILE "test_appdl.disk"
+#define BLOCK_SIZE (64 * 1024)
+
+/* disk image alike, zero blocks mixed with text blocks */
+static int make_image(long long size, char *checksum, unsigned char *disk_md5)
+{
+    gzFile gz = gzopen(IMG_FILE, "wb1");
+    if (gz == NULL)
+        return -1;
+
+    static char block[BLOCK_SIZE];
+    struct MD5Context md5c;
+    MD5Init(&md5c);
+    srand(1);
+    long long n;
+    for (n = 0; n < size; n += BLOCK_SIZE) {
+        int i;
+        if (rand() % 4 == 0)
+            bzero(block, BLOCK_SIZE);
+        else
+            for (i = 0; i < BLOCK_SIZE; i++)
+                block[i] = "luoyun cloud 0123456789\n"[rand() % 24];
+        MD5Update(&md5c, (unsigned char *)block, BLOCK_SIZE);
+        if (gzwrite(gz, block, BLOCK_SIZE) != BLOCK_SIZE) {
+            gzclose(gz);
+            return -1;
+        }
+    }
+    gzclose(gz);
+    MD5Final(disk_md5, &md5c);
+
+    /* checksum of compressed image, as kept by web server */
+    int fd = open(IMG_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    unsigned char sig[16];
+    int len;
+    MD5Init(&md5c);
+    while ((len = read(fd, block, BLOCK_SIZE)) > 0)
+        MD5Update(&md5c, (unsigned char *)block, len);
+    close(fd);
+    MD5Final(sig, &md5c);
+    for (len = 0; len < 16; len++)
+        sprintf(checksum + len * 2, "%02x", sig[len]);
+    return 0;
+}
+
+static int disk_check(unsigned char *disk_md5)
+{
+    int fd = open(DISK_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    static char block[BLOCK_SIZE];
+    unsigned char sig[16];
+    struct MD5Context md5c;
+    int len;
+    MD5Init(&md5c);
+    while ((len = read(fd, block, BLOCK_SIZE)) > 0)
+        MD5Update(&md5c, (unsigned char *)block, len);
+    close(fd);
+    MD5Final(sig, &md5c);
+    return memcmp(sig, disk_md5, 16) ? -1 : 0;
+}
+
+/* connection limited as over wan, in MB/s, 0: no limit */
+static int g_rate = 0;
+
+/* requests starting past offset kept in this file are cut short */
+#define FAIL_FILE "test_appdl.fail"
+
+static void http_send(int fd, int img, off_t off, off_t end)
+{
+    off_t cut = -1;
+    FILE *fp = fopen(FAIL_FILE, "r");
+    if (fp) {
+        long long n;
+        if (fscanf(fp, "%lld", &n) == 1 && off >= n)
+            cut = off + (1 << 20);
+        fclose(fp);
+    }
+    double t0 = now_ms();
+    long long sent = 0;
+    while (off < end) {
+        if (cut >= 0 && off >= cut)
+            return;
+        size_t len = end - off > BLOCK_SIZE ? BLOCK_SIZE : end - off;
+        ssize_t n = sendfile(fd, img, &off, len);
+        if (n <= 0)
+            return;
+        sent += n;
+        if (g_rate) {
+            double ahead = sent / (g_rate * 1048.576) - (now_ms() - t0);
+            if (ahead > 0)
+                usleep(ahead * 1000);
+        }
+    }
+}
+
+/*
+** minimal http/1.0 server, the image is sent for any request,
+** HEAD and single range requests are supported.
+*/
+static void http_serve(int sfd)
+{
+    signal(SIGCHLD, SIG_IGN);
+    while (1) {
+        int fd = accept(sfd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        if (fork()) {
+            close(fd);
+            continue;
+        }
+        close(sfd);
+        char buf[4096];
+        int len = read(fd, buf, sizeof(buf) - 1);
+        int img = open(IMG_FILE, O_RDONLY);
+        struct stat st;
+        if (len <= 0 || img < 0 || fstat(img, &st) < 0)
+            exit(1);
+        buf[len] = '\0';
+        int head = strncmp(buf, "HEAD ", 5) == 0;
+        long long start = 0, end = st.st_size - 1;
+        char *range = strcasestr(buf, "\r\nRange: bytes=");
+        if (range &&
+            sscanf(range, "\r\nRange: bytes=%lld-%lld", &start, &end) >= 1 &&
+            start <= end && end < st.st_size)
+            len = snprintf(buf, sizeof(buf),
+                           "HTTP/1.0 206 Partial Content\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Content-Range: bytes %lld-%lld/%lld\r\n"
+                           "Content-Length: %lld\r\n\r\n",
+                           start, end, (long long)st.st_size,
+                           end - start + 1);
+        else {
+            start = 0;
+            end = st.st_size - 1;
+            len = snprintf(buf, sizeof(buf),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: application/octet-stream\r\n"
+                           "Accept-Ranges: bytes\r\n"
+                           "Content-Length: %lld\r\n\r\n",
+                           (long long)st.st_size);
+        }
+        if (write(fd, buf, len) == len && !head)
+            http_send(fd, img, start, end + 1);
+        exit(0);
+    }
+}
+
+static void drop_caches(void)
+{
+    /* as cold as possible without root */
+    int fd = open(APP_FILE, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    fd = open(DISK_FILE, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    unlink(APP_FILE);
+    unlink(DISK_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 2048;
+    int port = argc > 2 ? atoi(argv[2]) : 18080;
+    g_rate = argc > 3 ? atoi(argv[3]) : 0;
+    if (size <= 0 || port <= 0 || g_rate < 0) {
+        printf("usage: %s [image size in MB [port [MB/s per connection]]]\n",
+               argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    char checksum[33];
+    unsigned char disk_md5[16];
+    printf("creating %d MB image ...\n", size);
+    if (make_image((long long)size << 20, checksum, disk_md5) < 0) {
+        printf("failed to create image\n");
+        return 1;
+    }
+
+    int sfd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sfd, 32) < 0) {
+        printf("failed to listen on port %d\n", port);
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        http_serve(sfd);
+        exit(0);
+    }
+    close(sfd);
+
+    char url[100];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/app.img.gz", port);
+    int err = 0;
+
+    /* download, checksum then decompress */
+    drop_caches();
+    double t0 = now_ms();
+    if (lyutil_download(url, APP_FILE) != 0)
+        err++;
+    double t1 = now_ms();
+    if (lyutil_checksum(APP_FILE, checksum) != 0)
+        err++;
+    double t2 = now_ms();
+    if (lyutil_decompress_gz(APP_FILE, DISK_FILE) != 0 ||
+        disk_check(disk_md5) != 0)
+        err++;
+    double t3 = now_ms();
+    printf("3 passes: %8.1f ms, download %.1f ms, checksum %.1f ms, "
+           "decompress %.1f ms\n", t3 - t0, t1 - t0, t2 - t1, t3 - t2);
+
+    /* all in one pass */
+    drop_caches();
+    t0 = now_ms();
+    if (lyutil_download_stream(url, APP_FILE, checksum, DISK_FILE) != 0)
+        err++;
+    t1 = now_ms();
+    if (disk_check(disk_md5) != 0)
+        err++;
+    printf("1 pass  : %8.1f ms\n", t1 - t0);
+
+    /* all in one pass, over several connections */
+    int conns;
+    for (conns = 2; conns <= 8; conns *= 2) {
+        drop_caches();
+        t0 = now_ms();
+        if (lyutil_download_parallel(url, APP_FILE, checksum, DISK_FILE,
+                                     conns) != 0)
+            err++;
+        t1 = now_ms();
+        if (disk_check(disk_md5) != 0 || lyutil_download_partial(APP_FILE))
+            err++;
+        printf("%d conns : %8.1f ms\n", conns, t1 - t0);
+    }
+
+    /* interrupted in the second half, then resumed */
+    drop_caches();
+    struct stat st;
+    FILE *fp = fopen(FAIL_FILE, "w");
+    if (fp == NULL || stat(IMG_FILE, &st) < 0)
+        err++;
+    else {
+        fprintf(fp, "%lld\n", (long long)st.st_size / 2);
+        fclose(fp);
+    }
+    if (lyutil_download_parallel(url, APP_FILE, checksum, DISK_FILE, 4) == 0 ||
+        !lyutil_download_partial(APP_FILE) || access(DISK_FILE, F_OK) == 0)
+        err++;
+    unlink(FAIL_FILE);
+    t0 = now_ms();
+    if (lyutil_download_parallel(url, APP_FILE, checksum, DISK_FILE, 4) != 0 ||
+        lyutil_download_partial(APP_FILE) || disk_check(disk_md5) != 0)
+        err++;
+    t1 = now_ms();
+    printf("resumed : %8.1f ms\n", t1 - t0);
+
+    /* local appliance checked and decompressed together */
+    drop_caches();
+    lyutil_download(url, APP_FILE);
+    t0 = now_ms();
+    if (lyutil_checksum_decompress_gz(APP_FILE, checksum, DISK_FILE) != 0 ||
+        disk_check(disk_md5) != 0)
+        err++;
+    t1 = now_ms();
+    drop_caches();
+    lyutil_download(url, APP_FILE);
+    t2 = now_ms();
+    if (lyutil_checksum(APP_FILE, checksum) != 0 ||
+        lyutil_decompress_gz(APP_FILE, DISK_FILE) != 0 ||
+        disk_check(disk_md5) != 0)
+        err++;
+    t3 = now_ms();
+    printf("local   : %8.1f ms in 2 passes, %8.1f ms in 1 pass\n",
+           t3 - t2, t1 - t0);
+
+    /* bad checksum, files removed */
+    checksum[0] = checksum[0] == '0' ? '1' : '0';
+    if (lyutil_download_stream(url, APP_FILE, checksum, DISK_FILE) != 1 ||
+        access(APP_FILE, F_OK) == 0 || access(DISK_FILE, F_OK) == 0)
+        err++;
+    if (lyutil_download_parallel(url, APP_FILE, checksum, DISK_FILE, 4) != 1 ||
+        access(APP_FILE, F_OK) == 0 || access(DISK_FILE, F_OK) == 0 ||
+        lyutil_download_partial(APP_FILE))
+        err++;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(IMG_FILE);
+    drop_caches();
+
+    return test_result("appliance download", err);
+}
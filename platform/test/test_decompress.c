@@ -0,0 +1,280 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** appliance decompression benchmark
+**
+** usage: test_decompress [image size in MB [threads [bzip2 size in MB]]]
+**
+** a disk image alike is compressed as gz of one member, gz of many
+** members, as bgzip or pigz does, and bzip2, which is slow to create,
+** so its size is limited separately. each is decompressed with
+** lyutil_decompress_gz or lyutil_decompress_bzip2, then with
+** lyutil_decompress_parallel, and the result is checked. data is also
+** written to a stream in pieces, as it's received in download. data
+** not compressed is copied as it is.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <bzlib.h>
+#include <zlib.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/md5.h"
+#include "../src/util/lyutil.h"
+#include "../src/util/decompress.h"
+#include "test.h"
+
+#define GZ_FILE "test_decompress.gz"
+#define GZ_MULTI_FILE "test_decompress.multi.gz"
+#define BZ_FILE "test_decompress.bz2"
+#define DISK_FILE "test_decompress.disk"
+#define RAW_FILE "test_decompress.raw"
+#define BLOCK_SIZE (64 * 1024)
+#define MEMBER_SIZE (1 << 20)   /* data per gz member */
+
+/* disk image alike, zero blocks mixed with text blocks */
+static void make_block(char *block)
+{
+    int i;
+    if (rand() % 4 == 0)
+        bzero(block, BLOCK_SIZE);
+    else
+        for (i = 0; i < BLOCK_SIZE; i++)
+            block[i] = "luoyun cloud 0123456789\n"[rand() % 24];
+}
+
+static int make_gz(long long size, unsigned char *disk_md5)
+{
+    static char block[BLOCK_SIZE];
+    struct MD5Context md5c;
+    MD5Init(&md5c);
+    gzFile gz = gzopen(GZ_FILE, "wb1");
+    if (gz == NULL)
+        return -1;
+    gzFile multi = NULL;
+    srand(1);
+    long long n;
+    for (n = 0; n < size; n += BLOCK_SIZE) {
+        make_block(block);
+        MD5Update(&md5c, (unsigned char *)block, BLOCK_SIZE);
+        if (n % MEMBER_SIZE == 0) {
+            /* new member */
+            if (multi)
+                gzclose(multi);
+            multi = gzopen(GZ_MULTI_FILE, n ? "ab1" : "wb1");
+        }
+        if (multi == NULL ||
+            gzwrite(gz, block, BLOCK_SIZE) != BLOCK_SIZE ||
+            gzwrite(multi, block, BLOCK_SIZE) != BLOCK_SIZE) {
+            gzclose(gz);
+            return -1;
+        }
+    }
+    gzclose(gz);
+    gzclose(multi);
+    MD5Final(disk_md5, &md5c);
+    return 0;
+}
+
+static int make_bz2(long long size, unsigned char *disk_md5)
+{
+    static char block[BLOCK_SIZE];
+    struct MD5Context md5c;
+    MD5Init(&md5c);
+    FILE *fp = fopen(BZ_FILE, "wb");
+    if (fp == NULL)
+        return -1;
+    int bzerror;
+    BZFILE *b = BZ2_bzWriteOpen(&bzerror, fp, 9, 0, 0);
+    if (bzerror != BZ_OK) {
+        fclose(fp);
+        return -1;
+    }
+    srand(2);
+    long long n;
+    for (n = 0; n < size && bzerror == BZ_OK; n += BLOCK_SIZE) {
+        make_block(block);
+        MD5Update(&md5c, (unsigned char *)block, BLOCK_SIZE);
+        BZ2_bzWrite(&bzerror, b, block, BLOCK_SIZE);
+    }
+    int ret = bzerror == BZ_OK ? 0 : -1;
+    BZ2_bzWriteClose(&bzerror, b, 0, NULL, NULL);
+    fclose(fp);
+    MD5Final(disk_md5, &md5c);
+    return ret;
+}
+
+static int file_md5(const char *file, unsigned char *sig, char *checksum)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    static char block[BLOCK_SIZE];
+    struct MD5Context md5c;
+    int len;
+    MD5Init(&md5c);
+    while ((len = read(fd, block, BLOCK_SIZE)) > 0)
+        MD5Update(&md5c, (unsigned char *)block, len);
+    close(fd);
+    MD5Final(sig, &md5c);
+    if (checksum)
+        for (len = 0; len < 16; len++)
+            sprintf(checksum + len * 2, "%02x", sig[len]);
+    return 0;
+}
+
+static int disk_check(unsigned char *disk_md5)
+{
+    unsigned char sig[16];
+    int ret = -1;
+    if (file_md5(DISK_FILE, sig, NULL) == 0)
+        ret = memcmp(sig, disk_md5, 16) ? -1 : 0;
+    unlink(DISK_FILE);
+    return ret;
+}
+
+/* feed file to stream in pieces, the first ones smaller than magic */
+static int stream(const char *file, unsigned char *disk_md5)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    LYStream *s = lyutil_stream_open(NULL, DISK_FILE);
+    static char block[BLOCK_SIZE];
+    int ret = s ? 0 : -1, len, piece = 1;
+    while (ret == 0 && (len = read(fd, block, piece)) > 0) {
+        if (lyutil_stream_write(s, block, len) < 0)
+            ret = -1;
+        if (piece < BLOCK_SIZE)
+            piece = piece < 4 ? piece + 1 : BLOCK_SIZE;
+    }
+    close(fd);
+    if (lyutil_stream_close(s, NULL) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = disk_check(disk_md5);
+    unlink(DISK_FILE);
+    return ret;
+}
+
+static int compare(const char *name, const char *file, int bz, int threads,
+                   unsigned char *disk_md5)
+{
+    int err = 0;
+    double t0 = now_ms();
+    if ((bz ? lyutil_decompress_bzip2(file, DISK_FILE) :
+              lyutil_decompress_gz(file, DISK_FILE)) != 0)
+        err++;
+    double t1 = now_ms();
+    if (disk_check(disk_md5) != 0)
+        err++;
+    if (stream(file, disk_md5) != 0)
+        err++;
+
+    double t2 = now_ms();
+    if (lyutil_decompress_parallel(file, NULL, DISK_FILE, threads) != 0)
+        err++;
+    double t3 = now_ms();
+    if (disk_check(disk_md5) != 0)
+        err++;
+
+    /* checksum of compressed file along */
+    char checksum[33];
+    unsigned char sig[16];
+    if (file_md5(file, sig, checksum) < 0)
+        err++;
+    double t4 = now_ms();
+    if (lyutil_decompress_parallel(file, checksum, DISK_FILE, threads) != 0)
+        err++;
+    double t5 = now_ms();
+    if (disk_check(disk_md5) != 0)
+        err++;
+    checksum[0] = checksum[0] == '0' ? '1' : '0';
+    if (lyutil_decompress_parallel(file, checksum, DISK_FILE, threads) != 1 ||
+        access(DISK_FILE, F_OK) == 0)
+        err++;
+
+    printf("%-9s: %8.1f ms single, %8.1f ms parallel, "
+           "%8.1f ms parallel with checksum\n",
+           name, t1 - t0, t3 - t2, t5 - t4);
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 2048;
+    int threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int bz_size = argc > 3 ? atoi(argv[3]) : 256;
+    if (size <= 0 || threads <= 0 || bz_size <= 0) {
+        printf("usage: %s [image size in MB [threads [bzip2 size in MB]]]\n",
+               argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    unsigned char disk_md5[16], bz_md5[16];
+    printf("creating %d MB image, %d MB for bzip2 ...\n", size, bz_size);
+    if (make_gz((long long)size << 20, disk_md5) < 0 ||
+        make_bz2((long long)bz_size << 20, bz_md5) < 0) {
+        printf("failed to create image\n");
+        return 1;
+    }
+
+    printf("%d threads\n", threads);
+    int err = 0;
+    err += compare("gz", GZ_FILE, 0, threads, disk_md5);
+    err += compare("gz multi", GZ_MULTI_FILE, 0, threads, disk_md5);
+    err += compare("bzip2", BZ_FILE, 1, threads, bz_md5);
+
+    /* not compressed, copied as it is */
+    unsigned char raw_md5[16], sig[16];
+    FILE *fp = fopen(RAW_FILE, "w");
+    if (fp == NULL || fputs("luoyun cloud\n", fp) < 0)
+        err++;
+    if (fp)
+        fclose(fp);
+    if (file_md5(RAW_FILE, raw_md5, NULL) < 0 ||
+        lyutil_decompress_parallel(RAW_FILE, NULL, DISK_FILE, threads) != 0 ||
+        file_md5(DISK_FILE, sig, NULL) < 0 || memcmp(sig, raw_md5, 16) ||
+        stream(RAW_FILE, raw_md5) != 0)
+        err++;
+    unlink(DISK_FILE);
+    unlink(RAW_FILE);
+
+    unlink(GZ_FILE);
+    unlink(GZ_MULTI_FILE);
+    unlink(BZ_FILE);
+
+    return test_result("decompression", err);
+}
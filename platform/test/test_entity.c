@@ -0,0 +1,143 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** entity store microbenchmark
+**
+** usage: test_entity [number of entities]
+**
+** fake fds are used, so no real socket is needed
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/luoyun/luoyun.h"
+#include "../src/util/logging.h"
+#include "../src/clc/node.h"
+#include "../src/clc/entity.h"
+#include "test.h"
+
+#define FAKE_FD_BASE 1000000
+
+/* used by node placement in node.c */
+CLCConfig *g_c = NULL;
+
+int main(int argc, char *argv[])
+{
+    int num = 20000;
+    if (argc > 1)
+        num = atoi(argv[1]);
+    if (num <= 0) {
+        printf("usage: %s [number of entities]\n", argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    if (ly_entity_store_init() < 0) {
+        printf("ly_entity_store_init failed\n");
+        return 1;
+    }
+
+    int *ids = malloc(num * sizeof(int));
+    char (*ips)[32] = malloc(num * 32);
+    if (ids == NULL || ips == NULL) {
+        printf("malloc failed %s %d\n", __FILE__, __LINE__);
+        return 1;
+    }
+
+    /* connect: create, init and register all the entities */
+    double t = now_ns();
+    int i;
+    for (i = 0; i < num; i++) {
+        ids[i] = ly_entity_new(FAKE_FD_BASE + i);
+        int type = i % 2 ? LY_ENTITY_OSM : LY_ENTITY_NODE;
+        if (ids[i] < 0 || ly_entity_init(ids[i], type) < 0) {
+            printf("entity %d creation failed\n", i);
+            return 1;
+        }
+        if (type == LY_ENTITY_NODE) {
+            LYNodeData * nd = ly_entity_data(ids[i]);
+            snprintf(ips[i], 32, "10.%d.%d.%d",
+                     (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+            nd->node.host_ip = strdup(ips[i]);
+        }
+        ly_entity_update(ids[i], i + 1, LY_ENTITY_FLAG_STATUS_REGISTERED);
+    }
+    t = now_ns() - t;
+    printf("connect  %d entities: %10.1f ns/op\n", num, t / num);
+
+    /* lookup by db id and by node ip */
+    int err = 0;
+    t = now_ns();
+    for (i = 0; i < num; i++) {
+        int type = i % 2 ? LY_ENTITY_OSM : LY_ENTITY_NODE;
+        if (ly_entity_find_by_db(type, i + 1) != ids[i])
+            err++;
+        if (type == LY_ENTITY_NODE && !ly_entity_node_active(ips[i]))
+            err++;
+    }
+    t = now_ns() - t;
+    printf("lookup   %d entities: %10.1f ns/op\n", num, t / num);
+    if (ly_entity_find_by_db(LY_ENTITY_NODE, 2) >= 0 ||
+        ly_entity_node_active("192.168.255.255"))
+        err++;
+
+    /* churn: release and reconnect half of the entities */
+    t = now_ns();
+    for (i = 0; i < num; i += 2) {
+        if (ly_entity_release(ids[i]) < 0)
+            err++;
+        if (ly_entity_find_by_db(LY_ENTITY_NODE, i + 1) >= 0 ||
+            ly_entity_node_active(ips[i]))
+            err++;
+        ids[i] = ly_entity_new(FAKE_FD_BASE + i);
+        if (ids[i] < 0 || ly_entity_init(ids[i], LY_ENTITY_NODE) < 0) {
+            printf("entity %d re-creation failed\n", i);
+            return 1;
+        }
+        ly_entity_update(ids[i], i + 1, LY_ENTITY_FLAG_STATUS_ONLINE);
+    }
+    t = now_ns() - t;
+    printf("churn    %d entities: %10.1f ns/op\n", (num + 1) / 2,
+           t / ((num + 1) / 2));
+
+    for (i = 0; i < num; i++) {
+        int type = i % 2 ? LY_ENTITY_OSM : LY_ENTITY_NODE;
+        if (ly_entity_find_by_db(type, i + 1) != ids[i])
+            err++;
+    }
+
+    ly_entity_store_destroy();
+    free(ids);
+    free(ips);
+
+    return test_result("entity store", err);
+}
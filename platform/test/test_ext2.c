@@ -0,0 +1,217 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** kernel/initrd extraction from disk image without mounting
+**
+** usage: test_ext2
+**
+** file systems of paravirtual appliance layout, kernel and initrd
+** symlinks at root, are created in plain image files by mke2fs -d,
+** as ext2 with 1k blocks, ext3, ext4, and ext4 at partition offset.
+** kernel and initrd are then copied out with lyutil_ext2_copy.
+** no root privilege is needed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/ext2.h"
+#include "test.h"
+
+#define ROOT_DIR "test_ext2.d"
+#define IMG_FILE "test_ext2.img"
+#define OUT_FILE "test_ext2.out"
+#define PART_OFFSET (1 << 20)
+
+static int make_file(const char *path, int size, int hole)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        return -1;
+    int i;
+    for (i = 0; i < size; i++) {
+        if (hole && i == size / 2) {
+            /* sparse in the middle */
+            fseek(fp, hole, SEEK_CUR);
+            i += hole;
+        }
+        fputc(rand() & 0xff, fp);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* paravirtual appliance layout */
+static int make_root(void)
+{
+    char path[100];
+    int i;
+    if (mkdir(ROOT_DIR, 0755) || mkdir(ROOT_DIR "/boot", 0755) ||
+        mkdir(ROOT_DIR "/etc", 0755))
+        return -1;
+    srand(1);
+    if (make_file(ROOT_DIR "/boot/vmlinuz-2.6.32", 5 << 20, 0) ||
+        make_file(ROOT_DIR "/boot/initrd.img-2.6.32", 3 << 20, 1 << 20) ||
+        symlink("boot/vmlinuz-2.6.32", ROOT_DIR "/vmlinuz") ||
+        symlink("vmlinuz", ROOT_DIR "/kernel") ||
+        symlink("/boot/initrd.img-2.6.32", ROOT_DIR "/initrd"))
+        return -1;
+    /* big directory, indexed in ext3/4 */
+    for (i = 0; i < 3000; i++) {
+        snprintf(path, sizeof(path), ROOT_DIR "/etc/file-%d", i);
+        if (make_file(path, 16, 0))
+            return -1;
+    }
+    return 0;
+}
+
+static int same_file(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    int ret = fa && fb ? 0 : -1;
+    while (ret == 0) {
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if (ca != cb)
+            ret = -1;
+        else if (ca == EOF)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return ret;
+}
+
+static int check(const char *name, const char *options, long long offset)
+{
+    char cmd[512];
+    unlink(IMG_FILE);
+    snprintf(cmd, sizeof(cmd), "mke2fs -q -F %s -d %s %s 64M >/dev/null",
+             options, ROOT_DIR, IMG_FILE);
+    if (system(cmd)) {
+        printf("%-9s: failed executing %s\n", name, cmd);
+        return 1;
+    }
+
+    int err = 0;
+    double t0 = now_ms();
+    LYExt2 *fs = lyutil_ext2_open(IMG_FILE, offset);
+    if (fs == NULL ||
+        lyutil_ext2_copy(fs, "kernel", OUT_FILE) ||
+        same_file(OUT_FILE, ROOT_DIR "/boot/vmlinuz-2.6.32"))
+        err++;
+    if (fs == NULL ||
+        lyutil_ext2_copy(fs, "/initrd", OUT_FILE) ||
+        same_file(OUT_FILE, ROOT_DIR "/boot/initrd.img-2.6.32"))
+        err++;
+    double t1 = now_ms();
+    if (fs == NULL ||
+        lyutil_ext2_copy(fs, "etc/file-2999", OUT_FILE) ||
+        same_file(OUT_FILE, ROOT_DIR "/etc/file-2999"))
+        err++;
+    /* not found, not a regular file */
+    unlink(OUT_FILE);
+    if (fs == NULL ||
+        lyutil_ext2_copy(fs, "/boot/vmlinuz", OUT_FILE) == 0 ||
+        lyutil_ext2_copy(fs, "/etc", OUT_FILE) == 0 ||
+        access(OUT_FILE, F_OK) == 0)
+        err++;
+    lyutil_ext2_close(fs);
+    /* no file system at wrong offset */
+    fs = lyutil_ext2_open(IMG_FILE, offset + 4096);
+    if (fs) {
+        lyutil_ext2_close(fs);
+        err++;
+    }
+    printf("%-9s: kernel and initrd copied in %.1f ms, %d errors\n",
+           name, t1 - t0, err);
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    logfile(NULL, LYFATAL);
+
+    if (system("mke2fs -V >/dev/null 2>&1")) {
+        printf("mke2fs not found, test skipped\n");
+        return 0;
+    }
+    system("rm -rf " ROOT_DIR);
+    if (make_root() < 0) {
+        printf("failed to create files in %s\n", ROOT_DIR);
+        return 1;
+    }
+
+    char options[100];
+    snprintf(options, sizeof(options), "-t ext4 -E offset=%d", PART_OFFSET);
+    int err = 0;
+    err += check("ext2 1k", "-t ext2 -b 1024", 0);
+    err += check("ext3", "-t ext3", 0);
+    err += check("ext4", "-t ext4", 0);
+    err += check("ext4 part", options, PART_OFFSET);
+
+    /* bad extent root, eh_max larger than room in inode */
+    unlink(IMG_FILE);
+    if (system("mke2fs -q -F -t ext4 -d " ROOT_DIR " " IMG_FILE
+               " 64M >/dev/null 2>&1") == 0 &&
+        system("debugfs -w -R 'sif /boot/vmlinuz-2.6.32 block[1] 5' "
+               IMG_FILE " >/dev/null 2>&1") == 0) {
+        LYExt2 *fs = lyutil_ext2_open(IMG_FILE, 0);
+        int ret = fs ? lyutil_ext2_copy(fs, "kernel", OUT_FILE) : -1;
+        if (fs == NULL || ret == 0)
+            err++;
+        if (fs)
+            lyutil_ext2_close(fs);
+        printf("bad root : %s\n", ret ? "not copied" : "copied");
+    }
+
+    /* not supported, to be mounted instead */
+    unlink(IMG_FILE);
+    if (system("mke2fs -q -F -t ext4 -O inline_data " IMG_FILE
+               " 64M >/dev/null 2>&1") == 0) {
+        LYExt2 *fs = lyutil_ext2_open(IMG_FILE, 0);
+        if (fs) {
+            lyutil_ext2_close(fs);
+            err++;
+        }
+        printf("inline   : %s\n", fs ? "opened" : "not opened");
+    }
+
+    system("rm -rf " ROOT_DIR);
+    unlink(IMG_FILE);
+    unlink(OUT_FILE);
+
+    return test_result("ext2", err);
+}
@@ -0,0 +1,172 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** libvirt domain events in epoll loop
+**
+** usage: test_libvirt [uri]
+**
+** uri is test:///default by default, no hypervisor is needed. an epoll
+** loop, as the one of lynode, runs in a thread, and domains are created
+** and stopped by main thread, waiting for them with libvirt_domain_wait.
+** the waits should end on lifecycle events, not on the polling second.
+** statistics of the domain are then checked in the node snapshot.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "../src/util/logging.h"
+#include "../src/compute/domain.h"
+#include "test.h"
+
+#define DOMAIN_NAME "i-99"
+#define DOMAIN_XML \
+"<domain type='test'>"\
+  "<name>" DOMAIN_NAME "</name>"\
+  "<memory>65536</memory>"\
+  "<vcpu>1</vcpu>"\
+  "<os><type>hvm</type></os>"\
+"</domain>"
+
+static int g_efd = -1;
+static volatile int g_stop = 0;
+static volatile int g_started = 0, g_stopped = 0;
+
+static void domain_event(const char * name, int event)
+{
+    if (strcmp(name, DOMAIN_NAME))
+        return;
+    if (event == VIR_DOMAIN_EVENT_STARTED)
+        g_started++;
+    else if (event == VIR_DOMAIN_EVENT_STOPPED)
+        g_stopped++;
+}
+
+/* main loop of lynode, libvirt events only */
+static void * event_loop(void * arg)
+{
+    struct epoll_event events[10];
+    while (!g_stop) {
+        int timeout = libvirt_event_timeout();
+        if (timeout < 0 || timeout > 100)
+            timeout = 100;
+        int i, n = epoll_wait(g_efd, events, 10, timeout);
+        for (i = 0; i < n; i++) {
+            if (!libvirt_event_handle(&events[i]))
+                printf("unexpected epoll event for %d\n", events[i].data.fd);
+        }
+        libvirt_event_run();
+    }
+    return NULL;
+}
+
+static void * domain_poweroff(void * arg)
+{
+    usleep(200000);
+    libvirt_domain_poweroff(DOMAIN_NAME);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char * uri = argc > 1 ? argv[1] : "test:///default";
+
+    logfile(NULL, LYWARN);
+
+    g_efd = epoll_create(10);
+    if (g_efd < 0 || libvirt_event_init(g_efd, domain_event) != 0 ||
+        libvirt_connect_uri(uri) != 0) {
+        printf("failed to connect %s\n", uri);
+        return 1;
+    }
+    pthread_t loop;
+    if (pthread_create(&loop, NULL, event_loop, NULL)) {
+        printf("failed to start event loop\n");
+        return 1;
+    }
+
+    int err = 0;
+    double t0 = now_ms();
+    if (libvirt_domain_create(DOMAIN_XML) != 0 ||
+        libvirt_domain_wait(DOMAIN_NAME, 1, 5) != 1)
+        err++;
+    double t1 = now_ms();
+
+    /* snapshot of domains, both for node resource and the domain */
+    DomainStats ds;
+    NodeInfo ni;
+    bzero(&ni, sizeof(NodeInfo));
+    if (libvirt_node_info_update(&ni) <= 0 ||
+        ni.cpu_commit < 1 || ni.mem_commit < 65536 ||
+        libvirt_domain_stats(DOMAIN_NAME, &ds) != 0 ||
+        ds.vcpus != 1 || ds.max_mem != 65536) {
+        printf("domain stats not found\n");
+        err++;
+    }
+    if (libvirt_domain_stats("no-such-domain", &ds) != 1)
+        err++;
+
+    /* stopped by other thread, wait is woken by event */
+    pthread_t t;
+    double t2 = now_ms();
+    pthread_create(&t, NULL, domain_poweroff, NULL);
+    if (libvirt_domain_wait(DOMAIN_NAME, 0, 5) != 1)
+        err++;
+    double t3 = now_ms();
+    pthread_join(t, NULL);
+    if (t3 - t2 > 900) {
+        printf("stop wait not woken by event\n");
+        err++;
+    }
+
+    /* timed out */
+    if (libvirt_domain_wait(DOMAIN_NAME, 1, 1) != 0)
+        err++;
+
+    /* events are dispatched before domain wait returns */
+    usleep(100000);
+    if (g_started != 1 || g_stopped != 1) {
+        printf("events %d started, %d stopped\n", g_started, g_stopped);
+        err++;
+    }
+    printf("domain started in %.1f ms, stopped in %.1f ms after 200 ms\n",
+           t1 - t0, t3 - t2);
+
+    g_stop = 1;
+    pthread_join(loop, NULL);
+    libvirt_close();
+    libvirt_event_run();
+    close(g_efd);
+
+    return test_result("libvirt", err);
+}
@@ -0,0 +1,209 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** async logging against synchronous logging
+**
+** usage: test_logasync [messages] [threads]
+**
+** threads log numbered messages, some longer than LOG_ASYNC_MSG_MAX,
+** in async mode. every message must be in log file or counted as
+** dropped, and messages of one thread must be in order. callback must
+** get each warning and error, long ones truncated. time per message
+** is printed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "test.h"
+
+#define TEST_THREAD_MAX 16
+#define TEST_LONG_EVERY 500
+#define TEST_CALLBACK_NUM 50
+
+static int g_messages;
+static int g_evaluated;
+static int g_callback;
+
+static int evaluated(void)
+{
+    return ++g_evaluated;
+}
+
+static void callback(int type, char * msg, int data)
+{
+    if ((type == LYWARN || type == LYERROR) && strncmp(msg, "cb ", 3) == 0)
+        g_callback++;
+}
+
+static void * producer(void * arg)
+{
+    int id = (long) arg;
+    char pad[LOG_ASYNC_MSG_MAX + 100];
+    memset(pad, 'x', sizeof(pad) - 1);
+    pad[sizeof(pad) - 1] = '\0';
+
+    int i;
+    for (i = 0; i < g_messages; i++) {
+        if (i % TEST_LONG_EVERY == TEST_LONG_EVERY - 1)
+            loginfo("t%d n%d %s\n", id, i, pad);
+        else
+            loginfo("t%d n%d\n", id, i);
+    }
+    return NULL;
+}
+
+/* check log file, return number of errors */
+static int check(const char * path, int threads)
+{
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("can not open %s\n", path);
+        return 1;
+    }
+
+    int last[TEST_THREAD_MAX], got = 0, dropped = 0, err = 0;
+    int i;
+    for (i = 0; i < threads; i++)
+        last[i] = -1;
+
+    char line[LOG_ASYNC_MSG_MAX * 2];
+    while (fgets(line, sizeof(line), fp)) {
+        char * p = strstr(line, "] ");
+        if (p == NULL)
+            continue;
+        p += 2;
+        int t, n;
+        unsigned int d;
+        if (sscanf(p, "%u log messages dropped", &d) == 1) {
+            dropped += d;
+            continue;
+        }
+        if (sscanf(p, "t%d n%d", &t, &n) != 2 || t < 0 || t >= threads)
+            continue;
+        if (n <= last[t]) {
+            printf("thread %d: message %d after %d\n", t, n, last[t]);
+            err++;
+        }
+        last[t] = n;
+        got++;
+    }
+    fclose(fp);
+
+    printf("%d messages written, %d dropped\n", got, dropped);
+    if (got + dropped != threads * g_messages) {
+        printf("%d messages lost\n", threads * g_messages - got - dropped);
+        err++;
+    }
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    g_messages = argc > 1 ? atoi(argv[1]) : 20000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (g_messages <= 0)
+        g_messages = 20000;
+    if (threads <= 0 || threads > TEST_THREAD_MAX)
+        threads = 4;
+
+    char path[] = "/tmp/test_logasync.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        printf("can not create log file\n");
+        return 1;
+    }
+    close(fd);
+
+    int i, err = 0;
+    logfile(path, LYINFO);
+    logcallback(callback, 0);
+
+    /* disabled level, arguments must not be evaluated */
+    double t = now_us();
+    for (i = 0; i < g_messages; i++)
+        logdebug("%d\n", evaluated());
+    double t_off = (now_us() - t) / g_messages;
+    if (g_evaluated) {
+        printf("disabled logdebug evaluated its arguments\n");
+        err++;
+    }
+
+    t = now_us();
+    for (i = 0; i < g_messages; i++)
+        loginfo("sync %d\n", i);
+    double t_sync = (now_us() - t) / g_messages;
+
+    if (logasync() < 0) {
+        printf("failed starting async logging\n");
+        return 1;
+    }
+
+    /* few enough to never be dropped */
+    g_callback = 0;
+    for (i = 0; i < TEST_CALLBACK_NUM; i++) {
+        if (i & 1)
+            logwarn("cb %d\n", i);
+        else
+            logerror("cb %d\n", i);
+    }
+    /* written synchronously */
+    char pad[LOG_ASYNC_MSG_MAX + 100];
+    memset(pad, 'x', sizeof(pad) - 1);
+    pad[sizeof(pad) - 1] = '\0';
+    logwarn("cb long %s\n", pad);
+
+    pthread_t tid[TEST_THREAD_MAX];
+    t = now_us();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, producer, (void *)(long) i);
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    double t_async = (now_us() - t) / g_messages / threads;
+    logclose();
+
+    if (g_callback != TEST_CALLBACK_NUM + 1) {
+        printf("callback got %d of %d messages\n", g_callback,
+               TEST_CALLBACK_NUM + 1);
+        err++;
+    }
+    err += check(path, threads);
+    unlink(path);
+
+    printf("%d messages, %d threads\n", g_messages, threads);
+    printf("disabled logdebug: %8.3f us/message\n", t_off);
+    printf("sync loginfo:      %8.3f us/message\n", t_sync);
+    printf("async loginfo:     %8.3f us/message\n", t_async);
+
+    return test_result("async logging", err);
+}
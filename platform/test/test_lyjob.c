@@ -0,0 +1,144 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** job queue admission benchmark
+**
+** usage: test_lyjob [number of jobs]
+**
+** web jobs are admitted as in ly_epoll_work_recv, job_exist, job_check
+** then job_insert. jobs are on different instances, so no db access
+** is needed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/luoyun/luoyun.h"
+#include "../src/util/logging.h"
+#include "../src/clc/lyclc.h"
+#include "../src/clc/lyjob.h"
+#include "test.h"
+
+CLCConfig *g_c = NULL;
+
+static LYJobInfo * new_job(int id, int target_id)
+{
+    LYJobInfo * job = malloc(sizeof(LYJobInfo));
+    if (job == NULL)
+        return NULL;
+    bzero(job, sizeof(LYJobInfo));
+    job->j_id = id;
+    job->j_status = JOB_S_RUNNING;
+    job->j_target_type = JOB_TARGET_INSTANCE;
+    job->j_target_id = target_id;
+    job->j_action = LY_A_NODE_STOP_INSTANCE;
+    return job;
+}
+
+int main(int argc, char *argv[])
+{
+    int num = 50000;
+    if (argc > 1)
+        num = atoi(argv[1]);
+    if (num <= 0) {
+        printf("usage: %s [number of jobs]\n", argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    /* job queue without db */
+    LYJobInfo * job = new_job(1, 1);
+    if (job == NULL || job_insert(job) < 0 || job_find(1) != job) {
+        printf("job_insert failed\n");
+        return 1;
+    }
+
+    int i, err = 0, step = num / 5 > 0 ? num / 5 : 1;
+    double t = now_ns(), t_step = t;
+    for (i = 2; i <= num; i++) {
+        job = new_job(i, i);
+        if (job == NULL)
+            return 1;
+        if (job_exist(job) || job_check(job) || job_insert(job) < 0)
+            err++;
+        if (i % step == 0) {
+            double t1 = now_ns();
+            printf("admit  jobs %6d - %6d: %8.1f ns/job\n",
+                   i - step + 1, i, (t1 - t_step) / step);
+            t_step = t1;
+        }
+    }
+    t = now_ns() - t;
+    printf("admit  %d jobs          : %8.1f ns/job\n", num, t / num);
+
+    /* conflict check against a full queue */
+    t = now_ns();
+    LYJobInfo * dup = new_job(num + 1, 1);
+    for (i = 1; i <= num; i++) {
+        dup->j_target_id = i;
+        if (job_check(dup) != LY_S_CANCEL_TARGET_BUSY)
+            err++;
+    }
+    t = now_ns() - t;
+    printf("reject %d jobs          : %8.1f ns/job\n", num, t / num);
+    free(dup);
+
+    /* lookup by id */
+    t = now_ns();
+    for (i = 1; i <= num; i++) {
+        job = job_find(i);
+        if (job == NULL || job->j_id != i)
+            err++;
+    }
+    t = now_ns() - t;
+    printf("find   %d jobs          : %8.1f ns/job\n", num, t / num);
+
+    /* new jobs are due right now */
+    if (ly_timer_wait(1000) != 0)
+        err++;
+
+    /* remove every other job, then check the indexes again */
+    for (i = 1; i <= num; i += 2)
+        job_remove(job_find(i));
+    for (i = 1; i <= num; i++) {
+        job = job_find(i);
+        if ((job == NULL) != (i % 2 == 1))
+            err++;
+        else if (job && !ly_timer_pending(&job->j_timer))
+            err++;
+    }
+
+    job_cleanup();
+    if (ly_timer_wait(1000) != 1000)
+        err++;
+
+    return test_result("job queue", err);
+}
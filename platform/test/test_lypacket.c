@@ -0,0 +1,173 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** packet receive test
+**
+** usage: test_lypacket [number of packets]
+**
+** a stream of packets, a few of them larger than the initial buffer,
+** is written to a socketpair and received in small random chunks, as
+** the epoll loops do. every packet must come out intact and as string.
+** packets over the send limit, which older peers reject, are refused.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "../src/luoyun/luoyun.h"
+#include "../src/util/lypacket.h"
+#include "test.h"
+
+#define LARGE_PACKET_SIZE (LUOYUN_PACKET_BUF_SIZE * 5)
+
+static int packet_len(int i)
+{
+    if (i % 100 == 99)
+        return LARGE_PACKET_SIZE + i % 1000;
+    return 16 + i % 300;
+}
+
+static void packet_fill(char * data, int len, int i)
+{
+    int j;
+    for (j = 0; j < len; j++)
+        data[j] = 'a' + (i + j) % 26;
+}
+
+int main(int argc, char *argv[])
+{
+    int num = 2000;
+    if (argc > 1)
+        num = atoi(argv[1]);
+    if (num <= 0) {
+        printf("usage: %s [number of packets]\n", argv[0]);
+        return 1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        printf("socketpair failed\n");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+        return 1;
+    if (pid == 0) {
+        close(sv[0]);
+        char * data = malloc(LARGE_PACKET_SIZE + 1000);
+        int i;
+        for (i = 0; data && i < num; i++) {
+            int len = packet_len(i);
+            packet_fill(data, len, i);
+            if (ly_packet_send(sv[1], PKT_TYPE_TEST_ECHO_REQUEST,
+                               data, len) < 0)
+                break;
+        }
+        close(sv[1]);
+        exit(0);
+    }
+    close(sv[1]);
+
+    LYPacketRecv pkt;
+    bzero(&pkt, sizeof(pkt));
+    if (ly_packet_init(&pkt) < 0)
+        return 1;
+
+    char * expect = malloc(LARGE_PACKET_SIZE + 1000);
+    if (expect == NULL)
+        return 1;
+
+    srand(1);
+    int n = 0, err = 0;
+    long long bytes = 0;
+    double t = now_ns();
+    while (n < num) {
+        int size;
+        void * buf = ly_packet_buf(&pkt, &size);
+        if (buf == NULL || size == 0) {
+            printf("no buffer space for packet %d\n", n);
+            err++;
+            break;
+        }
+        /* small reads split headers and data */
+        int chunk = rand() % 2 ? 1 + rand() % 64 : 1 + rand() % 8192;
+        int len = recv(sv[0], buf, size < chunk ? size : chunk, 0);
+        if (len <= 0)
+            break;
+        bytes += len;
+
+        while (1) {
+            int ret = ly_packet_recv(&pkt, len);
+            if (ret < 0) {
+                printf("ly_packet_recv error\n");
+                return 1;
+            }
+            if (ret == 0)
+                break;
+
+            int size;
+            char * data = ly_packet_data(&pkt, &size);
+            packet_fill(expect, packet_len(n), n);
+            if (ly_packet_type(&pkt) != PKT_TYPE_TEST_ECHO_REQUEST ||
+                size != packet_len(n) || memcmp(data, expect, size) ||
+                strlen(data) != size) {
+                printf("packet %d corrupted\n", n);
+                err++;
+            }
+            n++;
+            ly_packet_recv_done(&pkt);
+            len = 0;
+        }
+    }
+    t = now_ns() - t;
+
+    static char big[LUOYUN_PACKET_SEND_MAX];
+    if (ly_packet_send(sv[0], PKT_TYPE_TEST_ECHO_REPLY, big,
+                       LUOYUN_PACKET_SEND_MAX) != -1) {
+        printf("packet over send limit not refused\n");
+        err++;
+    }
+    close(sv[0]);
+
+    if (pkt.pkt_buf_size != LUOYUN_PACKET_BUF_SIZE) {
+        printf("buffer not shrunk, size %d\n", pkt.pkt_buf_size);
+        err++;
+    }
+    ly_packet_cleanup(&pkt);
+    free(expect);
+
+    if (n != num)
+        err++;
+    printf("%d packets, %lld bytes received in %.1f ms\n", n, bytes, t / 1e6);
+    return test_result("packet receive", err);
+}
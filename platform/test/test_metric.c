@@ -0,0 +1,277 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** metrics registry and its export
+**
+** usage: test_metric [loops] [threads]
+**
+** counters and histograms are updated by threads at once, no update
+** may be lost. quantiles of histogram must be within bucket error.
+** metrics are read from unix socket, raw and by http, and checked
+** against prometheus text format. time per update is printed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "logging.h"
+#include "lymetric.h"
+#include "test.h"
+
+#define TEST_THREAD_MAX 16
+
+static int g_loops;
+static LYMetric * g_counter;
+static LYMetric * g_hist;
+
+static void * updater(void * arg)
+{
+    int i;
+    for (i = 0; i < g_loops; i++) {
+        lymetric_inc(g_counter);
+        lymetric_observe(g_hist, i % 1000);
+    }
+    return NULL;
+}
+
+/* read all the metrics from socket at path, request may be NULL */
+static char * fetch(const char * path, const char * request)
+{
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("can not connect to %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if (request && write(fd, request, strlen(request)) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    int len = 0, size = 4096;
+    char * buf = malloc(size);
+    while (buf) {
+        int n = read(fd, buf + len, size - len - 1);
+        if (n <= 0)
+            break;
+        len += n;
+        if (len == size - 1) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+    }
+    close(fd);
+    if (buf)
+        buf[len] = '\0';
+    return buf;
+}
+
+/* check text format, return number of errors */
+static int check_text(const char * text)
+{
+    int err = 0, types = 0;
+    const char * p;
+    char family[LYMETRIC_NAME_MAX] = "";
+    double last = -1;
+
+    for (p = text; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        char name[LYMETRIC_NAME_MAX * 2];
+        double v;
+        if (strncmp(p, "# TYPE ", 7) == 0) {
+            /* each family has one TYPE line */
+            sscanf(p + 7, "%127s", name);
+            char key[sizeof(name) + 16];
+            snprintf(key, sizeof(key), "# TYPE %s ", name);
+            if (strstr(p + 1, key)) {
+                printf("TYPE of %s repeated\n", name);
+                err++;
+            }
+            strcpy(family, name);
+            types++;
+            last = -1;
+            continue;
+        }
+        if (*p == '#' || *p == '\n')
+            continue;
+        if (sscanf(p, "%255s %lf", name, &v) != 2) {
+            printf("bad line: %.40s\n", p);
+            err++;
+            continue;
+        }
+        if (strncmp(name, family, strlen(family)) != 0) {
+            printf("%s is not in family %s\n", name, family);
+            err++;
+        }
+        /* buckets are cumulative */
+        if (strstr(name, "_bucket{")) {
+            if (v < last) {
+                printf("%s decreases\n", name);
+                err++;
+            }
+            last = v;
+        }
+        else
+            last = -1;
+    }
+    if (types == 0) {
+        printf("no metric found\n");
+        err++;
+    }
+    return err;
+}
+
+int main(int argc, char *argv[])
+{
+    g_loops = argc > 1 ? atoi(argv[1]) : 200000;
+    int threads = argc > 2 ? atoi(argv[2]) : 4;
+    if (g_loops <= 0)
+        g_loops = 200000;
+    if (threads <= 0 || threads > TEST_THREAD_MAX)
+        threads = 4;
+
+    logfile(NULL, LYERROR);
+    int i, err = 0;
+
+    g_counter = lymetric_counter("test_updates_total", "updates");
+    g_hist = lymetric_histogram("test_seconds{kind=\"a\"}", "values");
+    LYMetric * hist_b = lymetric_histogram("test_seconds{kind=\"b\"}", NULL);
+    LYMetric * gauge = lymetric_gauge("test_queue", "queue depth");
+    lymetric_counter("test_other_total", "registered after family");
+    if (lymetric_counter("test_updates_total", NULL) != g_counter) {
+        printf("same name registered twice\n");
+        err++;
+    }
+    if (lymetric_gauge("test_updates_total", NULL) != NULL) {
+        printf("same name registered with other type\n");
+        err++;
+    }
+    lymetric_set(gauge, 5);
+    lymetric_add(gauge, -2);
+    if (lymetric_value(gauge) != 3) {
+        printf("gauge is %lld, not 3\n", lymetric_value(gauge));
+        err++;
+    }
+
+    /* relative error of quantile is under 25% */
+    unsigned long long v;
+    for (v = 1; v <= 100000; v++)
+        lymetric_observe(hist_b, v);
+    double qs[] = { 0.5, 0.9, 0.99 };
+    for (i = 0; i < 3; i++) {
+        double want = qs[i] * 100000;
+        unsigned long long got = lymetric_quantile(hist_b, qs[i]);
+        if (got < want || got > want * 1.25) {
+            printf("quantile %.2f is %llu, want %.0f\n", qs[i], got, want);
+            err++;
+        }
+    }
+
+    pthread_t tid[TEST_THREAD_MAX];
+    double t = lymetric_now_us();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, updater, NULL);
+    for (i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+    double t_update = (lymetric_now_us() - t) / g_loops / threads;
+    if (lymetric_value(g_counter) != (long long) g_loops * threads ||
+        lymetric_count(g_hist) != (unsigned long long) g_loops * threads) {
+        printf("updates lost, counter %lld, histogram %llu, want %lld\n",
+               lymetric_value(g_counter), lymetric_count(g_hist),
+               (long long) g_loops * threads);
+        err++;
+    }
+
+    char path[] = "/tmp/test_metric.XXXXXX";
+    if (mkdtemp(path) == NULL) {
+        printf("can not create socket dir\n");
+        return 1;
+    }
+    char sock[64];
+    snprintf(sock, sizeof(sock), "%s/metrics", path);
+    if (lymetric_serve(sock) < 0) {
+        printf("can not serve on %s\n", sock);
+        return 1;
+    }
+
+    char * raw = fetch(sock, NULL);
+    char * http = fetch(sock, "GET /metrics HTTP/1.0\r\n\r\n");
+    if (raw == NULL || http == NULL) {
+        err++;
+    }
+    else {
+        err += check_text(raw);
+        char * body = strstr(http, "\r\n\r\n");
+        if (strncmp(http, "HTTP/1.0 200 OK\r\n", 17) || body == NULL ||
+            strcmp(body + 4, raw)) {
+            printf("http response differs from raw text\n");
+            err++;
+        }
+        char line[128];
+        snprintf(line, sizeof(line),
+                 "test_seconds_bucket{kind=\"a\",le=\"+Inf\"} %lld\n",
+                 (long long) g_loops * threads);
+        if (strstr(raw, line) == NULL) {
+            printf("no line %s", line);
+            err++;
+        }
+    }
+    if (argc > 3)
+        printf("%s", raw);
+    free(raw);
+    free(http);
+
+    lymetric_stop();
+    if (access(sock, F_OK) == 0) {
+        printf("socket %s not removed\n", sock);
+        unlink(sock);
+        err++;
+    }
+    rmdir(path);
+
+    int len;
+    t = lymetric_now_us();
+    for (i = 0; i < 1000; i++)
+        free(lymetric_export(&len));
+    double t_export = (lymetric_now_us() - t) / 1000;
+
+    printf("%d updates, %d threads\n", g_loops, threads);
+    printf("counter and histogram update: %8.3f us\n", t_update);
+    printf("export of %d bytes:        %8.3f us\n", len, t_export);
+
+    return test_result("metric", err);
+}
@@ -0,0 +1,169 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** async db access benchmark, a local PostgreSQL is needed
+**
+** usage: test_pgasync [dbname user password [number of statements]]
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <libpq-fe.h>
+
+#include "../src/util/logging.h"
+#include "../src/clc/options.h"
+#include "../src/clc/events.h"
+#include "../src/clc/postgres.h"
+#include "test.h"
+
+CLCConfig *g_c = NULL;
+int g_efd = -1;
+
+static int g_done = 0, g_failed = 0;
+static double g_latency = 0;
+
+static void query_done(PGresult * res, void * data)
+{
+    double * start = data;
+    if (res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK)
+        g_failed++;
+    g_latency += now_us() - *start;
+    g_done++;
+}
+
+static int bench_sync(int num)
+{
+    char conninfo[256];
+    snprintf(conninfo, 256, "dbname=%s user=%s password=%s",
+             g_c->db_name, g_c->db_user, g_c->db_pass);
+    PGconn * conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        printf("unable to connect to the database: %s\n",
+               PQerrorMessage(conn));
+        PQfinish(conn);
+        return -1;
+    }
+
+    int i;
+    char sql[64];
+    double t = now_us();
+    for (i = 0; i < num; i++) {
+        snprintf(sql, 64, "SELECT %d;", i);
+        PGresult * res = PQexec(conn, sql);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            g_failed++;
+        PQclear(res);
+    }
+    t = now_us() - t;
+    printf("sync   PQexec      : %8.1f us/stmt, %8.0f stmt/s\n",
+           t / num, num * 1e6 / t);
+
+    PQfinish(conn);
+    return 0;
+}
+
+static int bench_async(int num, int pool)
+{
+    if (ly_db_async_init(pool) < 0) {
+        printf("ly_db_async_init failed\n");
+        return -1;
+    }
+
+    double * start = malloc(num * sizeof(double));
+    if (start == NULL)
+        return -1;
+
+    g_done = 0;
+    g_latency = 0;
+
+    int i;
+    char sql[64];
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+    double t = now_us();
+    for (i = 0; i < num; i++) {
+        snprintf(sql, 64, "SELECT %d;", i);
+        start[i] = now_us();
+        if (ly_db_async_query(sql, DB_KEY_NONE, query_done, &start[i]) < 0) {
+            printf("ly_db_async_query failed\n");
+            return -1;
+        }
+        /* keep the queue short, as clc event loop does */
+        while (ly_db_async_pending() > 64) {
+            int j, n = epoll_wait(g_efd, events, EPOLL_EVENTS_MAX, 1000);
+            for (j = 0; j < n; j++)
+                ly_db_async_event(events[j].data.fd, events[j].events);
+        }
+    }
+    while (ly_db_async_pending() > 0) {
+        int j, n = epoll_wait(g_efd, events, EPOLL_EVENTS_MAX, 1000);
+        for (j = 0; j < n; j++)
+            ly_db_async_event(events[j].data.fd, events[j].events);
+    }
+    t = now_us() - t;
+    printf("async  pool size %d : %8.1f us/stmt, %8.0f stmt/s, "
+           "latency %8.1f us\n",
+           pool, t / num, num * 1e6 / t, g_latency / g_done);
+
+    ly_db_async_close();
+    free(start);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    CLCConfig c;
+    bzero(&c, sizeof(c));
+    c.db_name = argc > 3 ? argv[1] : "lyweb";
+    c.db_user = argc > 3 ? argv[2] : "luoyun";
+    c.db_pass = argc > 3 ? argv[3] : "luoyun";
+    int num = argc > 4 ? atoi(argv[4]) : 10000;
+    g_c = &c;
+
+    logfile(NULL, LYWARN);
+
+    g_efd = epoll_create(EPOLL_EVENTS_MAX);
+    if (g_efd < 0)
+        return 1;
+
+    if (bench_sync(num) < 0)
+        return 1;
+
+    int pool;
+    for (pool = 1; pool <= 4; pool <<= 1)
+        if (bench_async(num, pool) < 0)
+            return 1;
+
+    if (g_failed) {
+        printf("%d statements failed\n", g_failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** text vs prepared statement benchmark, a local PostgreSQL is needed
+**
+** usage: test_pgprepare [dbname user password [number of statements]]
+**
+** a temp table shaped like instance table is used, so the db is not
+** changed. statements are the same as instance status update and
+** query in clc.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <libpq-fe.h>
+
+#include "../src/util/logging.h"
+#include "../src/clc/postgres.h"
+#include "test.h"
+
+#define ROWS 1000
+
+static int g_failed = 0;
+
+static void check(PGresult * res, ExecStatusType status)
+{
+    if (PQresultStatus(res) != status) {
+        if (g_failed++ == 0)
+            printf("statement failed: %s\n", PQresultErrorMessage(res));
+    }
+    PQclear(res);
+}
+
+static int setup(PGconn * conn)
+{
+    check(PQexec(conn, "CREATE TEMP TABLE bench_instance ("
+                       "id integer PRIMARY KEY, key varchar(128), "
+                       "ip varchar(32), node_id integer, status integer, "
+                       "vdi_port integer, rx bigint, tx bigint, "
+                       "updated timestamp);"), PGRES_COMMAND_OK);
+    check(PQexec(conn, "INSERT INTO bench_instance "
+                       "SELECT i, 'secret', '10.0.0.1', 1, 4, 0, 0, 0, now() "
+                       "FROM generate_series(1, 1000) AS i;"),
+          PGRES_COMMAND_OK);
+    check(PQprepare(conn, "bench_select",
+                    "SELECT key, ip, node_id, status FROM bench_instance "
+                    "WHERE id = $1;", 0, NULL), PGRES_COMMAND_OK);
+    check(PQprepare(conn, "bench_update",
+                    "UPDATE bench_instance SET key = $1, vdi_port = $2, "
+                    "rx = $3, tx = $4, updated = now() "
+                    "WHERE status != $5 AND id = $6;", 0, NULL),
+          PGRES_COMMAND_OK);
+    return g_failed ? -1 : 0;
+}
+
+static void bench_text(PGconn * conn, int num)
+{
+    int i;
+    char sql[LINE_MAX];
+    double t = now_us();
+    for (i = 0; i < num; i++) {
+        int id = i % ROWS + 1;
+        snprintf(sql, LINE_MAX,
+                 "SELECT key, ip, node_id, status FROM bench_instance "
+                 "WHERE id = %d;", id);
+        PGresult * res = PQexec(conn, sql);
+        if (PQntuples(res) == 1)
+            atoi(PQgetvalue(res, 0, 3));
+        check(res, PGRES_TUPLES_OK);
+
+        snprintf(sql, LINE_MAX,
+                 "UPDATE bench_instance SET key = 'secret:5900:%d:%d:%d:%d', "
+                 "vdi_port = 5900, rx = %d, tx = %d, updated = 'now' "
+                 "WHERE status != %d AND id = %d;",
+                 i, i, i, i, i, i, 9, id);
+        check(PQexec(conn, sql), PGRES_COMMAND_OK);
+    }
+    t = now_us() - t;
+    printf("text     PQexec         : %8.1f us/update, %8.0f update/s\n",
+           t / num, num * 1e6 / t);
+}
+
+static void bench_prepared(PGconn * conn, int num)
+{
+    int i;
+    char key[LINE_MAX];
+    LYDBParams p;
+    double t = now_us();
+    for (i = 0; i < num; i++) {
+        int id = i % ROWS + 1;
+        ly_db_params_init(&p);
+        ly_db_param_int(&p, id);
+        PGresult * res = PQexecPrepared(conn, "bench_select", p.n, p.values,
+                                        p.lengths, p.formats, 1);
+        if (PQntuples(res) == 1)
+            ly_db_get_int(res, 0, 3);
+        check(res, PGRES_TUPLES_OK);
+
+        snprintf(key, LINE_MAX, "secret:5900:%d:%d:%d:%d", i, i, i, i);
+        ly_db_params_init(&p);
+        ly_db_param_str(&p, key);
+        ly_db_param_int(&p, 5900);
+        ly_db_param_long(&p, i);
+        ly_db_param_long(&p, i);
+        ly_db_param_int(&p, 9);
+        ly_db_param_int(&p, id);
+        check(PQexecPrepared(conn, "bench_update", p.n, p.values,
+                             p.lengths, p.formats, 1), PGRES_COMMAND_OK);
+    }
+    t = now_us() - t;
+    printf("prepared PQexecPrepared : %8.1f us/update, %8.0f update/s\n",
+           t / num, num * 1e6 / t);
+}
+
+int main(int argc, char *argv[])
+{
+    char * db_name = argc > 3 ? argv[1] : "lyweb";
+    char * db_user = argc > 3 ? argv[2] : "luoyun";
+    char * db_pass = argc > 3 ? argv[3] : "luoyun";
+    int num = argc > 4 ? atoi(argv[4]) : 10000;
+    if (num <= 0) {
+        printf("usage: %s [dbname user password [number of statements]]\n",
+               argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    char conninfo[LINE_MAX];
+    snprintf(conninfo, LINE_MAX, "dbname=%s user=%s password=%s",
+             db_name, db_user, db_pass);
+    PGconn * conn = PQconnectdb(conninfo);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        printf("unable to connect to the database: %s\n",
+               PQerrorMessage(conn));
+        PQfinish(conn);
+        return 1;
+    }
+
+    if (setup(conn) < 0) {
+        PQfinish(conn);
+        return 1;
+    }
+
+    /* one status query and update for each report, as clc does */
+    bench_text(conn, num);
+    bench_prepared(conn, num);
+
+    PQfinish(conn);
+    if (g_failed) {
+        printf("%d statements failed\n", g_failed);
+        return 1;
+    }
+    return 0;
+}
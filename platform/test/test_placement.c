@@ -0,0 +1,205 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** offline node placement simulator
+**
+** usage: test_placement [number of nodes [number of instances]]
+**
+** synthetic nodes of different sizes are registered in entity store,
+** then the same sequence of instance placements is replayed for the
+** linear scan used before and for each placement strategy.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/luoyun/luoyun.h"
+#include "../src/util/logging.h"
+#include "../src/clc/lyclc.h"
+#include "../src/clc/entity.h"
+#include "../src/clc/node.h"
+#include "test.h"
+
+#define APP_NUM 50
+#define FAKE_FD_BASE 1000000
+
+CLCConfig *g_c = NULL;
+
+static int setup_nodes(int num)
+{
+    if (ly_entity_store_init() < 0)
+        return -1;
+
+    /* entity 0 is the clc socket, as in lyclc */
+    int i = ly_entity_new(FAKE_FD_BASE);
+    if (i != 0 || ly_entity_init(i, LY_ENTITY_CLC) < 0)
+        return -1;
+
+    srand(1);
+    for (i = 0; i < num; i++) {
+        int id = ly_entity_new(FAKE_FD_BASE + i + 1);
+        if (id < 0 || ly_entity_init(id, LY_ENTITY_NODE) < 0)
+            return -1;
+        ly_entity_update(id, i + 1, LY_ENTITY_FLAG_STATUS_REGISTERED);
+        ly_entity_enable(id, -1, 1);
+
+        LYNodeData * nd = ly_entity_data(id);
+        NodeInfo * nf = &nd->node;
+        nf->status = NODE_STATUS_REGISTERED;
+        nf->cpu_max = 8 << (rand() % 3);
+        nf->cpu_vlimit = nf->cpu_max * DEFAULT_NODE_CPU_FACTOR;
+        nf->mem_max = (16 << (rand() % 3)) * 1024;
+        nf->mem_vlimit = nf->mem_max * DEFAULT_NODE_MEM_FACTOR;
+        nf->storage_total = 1024 * 1024;
+        nf->storage_free = nf->storage_total / 2 + rand() % (nf->storage_total / 2);
+        nf->load_average = rand() % (nf->cpu_max * 100);
+        if (node_update(id) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void new_instance(NodeCtrlInstance * ci, int i)
+{
+    bzero(ci, sizeof(NodeCtrlInstance));
+    ci->ins_id = i + 1;
+    ci->ins_vcpu = 1 << (rand() % 3);
+    ci->ins_mem = 512 << (rand() % 5);
+    /* a few appliances are popular */
+    ci->app_id = rand() % 2 ? rand() % 5 + 1 : rand() % APP_NUM + 1;
+}
+
+/* node selection before placement index, for comparison */
+static int linear_schedule(void)
+{
+    int ent_curr = -1;
+    int ent_id = NODE_SCHEDULE_NODE_UNAVAIL;
+    int mem_avail_max = 0;
+    while(1) {
+        LYNodeData * nd = ly_entity_data_next(LY_ENTITY_NODE, &ent_curr);
+        if (nd == NULL)
+            break;
+        if (!ly_entity_is_registered(ent_curr) ||
+            !ly_entity_is_enabled(ent_curr))
+            continue;
+        NodeInfo * nf = &nd->node;
+        if (nf->storage_free <= g_c->node_storage_low ||
+            nf->cpu_commit >= nf->cpu_vlimit ||
+            nf->mem_commit >= nf->mem_vlimit)
+            continue;
+        int mem_avail = nf->mem_vlimit - nf->mem_commit;
+        if (mem_avail > mem_avail_max) {
+            mem_avail_max = mem_avail;
+            ent_id = ent_curr;
+        }
+    }
+    return ent_id;
+}
+
+static int simulate(const char * name, int strategy, int nodes, int num)
+{
+    if (setup_nodes(nodes) < 0) {
+        printf("failed to set up nodes\n");
+        return -1;
+    }
+    g_c->node_placement = strategy;
+
+    int i, failed = 0, local = 0;
+    double t = 0;
+    for (i = 0; i < num; i++) {
+        NodeCtrlInstance ci;
+        new_instance(&ci, i);
+        double t0 = now_ns();
+        int ent_id = strategy ? node_schedule(0, &ci) : linear_schedule();
+        t += now_ns() - t0;
+        if (ent_id < 0) {
+            failed++;
+            continue;
+        }
+        LYNodeData * nd = ly_entity_data(ent_id);
+        int j;
+        for (j = 0; j < NODE_APP_CACHE_NR; j++)
+            if (nd->app_cache[j].app_id == ci.app_id)
+                local++;
+        node_commit(ent_id, &ci);
+    }
+
+    /* node usage */
+    int used = 0, over = 0, ent_curr = -1;
+    double util = 0;
+    while (1) {
+        LYNodeData * nd = ly_entity_data_next(LY_ENTITY_NODE, &ent_curr);
+        if (nd == NULL)
+            break;
+        NodeInfo * nf = &nd->node;
+        if (nf->mem_commit == 0)
+            continue;
+        used++;
+        util += (double)nf->mem_commit / nf->mem_vlimit;
+        if (nf->mem_commit > nf->mem_vlimit || nf->cpu_commit > nf->cpu_vlimit)
+            over++;
+    }
+    printf("%-9s: %8.1f ns/placement, %5d nodes used, "
+           "mem %5.1f%%, %4d overcommitted, %5.1f%% cached, %d failed\n",
+           name, t / num, used, used ? util * 100 / used : 0, over,
+           (num - failed) ? local * 100.0 / (num - failed) : 0, failed);
+
+    ly_entity_store_destroy();
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nodes = argc > 1 ? atoi(argv[1]) : 5000;
+    int num = argc > 2 ? atoi(argv[2]) : 20000;
+    if (nodes <= 0 || num <= 0) {
+        printf("usage: %s [number of nodes [number of instances]]\n",
+               argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    CLCConfig c;
+    bzero(&c, sizeof(CLCConfig));
+    c.node_select = NODE_SELECT_ANY;
+    c.node_storage_low = DEFAULT_NODE_STORAGE_LOW;
+    c.node_ins_job_busy_limit = num;
+    g_c = &c;
+
+    printf("%d nodes, %d instances\n", nodes, num);
+    if (simulate("linear", 0, nodes, num) < 0 ||
+        simulate("spread", NODE_PLACEMENT_SPREAD, nodes, num) < 0 ||
+        simulate("best-fit", NODE_PLACEMENT_BESTFIT, nodes, num) < 0 ||
+        simulate("binpack", NODE_PLACEMENT_BINPACK, nodes, num) < 0 ||
+        simulate("locality", NODE_PLACEMENT_LOCALITY, nodes, num) < 0)
+        return 1;
+    return 0;
+}
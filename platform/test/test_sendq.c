@@ -0,0 +1,245 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** packet send queue throughput test
+**
+** usage: test_sendq [number of packets [packets per tick]]
+**
+** a local echo peer returns every packet it gets. packets are sent in
+** ticks, the way clc fans out queries, first one ly_packet_send per
+** packet, then through send queue flushed once per tick. at last the
+** peer is stopped, to see the queue grow without blocking the sender.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "../src/luoyun/luoyun.h"
+#include "../src/util/lypacket.h"
+#include "test.h"
+
+#define PACKET_SIZE 300
+#define MAX_EVENTS 10
+
+static char g_data[PACKET_SIZE];
+static LYPacketRecv g_pkt;
+static int g_received = 0;
+
+/* echo peer, runs in child process */
+static void echo_peer(int fd)
+{
+    LYPacketRecv pkt;
+    bzero(&pkt, sizeof(pkt));
+    if (ly_packet_init(&pkt) < 0)
+        exit(1);
+
+    while (1) {
+        int size;
+        void * buf = ly_packet_buf(&pkt, &size);
+        if (buf == NULL || size == 0)
+            exit(1);
+        int len = recv(fd, buf, size, 0);
+        if (len <= 0)
+            exit(0);
+        while (ly_packet_recv(&pkt, len) > 0) {
+            char * data = ly_packet_data(&pkt, &size);
+            if (ly_packet_send(fd, PKT_TYPE_TEST_ECHO_REPLY, data, size) < 0)
+                exit(1);
+            ly_packet_recv_done(&pkt);
+            len = 0;
+        }
+    }
+}
+
+/* receive echo replies */
+static int echo_recv(int fd)
+{
+    int size;
+    void * buf = ly_packet_buf(&g_pkt, &size);
+    if (buf == NULL || size == 0)
+        return -1;
+    int len = recv(fd, buf, size, MSG_DONTWAIT);
+    if (len <= 0)
+        return len == 0 ? -1 : 0;
+    while (1) {
+        int ret = ly_packet_recv(&g_pkt, len);
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            return 0;
+        if (ly_packet_type(&g_pkt) != PKT_TYPE_TEST_ECHO_REPLY ||
+            memcmp(ly_packet_data(&g_pkt, NULL), g_data, PACKET_SIZE))
+            return -1;
+        g_received++;
+        ly_packet_recv_done(&g_pkt);
+        len = 0;
+    }
+}
+
+/* wait for events, send queued packets and receive echo replies */
+static int echo_wait(int efd, int fd, LYPacketSendQueue * q, int expect)
+{
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    while (g_received < expect) {
+        int ret = q ? ly_packet_queue_flush(q, fd) : 0;
+        if (ret < 0)
+            return -1;
+        ev.events = ret == 1 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev) < 0)
+            return -1;
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(efd, events, MAX_EVENTS, 1000);
+        if (n <= 0)
+            return -1;
+        if (events[0].events & EPOLLIN && echo_recv(fd) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int run(const char * name, int efd, int fd,
+               LYPacketSendQueue * q, int num, int tick)
+{
+    g_received = 0;
+    double t = now_ns();
+    int i, j;
+    for (i = 0; i < num; i += tick) {
+        for (j = 0; j < tick && i + j < num; j++) {
+            int ret = q ? ly_packet_queue(q, PKT_TYPE_TEST_ECHO_REQUEST,
+                                          g_data, PACKET_SIZE) :
+                          ly_packet_send(fd, PKT_TYPE_TEST_ECHO_REQUEST,
+                                         g_data, PACKET_SIZE);
+            if (ret < 0) {
+                printf("%s: send error\n", name);
+                return -1;
+            }
+        }
+        if (echo_wait(efd, fd, q, i + j) < 0) {
+            printf("%s: echo error, %d received\n", name, g_received);
+            return -1;
+        }
+    }
+    t = now_ns() - t;
+    printf("%-9s: %d packets echoed, %8.1f ns/packet, %8.0f packets/s\n",
+           name, g_received, t / num, num * 1e9 / t);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int num = argc > 1 ? atoi(argv[1]) : 200000;
+    int tick = argc > 2 ? atoi(argv[2]) : 64;
+    if (num <= 0 || tick <= 0) {
+        printf("usage: %s [number of packets [packets per tick]]\n", argv[0]);
+        return 1;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        printf("socketpair failed\n");
+        return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+        return 1;
+    if (pid == 0) {
+        close(sv[0]);
+        echo_peer(sv[1]);
+    }
+    close(sv[1]);
+
+    int i, fd = sv[0], ret = 1;
+    for (i = 0; i < PACKET_SIZE; i++)
+        g_data[i] = 'a' + i % 26;
+    bzero(&g_pkt, sizeof(g_pkt));
+    if (ly_packet_init(&g_pkt) < 0)
+        return 1;
+    LYPacketSendQueue q;
+    ly_packet_queue_init(&q);
+
+    int efd = epoll_create(MAX_EVENTS);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        printf("epoll error\n");
+        goto out;
+    }
+
+    printf("%d packets of %d bytes, %d packets per tick\n",
+           num, PACKET_SIZE, tick);
+    if (run("sendmsg", efd, fd, NULL, num, tick) < 0 ||
+        run("queue", efd, fd, &q, num, tick) < 0)
+        goto out;
+
+    /* peer stops reading, queue grows, sender does not block */
+    kill(pid, SIGSTOP);
+    double t = now_ns();
+    int full = 0;
+    for (i = 0; i < num; i++) {
+        if (ly_packet_queue(&q, PKT_TYPE_TEST_ECHO_REQUEST,
+                            g_data, PACKET_SIZE) < 0)
+            goto out;
+        if (ly_packet_queue_flush(&q, fd) == 1)
+            full++;
+    }
+    t = now_ns() - t;
+    printf("peer stopped: %d packets queued, %u bytes pending, "
+           "%.1f ns/packet\n", q.num, q.bytes, t / num);
+    kill(pid, SIGCONT);
+    if (full == 0) {
+        printf("socket never got full\n");
+        goto out;
+    }
+
+    g_received = 0;
+    if (echo_wait(efd, fd, &q, num) < 0 || q.num != 0) {
+        printf("queue not drained, %d received\n", g_received);
+        goto out;
+    }
+    printf("send queue test passed\n");
+    ret = 0;
+
+out:
+    ly_packet_queue_cleanup(&q);
+    ly_packet_cleanup(&g_pkt);
+    close(fd);
+    waitpid(pid, NULL, 0);
+    if (efd >= 0)
+        close(efd);
+    return ret;
+}
@@ -0,0 +1,212 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** compute node work queue test
+**
+** usage: test_work [number of works [number of keys]]
+**
+** works sleep a little while, as instance control requests wait for
+** hypervisor. works of the same key must run in order and never at
+** the same time, works of different keys must run in parallel. works
+** waiting for a second key must not hold worker threads.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../src/util/logging.h"
+#include "../src/compute/work.h"
+#include "test.h"
+
+#define WORKER_NUM 16
+#define WORK_SLEEP 2000 /* in us */
+
+typedef struct TestWork_t {
+    int key;
+    int seq;
+} TestWork;
+
+static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int * g_key_running = NULL;
+static int * g_key_seq = NULL;
+static int g_running = 0, g_running_max = 0, g_done = 0, g_err = 0;
+static LYWorkLock g_lock = LY_WORK_LOCK_INITIALIZER;
+static int g_lock_held = 0;
+
+static void test_func(void * arg)
+{
+    TestWork * w = arg;
+
+    pthread_mutex_lock(&g_mutex);
+    if (g_key_running[w->key]++ || g_key_seq[w->key] != w->seq)
+        g_err++;
+    g_key_seq[w->key]++;
+    if (++g_running > g_running_max)
+        g_running_max = g_running;
+    pthread_mutex_unlock(&g_mutex);
+
+    usleep(WORK_SLEEP);
+
+    pthread_mutex_lock(&g_mutex);
+    g_key_running[w->key]--;
+    g_running--;
+    g_done++;
+    pthread_mutex_unlock(&g_mutex);
+    free(w);
+}
+
+/* works share one resource through keyed lock */
+static void lock_func(void * arg)
+{
+    if (ly_work_lock(&g_lock, 1) < 0) {
+        g_err++;
+        return;
+    }
+    pthread_mutex_lock(&g_mutex);
+    if (g_lock_held++)
+        g_err++;
+    pthread_mutex_unlock(&g_mutex);
+
+    usleep(WORK_SLEEP);
+
+    pthread_mutex_lock(&g_mutex);
+    g_lock_held--;
+    g_done++;
+    pthread_mutex_unlock(&g_mutex);
+    ly_work_unlock(&g_lock, 1);
+}
+
+/* works share one resource through a second work key */
+static void key2_func(void * arg)
+{
+    pthread_mutex_lock(&g_mutex);
+    if (g_lock_held++)
+        g_err++;
+    pthread_mutex_unlock(&g_mutex);
+
+    usleep(WORK_SLEEP);
+
+    pthread_mutex_lock(&g_mutex);
+    g_lock_held--;
+    g_done++;
+    pthread_mutex_unlock(&g_mutex);
+}
+
+/* works waiting for a key must not take threads */
+static void mark_func(void * arg)
+{
+    pthread_mutex_lock(&g_mutex);
+    *(int *)arg = g_done;
+    pthread_mutex_unlock(&g_mutex);
+}
+
+int main(int argc, char *argv[])
+{
+    int num = argc > 1 ? atoi(argv[1]) : 2000;
+    int keys = argc > 2 ? atoi(argv[2]) : 100;
+    if (num <= 0 || keys <= 0) {
+        printf("usage: %s [number of works [number of keys]]\n", argv[0]);
+        return 1;
+    }
+
+    logfile(NULL, LYWARN);
+
+    g_key_running = calloc(keys + 1, sizeof(int));
+    g_key_seq = calloc(keys + 1, sizeof(int));
+    if (g_key_running == NULL || g_key_seq == NULL)
+        return 1;
+
+    if (ly_work_start(WORKER_NUM) < 0) {
+        printf("ly_work_start failed\n");
+        return 1;
+    }
+
+    /* same key works are queued back to back */
+    int i, seq[keys + 1];
+    bzero(seq, sizeof(seq));
+    double t = now_ms();
+    for (i = 0; i < num; i++) {
+        TestWork * w = malloc(sizeof(TestWork));
+        if (w == NULL)
+            return 1;
+        w->key = (i / 3) % keys + 1;
+        w->seq = seq[w->key]++;
+        if (ly_work_add(w->key, test_func, w) < 0) {
+            printf("ly_work_add failed\n");
+            return 1;
+        }
+    }
+    while (ly_work_num() > 0)
+        usleep(1000);
+    t = now_ms() - t;
+    printf("%d works, %d keys, %d threads: %.1f ms, serial %.1f ms, "
+           "%d running at most\n", num, keys, WORKER_NUM, t,
+           num * WORK_SLEEP / 1e3, g_running_max);
+    if (g_done != num || g_running_max > WORKER_NUM ||
+        (keys > 1 && g_running_max < 2))
+        g_err++;
+
+    /* keyed lock */
+    g_done = 0;
+    for (i = 0; i < WORKER_NUM; i++)
+        if (ly_work_add(0, lock_func, NULL) < 0)
+            return 1;
+    while (ly_work_num() > 0)
+        usleep(1000);
+    if (g_done != WORKER_NUM)
+        g_err++;
+
+    /* second key */
+    g_done = 0;
+    int mark = -1;
+    for (i = 0; i < WORKER_NUM * 2; i++)
+        if (ly_work_add_keys(i + 1, -1, key2_func, NULL) < 0)
+            return 1;
+    if (ly_work_add(0, mark_func, &mark) < 0)
+        return 1;
+    if (!ly_work_busy(0, -1))
+        g_err++;
+    while (ly_work_num() > 0)
+        usleep(1000);
+    if (ly_work_busy(1, -1))
+        g_err++;
+    printf("%d works of second key, other work run after %d of them\n",
+           WORKER_NUM * 2, mark);
+    if (g_done != WORKER_NUM * 2 || mark < 0 || mark >= WORKER_NUM)
+        g_err++;
+
+    ly_work_stop();
+    free(g_key_running);
+    free(g_key_seq);
+
+    return test_result("work queue", g_err);
+}
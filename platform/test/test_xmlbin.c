@@ -0,0 +1,399 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** xml and binary packet data, encoding and decoding
+**
+** usage: test_xmlbin [loops]
+**
+** each message between clc and node is built in both wire formats,
+** and the fields read by its handler must be decoded the same from
+** both. size, time to encode and time to decode of each message type
+** are printed.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/lyxml.h"
+#include "test.h"
+
+#define MSG_FIELD_MAX 32
+
+static NodeInfo g_ni;
+static InstanceInfo g_ii;
+static NodeCtrlInstance g_ci;
+static AuthInfo g_ai;
+
+typedef struct TestMsg_t {
+    const char * name;
+    char * (*build)(int proto, int * len);
+    const char * paths[MSG_FIELD_MAX];
+} TestMsg;
+
+static void sample_init(void)
+{
+    g_ni.status = 1;
+    g_ni.hypervisor = 1;
+    g_ni.host_tag = 8;
+    g_ni.host_name = "node-8";
+    g_ni.host_ip = "192.168.1.108";
+    g_ni.cpu_model = "Intel(R) Xeon(R) CPU E5-2620 0 @ 2.00GHz";
+    g_ni.cpu_mhz = 2000;
+    g_ni.cpu_max = 24;
+    g_ni.cpu_commit = 6;
+    g_ni.mem_max = 67108864;
+    g_ni.mem_free = 50331648;
+    g_ni.mem_commit = 16777216;
+    g_ni.storage_total = 2000;
+    g_ni.storage_free = 1500;
+    g_ni.load_average = 3;
+    g_ni.app_cache_hit = 12;
+    g_ni.app_cache_miss = 2;
+    g_ni.numa_cells = 2;
+    g_ni.numa_cell_cpus = 12;
+    g_ni.numa_mem_free = 3000000000U;
+
+    g_ii.id = 27;
+    g_ii.status = 3;
+    g_ii.ip = "10.0.0.27";
+    g_ii.gport = 5927;
+    g_ii.netstat[0].rx_bytes = 123456789;
+    g_ii.netstat[0].rx_pkts = 98765;
+    g_ii.netstat[0].tx_bytes = 23456789;
+    g_ii.netstat[0].tx_pkts = 8765;
+
+    g_ci.req_id = 2048;
+    g_ci.req_action = LY_A_NODE_RUN_INSTANCE;
+    g_ci.ins_id = 27;
+    g_ci.ins_status = 1;
+    g_ci.ins_name = "web server";
+    g_ci.ins_vcpu = 2;
+    g_ci.ins_mem = 2097152;
+    g_ci.ins_extsize = 10;
+    g_ci.ins_mac = "00:16:36:1b:00:1b";
+    g_ci.ins_ip = "10.0.0.27";
+    g_ci.ins_domain = "i-27";
+    g_ci.ins_json = "{\"hostname\": \"web\"}";
+    g_ci.app_id = 5;
+    g_ci.app_name = "ubuntu 12.04 nginx";
+    g_ci.app_uri = "http://192.168.1.107/dl/appliance/appliance_5";
+    g_ci.app_checksum = "9e107d9d372bb6826bd81d3542a419d6";
+    g_ci.osm_clcip = "192.168.1.107";
+    g_ci.osm_clcport = 1369;
+    g_ci.osm_tag = 27;
+    g_ci.osm_secret = "2a3b3d48-0c7b-4a6f-9f3b-4f0f1cdb0b1f";
+    g_ci.osm_json = "{\"key\": \"ssh-rsa AAAAB3NzaC1yc2E\"}";
+    g_ci.storage_ip = "192.168.1.110";
+    g_ci.storage_method = 1;
+    g_ci.storage_parm = "/export/storage";
+
+    g_ai.tag = 8;
+    strcpy((char *)g_ai.data, "0c7b4a6f9f3b4f0f1cdb0b1f");
+}
+
+static char * build_node_register(int proto, int * len)
+{
+    return lyxml_msg_node_register(proto, &g_ni, len);
+}
+
+static char * build_node_info(int proto, int * len)
+{
+    return lyxml_msg_node_info(proto, 1024, len);
+}
+
+static char * build_reply_auth_info(int proto, int * len)
+{
+    LYReply r = { 1, LY_ENTITY_CLC, LY_ENTITY_NODE,
+                  LY_S_REGISTERING_DONE_SUCCESS, NULL, &g_ai };
+    return lyxml_msg_reply_auth_info(proto, &r, len);
+}
+
+static char * build_instance_run(int proto, int * len)
+{
+    return lyxml_msg_instance_run(proto, &g_ci, len);
+}
+
+static char * build_instance_other(int proto, int * len)
+{
+    return lyxml_msg_instance_other(proto, &g_ci, len);
+}
+
+static char * build_appliance_prefetch(int proto, int * len)
+{
+    return lyxml_msg_appliance_prefetch(proto, &g_ci, len);
+}
+
+static char * build_reply(int proto, int * len)
+{
+    LYReply r = { 2048, LY_ENTITY_NODE, LY_ENTITY_CLC,
+                  LY_S_RUNNING_STOPPED, "instance stopped", NULL, 1500 };
+    return lyxml_msg_reply(proto, &r, len);
+}
+
+static char * build_reply_instance_info(int proto, int * len)
+{
+    LYReply r = { 2048, LY_ENTITY_NODE, LY_ENTITY_CLC,
+                  LY_S_FINISHED_SUCCESS, NULL, &g_ii };
+    return lyxml_msg_reply_instance_info(proto, &r, len);
+}
+
+static char * build_reply_node_info(int proto, int * len)
+{
+    LYReply r = { 1024, LY_ENTITY_NODE, LY_ENTITY_CLC,
+                  LY_S_FINISHED_SUCCESS, NULL, &g_ni };
+    return lyxml_msg_reply_node_info(proto, &r, len);
+}
+
+static char * build_report(int proto, int * len)
+{
+    LYReport r = { LY_ENTITY_NODE, LY_ENTITY_CLC, NODE_STATUS_CHECK,
+                   "appliance download failed", NULL };
+    return lyxml_msg_report(proto, &r, len);
+}
+
+static char * build_report_node_info(int proto, int * len)
+{
+    LYReport r = { LY_ENTITY_NODE, LY_ENTITY_CLC, 0, NULL, &g_ni };
+    return lyxml_msg_report_node_info(proto, &r, len);
+}
+
+static char * build_report_instance_info(int proto, int * len)
+{
+    LYReport r = { LY_ENTITY_NODE, LY_ENTITY_CLC, 0, NULL, &g_ii };
+    return lyxml_msg_report_instance_info(proto, &r, len);
+}
+
+static TestMsg g_msgs[] = {
+    /* request id of node register differs, it's a new request */
+    { "node register", build_node_register, {
+        "request", "request@action", "request/reply/result",
+        "request/parameters/status", "request/parameters/hypervisor",
+        "request/parameters/host/tag", "request/parameters/host/name",
+        "request/parameters/host/ip", "request/parameters/cpu/arch",
+        "request/parameters/cpu/model", "request/parameters/cpu/mhz",
+        "request/parameters/cpu/max", "request/parameters/cpu/commit",
+        "request/parameters/memory/total", "request/parameters/memory/free",
+        "request/parameters/memory/commit", "request/parameters/storage/total",
+        "request/parameters/storage/free", "request/parameters/load/average",
+        "request/parameters/numa/cells", "request/parameters/numa/cpus",
+        "request/parameters/numa/free", NULL } },
+    { "node query", build_node_info, {
+        "request", "request@id", "request@action", "request/reply/result",
+        "request/reply/status", "request/parameters/instance@id", NULL } },
+    { "register reply", build_reply_auth_info, {
+        "response", "response@id", "response@status", "response/data/tag",
+        "response/data/secret", NULL } },
+    { "instance run", build_instance_run, {
+        "request", "request@id", "request@action", "request/reply/result",
+        "request/reply/status", "request/parameters/appliance@id",
+        "request/parameters/appliance/name", "request/parameters/appliance/uri",
+        "request/parameters/appliance/checksum",
+        "request/parameters/instance@id", "request/parameters/instance/name",
+        "request/parameters/instance/domain",
+        "request/parameters/instance/domxml",
+        "request/parameters/instance@status",
+        "request/parameters/instance/vcpu",
+        "request/parameters/instance/memory",
+        "request/parameters/instance/extsize",
+        "request/parameters/instance/mac", "request/parameters/instance/ip",
+        "request/parameters/osmanager/clc/ip",
+        "request/parameters/osmanager/clc/port",
+        "request/parameters/osmanager/tag",
+        "request/parameters/osmanager/secret",
+        "request/parameters/osmanager/json", "request/parameters/storage/ip",
+        "request/parameters/storage/method", "request/parameters/storage/parm",
+        NULL } },
+    { "instance control", build_instance_other, {
+        "request", "request@id", "request@action", "request/reply/result",
+        "request/reply/status", "request/parameters/instance@id",
+        "request/parameters/instance/domain", NULL } },
+    { "appliance prefetch", build_appliance_prefetch, {
+        "request", "request@id", "request@action", "request/reply/result",
+        "request/parameters/appliance@id", "request/parameters/appliance/name",
+        "request/parameters/appliance/uri",
+        "request/parameters/appliance/checksum", NULL } },
+    { "reply", build_reply, {
+        "response", "response@id", "response@status", "response@elapsed",
+        "response/result", "response/data", "response/data@type",
+        NULL } },
+    { "instance info reply", build_reply_instance_info, {
+        "response", "response@id", "response@status", "response/result",
+        "response/data", "response/data@type", "response/data/id",
+        "response/data/status", "response/data/ip", "response/data/gport",
+        "response/data/netstat0", NULL } },
+    { "node info reply", build_reply_node_info, {
+        "response", "response@id", "response@status", "response/result",
+        "response/data", "response/data@type", "response/data/status",
+        "response/data/cpu/commit", "response/data/memory/free",
+        "response/data/storage/free", "response/data/memory/commit",
+        "response/data/load/average", "response/data/appcache/hit",
+        "response/data/appcache/miss", "response/data/numa/free", NULL } },
+    { "report", build_report, {
+        "report", "report/status", "report/message", "report/resource",
+        "report/instance", NULL } },
+    { "resource report", build_report_node_info, {
+        "report", "report/status", "report/message", "report/resource",
+        "report/resource/cpu/commit", "report/resource/memory/free",
+        "report/resource/memory/commit", "report/resource/storage/free",
+        "report/resource/load/average", "report/resource/appcache/hit",
+        "report/resource/appcache/miss", "report/resource/numa/free", NULL } },
+    { "instance report", build_report_instance_info, {
+        "report", "report/status", "report/resource", "report/instance",
+        "report/instance/id", "report/instance/status", NULL } },
+};
+#define MSG_NUM ((int)(sizeof(g_msgs) / sizeof(TestMsg)))
+
+/* binary message finds fields by hash only */
+static int check_hash(void)
+{
+    static const char * seen[MSG_NUM * MSG_FIELD_MAX];
+    int i, j, k, n = 0, err = 0;
+    for (i = 0; i < MSG_NUM; i++) {
+        for (j = 0; g_msgs[i].paths[j]; j++) {
+            const char * p = g_msgs[i].paths[j];
+            unsigned int h = lyxml_msg_hash(p, strlen(p));
+            for (k = 0; k < n; k++) {
+                if (strcmp(seen[k], p) == 0)
+                    break;
+                if (lyxml_msg_hash(seen[k], strlen(seen[k])) == h) {
+                    printf("hash of %s and %s collides\n", seen[k], p);
+                    err++;
+                }
+            }
+            if (k == n)
+                seen[n++] = p;
+        }
+    }
+    return err;
+}
+
+/* both exist or not, with same text */
+static int compare(TestMsg * m)
+{
+    int len[2], err = 0, i;
+    char * data[2];
+    LYXmlMsg * msg[2];
+    for (i = 0; i < 2; i++) {
+        data[i] = m->build(i ? LUOYUN_PROTO_BIN : LUOYUN_PROTO_XML, &len[i]);
+        msg[i] = data[i] ? lyxml_msg_parse(data[i], len[i]) : NULL;
+    }
+    if (msg[0] == NULL || msg[1] == NULL) {
+        printf("%s: failed to %s\n", m->name,
+               data[0] && data[1] ? "decode" : "encode");
+        err++;
+        goto out;
+    }
+    if (data[1][0] == '<') {
+        printf("%s: xml built for binary\n", m->name);
+        err++;
+    }
+    for (i = 0; m->paths[i]; i++) {
+        const char * p = m->paths[i];
+        char * t0 = lyxml_msg_text(msg[0], p), * t1 = lyxml_msg_text(msg[1], p);
+        if (lyxml_msg_exist(msg[0], p) != lyxml_msg_exist(msg[1], p) ||
+            (t0 == NULL) != (t1 == NULL) || (t0 && strcmp(t0, t1))) {
+            printf("%s: %s is %s in xml, %s in binary\n", m->name, p,
+                   t0 ? t0 : "NULL", t1 ? t1 : "NULL");
+            err++;
+        }
+    }
+
+    /* truncated binary, or of other version, is not decoded */
+    LYXmlMsg * t = lyxml_msg_parse(data[1], len[1] - 1);
+    data[1][3]++;
+    LYXmlMsg * v = lyxml_msg_parse(data[1], len[1]);
+    if (t || v) {
+        printf("%s: broken binary decoded\n", m->name);
+        err++;
+    }
+    lyxml_msg_free(t);
+    lyxml_msg_free(v);
+out:
+    for (i = 0; i < 2; i++) {
+        lyxml_msg_free(msg[i]);
+        free(data[i]);
+    }
+    return err;
+}
+
+static void bench(TestMsg * m, int proto, int loops, double * enc, double * dec)
+{
+    int i, j, len;
+    double t = now_us();
+    for (i = 0; i < loops; i++)
+        free(m->build(proto, &len));
+    *enc = (now_us() - t) / loops;
+
+    char * data = m->build(proto, &len);
+    t = now_us();
+    for (i = 0; i < loops; i++) {
+        LYXmlMsg * msg = lyxml_msg_parse(data, len);
+        for (j = 0; m->paths[j]; j++)
+            lyxml_msg_text(msg, m->paths[j]);
+        lyxml_msg_free(msg);
+    }
+    *dec = (now_us() - t) / loops;
+    free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    int loops = argc > 1 ? atoi(argv[1]) : 10000;
+    if (loops <= 0)
+        loops = 10000;
+
+    logfile(NULL, LYERROR);
+    xmlInitParser();
+    sample_init();
+
+    int i, err = check_hash();
+    for (i = 0; i < MSG_NUM; i++)
+        err += compare(&g_msgs[i]);
+
+    printf("%-20s %6s %6s %8s %8s %8s %8s\n", "us per message",
+           "xml", "bin", "xml enc", "bin enc", "xml dec", "bin dec");
+    for (i = 0; i < MSG_NUM; i++) {
+        TestMsg * m = &g_msgs[i];
+        int len[2];
+        char * x = m->build(LUOYUN_PROTO_XML, &len[0]);
+        char * b = m->build(LUOYUN_PROTO_BIN, &len[1]);
+        free(x);
+        free(b);
+        double enc[2], dec[2];
+        bench(m, LUOYUN_PROTO_XML, loops, &enc[0], &dec[0]);
+        bench(m, LUOYUN_PROTO_BIN, loops, &enc[1], &dec[1]);
+        printf("%-20s %6d %6d %8.2f %8.2f %8.2f %8.2f\n", m->name,
+               len[0], len[1], enc[0], enc[1], dec[0], dec[1]);
+    }
+    xmlCleanupParser();
+
+    return test_result("xml and binary", err);
+}
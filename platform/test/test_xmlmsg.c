@@ -0,0 +1,388 @@
+/*
+** Copyright (C) 2012 LuoYun Co.
+**
+**           Authors:
+**                    lijian.gnu@gmail.com
+**                    zengdongwu@hotmail.com
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+**
+*/
+
+/*
+** single pass xml message decoder against DOM and XPath
+**
+** usage: test_xmlmsg [loops] [cmds.xml]
+**
+** messages are built by lyxml_data functions, as sent between clc and
+** node, and the fields read by their handlers are looked up with both
+** decoders. values must be the same, time per message is printed.
+** messages in cmds.xml, an old sketch of the protocol which is not well
+** formed, must be rejected by both.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/util/logging.h"
+#include "../src/util/lyxml.h"
+#include "test.h"
+
+#define MSG_MAX 16
+#define MSG_FIELD_MAX 32
+
+typedef struct TestMsg_t {
+    char * name;
+    char * xml;
+    const char * paths[MSG_FIELD_MAX];
+} TestMsg;
+
+static TestMsg g_msgs[MSG_MAX];
+static int g_msg_num = 0;
+static int g_msg_built = 0;             /* messages timed */
+
+static void xml_error_ignore(void * ctx, const char * msg, ...)
+{
+}
+
+/* "request/data@type" to "/luoyun/request/data/@type" */
+static void xpath_expr(const char * path, char * expr, int size)
+{
+    const char * a = strchr(path, '@');
+    if (a)
+        snprintf(expr, size, "/" LYXML_ROOT "/%.*s/%s", (int)(a - path), path, a);
+    else
+        snprintf(expr, size, "/" LYXML_ROOT "/%s", path);
+}
+
+static int decode_dom(TestMsg * m, char ** vals)
+{
+    char expr[256];
+    xmlDoc * doc = xml_doc_from_str(m->xml);
+    if (doc == NULL)
+        return -1;
+    xmlXPathContextPtr xpathCtx = xmlXPathNewContext(doc);
+    if (xpathCtx == NULL) {
+        xmlFreeDoc(doc);
+        return -1;
+    }
+    int i;
+    for (i = 0; m->paths[i]; i++) {
+        xpath_expr(m->paths[i], expr, sizeof(expr));
+        char * str = xml_xpath_text_from_ctx(xpathCtx, expr);
+        if (vals)
+            vals[i] = str;
+        else
+            free(str);
+    }
+    xmlXPathFreeContext(xpathCtx);
+    xmlFreeDoc(doc);
+    return 0;
+}
+
+static int decode_msg(TestMsg * m, char ** vals)
+{
+    LYXmlMsg * msg = lyxml_msg_parse(m->xml, strlen(m->xml));
+    if (msg == NULL)
+        return -1;
+    int i;
+    for (i = 0; m->paths[i]; i++) {
+        char * str = lyxml_msg_text(msg, m->paths[i]);
+        if (vals)
+            vals[i] = str ? strdup(str) : NULL;
+    }
+    lyxml_msg_free(msg);
+    return 0;
+}
+
+static int compare(TestMsg * m)
+{
+    char * v1[MSG_FIELD_MAX], * v2[MSG_FIELD_MAX];
+    int r1 = decode_dom(m, v1), r2 = decode_msg(m, v2);
+    if (r1 != r2) {
+        printf("%s: parsed by %s only\n", m->name, r1 == 0 ? "dom" : "msg");
+        return 1;
+    }
+    if (r1 < 0)
+        return 0;
+
+    int i, err = 0;
+    for (i = 0; m->paths[i]; i++) {
+        if ((v1[i] == NULL) != (v2[i] == NULL) ||
+            (v1[i] && strcmp(v1[i], v2[i]))) {
+            printf("%s: %s is %s by dom, %s by msg\n", m->name, m->paths[i],
+                   v1[i] ? v1[i] : "NULL", v2[i] ? v2[i] : "NULL");
+            err++;
+        }
+        if (v1[i])
+            free(v1[i]);
+        if (v2[i])
+            free(v2[i]);
+    }
+    return err;
+}
+
+static void msg_add(const char * name, char * xml, const char ** paths)
+{
+    if (xml == NULL || g_msg_num >= MSG_MAX)
+        return;
+    TestMsg * m = &g_msgs[g_msg_num++];
+    m->name = strdup(name);
+    m->xml = xml;
+    int i;
+    for (i = 0; paths[i] && i < MSG_FIELD_MAX - 1; i++)
+        m->paths[i] = paths[i];
+    m->paths[i] = NULL;
+}
+
+static void corpus_build(void)
+{
+    NodeInfo ni;
+    bzero(&ni, sizeof(NodeInfo));
+    ni.status = 1;
+    ni.hypervisor = 1;
+    ni.host_tag = 8;
+    ni.host_name = "node-8";
+    ni.host_ip = "192.168.1.108";
+    ni.cpu_model = "Intel(R) Xeon(R) CPU E5-2620 0 @ 2.00GHz";
+    ni.cpu_mhz = 2000;
+    ni.cpu_max = 24;
+    ni.cpu_commit = 6;
+    ni.mem_max = 67108864;
+    ni.mem_free = 50331648;
+    ni.mem_commit = 16777216;
+    ni.storage_total = 2000;
+    ni.storage_free = 1500;
+    ni.load_average = 3;
+    ni.app_cache_hit = 12;
+    ni.app_cache_miss = 2;
+    ni.numa_cells = 2;
+    ni.numa_cell_cpus = 12;
+    ni.numa_mem_free = 25165824;
+
+    const char * register_paths[] = {
+        "request@id", "request@action",
+        "request/parameters/status", "request/parameters/hypervisor",
+        "request/parameters/host/tag", "request/parameters/host/name",
+        "request/parameters/host/ip", "request/parameters/cpu/arch",
+        "request/parameters/cpu/model", "request/parameters/cpu/mhz",
+        "request/parameters/cpu/max", "request/parameters/cpu/commit",
+        "request/parameters/memory/total", "request/parameters/memory/free",
+        "request/parameters/memory/commit", "request/parameters/storage/total",
+        "request/parameters/storage/free", "request/parameters/load/average",
+        "request/parameters/numa/cells", "request/parameters/numa/cpus",
+        "request/parameters/numa/free", NULL
+    };
+    msg_add("node register", lyxml_data_node_register(&ni, NULL, 0),
+            register_paths);
+
+    LYReply r;
+    bzero(&r, sizeof(LYReply));
+    r.req_id = 1024;
+    r.from = LY_ENTITY_NODE;
+    r.to = LY_ENTITY_CLC;
+    r.status = LY_S_FINISHED_SUCCESS;
+    r.data = &ni;
+    const char * node_info_paths[] = {
+        "response@id", "response@status", "response/result",
+        "response/data@type", "response/data/status",
+        "response/data/cpu/commit", "response/data/memory/free",
+        "response/data/storage/free", "response/data/memory/commit",
+        "response/data/load/average", "response/data/appcache/hit",
+        "response/data/appcache/miss", "response/data/numa/free", NULL
+    };
+    msg_add("node info reply", lyxml_data_reply_node_info(&r, NULL, 0),
+            node_info_paths);
+
+    LYReport rp;
+    bzero(&rp, sizeof(LYReport));
+    rp.from = LY_ENTITY_NODE;
+    rp.to = LY_ENTITY_CLC;
+    rp.status = 0;
+    rp.data = &ni;
+    const char * resource_paths[] = {
+        "report/status", "report/message",
+        "report/resource/cpu/commit", "report/resource/memory/free",
+        "report/resource/memory/commit", "report/resource/storage/free",
+        "report/resource/load/average", "report/resource/appcache/hit",
+        "report/resource/appcache/miss", "report/resource/numa/free", NULL
+    };
+    msg_add("resource report", lyxml_data_report_node_info(&rp, NULL, 0),
+            resource_paths);
+
+    InstanceInfo ii;
+    bzero(&ii, sizeof(InstanceInfo));
+    ii.id = 27;
+    ii.status = 3;
+    ii.ip = "10.0.0.27";
+    ii.gport = 5927;
+    ii.netstat[0].rx_bytes = 123456789;
+    ii.netstat[0].rx_pkts = 98765;
+    ii.netstat[0].tx_bytes = 23456789;
+    ii.netstat[0].tx_pkts = 8765;
+    r.data = &ii;
+    const char * instance_info_paths[] = {
+        "response@id", "response@status", "response/data@type",
+        "response/data/id", "response/data/status", "response/data/ip",
+        "response/data/gport", "response/data/netstat0", NULL
+    };
+    msg_add("instance info reply", lyxml_data_reply_instance_info(&r, NULL, 0),
+            instance_info_paths);
+
+    rp.data = &ii;
+    const char * instance_report_paths[] = {
+        "report/instance/id", "report/instance/status", NULL
+    };
+    msg_add("instance report", lyxml_data_report_instance_info(&rp, NULL, 0),
+            instance_report_paths);
+
+    NodeCtrlInstance ci;
+    bzero(&ci, sizeof(NodeCtrlInstance));
+    ci.req_id = 2048;
+    ci.req_action = LY_A_NODE_RUN_INSTANCE;
+    ci.ins_id = 27;
+    ci.ins_status = 1;
+    ci.ins_name = "web server";
+    ci.ins_vcpu = 2;
+    ci.ins_mem = 2097152;
+    ci.ins_extsize = 10;
+    ci.ins_mac = "00:16:36:1b:00:1b";
+    ci.ins_ip = "10.0.0.27";
+    ci.ins_domain = "i-27";
+    ci.ins_json = "{&quot;hostname&quot;: &quot;web&quot;}";
+    ci.app_id = 5;
+    ci.app_name = "ubuntu 12.04 &amp; nginx";
+    ci.app_uri = "http://192.168.1.107/dl/appliance/appliance_5";
+    ci.app_checksum = "9e107d9d372bb6826bd81d3542a419d6";
+    ci.osm_clcip = "192.168.1.107";
+    ci.osm_clcport = 1369;
+    ci.osm_tag = 27;
+    ci.osm_secret = "2a3b3d48-0c7b-4a6f-9f3b-4f0f1cdb0b1f";
+    ci.osm_json = "{&quot;key&quot;: &quot;ssh-rsa AAAAB3NzaC1yc2E&quot;}";
+    ci.storage_ip = "192.168.1.110";
+    ci.storage_method = 1;
+    ci.storage_parm = "/export/storage";
+    const char * instance_run_paths[] = {
+        "request@id", "request@action", "request/reply/result",
+        "request/reply/status", "request/parameters/appliance@id",
+        "request/parameters/appliance/name", "request/parameters/appliance/uri",
+        "request/parameters/appliance/checksum",
+        "request/parameters/instance@id", "request/parameters/instance/name",
+        "request/parameters/instance/domain",
+        "request/parameters/instance/domxml",
+        "request/parameters/instance@status",
+        "request/parameters/instance/vcpu",
+        "request/parameters/instance/memory",
+        "request/parameters/instance/extsize",
+        "request/parameters/instance/mac", "request/parameters/instance/ip",
+        "request/parameters/osmanager/clc/ip",
+        "request/parameters/osmanager/clc/port",
+        "request/parameters/osmanager/tag",
+        "request/parameters/osmanager/secret",
+        "request/parameters/osmanager/json", "request/parameters/storage/ip",
+        "request/parameters/storage/method", "request/parameters/storage/parm",
+        NULL
+    };
+    msg_add("instance run", lyxml_data_instance_run(&ci, NULL, 0),
+            instance_run_paths);
+}
+
+/* messages of cmds.xml start with xml declaration, comments are dropped */
+static void corpus_load(const char * path)
+{
+    FILE * fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("%s not found, skipped\n", path);
+        return;
+    }
+    const char * paths[] = { "request@id", "request@action", NULL };
+    char line[1024], name[64];
+    char * xml = NULL;
+    int len = 0, n = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#')
+            continue;
+        if (strncmp(line, "<?xml", 5) == 0 && xml) {
+            snprintf(name, sizeof(name), "%s #%d", path, ++n);
+            msg_add(name, xml, paths);
+            xml = NULL;
+            len = 0;
+        }
+        int l = strlen(line);
+        char * p = realloc(xml, len + l + 1);
+        if (p == NULL)
+            break;
+        xml = p;
+        memcpy(xml + len, line, l + 1);
+        len += l;
+    }
+    if (xml) {
+        snprintf(name, sizeof(name), "%s #%d", path, ++n);
+        msg_add(name, xml, paths);
+    }
+    fclose(fp);
+}
+
+static double bench(int (*decode)(TestMsg *, char **), int loops)
+{
+    double t = now_us();
+    int i, j;
+    for (i = 0; i < loops; i++)
+        for (j = 0; j < g_msg_built; j++)
+            decode(&g_msgs[j], NULL);
+    return (now_us() - t) / loops / g_msg_built;
+}
+
+int main(int argc, char *argv[])
+{
+    int loops = argc > 1 ? atoi(argv[1]) : 10000;
+    const char * path = argc > 2 ? argv[2] : "cmds.xml";
+    if (loops <= 0)
+        loops = 10000;
+
+    logfile(NULL, LYERROR);
+    xmlInitParser();
+    /* parse errors of cmds.xml are expected */
+    xmlSetGenericErrorFunc(NULL, xml_error_ignore);
+
+    corpus_build();
+    g_msg_built = g_msg_num;
+    corpus_load(path);
+
+    int i, err = 0;
+    for (i = 0; i < g_msg_num; i++)
+        err += compare(&g_msgs[i]);
+
+    double t_dom = bench(decode_dom, loops);
+    double t_msg = bench(decode_msg, loops);
+    printf("%d messages, %d checked, %d loops\n", g_msg_built, g_msg_num, loops);
+    printf("dom and xpath: %8.2f us/message\n", t_dom);
+    printf("single pass:   %8.2f us/message, %.1fx\n", t_msg,
+           t_msg > 0 ? t_dom / t_msg : 0);
+
+    for (i = 0; i < g_msg_num; i++) {
+        free(g_msgs[i].name);
+        free(g_msgs[i].xml);
+    }
+    xmlCleanupParser();
+
+    return test_result("xml message", err);
+}